@@ -61,6 +61,35 @@ atomic_cmpset_int(volatile u_int *dst, u_int expect, u_int src)
 }
 #endif
 
+/*
+ * 128 bit compare and set of two adjacent 64 bit words, dst 16 byte aligned
+ *
+ * if (dst[0] == expect_lo && dst[1] == expect_hi) dst[0..1] = src_lo, src_hi
+ *
+ * Returns 0 on failure, non-zero on success
+ */
+static __inline int
+atomic_cmpset_128(volatile u_long *dst, u_long expect_lo, u_long expect_hi,
+		  u_long src_lo, u_long src_hi)
+{
+	u_char res;
+
+	__asm __volatile(
+	"	lock ;			"
+	"	cmpxchg16b %1 ;		"
+	"       sete	%0 ;		"
+	"# atomic_cmpset_128"
+	: "=q" (res),			/* 0 */
+	  "+m" (*dst),			/* 1 */
+	  "+a" (expect_lo),		/* 2 */
+	  "+d" (expect_hi)		/* 3 */
+	: "b" (src_lo),			/* 4 */
+	  "c" (src_hi)			/* 5 */
+	: "memory", "cc");
+	return res;
+}
+
+#define	barrier()	__asm __volatile("" : : : "memory")
 #define	mb()	__asm __volatile("mfence;" : : : "memory")
 #define	wmb()	__asm __volatile("sfence;" : : : "memory")
 #define	rmb()	__asm __volatile("lfence;" : : : "memory")
@@ -11,16 +11,61 @@
 #include <sys/eventfd.h>
 #include "mempool.h"
 
+#define MEM_POOL_MAX_SEG_NAME (MEM_POOL_MAX_NAME + 16)
+
+__thread uint32_t mp_shard_id[MEM_POOL_MAX_BUCKETS];
+__thread uint32_t mp_shard_cursor[MEM_POOL_MAX_BUCKETS];
+__thread uint32_t mp_shard_gen[MEM_POOL_MAX_BUCKETS];
+
+static void mp_seg_name(char *seg_name, const char *name, unsigned int seg)
+{
+	snprintf(seg_name, MEM_POOL_MAX_SEG_NAME, "%s.%u", name, seg);
+}
+
+static void mp_bucket_shm_name(char *shm_name, const char *name,
+			       unsigned int bucket)
+{
+	snprintf(shm_name, MEM_POOL_MAX_SEG_NAME, "%s.b%u", name, bucket);
+}
+
+/* headers then page aligned payloads, hdr_off is where the headers start */
+static size_t mp_seg_mem_size(size_t hdr_off, unsigned int entries)
+{
+	return MEM_POOL_PAGE_ALIGN(hdr_off + sizeof(mp_buf_t) * entries)
+		+ (size_t)MEM_POOL_BUF_SIZE * entries;
+}
+
+static size_t mp_ring_mem_size(unsigned int entries)
+{
+	return sizeof(mp_ring_t) + sizeof(void *) * entries;
+}
+
+static size_t mp_bucket_mem_size(struct mp_bucket_desc *desc)
+{
+	if (desc->type == MP_RING_FAA)
+		return mp_ring_faa_mem_size(desc->entries);
+	if (desc->type == MP_RING_REORDER)
+		return mp_ring_reorder_mem_size(desc->entries);
+
+	return mp_ring_mem_size(desc->entries) * desc->shards;
+}
 
 int mp_create(mempool_priv_t *mp_priv, const char *name, unsigned int entries,
 	      unsigned int buckets)
 {
-	int fd, i, mask = entries - 1;
+	return mp_create_growable(mp_priv, name, entries, entries, buckets);
+}
+
+int mp_create_growable(mempool_priv_t *mp_priv, const char *name,
+		       unsigned int entries, unsigned int max_entries,
+		       unsigned int buckets)
+{
+	int fd, i, mask = max_entries - 1;
 	mempool_t *mp;
 
-	int size = sizeof(mempool_t)
-		+ (sizeof(mp_ring_t) + sizeof(void *) * entries) * buckets
-		+  sizeof(mp_buf_t) * entries;
+	int size = mp_seg_mem_size(sizeof(mempool_t) +
+		(sizeof(mp_ring_t) + sizeof(void *) * max_entries) * buckets,
+		entries);
 
 	if (buckets < 2 || buckets > MEM_POOL_MAX_BUCKETS) {
 		fprintf(stderr, "number of buckets must be greater than 1 and "
@@ -28,8 +73,10 @@ int mp_create(mempool_priv_t *mp_priv, const char *name, unsigned int entries,
 		return -1;
 	}
 
-	if (!POWEROF2(entries)) {
-		fprintf(stderr, "number of entries must be power of 2\n");
+	if (!POWEROF2(max_entries) || entries > max_entries ||
+	    entries > MEM_POOL_MAX_SEG_ENTRIES) {
+		fprintf(stderr, "max number of entries must be power of 2 and "
+			"not lower than the number of entries\n");
 		return -1;
 	}
 
@@ -52,8 +99,23 @@ int mp_create(mempool_priv_t *mp_priv, const char *name, unsigned int entries,
 	mp->entries = entries;
 	strncpy(mp->name, name, MEM_POOL_MAX_NAME);
 	mp->buckets = buckets;
-
+	mp->ring_entries = max_entries;
+	mp->seg_entries[0] = entries;
+	mp->segments = 1;
+
+	memset(mp_priv->seg, 0, sizeof(mp_priv->seg));
+	memset(mp_priv->bucket, 0, sizeof(mp_priv->bucket));
+	memset(mp_priv->bucket_type, 0, sizeof(mp_priv->bucket_type));
+	memset(mp_priv->spill_map, 0, sizeof(mp_priv->spill_map));
 	memset(mp_priv->fds, -1, sizeof(int) * MEM_POOL_MAX_FDS);
+	mp_priv->client = -1;
+
+	for (i = 0; i < buckets; i++) {
+		mp->bucket_desc[i].entries = max_entries;
+		mp->bucket_desc[i].state = MP_BUCKET_STATIC;
+		mp->bucket_desc[i].type = MP_RING_CLASSIC;
+		mp->bucket_desc[i].shards = 1;
+	}
 
 	mp_priv->mp = mp;
 	mp_priv->bucket[0] = (mp_ring_t *)((char *)mp + sizeof(mempool_t));
@@ -62,34 +124,29 @@ int mp_create(mempool_priv_t *mp_priv, const char *name, unsigned int entries,
 	for (i = 1; i < buckets; i++) {
 		mp_ring_t *ring = (mp_ring_t *)((char *)mp_priv->bucket[i-1]
 						+ sizeof(mp_ring_t)
-						+ sizeof(void *) * entries);
+						+ sizeof(void *) * max_entries);
 		ring->mask = mask;
 		mp_priv->bucket[i] = ring;
 	}
 	mp_priv->data = (mp_buf_t *)((char *)mp_priv->bucket[buckets-1]
-		      + sizeof(mp_ring_t) + sizeof(void *) * entries);
+		      + sizeof(mp_ring_t) + sizeof(void *) * max_entries);
 
 	if ((uintptr_t)mp_priv->data & __cache_line_mask) {
 		fprintf(stderr, "mp_priv->data not cache aligned\n");
 		goto error;
 	}
 	mp_priv->entries = entries;
+	mp_priv->seg[0] = mp_priv->data;
 
-	/* fill up the 1st ring */
-	for (i = 0; i < entries - 1; i++) {
+	/* fill up the 1st ring (it can't hold more than mask entries) */
+	for (i = 0; i < entries && i < mask; i++) {
 		mp_buf_priv_t buf = {
 			.offset = i,
-#ifndef NDEBUG
 			.buf = &mp_priv->data[i],
-#endif
 		};
-#ifndef NDEBUG
+
 		mp_priv->data[i].owner = -1;
-		if ((long)buf.buf & __cache_line_mask) {
-			fprintf(stderr, "buf not cache aligned\n");
-			goto error;
-		}
-#endif
+		mp_priv->data[i].next = MEM_POOL_BUF_NONE;
 		if (mp_put(mp_priv, 0, &buf) < 0)
 			goto error;
 	}
@@ -145,6 +202,8 @@ int mp_unregister(mempool_priv_t *mp_priv)
 	size = mp_priv->mp->size;
 	strncpy(name, mp_priv->mp->name, MEM_POOL_MAX_NAME);
 
+	mp_quota_leave(mp_priv);
+
 	if (atomic_sub_fetch(&mp_priv->mp->refcnt, 1) > 0)
 		return 0;
 
@@ -153,6 +212,37 @@ int mp_unregister(mempool_priv_t *mp_priv)
 		mp_priv->fds[i] = -1;
 	}
 
+	for (i = 1; i < MEM_POOL_MAX_BUCKETS; i++) {
+		if (mp_priv->mp->bucket_desc[i].flags & MP_BUCKET_F_SPILL)
+			mp_spill_release(mp_priv, i, 1);
+	}
+
+	for (i = 1; i < mp_priv->mp->segments; i++) {
+		char seg_name[MEM_POOL_MAX_SEG_NAME];
+
+		if (mp_priv->seg[i]) {
+			munmap(mp_priv->seg[i],
+			       mp_seg_mem_size(0, mp_priv->mp->seg_entries[i]));
+			mp_priv->seg[i] = NULL;
+		}
+		mp_seg_name(seg_name, name, i);
+		shm_unlink(seg_name);
+	}
+
+	for (i = mp_priv->mp->buckets; i < MEM_POOL_MAX_BUCKETS; i++) {
+		struct mp_bucket_desc *desc = &mp_priv->mp->bucket_desc[i];
+		char shm_name[MEM_POOL_MAX_SEG_NAME];
+
+		if (mp_priv->bucket[i]) {
+			munmap(mp_priv->bucket[i], mp_bucket_mem_size(desc));
+			mp_priv->bucket[i] = NULL;
+		}
+		if (desc->state != MP_BUCKET_DYNAMIC)
+			continue;
+		mp_bucket_shm_name(shm_name, name, i);
+		shm_unlink(shm_name);
+	}
+
 	munmap(mp_priv->mp, size);
 	shm_unlink(name);
 
@@ -187,8 +277,14 @@ int mp_register(mempool_priv_t *mp_priv, const char *name)
 	mp_retain(mp);
 
 	mp_priv->mp = mp;
-	entries = mp_priv->entries = mp->entries;
+	mp_priv->entries = mp->entries;
+	entries = mp->ring_entries;
 	memset(mp_priv->fds, -1, sizeof(int) * MEM_POOL_MAX_FDS);
+	memset(mp_priv->seg, 0, sizeof(mp_priv->seg));
+	memset(mp_priv->bucket, 0, sizeof(mp_priv->bucket));
+	memset(mp_priv->bucket_type, 0, sizeof(mp_priv->bucket_type));
+	memset(mp_priv->spill_map, 0, sizeof(mp_priv->spill_map));
+	mp_priv->client = -1;
 
 	mp_priv->bucket[0] = (mp_ring_t *)((char *)mp + sizeof(mempool_t));
 	for (i = 1; i < mp->buckets; i++) {
@@ -203,6 +299,12 @@ int mp_register(mempool_priv_t *mp_priv, const char *name)
 		fprintf(stderr, "buf not cache aligned\n");
 		goto error;
 	}
+	mp_priv->seg[0] = mp_priv->data;
+
+	/* a process can't allocate without a quota once they are enabled */
+	if ((mp->bucket_desc[0].flags & MP_BUCKET_F_QUOTA) &&
+	    mp_quota_join(mp_priv) < 0)
+		goto error;
 
 	close(fd);
 
@@ -215,3 +317,506 @@ int mp_register(mempool_priv_t *mp_priv, const char *name)
 
 	return -1;
 }
+
+static mp_buf_t *mp_seg_mmap(const char *name, unsigned int seg, size_t size,
+			     int create)
+{
+	char seg_name[MEM_POOL_MAX_SEG_NAME];
+	mp_buf_t *data;
+	int fd;
+
+	mp_seg_name(seg_name, name, seg);
+
+	if (create)
+		fd = shm_open(seg_name, O_CREAT|O_RDWR|O_TRUNC,
+			      S_IRUSR|S_IWUSR);
+	else
+		fd = shm_open(seg_name, O_RDWR, S_IRUSR|S_IWUSR);
+	if (fd < 0) {
+		fprintf(stderr, "can't open shared memory %s\n", seg_name);
+		return NULL;
+	}
+
+	if (create && ftruncate(fd, size) < 0) {
+		shm_unlink(seg_name);
+		close(fd);
+		return NULL;
+	}
+
+	data = mmap(NULL, size, PROT_WRITE | PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if ((long)data == -1) {
+		if (create)
+			shm_unlink(seg_name);
+		return NULL;
+	}
+
+	return data;
+}
+
+/*
+ * Map a segment announced by another process. Called from the get path the
+ * first time a buffer of the segment is seen, racing threads of the same
+ * process are resolved with a CAS on the segment slot.
+ */
+mp_buf_t *mp_map_segment(mempool_priv_t *mp_priv, unsigned int seg)
+{
+	mempool_t *mp = mp_priv->mp;
+	size_t size;
+	mp_buf_t *data;
+
+	if (seg >= mp->segments) {
+		fprintf(stderr, "segment %u doesn't exist\n", seg);
+		return NULL;
+	}
+	size = mp_seg_mem_size(0, mp->seg_entries[seg]);
+
+	data = mp_seg_mmap(mp->name, seg, size, 0);
+	if (data == NULL)
+		return NULL;
+
+	if (!__sync_bool_compare_and_swap(&mp_priv->seg[seg], NULL, data)) {
+		munmap(data, size);
+		return mp_priv->seg[seg];
+	}
+
+	return data;
+}
+
+/*
+ * Grow the pool with a new segment of entries buffers. The segment is
+ * announced in the header before its buffers are put into the 1st ring so
+ * a process getting a handle can always map it. Producers and consumers
+ * are not stopped, only concurrent growers are serialized.
+ */
+int mp_grow(mempool_priv_t *mp_priv, unsigned int entries)
+{
+	mempool_t *mp = mp_priv->mp;
+	unsigned int seg, i;
+	size_t size = mp_seg_mem_size(0, entries);
+	mp_buf_t *data;
+	int ret = -1;
+
+	if (entries == 0 || entries > MEM_POOL_MAX_SEG_ENTRIES) {
+		fprintf(stderr, "number of entries must be between 1 and %u\n",
+			MEM_POOL_MAX_SEG_ENTRIES);
+		return -1;
+	}
+
+	spin_lock(&mp->lock);
+
+	seg = mp->segments;
+	if (seg >= MEM_POOL_MAX_SEGS) {
+		fprintf(stderr, "number of segments cannot exceed %d\n",
+			MEM_POOL_MAX_SEGS);
+		goto end;
+	}
+
+	/* the 1st ring must be able to hold all the buffers */
+	if (mp->entries + entries > mp->ring_entries - 1) {
+		fprintf(stderr, "pool can't grow beyond %u entries\n",
+			mp->ring_entries - 1);
+		goto end;
+	}
+
+	data = mp_seg_mmap(mp->name, seg, size, 1);
+	if (data == NULL)
+		goto end;
+
+	mp_priv->seg[seg] = data;
+	mp->seg_entries[seg] = entries;
+	wmb();
+	mp->segments = seg + 1;
+	mp->entries += entries;
+
+	for (i = 0; i < entries; i++) {
+		mp_buf_priv_t buf = {
+			.offset = ((uintptr_t)seg << MEM_POOL_SEG_SHIFT) | i,
+			.buf = &data[i],
+		};
+
+		data[i].owner = -1;
+		data[i].next = MEM_POOL_BUF_NONE;
+		/* can't fail, the ring size has been checked */
+		mp_put(mp_priv, 0, &buf);
+	}
+	ret = 0;
+
+ end:
+	spin_unlock(&mp->lock);
+
+	return ret;
+}
+
+static mp_ring_t *mp_bucket_mmap(mempool_priv_t *mp_priv, int bucket,
+				 int create)
+{
+	mempool_t *mp = mp_priv->mp;
+	struct mp_bucket_desc *desc = &mp->bucket_desc[bucket];
+	char shm_name[MEM_POOL_MAX_SEG_NAME];
+	size_t size = mp_bucket_mem_size(desc);
+	mp_ring_t *ring;
+	int fd;
+
+	mp_bucket_shm_name(shm_name, mp->name, bucket);
+
+	if (create)
+		fd = shm_open(shm_name, O_CREAT|O_RDWR|O_TRUNC,
+			      S_IRUSR|S_IWUSR);
+	else
+		fd = shm_open(shm_name, O_RDWR, S_IRUSR|S_IWUSR);
+	if (fd < 0) {
+		fprintf(stderr, "can't open shared memory %s\n", shm_name);
+		return NULL;
+	}
+
+	if (create && ftruncate(fd, size) < 0) {
+		shm_unlink(shm_name);
+		close(fd);
+		return NULL;
+	}
+
+	ring = mmap(NULL, size, PROT_WRITE | PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if ((long)ring == -1) {
+		if (create)
+			shm_unlink(shm_name);
+		return NULL;
+	}
+
+	return ring;
+}
+
+static int __mp_bucket_create(mempool_priv_t *mp_priv, const char *name,
+			      unsigned int entries, enum mp_ring_type type,
+			      unsigned int shards)
+{
+	mempool_t *mp = mp_priv->mp;
+	struct mp_bucket_desc *desc = NULL;
+	mp_ring_t *ring;
+	int i, bucket = -1;
+
+	if (!POWEROF2(entries) || entries < 2) {
+		fprintf(stderr, "number of entries must be power of 2\n");
+		return -1;
+	}
+
+	if (shards < 1) {
+		fprintf(stderr, "number of shards must be greater than 0\n");
+		return -1;
+	}
+
+	if (strlen(name) >= MEM_POOL_MAX_BUCKET_NAME) {
+		fprintf(stderr, "bucket name cannot exceed %d characters\n",
+			MEM_POOL_MAX_BUCKET_NAME - 1);
+		return -1;
+	}
+
+	spin_lock(&mp->lock);
+
+	for (i = mp->buckets; i < MEM_POOL_MAX_BUCKETS; i++) {
+		struct mp_bucket_desc *d = &mp->bucket_desc[i];
+
+		if (d->state == MP_BUCKET_DYNAMIC &&
+		    strcmp(d->name, name) == 0) {
+			fprintf(stderr, "bucket %s already exists\n", name);
+			goto end;
+		}
+		if (desc == NULL && d->state == MP_BUCKET_FREE) {
+			desc = d;
+			bucket = i;
+		}
+	}
+
+	if (desc == NULL) {
+		fprintf(stderr, "number of buckets cannot exceed %d\n",
+			MEM_POOL_MAX_BUCKETS);
+		goto end;
+	}
+
+	/* the slot was destroyed by another process since we mapped it */
+	if (mp_priv->bucket[bucket]) {
+		munmap(mp_priv->bucket[bucket], mp_bucket_mem_size(desc));
+		mp_priv->bucket[bucket] = NULL;
+	}
+
+	desc->entries = entries;
+	desc->type = type;
+	desc->shards = shards;
+	desc->next_shard = 0;
+	desc->flags = 0;
+	desc->congested = 0;
+	ring = mp_bucket_mmap(mp_priv, bucket, 1);
+	if (ring == NULL) {
+		bucket = -1;
+		goto end;
+	}
+	if (type == MP_RING_FAA) {
+		mp_ring_faa_init((mp_ring_faa_t *)ring, entries);
+	} else if (type == MP_RING_REORDER) {
+		mp_ring_reorder_init((mp_ring_reorder_t *)ring, entries);
+	} else {
+		for (i = 0; i < shards; i++)
+			mp_shard_ring(ring, i)->mask = entries - 1;
+	}
+
+	strcpy(desc->name, name);
+	desc->gen++;
+	wmb();
+	desc->state = MP_BUCKET_DYNAMIC;
+
+	mp_priv->bucket[bucket] = ring;
+	mp_priv->bucket_gen[bucket] = desc->gen;
+	mp_priv->bucket_type[bucket] = type;
+
+ end:
+	spin_unlock(&mp->lock);
+
+	return bucket;
+}
+
+/*
+ * Create a named bucket after the pool creation. The ring lives in its own
+ * shared memory object (<pool name>.b<bucket>) so its size does not depend
+ * on the number of entries of the pool. Returns the bucket handle to be
+ * used with mp_get()/mp_put().
+ */
+int mp_bucket_create(mempool_priv_t *mp_priv, const char *name,
+		     unsigned int entries)
+{
+	return __mp_bucket_create(mp_priv, name, entries, MP_RING_CLASSIC, 1);
+}
+
+/*
+ * Create a named bucket made of shards rings of entries buffers each.
+ * Producers are spread over the shards and don't contend with each other
+ * as long as they are not more numerous than the shards.
+ */
+int mp_bucket_create_sharded(mempool_priv_t *mp_priv, const char *name,
+			     unsigned int entries, unsigned int shards)
+{
+	return __mp_bucket_create(mp_priv, name, entries, MP_RING_SHARDED,
+				  shards);
+}
+
+/*
+ * Create a named bucket backed by a fetch-and-add ring, which scales better
+ * than the CAS based one when many producers and consumers contend.
+ */
+int mp_bucket_create_faa(mempool_priv_t *mp_priv, const char *name,
+			 unsigned int entries)
+{
+	return __mp_bucket_create(mp_priv, name, entries, MP_RING_FAA, 1);
+}
+
+/*
+ * Create a named bucket releasing buffers in the order of the sequence
+ * numbers they got entering a section, see mp_reorder_create().
+ */
+int mp_bucket_create_reorder(mempool_priv_t *mp_priv, const char *name,
+			     unsigned int entries)
+{
+	return __mp_bucket_create(mp_priv, name, entries, MP_RING_REORDER, 1);
+}
+
+/* map a dynamic bucket in the calling process, called with the lock held */
+static int __mp_bucket_map(mempool_priv_t *mp_priv, int bucket)
+{
+	struct mp_bucket_desc *desc = &mp_priv->mp->bucket_desc[bucket];
+	mp_ring_t *ring;
+
+	if (mp_priv->bucket[bucket] && mp_priv->bucket_gen[bucket] == desc->gen)
+		return bucket;
+
+	/* the slot has been reused since it was mapped */
+	if (mp_priv->bucket[bucket])
+		munmap(mp_priv->bucket[bucket], mp_bucket_mem_size(desc));
+
+	ring = mp_bucket_mmap(mp_priv, bucket, 0);
+	mp_priv->bucket[bucket] = ring;
+	if (ring == NULL)
+		return -1;
+	mp_priv->bucket_gen[bucket] = desc->gen;
+	mp_priv->bucket_type[bucket] = desc->type;
+
+	return bucket;
+}
+
+/*
+ * Resolve a bucket name into a handle, mapping its ring in the calling
+ * process. It is meant to be called once, the handle then indexes
+ * mp_priv->bucket[] like any static bucket.
+ */
+int mp_bucket_lookup(mempool_priv_t *mp_priv, const char *name)
+{
+	mempool_t *mp = mp_priv->mp;
+	int i, bucket = -1;
+
+	spin_lock(&mp->lock);
+
+	for (i = mp->buckets; i < MEM_POOL_MAX_BUCKETS; i++) {
+		struct mp_bucket_desc *desc = &mp->bucket_desc[i];
+
+		if (desc->state != MP_BUCKET_DYNAMIC ||
+		    strcmp(desc->name, name) != 0)
+			continue;
+
+		bucket = __mp_bucket_map(mp_priv, i);
+		break;
+	}
+
+	spin_unlock(&mp->lock);
+
+	return bucket;
+}
+
+/*
+ * Map a dynamic bucket known by its handle, e.g. received from another
+ * process. Returns the handle or -1 if the bucket doesn't exist.
+ */
+int mp_bucket_map(mempool_priv_t *mp_priv, int bucket)
+{
+	mempool_t *mp = mp_priv->mp;
+	int ret = -1;
+
+	if (bucket < 0 || bucket >= MEM_POOL_MAX_BUCKETS)
+		return -1;
+
+	if (bucket < mp->buckets)
+		return bucket;
+
+	spin_lock(&mp->lock);
+	if (mp->bucket_desc[bucket].state == MP_BUCKET_DYNAMIC)
+		ret = __mp_bucket_map(mp_priv, bucket);
+	spin_unlock(&mp->lock);
+
+	return ret;
+}
+
+/*
+ * Destroy a dynamic bucket. The bucket must be empty and no other process
+ * may use its handle anymore.
+ */
+int mp_bucket_destroy(mempool_priv_t *mp_priv, int bucket)
+{
+	mempool_t *mp = mp_priv->mp;
+	struct mp_bucket_desc *desc;
+	char shm_name[MEM_POOL_MAX_SEG_NAME];
+	mp_ring_t *ring;
+	int ret = -1;
+
+	if (bucket < mp->buckets || bucket >= MEM_POOL_MAX_BUCKETS) {
+		fprintf(stderr, "bucket %d is not a dynamic bucket\n", bucket);
+		return -1;
+	}
+	desc = &mp->bucket_desc[bucket];
+	ring = mp_priv->bucket[bucket];
+
+	spin_lock(&mp->lock);
+
+	if (desc->state != MP_BUCKET_DYNAMIC || ring == NULL ||
+	    mp_priv->bucket_gen[bucket] != desc->gen)
+		goto end;
+
+	if ((desc->flags & MP_BUCKET_F_SPILL) &&
+	    mp_spill_disable(mp_priv, bucket) < 0)
+		goto end;
+
+	if (mp_count(mp_priv, bucket)) {
+		fprintf(stderr, "bucket %s is not empty\n", desc->name);
+		goto end;
+	}
+
+	desc->state = MP_BUCKET_FREE;
+	mp_bucket_shm_name(shm_name, mp->name, bucket);
+	shm_unlink(shm_name);
+	munmap(ring, mp_bucket_mem_size(desc));
+	mp_priv->bucket[bucket] = NULL;
+	ret = 0;
+
+ end:
+	spin_unlock(&mp->lock);
+
+	return ret;
+}
+
+/*
+ * Set the watermarks of a bucket (see struct mp_bucket_desc). The
+ * congestion flag flips when a watermark is crossed and the eventfd notif
+ * is written if it is not -1. Setting both watermarks to 0 disables them.
+ */
+int mp_set_watermarks(mempool_priv_t *mp_priv, int bucket, unsigned int low,
+		      unsigned int high, int notif)
+{
+	struct mp_bucket_desc *desc;
+
+	if (bucket < 0 || bucket >= MEM_POOL_MAX_BUCKETS ||
+	    mp_priv->bucket[bucket] == NULL) {
+		fprintf(stderr, "invalid bucket %d\n", bucket);
+		return -1;
+	}
+	desc = &mp_priv->mp->bucket_desc[bucket];
+
+	if (low == 0 && high == 0) {
+		__sync_fetch_and_and(&desc->flags, ~MP_BUCKET_F_WM);
+		desc->congested = 0;
+		return 0;
+	}
+
+	if (low >= high || high > desc->entries * desc->shards) {
+		fprintf(stderr, "low watermark must be lower than the high one "
+			"and the high one cannot exceed the bucket size\n");
+		return -1;
+	}
+
+	if (notif >= MEM_POOL_MAX_FDS) {
+		fprintf(stderr, "invalid notification %d\n", notif);
+		return -1;
+	}
+
+	desc->low_wm = low;
+	desc->high_wm = high;
+	desc->wm_notif = notif;
+	desc->congested = 0;
+	wmb();
+	__sync_fetch_and_or(&desc->flags, MP_BUCKET_F_WM);
+
+	mp_wm_update(mp_priv, bucket);
+
+	return 0;
+}
+
+/* called after each get/put on buckets having watermarks */
+void mp_wm_update(mempool_priv_t *mp_priv, int bucket)
+{
+	struct mp_bucket_desc *desc = &mp_priv->mp->bucket_desc[bucket];
+	unsigned int count = mp_count(mp_priv, bucket);
+	uint32_t congested;
+	uint64_t value = 1;
+
+	/* bucket 0 holds the free buffers, it is congested when it drains */
+	if (bucket == 0) {
+		if (count <= desc->low_wm)
+			congested = 1;
+		else if (count >= desc->high_wm)
+			congested = 0;
+		else
+			return;
+	} else {
+		if (count >= desc->high_wm)
+			congested = 1;
+		else if (count <= desc->low_wm)
+			congested = 0;
+		else
+			return;
+	}
+
+	/* only the process flipping the flag notifies */
+	if (desc->congested == congested ||
+	    !atomic_cmpset_int(&desc->congested, !congested, congested))
+		return;
+
+	if (desc->wm_notif >= 0 && mp_priv->fds[desc->wm_notif] >= 0 &&
+	    write(mp_priv->fds[desc->wm_notif], &value, sizeof(value)) < 0)
+		perror("watermark notification");
+}
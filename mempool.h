@@ -2,30 +2,225 @@
 #define _MEMPOOL_H_
 #include <string.h>
 #include <assert.h>
+#include <time.h>
 #include "atomic.h"
 #include "mp_ring.h"
+#include "mp_shard.h"
+#include "mp_ring_faa.h"
+#include "mp_ring_reorder.h"
 
-#define MEM_POOL_BUF_SIZE 8196
-#define MEM_POOL_MAX_BUCKETS 16
+#define MEM_POOL_BUF_SIZE 8192
+#define MEM_POOL_PAGE_SIZE 4096
+#define MEM_POOL_PAGE_ALIGN(x) \
+	(((x) + MEM_POOL_PAGE_SIZE - 1) & ~((uintptr_t)MEM_POOL_PAGE_SIZE - 1))
+#define MEM_POOL_MAX_BUCKETS 256
+#define MEM_POOL_MAX_BUCKET_NAME 32
 #define MEM_POOL_MAX_FDS 16
 #define MEM_POOL_MAX_NAME 100
+#define MEM_POOL_MAX_SEGS 32
+#define MEM_POOL_MAX_CLIENTS 64
 
+/* buffer handle: segment number in the upper bits, index in the lower ones */
+#define MEM_POOL_SEG_SHIFT 24
+#define MEM_POOL_SEG_MASK  ((1UL << MEM_POOL_SEG_SHIFT) - 1)
+#define MEM_POOL_MAX_SEG_ENTRIES (1U << MEM_POOL_SEG_SHIFT)
+/* end of a buffer chain */
+#define MEM_POOL_BUF_NONE ((uintptr_t)-1)
+
+/*
+ * A segment is a dense array of buffer headers followed by the page
+ * aligned payloads, MEM_POOL_BUF_SIZE bytes each. The payload of a buffer
+ * is found from its handle, see mp_buf_data().
+ */
 struct mp_buf {
-	uint32_t len;
-#ifndef NDEBUG
-	int owner;
-#endif
-	struct mp_buf_t *next;
-	char data[MEM_POOL_BUF_SIZE];
-} __cache_aligned;
+	uint32_t  len;
+	int32_t   owner;	/* only maintained by debug builds */
+	uintptr_t next;		/* handle of the next buffer of a chain */
+	uint32_t  csum;		/* CRC32C of the payload, see mp_csum.c */
+	uint16_t  client;	/* quota slot charged + 1, 0 if none */
+	/* delayed delivery, see mp_timer.c */
+	uint16_t  timer_bucket;
+	uint32_t  timer_next;
+	uint32_t  timer_expires;
+	uint32_t  seq;		/* stamped entering a section, see mp_reorder.c */
+	uint32_t  deadline;	/* us, stale past it, see mp_deadline.c */
+};
 
 typedef struct mp_buf mp_buf_t;
 
+enum mp_bucket_state {
+	MP_BUCKET_FREE,
+	MP_BUCKET_STATIC,	/* created with the pool */
+	MP_BUCKET_DYNAMIC,	/* created with mp_bucket_create() */
+};
+
+enum mp_ring_type {
+	MP_RING_CLASSIC,
+	MP_RING_SHARDED,	/* one ring per producer, see mp_shard.h */
+	MP_RING_FAA,		/* fetch-and-add ring, see mp_ring_faa.h */
+	MP_RING_REORDER,	/* reorder window, see mp_ring_reorder.h */
+};
+
+/* bucket flags */
+#define MP_BUCKET_F_WM    0x1	/* watermarks are set */
+#define MP_BUCKET_F_SPILL 0x2	/* overflow to a file queue, see mp_spill.c */
+#define MP_BUCKET_F_CSUM  0x4	/* payload checksum set on put, see mp_csum.c */
+#define MP_BUCKET_F_CSUM_GET 0x8	/* and verified on get */
+#define MP_BUCKET_F_QUOTA 0x10	/* bucket 0 only, see mp_quota.c */
+#define MP_BUCKET_F_TIMER 0x20	/* target of delayed buffers, see mp_timer.c */
+#define MP_BUCKET_F_SEQ   0x40	/* puts are numbered, see mp_reorder.c */
+#define MP_BUCKET_F_DEADLINE 0x80	/* stale buffers shed, see mp_deadline.c */
+#define MP_BUCKET_F_TRIM  0x100	/* bucket 0 only, see mp_trim.c */
+
+/*
+ * File backed overflow queue of a bucket: fixed size segment files
+ * <dir>/<pool name>.<bucket>.<gen>.<segment> holding length prefixed
+ * records.
+ */
+struct mp_spill {
+	spinlock_t        lock;
+	volatile uint32_t count;	/* records in the queue */
+	uint32_t          gen;		/* bumped each time it is enabled */
+	volatile uint32_t growing;	/* next write segment being created */
+	uint32_t          seg_size;
+	uint32_t          wseg;		/* write position */
+	uint32_t          woff;
+	uint32_t          rseg;		/* read position */
+	uint32_t          roff;
+	char              dir[MEM_POOL_MAX_NAME];
+};
+
+#define MP_TIMER_LEVELS 4
+#define MP_TIMER_SLOTS  256
+#define MP_TIMER_NONE   0xffffffffU	/* end of a slot list */
+
+struct mp_timer_slot {
+	uint32_t head;
+	uint32_t tail;
+};
+
+/*
+ * Hierarchical timer wheel of the delayed buffers, linked through their
+ * headers. Level n slots cover 256^n ticks each.
+ */
+struct mp_timer {
+	spinlock_t        lock;
+	uint32_t          tick_ns;	/* 0 if the wheel is not enabled */
+	uint64_t          start_ns;	/* CLOCK_MONOTONIC of tick 0 */
+	volatile uint32_t next;		/* next tick to process */
+	volatile uint32_t pending;	/* buffers in the wheel */
+	uint32_t          postponed;	/* deliveries to a full bucket */
+	struct mp_timer_slot wheel[MP_TIMER_LEVELS][MP_TIMER_SLOTS];
+};
+
+/*
+ * Free buffers whose payload pages were given back to the kernel, chained
+ * through their next handle. A buffer is trimmed once bucket 0 had more
+ * than reserve free buffers for window runs in a row, see mp_trim.c.
+ */
+struct mp_trim {
+	spinlock_t        lock;
+	uint32_t          reserve;	/* free buffers always kept warm */
+	uint32_t          window;
+	uint32_t          runs;		/* consecutive runs with a surplus */
+	uint32_t          surplus;	/* lowest one over these runs */
+	uintptr_t         head;		/* cold buffers */
+	volatile uint32_t count;
+	uint32_t          trimmed;	/* buffers made cold, total */
+	uint32_t          refilled;	/* and brought back */
+	uint32_t          pinned;	/* io_uring rings with fixed buffers */
+};
+
+#define MP_PART_BITS 12
+#define MP_PART_SLOTS (1U << MP_PART_BITS)
+#define MP_PART_MAX_MEMBERS 32
+
+enum mp_part_state {
+	MP_PART_FREE,
+	MP_PART_JOINED,
+	MP_PART_LEAVING,	/* out of the table, draining its bucket */
+};
+
+/* a member may not consume until another one has processed taken buffers */
+struct mp_part_fence {
+	uint32_t member;
+	uint32_t taken;
+};
+
+struct mp_part_member {
+	volatile uint32_t state;
+	uint32_t          bucket;
+	volatile uint32_t taken;	/* buffers taken from the bucket */
+	volatile uint32_t done;		/* of which processed */
+	volatile uint32_t taking;	/* between the get and taken++ */
+	volatile uint32_t nfences;
+	uintptr_t         held;		/* taken while being fenced */
+	struct mp_part_fence fence[MP_PART_MAX_MEMBERS];
+} __cache_aligned;
+
+/*
+ * Key partitioned dispatch: the slots of the hash space are spread over
+ * the buckets of the members by consistent hashing, see mp_part.c.
+ */
+struct mp_part {
+	spinlock_t        lock;
+	uint32_t          members;
+	uint32_t          rebalances;
+	/* producers between the table lookup and the put, by epoch parity */
+	volatile uint32_t epoch;
+	volatile uint32_t puts[2];
+	volatile uint32_t sampling;	/* fences set, backlogs not sampled */
+	uint8_t           table[MP_PART_SLOTS] __cache_aligned;
+	struct mp_part_member member[MP_PART_MAX_MEMBERS];
+};
+
+struct mp_bucket_desc {
+	char     name[MEM_POOL_MAX_BUCKET_NAME];
+	uint32_t entries;	/* ring size */
+	uint32_t state;
+	uint32_t gen;		/* bumped each time the slot is reused */
+	uint32_t type;
+	uint32_t shards;
+	volatile uint32_t next_shard;	/* shard given to the next producer */
+	uint32_t flags;
+	/*
+	 * The bucket is congested when it fills up to high_wm and gets back
+	 * to normal when it drains down to low_wm. As bucket 0 holds the free
+	 * buffers, it is the other way round for it: it is congested when
+	 * there are only low_wm free buffers left and not anymore when there
+	 * are high_wm ones again.
+	 */
+	uint32_t low_wm;
+	uint32_t high_wm;
+	int      wm_notif;	/* index in mp_priv->fds, -1 if none */
+	volatile uint32_t congested;
+	volatile uint32_t csum_errors;	/* buffers dropped on a bad checksum */
+	spinlock_t        seq_lock;	/* numbered puts are serialized */
+	uint32_t          seq;		/* number of the next put */
+	uint32_t          ttl_us;	/* lifetime of the buffers put */
+	volatile uint32_t expired;	/* buffers shed past their deadline */
+	struct mp_spill spill;
+};
+
 typedef struct mp_buf_priv_t {
 	uintptr_t offset;
 	mp_buf_t *buf;
+	char     *data;
 } mp_buf_priv_t;
 
+/*
+ * Quota of a process allocating from bucket 0. Each slot sits on its own
+ * cache line, the pool wide counters are only touched by allocations
+ * within a reservation.
+ */
+struct mp_client {
+	volatile int32_t  pid;		/* 0 if the slot is free */
+	uint32_t          reserved;	/* buffers guaranteed to the client */
+	uint32_t          max;		/* limit of outstanding buffers */
+	volatile uint32_t outstanding;
+	volatile uint32_t failures;	/* allocations refused by the quota */
+} __cache_aligned;
+
 struct mempool {
 	uint32_t size;
 	uint32_t entries;
@@ -33,6 +228,21 @@ struct mempool {
 	char     name[MEM_POOL_MAX_NAME];
 	char     sun_path[MEM_POOL_MAX_NAME];
 	uint32_t buckets;
+	uint32_t ring_entries;	/* ring capacity, upper limit of the growth */
+	spinlock_t lock;	/* serializes growth and bucket management */
+	volatile uint32_t segments;
+	uint32_t seg_entries[MEM_POOL_MAX_SEGS];
+	struct mp_bucket_desc bucket_desc[MEM_POOL_MAX_BUCKETS];
+	/* quotas: defaults given to new clients, sum of the reservations */
+	uint32_t quota_reserved;
+	uint32_t quota_max;
+	uint32_t reserved_total;
+	/* reserved buffers not allocated yet, others can't take them */
+	volatile int32_t reserve_unused;
+	struct mp_client clients[MEM_POOL_MAX_CLIENTS];
+	struct mp_timer timer;
+	struct mp_part part;
+	struct mp_trim trim;
 } __cache_aligned;
 typedef struct mempool mempool_t;
 
@@ -42,40 +252,354 @@ typedef struct mempool_priv_t {
 	int        fds[MEM_POOL_MAX_FDS];
 	mp_buf_t  *data;
 	int        entries;
+	/*
+	 * buffer headers of the segments, mapped on first reference,
+	 * seg[0] == data
+	 */
+	mp_buf_t  *seg[MEM_POOL_MAX_SEGS];
+	/* generation of the locally mapped dynamic buckets */
+	uint32_t   bucket_gen[MEM_POOL_MAX_BUCKETS];
+	uint8_t    bucket_type[MEM_POOL_MAX_BUCKETS];
+	/* spill segments mapped by this process */
+	struct mp_spill_map *spill_map[MEM_POOL_MAX_BUCKETS];
+	int        client;	/* quota slot, -1 if none */
 } mempool_priv_t;
 
+/*
+ * per thread shard of the sharded buckets (+1, 0 if none yet), valid for
+ * the bucket generation in mp_shard_gen: a slot can be reused by a bucket
+ * with fewer shards
+ */
+extern __thread uint32_t mp_shard_id[MEM_POOL_MAX_BUCKETS];
+extern __thread uint32_t mp_shard_cursor[MEM_POOL_MAX_BUCKETS];
+extern __thread uint32_t mp_shard_gen[MEM_POOL_MAX_BUCKETS];
+
 int mp_create(mempool_priv_t *mp_priv, const char *name, unsigned int entries,
 	      unsigned int buckets);
+int mp_create_growable(mempool_priv_t *mp_priv, const char *name,
+		       unsigned int entries, unsigned int max_entries,
+		       unsigned int buckets);
+int mp_grow(mempool_priv_t *mp_priv, unsigned int entries);
+mp_buf_t *mp_map_segment(mempool_priv_t *mp_priv, unsigned int seg);
+int mp_bucket_create(mempool_priv_t *mp_priv, const char *name,
+		     unsigned int entries);
+int mp_bucket_create_sharded(mempool_priv_t *mp_priv, const char *name,
+			     unsigned int entries, unsigned int shards);
+int mp_bucket_create_faa(mempool_priv_t *mp_priv, const char *name,
+			 unsigned int entries);
+int mp_bucket_create_reorder(mempool_priv_t *mp_priv, const char *name,
+			     unsigned int entries);
+int mp_bucket_lookup(mempool_priv_t *mp_priv, const char *name);
+int mp_bucket_map(mempool_priv_t *mp_priv, int bucket);
+int mp_bucket_destroy(mempool_priv_t *mp_priv, int bucket);
+int mp_set_watermarks(mempool_priv_t *mp_priv, int bucket, unsigned int low,
+		      unsigned int high, int notif);
+void mp_wm_update(mempool_priv_t *mp_priv, int bucket);
+int mp_spill_enable(mempool_priv_t *mp_priv, int bucket, const char *dir,
+		    unsigned int seg_size);
+int mp_spill_disable(mempool_priv_t *mp_priv, int bucket);
+void mp_spill_release(mempool_priv_t *mp_priv, int bucket, int last);
+int mp_spill_put(mempool_priv_t *mp_priv, int bucket, mp_buf_priv_t *buf);
+int mp_spill_drain(mempool_priv_t *mp_priv, int bucket);
+uint32_t mp_crc32c(uint32_t crc, const void *data, size_t len);
+int mp_csum_check(mempool_priv_t *mp_priv, int bucket, mp_buf_priv_t *buf);
+void mp_deadline_drop(mempool_priv_t *mp_priv, int bucket,
+		      mp_buf_priv_t *buf);
+int mp_trim_refill(mempool_priv_t *mp_priv, unsigned int n);
+int mp_quota_join(mempool_priv_t *mp_priv);
+void mp_quota_leave(mempool_priv_t *mp_priv);
+int mp_quota_alloc(mempool_priv_t *mp_priv, mp_buf_priv_t *buf);
+void mp_quota_uncharge(mempool_priv_t *mp_priv, mp_buf_priv_t *buf);
+void mp_quota_recharge(mempool_priv_t *mp_priv, mp_buf_priv_t *buf,
+		       uint32_t client);
+int mp_timer_run(mempool_priv_t *mp_priv);
 int mp_unregister(mempool_priv_t *mp_priv);
 int mp_register(mempool_priv_t *mp_priv, const char *name);
 int mp_create_notifs(mempool_priv_t *mp_priv, unsigned notifications);
 void mp_retain(mempool_t *mp);
 
+/* translate a buffer handle into its address, mapping the segment lazily */
+static inline mp_buf_t *mp_buf_addr(mempool_priv_t *mp_priv, uintptr_t offset)
+{
+	unsigned int seg = offset >> MEM_POOL_SEG_SHIFT;
+	mp_buf_t *data = mp_priv->seg[seg];
+
+	if (unlikely(data == NULL) &&
+	    (data = mp_map_segment(mp_priv, seg)) == NULL)
+		return NULL;
+
+	return &data[offset & MEM_POOL_SEG_MASK];
+}
+
+/* the payloads of a segment start on the page following its headers */
+static inline char *mp_seg_payload(mp_buf_t *hdr, unsigned int entries)
+{
+	return (char *)MEM_POOL_PAGE_ALIGN((uintptr_t)(hdr + entries));
+}
+
+/* payload of a buffer, its segment must have been mapped by mp_buf_addr() */
+static inline char *mp_buf_data(mempool_priv_t *mp_priv, uintptr_t offset)
+{
+	unsigned int seg = offset >> MEM_POOL_SEG_SHIFT;
+	char *payload = mp_seg_payload(mp_priv->seg[seg],
+				       mp_priv->mp->seg_entries[seg]);
+
+	return payload + (offset & MEM_POOL_SEG_MASK) * MEM_POOL_BUF_SIZE;
+}
+
+/*
+ * Map the segments this process didn't see yet. Returns their number, -1
+ * if one of them can't be mapped.
+ */
+static inline int mp_map_segments(mempool_priv_t *mp_priv)
+{
+	unsigned int seg, segments = mp_priv->mp->segments;
+
+	for (seg = 0; seg < segments; seg++) {
+		if (unlikely(mp_priv->seg[seg] == NULL) &&
+		    mp_map_segment(mp_priv, seg) == NULL)
+			return -1;
+	}
+
+	return segments;
+}
+
+/*
+ * Take a lock under which lists of buffers are walked. mp_buf_addr() must
+ * not mmap with a spinlock held, so the segments are mapped before, and
+ * again if the pool grew in between. A segment which can't be mapped is
+ * left to mp_buf_addr(). Returns 0 if try is set and the lock is busy.
+ */
+static inline int
+__mp_lock_mapped(mempool_priv_t *mp_priv, spinlock_t *lock, int try)
+{
+	for (;;) {
+		int segments = mp_map_segments(mp_priv);
+
+		if (!try)
+			spin_lock(lock);
+		else if (!spin_trylock(lock))
+			return 0;
+		if (segments < 0 || segments == mp_priv->mp->segments)
+			return 1;
+		spin_unlock(lock);
+	}
+}
+
+#define mp_lock_mapped(mp_priv, lock) __mp_lock_mapped(mp_priv, lock, 0)
+#define mp_trylock_mapped(mp_priv, lock) __mp_lock_mapped(mp_priv, lock, 1)
+
+static inline unsigned int mp_shard_of(mempool_priv_t *mp_priv, int bucket)
+{
+	uint32_t id = mp_shard_id[bucket];
+
+	if (unlikely(id == 0 ||
+		     mp_shard_gen[bucket] != mp_priv->bucket_gen[bucket])) {
+		struct mp_bucket_desc *desc = &mp_priv->mp->bucket_desc[bucket];
+
+		id = __sync_fetch_and_add(&desc->next_shard, 1) % desc->shards;
+		mp_shard_id[bucket] = ++id;
+		mp_shard_gen[bucket] = mp_priv->bucket_gen[bucket];
+	}
+
+	return id - 1;
+}
+
+/* number of buffers in a bucket, no atomic operation involved */
+static inline unsigned int mp_count(mempool_priv_t *mp_priv, int bucket)
+{
+	mp_ring_t *ring = mp_priv->bucket[bucket];
+
+	switch (mp_priv->bucket_type[bucket]) {
+	case MP_RING_SHARDED:
+		return mp_shard_count(ring,
+				      mp_priv->mp->bucket_desc[bucket].shards);
+	case MP_RING_FAA:
+		return mp_ring_faa_count((mp_ring_faa_t *)ring);
+	case MP_RING_REORDER:
+		return mp_ring_reorder_count((mp_ring_reorder_t *)ring);
+	default:
+		return mp_ring_count(ring);
+	}
+}
+
+/* number of buffers that can still be put into a bucket */
+static inline unsigned int mp_free_count(mempool_priv_t *mp_priv, int bucket)
+{
+	mp_ring_t *ring = mp_priv->bucket[bucket];
+	struct mp_bucket_desc *desc = &mp_priv->mp->bucket_desc[bucket];
+
+	switch (mp_priv->bucket_type[bucket]) {
+	case MP_RING_SHARDED:
+		return desc->shards * (ring->mask)
+			- mp_shard_count(ring, desc->shards);
+	case MP_RING_FAA:
+		return mp_ring_faa_free_count((mp_ring_faa_t *)ring);
+	case MP_RING_REORDER:
+		return mp_ring_reorder_free_count((mp_ring_reorder_t *)ring);
+	default:
+		return mp_ring_free_count(ring);
+	}
+}
+
+static inline int mp_is_congested(mempool_priv_t *mp_priv, int bucket)
+{
+	return mp_priv->mp->bucket_desc[bucket].congested;
+}
+
+static inline int
+__mp_ring_get(mempool_priv_t *mp_priv, int bucket, void **ptr, int mp)
+{
+	mp_ring_t *ring = mp_priv->bucket[bucket];
+
+	switch (mp_priv->bucket_type[bucket]) {
+	case MP_RING_SHARDED:
+		return mp_shard_get(ring, mp_priv->mp->bucket_desc[bucket].shards,
+				    &mp_shard_cursor[bucket], ptr, mp);
+
+	case MP_RING_FAA:
+		/* the bucket ring is a mp_ring_faa_t */
+		return mp_ring_faa_get((mp_ring_faa_t *)ring, ptr);
+
+	case MP_RING_REORDER:
+		return mp_ring_reorder_get((mp_ring_reorder_t *)ring, ptr);
+
+	default:
+		if (mp)
+			return mp_ring_get(ring, ptr);
+		return mp_ring_get_sc(ring, ptr);
+	}
+}
+
+static inline int
+__mp_ring_put(mempool_priv_t *mp_priv, int bucket, void *ptr, int mp)
+{
+	mp_ring_t *ring = mp_priv->bucket[bucket];
+	mp_buf_t *hdr;
+
+	switch (mp_priv->bucket_type[bucket]) {
+	case MP_RING_SHARDED:
+		return mp_shard_put(ring, mp_shard_of(mp_priv, bucket), ptr);
+
+	case MP_RING_FAA:
+		return mp_ring_faa_put((mp_ring_faa_t *)ring, ptr);
+
+	case MP_RING_REORDER:
+		/* placed by the number stamped when entering the section */
+		if ((hdr = mp_buf_addr(mp_priv, (uintptr_t)ptr)) == NULL)
+			return -1;
+		return mp_ring_reorder_put((mp_ring_reorder_t *)ring, hdr->seq,
+					   ptr);
+
+	default:
+		if (mp)
+			return mp_ring_put(ring, ptr);
+		return mp_ring_put_sp(ring, ptr);
+	}
+}
+
+/*
+ * Numbered put into a section, see mp_reorder.c. A number is only used by
+ * a buffer which made it into the ring, the sequence has no hole.
+ */
+static inline int
+mp_seq_put(mempool_priv_t *mp_priv, int bucket, mp_buf_priv_t *buf)
+{
+	struct mp_bucket_desc *desc = &mp_priv->mp->bucket_desc[bucket];
+	int ret;
+
+	spin_lock(&desc->seq_lock);
+	buf->buf->seq = desc->seq;
+	ret = __mp_ring_put(mp_priv, bucket, (void *)buf->offset, 1);
+	if (ret == 0)
+		desc->seq++;
+	spin_unlock(&desc->seq_lock);
+
+	return ret;
+}
+
+/* deadlines are in microseconds of the monotonic clock, modulo 2^32 */
+static inline uint32_t mp_deadline_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* deadlines compare across wraparound as long as lifetimes stay < 35 min */
+static inline int mp_deadline_passed(mp_buf_t *buf, uint32_t now)
+{
+	return (int32_t)(now - buf->deadline) > 0;
+}
+
 static inline int
 __mp_get(mempool_priv_t *mp_priv, int bucket, mp_buf_priv_t *buf, int mp)
 {
 	uintptr_t offset;
 	void *ptr;
-	mp_ring_t *ring = mp_priv->bucket[bucket];
+	struct mp_bucket_desc *desc = &mp_priv->mp->bucket_desc[bucket];
+	unsigned int shed = 0;
+	uint32_t now = 0;
 
-	assert(bucket < mp_priv->mp->buckets);
+	assert(bucket < MEM_POOL_MAX_BUCKETS && mp_priv->bucket[bucket]);
 
-	if (mp) {
-		if (mp_ring_get(ring, &ptr) < 0)
-			return -1;
-	} else {
-		if (mp_ring_get_sc(ring, &ptr) < 0)
-			return -1;
+	/* deliver the delayed buffers which are due */
+	if (unlikely(desc->flags & MP_BUCKET_F_TIMER))
+		mp_timer_run(mp_priv);
+
+ again:
+	/* bring spilled buffers back first, they are older than new puts */
+	if (unlikely(desc->flags & MP_BUCKET_F_SPILL) && desc->spill.count)
+		mp_spill_drain(mp_priv, bucket);
+
+	if (__mp_ring_get(mp_priv, bucket, &ptr, mp) < 0) {
+		if (unlikely(shed))
+			__sync_fetch_and_add(&desc->expired, shed);
+		/* out of warm free buffers, cold ones are faulted back in */
+		if (unlikely(desc->flags & MP_BUCKET_F_TRIM) &&
+		    mp_priv->mp->trim.count && mp_trim_refill(mp_priv, 0) > 0)
+			goto again;
+		return -1;
 	}
 
 	offset = (uintptr_t)ptr;
 	buf->offset = offset;
-	buf->buf = &mp_priv->data[offset];
+	buf->buf = mp_buf_addr(mp_priv, offset);
+
+	if (unlikely(desc->flags & MP_BUCKET_F_WM))
+		mp_wm_update(mp_priv, bucket);
+
+	/* the segment can't be mapped, the buffer is lost */
+	if (unlikely(buf->buf == NULL))
+		return -1;
+	buf->data = mp_buf_data(mp_priv, offset);
 
 	assert(buf->buf->owner == bucket);
 #ifndef NDEBUG
 	buf->buf->owner = -1;
 #endif
+	/* a corrupted buffer is dropped, the next one is taken */
+	if (unlikely(desc->flags & MP_BUCKET_F_CSUM_GET) &&
+	    mp_csum_check(mp_priv, bucket, buf) < 0)
+		goto again;
+
+	/*
+	 * Stale buffers are shed until a fresh one comes, against a single
+	 * clock read, and counted once for the whole run.
+	 */
+	if (unlikely(desc->flags & MP_BUCKET_F_DEADLINE)) {
+		if (shed == 0)
+			now = mp_deadline_now();
+		if (mp_deadline_passed(buf->buf, now)) {
+			mp_deadline_drop(mp_priv, bucket, buf);
+			shed++;
+			goto again;
+		}
+		if (unlikely(shed))
+			__sync_fetch_and_add(&desc->expired, shed);
+	}
+
 	return 0;
 }
 
@@ -96,24 +620,61 @@ mp_get_sc(mempool_priv_t *mp_priv, int bucket, mp_buf_priv_t *buf)
 static inline int
 __mp_put(mempool_priv_t *mp_priv, int bucket, mp_buf_priv_t *buf, int mp)
 {
-	mp_ring_t *ring = mp_priv->bucket[bucket];
 	void *ptr = (void *)buf->offset;
+	struct mp_bucket_desc *desc = &mp_priv->mp->bucket_desc[bucket];
+	uint32_t client = 0;
 
-	assert(bucket < mp_priv->mp->buckets);
+	assert(bucket < MEM_POOL_MAX_BUCKETS && mp_priv->bucket[bucket]);
+
+	/*
+	 * A freed buffer is given back to the quota of its allocator before
+	 * another one can take it, and charged again if the put fails.
+	 */
+	if (unlikely(desc->flags & MP_BUCKET_F_QUOTA) &&
+	    (client = buf->buf->client))
+		mp_quota_uncharge(mp_priv, buf);
+
+	/* the consumer may read the payload as soon as it is in the ring */
+	if (unlikely(desc->flags & MP_BUCKET_F_CSUM))
+		buf->buf->csum = mp_crc32c(0, buf->data, buf->buf->len);
+
+	if (unlikely(desc->flags & MP_BUCKET_F_DEADLINE))
+		buf->buf->deadline = mp_deadline_now() + desc->ttl_us;
+
+	/*
+	 * Once a bucket spilled, puts go to the spill queue until it is
+	 * drained to keep the order. The buffer is returned to bucket 0.
+	 */
+	if (unlikely(desc->flags & MP_BUCKET_F_SPILL) && desc->spill.count)
+		return mp_spill_put(mp_priv, bucket, buf);
 
-	if (mp) {
-		if (mp_ring_put(ring, ptr) < 0)
-			return -1;
-	} else {
-		if (mp_ring_put_sp(ring, ptr) < 0)
-			return -1;
-	}
-	buf->offset = (uintptr_t)ptr;
 	assert(buf->buf->owner == -1);
 #ifndef NDEBUG
+	/* a consumer checks the owner as soon as the buffer is in the ring */
 	buf->buf->owner = bucket;
 #endif
+	if (unlikely(desc->flags & MP_BUCKET_F_SEQ)) {
+		if (mp_seq_put(mp_priv, bucket, buf) < 0)
+			goto fail;
+	} else if (__mp_ring_put(mp_priv, bucket, ptr, mp) < 0) {
+		goto fail;
+	}
+
+	if (unlikely(desc->flags & MP_BUCKET_F_WM))
+		mp_wm_update(mp_priv, bucket);
+
+	buf->offset = (uintptr_t)ptr;
 	return 0;
+
+ fail:
+#ifndef NDEBUG
+	buf->buf->owner = -1;
+#endif
+	if (desc->flags & MP_BUCKET_F_SPILL)
+		return mp_spill_put(mp_priv, bucket, buf);
+	if (unlikely(client))
+		mp_quota_recharge(mp_priv, buf, client);
+	return -1;
 }
 
 /* mempool put - multi producer safe */
@@ -130,9 +691,19 @@ mp_put_sp(mempool_priv_t *mp_priv, int bucket, mp_buf_priv_t *buf)
 	return __mp_put(mp_priv, bucket, buf, 0);
 }
 
+/* the buffer allocated ends a chain of its own */
 static inline int mp_alloc(mempool_priv_t *mp_priv, mp_buf_priv_t *buf)
 {
-	return mp_get(mp_priv, 0, buf);
+	int ret;
+
+	if (unlikely(mp_priv->mp->bucket_desc[0].flags & MP_BUCKET_F_QUOTA))
+		ret = mp_quota_alloc(mp_priv, buf);
+	else
+		ret = mp_get(mp_priv, 0, buf);
+	if (likely(ret == 0))
+		buf->buf->next = MEM_POOL_BUF_NONE;
+
+	return ret;
 }
 
 static inline int mp_free(mempool_priv_t *mp_priv, mp_buf_priv_t *buf)
@@ -140,9 +711,57 @@ static inline int mp_free(mempool_priv_t *mp_priv, mp_buf_priv_t *buf)
 	return mp_put(mp_priv, 0, buf);
 }
 
+/*
+ * Buffers are chained through the next handle of their header, the last
+ * one holding MEM_POOL_BUF_NONE, as a buffer does when mp_alloc() returns
+ * it. Load the buffer following buf into next, returns -1 at the end of
+ * the chain.
+ */
+static inline int
+mp_buf_next(mempool_priv_t *mp_priv, mp_buf_priv_t *buf, mp_buf_priv_t *next)
+{
+	uintptr_t offset = buf->buf->next;
+
+	if (offset == MEM_POOL_BUF_NONE)
+		return -1;
+
+	next->offset = offset;
+	next->buf = mp_buf_addr(mp_priv, offset);
+	if (unlikely(next->buf == NULL))
+		return -1;
+	next->data = mp_buf_data(mp_priv, offset);
+
+	return 0;
+}
+
+/* return all the buffers of a chain to bucket 0 */
+static inline void mp_free_chain(mempool_priv_t *mp_priv, mp_buf_priv_t *head)
+{
+	mp_buf_priv_t buf = *head, next;
+
+	for (;;) {
+		int more = mp_buf_next(mp_priv, &buf, &next) == 0;
+
+		mp_free(mp_priv, &buf);
+		if (!more)
+			break;
+		buf = next;
+	}
+}
+
 static inline int mp_is_full(mempool_priv_t *mp, int bucket)
 {
-	return mp_ring_is_full(mp->bucket[bucket]);
+	mp_ring_t *ring = mp->bucket[bucket];
+
+	/* a sharded bucket is full for the caller if its own shard is */
+	if (mp->bucket_type[bucket] == MP_RING_SHARDED)
+		ring = mp_shard_ring(ring, mp_shard_of(mp, bucket));
+	else if (mp->bucket_type[bucket] == MP_RING_FAA)
+		return mp_ring_faa_is_full((mp_ring_faa_t *)ring);
+	else if (mp->bucket_type[bucket] == MP_RING_REORDER)
+		return mp_ring_reorder_is_full((mp_ring_reorder_t *)ring);
+
+	return mp_ring_is_full(ring);
 }
 
 #endif /* _MEMPOOL_H_ */
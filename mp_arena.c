@@ -0,0 +1,63 @@
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "mempool.h"
+#include "mp_arena.h"
+
+/* start an arena in a buffer allocated from bucket 0 */
+int mp_arena_init(mempool_priv_t *mp_priv, struct mp_arena *arena)
+{
+	arena->mp_priv = mp_priv;
+	if (mp_alloc(mp_priv, &arena->head) < 0)
+		return -1;
+
+	arena->head.buf->len = 0;
+	arena->head.buf->next = MEM_POOL_BUF_NONE;
+	arena->cur = arena->head;
+
+	return 0;
+}
+
+/* free all the buffers but the head one and empty it */
+void mp_arena_reset(struct mp_arena *arena)
+{
+	mp_buf_priv_t next;
+
+	if (mp_buf_next(arena->mp_priv, &arena->head, &next) == 0)
+		mp_free_chain(arena->mp_priv, &next);
+
+	arena->head.buf->len = 0;
+	arena->head.buf->next = MEM_POOL_BUF_NONE;
+	arena->cur = arena->head;
+}
+
+/* the current buffer is full, chain a new one */
+void *mp_arena_grow(struct mp_arena *arena, size_t size, size_t align,
+		    mp_rptr_t *rptr)
+{
+	mp_buf_priv_t buf;
+
+	if (size > MEM_POOL_BUF_SIZE)
+		return NULL;
+	if (mp_alloc(arena->mp_priv, &buf) < 0)
+		return NULL;
+
+	buf.buf->len = 0;
+	buf.buf->next = MEM_POOL_BUF_NONE;
+	arena->cur.buf->next = buf.offset;
+	arena->cur = buf;
+
+	return mp_arena_alloc(arena, size, align, rptr);
+}
+
+char *mp_arena_strdup(struct mp_arena *arena, const char *s, mp_rptr_t *rptr)
+{
+	size_t len = strlen(s) + 1;
+	char *p = mp_arena_alloc(arena, len, 1, rptr);
+
+	if (p)
+		memcpy(p, s, len);
+
+	return p;
+}
@@ -0,0 +1,78 @@
+#ifndef _MP_ARENA_H_
+#define _MP_ARENA_H_
+#include <sys/types.h>
+#include <stdint.h>
+#include "mempool.h"
+
+/*
+ * Arena over pool buffers. A message made of many small objects (arrays,
+ * strings, nested records) is built in a chain of buffers taken from
+ * bucket 0 by bumping the length of the last one, then its head buffer is
+ * put into a bucket as is. The objects refer to each other with relative
+ * pointers - a buffer handle and an offset in its payload - which any
+ * process of the pool resolves with mp_rptr_addr(), so nothing has to be
+ * serialized. Objects are not freed one by one: the whole chain goes back
+ * to bucket 0 with mp_free_chain(), or all but the head buffer with
+ * mp_arena_reset() for scratch space reused from message to message.
+ */
+
+typedef uint64_t mp_rptr_t;
+
+#define MP_RPTR_NULL  ((mp_rptr_t)-1)
+#define MP_RPTR_SHIFT 16	/* payload offsets stay below 2^16 */
+
+struct mp_arena {
+	mempool_priv_t *mp_priv;
+	mp_buf_priv_t   head;
+	mp_buf_priv_t   cur;	/* allocations are carved from its tail */
+};
+
+int mp_arena_init(mempool_priv_t *mp_priv, struct mp_arena *arena);
+void mp_arena_reset(struct mp_arena *arena);
+void *mp_arena_grow(struct mp_arena *arena, size_t size, size_t align,
+		    mp_rptr_t *rptr);
+char *mp_arena_strdup(struct mp_arena *arena, const char *s, mp_rptr_t *rptr);
+
+/*
+ * Allocate size bytes aligned on align, a power of 2 up to a buffer, and
+ * store their relative pointer in rptr if not NULL. Returns NULL if size
+ * exceeds a buffer, align is not valid or the pool is out of buffers.
+ */
+static inline void *
+mp_arena_alloc(struct mp_arena *arena, size_t size, size_t align,
+	       mp_rptr_t *rptr)
+{
+	mp_buf_t *hdr = arena->cur.buf;
+	size_t off;
+
+	/* the aligned offset doesn't go past the payload */
+	if (unlikely(align == 0 || !POWEROF2(align) ||
+		     align > MEM_POOL_BUF_SIZE))
+		return NULL;
+	off = (hdr->len + align - 1) & ~(align - 1);
+
+	if (unlikely(off > MEM_POOL_BUF_SIZE ||
+		     size > MEM_POOL_BUF_SIZE - off))
+		return mp_arena_grow(arena, size, align, rptr);
+
+	hdr->len = off + size;
+	if (rptr)
+		*rptr = (mp_rptr_t)arena->cur.offset << MP_RPTR_SHIFT | off;
+
+	return arena->cur.data + off;
+}
+
+/* address of an object in this process, NULL for MP_RPTR_NULL */
+static inline void *mp_rptr_addr(mempool_priv_t *mp_priv, mp_rptr_t rptr)
+{
+	uintptr_t offset = rptr >> MP_RPTR_SHIFT;
+
+	if (rptr == MP_RPTR_NULL ||
+	    unlikely(mp_buf_addr(mp_priv, offset) == NULL))
+		return NULL;
+
+	return mp_buf_data(mp_priv, offset) +
+		(rptr & ((1U << MP_RPTR_SHIFT) - 1));
+}
+
+#endif /* _MP_ARENA_H_ */
@@ -0,0 +1,158 @@
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <immintrin.h>
+#include "mempool.h"
+#include "mp_copy.h"
+
+size_t mp_copy_threshold = MP_COPY_THRESHOLD;
+
+static void mp_copy_resolve(void *dst, const void *src, size_t len);
+
+static void (*mp_copy_fn)(void *dst, const void *src, size_t len) =
+	mp_copy_resolve;
+static int mp_copy_isa = MP_COPY_ISA_AUTO;
+
+static const char *mp_copy_isa_names[] = {
+	[MP_COPY_ISA_AUTO] = "none",
+	[MP_COPY_ISA_SSE2] = "sse2",
+	[MP_COPY_ISA_AVX2] = "avx2",
+	[MP_COPY_ISA_AVX512] = "avx512",
+};
+
+/*
+ * The kernels copy the bytes up to the next cache line of dst with
+ * memcpy(), stream whole cache lines and copy the rest with memcpy().
+ */
+static inline size_t mp_copy_head(void *dst, const void *src, size_t len)
+{
+	size_t head = -(uintptr_t)dst & 63;
+
+	if (head > len)
+		head = len;
+	memcpy(dst, src, head);
+
+	return head;
+}
+
+static void mp_copy_sse2(void *dst, const void *src, size_t len)
+{
+	size_t off = mp_copy_head(dst, src, len);
+	char *d = dst;
+	const char *s = src;
+
+	for (; off + 64 <= len; off += 64) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(s + off));
+		__m128i b = _mm_loadu_si128((const __m128i *)(s + off + 16));
+		__m128i c = _mm_loadu_si128((const __m128i *)(s + off + 32));
+		__m128i e = _mm_loadu_si128((const __m128i *)(s + off + 48));
+
+		_mm_stream_si128((__m128i *)(d + off), a);
+		_mm_stream_si128((__m128i *)(d + off + 16), b);
+		_mm_stream_si128((__m128i *)(d + off + 32), c);
+		_mm_stream_si128((__m128i *)(d + off + 48), e);
+	}
+	memcpy(d + off, s + off, len - off);
+}
+
+__attribute__((target("avx2")))
+static void mp_copy_avx2(void *dst, const void *src, size_t len)
+{
+	size_t off = mp_copy_head(dst, src, len);
+	char *d = dst;
+	const char *s = src;
+
+	for (; off + 64 <= len; off += 64) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(s + off));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(s + off + 32));
+
+		_mm256_stream_si256((__m256i *)(d + off), a);
+		_mm256_stream_si256((__m256i *)(d + off + 32), b);
+	}
+	memcpy(d + off, s + off, len - off);
+}
+
+__attribute__((target("avx512f")))
+static void mp_copy_avx512(void *dst, const void *src, size_t len)
+{
+	size_t off = mp_copy_head(dst, src, len);
+	char *d = dst;
+	const char *s = src;
+
+	for (; off + 64 <= len; off += 64)
+		_mm512_stream_si512((__m512i *)(d + off),
+				    _mm512_loadu_si512(s + off));
+	memcpy(d + off, s + off, len - off);
+}
+
+static int mp_copy_supported(int isa)
+{
+	__builtin_cpu_init();
+
+	switch (isa) {
+	case MP_COPY_ISA_SSE2:
+		return __builtin_cpu_supports("sse2");
+	case MP_COPY_ISA_AVX2:
+		return __builtin_cpu_supports("avx2");
+	case MP_COPY_ISA_AVX512:
+		return __builtin_cpu_supports("avx512f");
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Select the copy kernel, MP_COPY_ISA_AUTO takes the widest one supported
+ * by the CPU. Returns -1 if the CPU lacks the instruction set.
+ */
+int mp_copy_set_isa(int isa)
+{
+	if (isa == MP_COPY_ISA_AUTO) {
+		for (isa = MP_COPY_ISA_AVX512; isa > MP_COPY_ISA_SSE2; isa--) {
+			if (mp_copy_supported(isa))
+				break;
+		}
+	} else if (!mp_copy_supported(isa)) {
+		fprintf(stderr, "%s copy not supported by the cpu\n",
+			isa > MP_COPY_ISA_AUTO && isa <= MP_COPY_ISA_AVX512 ?
+			mp_copy_isa_names[isa] : "unknown");
+		return -1;
+	}
+
+	switch (isa) {
+	case MP_COPY_ISA_AVX512:
+		mp_copy_fn = mp_copy_avx512;
+		break;
+	case MP_COPY_ISA_AVX2:
+		mp_copy_fn = mp_copy_avx2;
+		break;
+	default:
+		/* part of x86-64 */
+		mp_copy_fn = mp_copy_sse2;
+		isa = MP_COPY_ISA_SSE2;
+	}
+	mp_copy_isa = isa;
+
+	return 0;
+}
+
+const char *mp_copy_isa_name(void)
+{
+	return mp_copy_isa_names[mp_copy_isa];
+}
+
+static void mp_copy_resolve(void *dst, const void *src, size_t len)
+{
+	mp_copy_set_isa(MP_COPY_ISA_AUTO);
+	mp_copy_fn(dst, src, len);
+}
+
+/*
+ * Copy with non-temporal stores. Those are weakly ordered, they are fenced
+ * before returning so the buffer can be published right away.
+ */
+void mp_copy_nt(void *dst, const void *src, size_t len)
+{
+	mp_copy_fn(dst, src, len);
+	wmb();
+}
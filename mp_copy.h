@@ -0,0 +1,75 @@
+#ifndef _MP_COPY_H_
+#define _MP_COPY_H_
+#include <sys/types.h>
+#include "mempool.h"
+
+/*
+ * Copies into and out of buffer payloads. A large payload written by a
+ * producer is usually read by another process only, so writes of at least
+ * mp_copy_threshold bytes use non-temporal stores which don't evict the
+ * producer's working set. Shorter writes and all reads, whose destination
+ * the caller is about to use, go through memcpy(). The SIMD kernel is
+ * picked at first use from what the CPU supports.
+ */
+
+enum mp_copy_isa {
+	MP_COPY_ISA_AUTO,
+	MP_COPY_ISA_SSE2,
+	MP_COPY_ISA_AVX2,
+	MP_COPY_ISA_AVX512,
+};
+
+#define MP_COPY_THRESHOLD 4096	/* default non-temporal threshold */
+
+extern size_t mp_copy_threshold;
+
+void mp_copy_nt(void *dst, const void *src, size_t len);
+int mp_copy_set_isa(int isa);
+const char *mp_copy_isa_name(void);
+
+/* writes of threshold bytes or more bypass the cache, (size_t)-1 disables */
+static inline void mp_copy_set_threshold(size_t threshold)
+{
+	mp_copy_threshold = threshold;
+}
+
+/*
+ * Copy len bytes from src at offset off of the payload and set the length
+ * of the buffer to the end of the copy. Returns the number of bytes copied,
+ * less than len if the payload is too small.
+ */
+static inline size_t
+mp_buf_write(mp_buf_priv_t *buf, size_t off, const void *src, size_t len)
+{
+	if (off > MEM_POOL_BUF_SIZE)
+		return 0;
+	if (len > MEM_POOL_BUF_SIZE - off)
+		len = MEM_POOL_BUF_SIZE - off;
+
+	if (len >= mp_copy_threshold)
+		mp_copy_nt(buf->data + off, src, len);
+	else
+		memcpy(buf->data + off, src, len);
+	buf->buf->len = off + len;
+
+	return len;
+}
+
+/*
+ * Copy up to len bytes of the payload from offset off to dst. Returns the
+ * number of bytes copied, 0 past the end of the data.
+ */
+static inline size_t
+mp_buf_read(mp_buf_priv_t *buf, size_t off, void *dst, size_t len)
+{
+	if (off >= buf->buf->len)
+		return 0;
+	if (len > buf->buf->len - off)
+		len = buf->buf->len - off;
+
+	memcpy(dst, buf->data + off, len);
+
+	return len;
+}
+
+#endif /* _MP_COPY_H_ */
@@ -0,0 +1,364 @@
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <immintrin.h>
+#include "mempool.h"
+#include "mp_csum.h"
+
+#define MP_CRC32C_POLY 0x82f63b78	/* Castagnoli, bit reflected */
+
+/*
+ * The three streams of a round are merged by shifting the first two by
+ * the length of the data following them. There are long rounds for the
+ * bulk of a buffer and short ones for what is left.
+ */
+#define MP_CSUM_LONG  512
+#define MP_CSUM_SHORT 128
+
+static uint32_t mp_crc_table[8][256];
+static uint32_t mp_csum_k[2][2];	/* shift constants of long and short */
+static pthread_once_t mp_crc_tables_once = PTHREAD_ONCE_INIT;
+
+static uint32_t mp_crc_resolve(uint32_t crc, const char *p, size_t len);
+
+/* update the CRC register, without the pre and post inversions */
+static uint32_t (*mp_crc_fn)(uint32_t crc, const char *p, size_t len) =
+	mp_crc_resolve;
+static int mp_csum_isa = MP_CSUM_ISA_AUTO;
+
+static const char *mp_csum_isa_names[] = {
+	[MP_CSUM_ISA_AUTO] = "none",
+	[MP_CSUM_ISA_GENERIC] = "generic",
+	[MP_CSUM_ISA_SSE42] = "sse4.2",
+	[MP_CSUM_ISA_PCLMUL] = "sse4.2+pclmul",
+};
+
+/* a * b modulo the polynomial, x^0 being the most significant bit */
+static uint32_t mp_crc_mult(uint32_t a, uint32_t b)
+{
+	uint32_t m = 1U << 31, p = 0;
+
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ MP_CRC32C_POLY : b >> 1;
+	}
+
+	return p;
+}
+
+/* x^n modulo the polynomial */
+static uint32_t mp_crc_xpow(uint64_t n)
+{
+	uint32_t r = 1U << 31, x = 1U << 30;
+
+	while (n) {
+		if (n & 1)
+			r = mp_crc_mult(x, r);
+		x = mp_crc_mult(x, x);
+		n >>= 1;
+	}
+
+	return r;
+}
+
+static void mp_crc_init_tables(void)
+{
+	uint32_t i, j, crc;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = crc & 1 ? (crc >> 1) ^ MP_CRC32C_POLY : crc >> 1;
+		mp_crc_table[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++) {
+		crc = mp_crc_table[0][i];
+		for (j = 1; j < 8; j++) {
+			crc = mp_crc_table[0][crc & 0xff] ^ (crc >> 8);
+			mp_crc_table[j][i] = crc;
+		}
+	}
+
+	/*
+	 * A carry-less product reduced by the crc32 instruction is multiplied
+	 * by x^33 on the way, hence the exponents.
+	 */
+	mp_csum_k[0][0] = mp_crc_xpow(2 * 8 * MP_CSUM_LONG - 33);
+	mp_csum_k[0][1] = mp_crc_xpow(8 * MP_CSUM_LONG - 33);
+	mp_csum_k[1][0] = mp_crc_xpow(2 * 8 * MP_CSUM_SHORT - 33);
+	mp_csum_k[1][1] = mp_crc_xpow(8 * MP_CSUM_SHORT - 33);
+}
+
+/* slicing by 8 */
+static uint32_t mp_crc_generic(uint32_t crc, const char *p, size_t len)
+{
+	const unsigned char *b = (const unsigned char *)p;
+
+	while (len && ((uintptr_t)b & 7)) {
+		crc = mp_crc_table[0][(crc ^ *b++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+	while (len >= 8) {
+		uint64_t v;
+
+		memcpy(&v, b, sizeof(v));
+		v ^= crc;
+		crc = mp_crc_table[7][v & 0xff] ^
+			mp_crc_table[6][(v >> 8) & 0xff] ^
+			mp_crc_table[5][(v >> 16) & 0xff] ^
+			mp_crc_table[4][(v >> 24) & 0xff] ^
+			mp_crc_table[3][(v >> 32) & 0xff] ^
+			mp_crc_table[2][(v >> 40) & 0xff] ^
+			mp_crc_table[1][(v >> 48) & 0xff] ^
+			mp_crc_table[0][v >> 56];
+		b += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = mp_crc_table[0][(crc ^ *b++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t mp_crc_sse42(uint32_t crc, const char *p, size_t len)
+{
+	uint64_t crc64;
+
+	while (len && ((uintptr_t)p & 7)) {
+		crc = _mm_crc32_u8(crc, *p++);
+		len--;
+	}
+	crc64 = crc;
+	for (; len >= 8; p += 8, len -= 8)
+		crc64 = _mm_crc32_u64(crc64, *(const uint64_t *)p);
+	crc = crc64;
+	while (len--)
+		crc = _mm_crc32_u8(crc, *p++);
+
+	return crc;
+}
+
+/*
+ * The crc32 instruction has a latency of 3 cycles and a throughput of 1,
+ * three independent streams keep it busy.
+ */
+__attribute__((target("sse4.2,pclmul")))
+static inline uint32_t
+mp_crc_3way(uint32_t crc, const char **pp, size_t *lenp, size_t blk,
+	    const uint32_t *k)
+{
+	const char *p = *pp;
+	size_t len = *lenp;
+
+	while (len >= 3 * blk) {
+		uint64_t a = crc, b = 0, c = 0;
+		__m128i t;
+		size_t i;
+
+		for (i = 0; i < blk; i += 8) {
+			a = _mm_crc32_u64(a, *(const uint64_t *)(p + i));
+			b = _mm_crc32_u64(b, *(const uint64_t *)(p + blk + i));
+			c = _mm_crc32_u64(c, *(const uint64_t *)(p + 2 * blk + i));
+		}
+		t = _mm_xor_si128(
+			_mm_clmulepi64_si128(_mm_cvtsi32_si128(a),
+					     _mm_cvtsi32_si128(k[0]), 0),
+			_mm_clmulepi64_si128(_mm_cvtsi32_si128(b),
+					     _mm_cvtsi32_si128(k[1]), 0));
+		crc = c ^ _mm_crc32_u64(0, _mm_cvtsi128_si64(t));
+		p += 3 * blk;
+		len -= 3 * blk;
+	}
+	*pp = p;
+	*lenp = len;
+
+	return crc;
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t mp_crc_pclmul(uint32_t crc, const char *p, size_t len)
+{
+	/* the streams load aligned words */
+	if ((uintptr_t)p & 7) {
+		size_t head = 8 - ((uintptr_t)p & 7);
+
+		if (head > len)
+			head = len;
+		crc = mp_crc_sse42(crc, p, head);
+		p += head;
+		len -= head;
+	}
+	crc = mp_crc_3way(crc, &p, &len, MP_CSUM_LONG, mp_csum_k[0]);
+	crc = mp_crc_3way(crc, &p, &len, MP_CSUM_SHORT, mp_csum_k[1]);
+
+	return mp_crc_sse42(crc, p, len);
+}
+
+static int mp_csum_supported(int isa)
+{
+	__builtin_cpu_init();
+
+	switch (isa) {
+	case MP_CSUM_ISA_GENERIC:
+		return 1;
+	case MP_CSUM_ISA_SSE42:
+		return __builtin_cpu_supports("sse4.2");
+	case MP_CSUM_ISA_PCLMUL:
+		return __builtin_cpu_supports("sse4.2") &&
+			__builtin_cpu_supports("pclmul");
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Select the CRC implementation, MP_CSUM_ISA_AUTO takes the fastest one
+ * supported by the CPU. Returns -1 if the CPU lacks the instructions.
+ */
+int mp_csum_set_isa(int isa)
+{
+	if (isa == MP_CSUM_ISA_AUTO) {
+		for (isa = MP_CSUM_ISA_PCLMUL; isa > MP_CSUM_ISA_GENERIC;
+		     isa--) {
+			if (mp_csum_supported(isa))
+				break;
+		}
+	} else if (!mp_csum_supported(isa)) {
+		fprintf(stderr, "%s crc32c not supported by the cpu\n",
+			isa > MP_CSUM_ISA_AUTO && isa <= MP_CSUM_ISA_PCLMUL ?
+			mp_csum_isa_names[isa] : "unknown");
+		return -1;
+	}
+
+	/* computed once, another thread may be reading them */
+	pthread_once(&mp_crc_tables_once, mp_crc_init_tables);
+
+	switch (isa) {
+	case MP_CSUM_ISA_PCLMUL:
+		mp_crc_fn = mp_crc_pclmul;
+		break;
+	case MP_CSUM_ISA_SSE42:
+		mp_crc_fn = mp_crc_sse42;
+		break;
+	default:
+		mp_crc_fn = mp_crc_generic;
+	}
+	mp_csum_isa = isa;
+
+	return 0;
+}
+
+const char *mp_csum_isa_name(void)
+{
+	return mp_csum_isa_names[mp_csum_isa];
+}
+
+static uint32_t mp_crc_resolve(uint32_t crc, const char *p, size_t len)
+{
+	mp_csum_set_isa(MP_CSUM_ISA_AUTO);
+	return mp_crc_fn(crc, p, len);
+}
+
+/* CRC32C of data, crc is the one of the preceding data, 0 to start */
+uint32_t mp_crc32c(uint32_t crc, const void *data, size_t len)
+{
+	return ~mp_crc_fn(~crc, data, len);
+}
+
+/* the buffer is freed if its checksum doesn't match, returns -1 then */
+int mp_csum_check(mempool_priv_t *mp_priv, int bucket, mp_buf_priv_t *buf)
+{
+	uint32_t len = buf->buf->len;
+
+	if (likely(len <= MEM_POOL_BUF_SIZE &&
+		   mp_crc32c(0, buf->data, len) == buf->buf->csum))
+		return 0;
+
+	__sync_fetch_and_add(&mp_priv->mp->bucket_desc[bucket].csum_errors, 1);
+	mp_free(mp_priv, buf);
+
+	return -1;
+}
+
+/*
+ * Verify n buffers taken from bucket. The corrupted ones are freed and the
+ * others moved to the front of bufs, in order. Returns their number.
+ */
+unsigned int mp_csum_verify_burst(mempool_priv_t *mp_priv, int bucket,
+				  mp_buf_priv_t *bufs, unsigned int n)
+{
+	unsigned int i, k = 0;
+
+	for (i = 0; i < n; i++) {
+		/* the next buffer's header and first lines are on their way */
+		if (i + 1 < n) {
+			__builtin_prefetch(bufs[i + 1].buf);
+			__builtin_prefetch(bufs[i + 1].data);
+		}
+		if (mp_csum_check(mp_priv, bucket, &bufs[i]) == 0)
+			bufs[k++] = bufs[i];
+	}
+
+	return k;
+}
+
+/*
+ * The bucket has to be empty: the buffers already in it have no checksum.
+ * flags is 0 or MP_CSUM_VERIFY. The entry of an ordered section is refused,
+ * a corrupted buffer dropped there would stall its reorder bucket.
+ */
+int mp_csum_enable(mempool_priv_t *mp_priv, int bucket, int flags)
+{
+	struct mp_bucket_desc *desc;
+
+	if (bucket <= 0 || bucket >= MEM_POOL_MAX_BUCKETS ||
+	    mp_priv->bucket[bucket] == NULL) {
+		fprintf(stderr, "invalid bucket %d\n", bucket);
+		return -1;
+	}
+	desc = &mp_priv->mp->bucket_desc[bucket];
+
+	if (desc->flags & MP_BUCKET_F_SEQ) {
+		fprintf(stderr, "bucket %d is an ordered section\n", bucket);
+		return -1;
+	}
+	if (mp_count(mp_priv, bucket) ||
+	    ((desc->flags & MP_BUCKET_F_SPILL) && desc->spill.count)) {
+		fprintf(stderr, "bucket %d is not empty\n", bucket);
+		return -1;
+	}
+
+	/* resolve the implementation before the first put */
+	if (mp_csum_isa == MP_CSUM_ISA_AUTO &&
+	    mp_csum_set_isa(MP_CSUM_ISA_AUTO) < 0)
+		return -1;
+
+	desc->csum_errors = 0;
+	if (flags & MP_CSUM_VERIFY)
+		__sync_fetch_and_or(&desc->flags, MP_BUCKET_F_CSUM_GET);
+	else
+		__sync_fetch_and_and(&desc->flags, ~MP_BUCKET_F_CSUM_GET);
+	__sync_fetch_and_or(&desc->flags, MP_BUCKET_F_CSUM);
+
+	return 0;
+}
+
+int mp_csum_disable(mempool_priv_t *mp_priv, int bucket)
+{
+	if (bucket <= 0 || bucket >= MEM_POOL_MAX_BUCKETS ||
+	    mp_priv->bucket[bucket] == NULL) {
+		fprintf(stderr, "invalid bucket %d\n", bucket);
+		return -1;
+	}
+	__sync_fetch_and_and(&mp_priv->mp->bucket_desc[bucket].flags,
+			     ~(MP_BUCKET_F_CSUM | MP_BUCKET_F_CSUM_GET));
+
+	return 0;
+}
@@ -0,0 +1,39 @@
+#ifndef _MP_CSUM_H_
+#define _MP_CSUM_H_
+#include <sys/types.h>
+#include "mempool.h"
+
+/*
+ * Payload checksums. Once enabled on a bucket, mp_put() stores the CRC32C
+ * of data[0..len) in the buffer header. With MP_CSUM_VERIFY, mp_get()
+ * checks it and drops corrupted buffers, otherwise the consumer checks
+ * the buffers it got with mp_csum_verify_burst(). Dropped buffers go back
+ * to bucket 0 and are counted in csum_errors of the bucket.
+ *
+ * The CRC is computed with the SSE4.2 crc32 instruction on three
+ * interleaved streams merged with PCLMULQDQ, with the crc32 instruction
+ * alone or with tables, depending on the CPU.
+ */
+
+#define MP_CSUM_VERIFY 0x1	/* verify in mp_get() */
+
+enum mp_csum_isa {
+	MP_CSUM_ISA_AUTO,
+	MP_CSUM_ISA_GENERIC,
+	MP_CSUM_ISA_SSE42,
+	MP_CSUM_ISA_PCLMUL,
+};
+
+int mp_csum_enable(mempool_priv_t *mp_priv, int bucket, int flags);
+int mp_csum_disable(mempool_priv_t *mp_priv, int bucket);
+unsigned int mp_csum_verify_burst(mempool_priv_t *mp_priv, int bucket,
+				  mp_buf_priv_t *bufs, unsigned int n);
+int mp_csum_set_isa(int isa);
+const char *mp_csum_isa_name(void);
+
+static inline uint32_t mp_csum_errors(mempool_priv_t *mp_priv, int bucket)
+{
+	return mp_priv->mp->bucket_desc[bucket].csum_errors;
+}
+
+#endif /* _MP_CSUM_H_ */
@@ -0,0 +1,62 @@
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "mempool.h"
+#include "mp_deadline.h"
+
+/* out of line for __mp_get(), the caller counts the buffers shed */
+void mp_deadline_drop(mempool_priv_t *mp_priv, int bucket, mp_buf_priv_t *buf)
+{
+	mp_free(mp_priv, buf);
+}
+
+/*
+ * The bucket has to be empty: the buffers already in it have no deadline.
+ * ttl_us is limited to 2^31 us (about 35 minutes). The entry of an ordered
+ * section is refused, a buffer shed there would leave a hole in the
+ * sequence and stall its reorder bucket.
+ */
+int mp_deadline_enable(mempool_priv_t *mp_priv, int bucket, uint32_t ttl_us)
+{
+	struct mp_bucket_desc *desc;
+
+	if (bucket <= 0 || bucket >= MEM_POOL_MAX_BUCKETS ||
+	    mp_priv->bucket[bucket] == NULL) {
+		fprintf(stderr, "invalid bucket %d\n", bucket);
+		return -1;
+	}
+	if (ttl_us == 0 || ttl_us > INT32_MAX) {
+		fprintf(stderr, "invalid ttl %u us\n", ttl_us);
+		return -1;
+	}
+	desc = &mp_priv->mp->bucket_desc[bucket];
+
+	if (desc->flags & MP_BUCKET_F_SEQ) {
+		fprintf(stderr, "bucket %d is an ordered section\n", bucket);
+		return -1;
+	}
+	if (mp_count(mp_priv, bucket) ||
+	    ((desc->flags & MP_BUCKET_F_SPILL) && desc->spill.count)) {
+		fprintf(stderr, "bucket %d is not empty\n", bucket);
+		return -1;
+	}
+
+	desc->ttl_us = ttl_us;
+	desc->expired = 0;
+	__sync_fetch_and_or(&desc->flags, MP_BUCKET_F_DEADLINE);
+
+	return 0;
+}
+
+int mp_deadline_disable(mempool_priv_t *mp_priv, int bucket)
+{
+	if (bucket <= 0 || bucket >= MEM_POOL_MAX_BUCKETS ||
+	    mp_priv->bucket[bucket] == NULL) {
+		fprintf(stderr, "invalid bucket %d\n", bucket);
+		return -1;
+	}
+	__sync_fetch_and_and(&mp_priv->mp->bucket_desc[bucket].flags,
+			     ~MP_BUCKET_F_DEADLINE);
+
+	return 0;
+}
@@ -0,0 +1,24 @@
+#ifndef _MP_DEADLINE_H_
+#define _MP_DEADLINE_H_
+#include <sys/types.h>
+#include <stdint.h>
+#include "mempool.h"
+
+/*
+ * Deadline based load shedding. Once enabled on a bucket, mp_put() stamps
+ * each buffer with a deadline, ttl microseconds ahead, and mp_get() returns
+ * the stale buffers it comes across to bucket 0 until it finds a fresh one
+ * for the consumer. Under overload, consumers thus spend their time on
+ * buffers still worth processing, and the backlog is bounded by what can
+ * be put within a ttl. Shed buffers are counted in expired of the bucket.
+ */
+
+int mp_deadline_enable(mempool_priv_t *mp_priv, int bucket, uint32_t ttl_us);
+int mp_deadline_disable(mempool_priv_t *mp_priv, int bucket);
+
+static inline uint32_t mp_deadline_expired(mempool_priv_t *mp_priv, int bucket)
+{
+	return mp_priv->mp->bucket_desc[bucket].expired;
+}
+
+#endif /* _MP_DEADLINE_H_ */
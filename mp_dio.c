@@ -0,0 +1,194 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "mempool.h"
+#include "mp_dio.h"
+
+#define MP_DIO_ROUND(x) \
+	(((x) + MP_DIO_ALIGN - 1) & ~((size_t)MP_DIO_ALIGN - 1))
+
+int mp_dio_open(const char *path, int flags, mode_t mode)
+{
+	int fd = open(path, flags | O_DIRECT, mode);
+
+	if (fd < 0)
+		fprintf(stderr, "can't open %s with O_DIRECT\n", path);
+
+	return fd;
+}
+
+/*
+ * Read len bytes at off into a chain of buffers allocated from bucket 0,
+ * each one filled up to MEM_POOL_BUF_SIZE but the last. The chain is
+ * returned in head. Returns the number of bytes read, which is lower than
+ * len at the end of the file, 0 and no chain if there is nothing to read,
+ * -1 on error or if bucket 0 runs out of buffers.
+ */
+ssize_t mp_dio_read(mempool_priv_t *mp_priv, int fd, off_t off, size_t len,
+		    mp_buf_priv_t *head)
+{
+	mp_buf_priv_t bufs[MP_DIO_BATCH], tail;
+	struct iovec iov[MP_DIO_BATCH];
+	size_t total = 0;
+	int has_tail = 0;
+
+	if (off & (MP_DIO_ALIGN - 1)) {
+		fprintf(stderr, "offset %jd is not aligned on %d\n",
+			(intmax_t)off, MP_DIO_ALIGN);
+		return -1;
+	}
+
+	while (total < len) {
+		size_t want = 0, got;
+		ssize_t ret;
+		int i, n;
+
+		for (n = 0; n < MP_DIO_BATCH && total + want < len; n++) {
+			size_t chunk = len - total - want;
+
+			if (chunk > MEM_POOL_BUF_SIZE)
+				chunk = MEM_POOL_BUF_SIZE;
+			if (mp_alloc(mp_priv, &bufs[n]) < 0)
+				break;
+			iov[n].iov_base = bufs[n].data;
+			iov[n].iov_len = MP_DIO_ROUND(chunk);
+			want += chunk;
+		}
+		if (n == 0) {
+			fprintf(stderr, "no free buffer\n");
+			goto error;
+		}
+
+		do {
+			ret = preadv(fd, iov, n, off + total);
+		} while (ret < 0 && errno == EINTR);
+		if (ret < 0) {
+			perror("preadv");
+			for (i = 0; i < n; i++)
+				mp_free(mp_priv, &bufs[i]);
+			goto error;
+		}
+
+		/* the last block may be read past len */
+		got = (size_t)ret < want ? (size_t)ret : want;
+		total += got;
+		for (i = 0; i < n; i++) {
+			size_t l = got;
+
+			if (l > MEM_POOL_BUF_SIZE)
+				l = MEM_POOL_BUF_SIZE;
+			if (l == 0) {
+				mp_free(mp_priv, &bufs[i]);
+				continue;
+			}
+			bufs[i].buf->len = l;
+			if (has_tail)
+				tail.buf->next = bufs[i].offset;
+			else
+				*head = bufs[i];
+			tail = bufs[i];
+			has_tail = 1;
+			got -= l;
+		}
+
+		/* end of file */
+		if ((size_t)ret < want)
+			break;
+	}
+
+	if (has_tail)
+		tail.buf->next = MEM_POOL_BUF_NONE;
+
+	return total;
+
+ error:
+	if (has_tail) {
+		tail.buf->next = MEM_POOL_BUF_NONE;
+		mp_free_chain(mp_priv, head);
+	}
+	return -1;
+}
+
+/* write the whole iovec array, short writes are resumed */
+static int mp_dio_writev(int fd, struct iovec *iov, int n, off_t off)
+{
+	while (n) {
+		ssize_t ret = pwritev(fd, iov, n, off);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("pwritev");
+			return -1;
+		}
+		off += ret;
+		while (n && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Write a chain of buffers at off. All the buffers but the last must hold
+ * a multiple of MP_DIO_ALIGN bytes, the last one is padded with zeros up
+ * to the next MP_DIO_ALIGN boundary: the file may have to be truncated to
+ * off plus the returned size. The chain is left to the caller. Returns the
+ * number of bytes of the chain written, -1 on error.
+ */
+ssize_t mp_dio_write(mempool_priv_t *mp_priv, int fd, off_t off,
+		     mp_buf_priv_t *head)
+{
+	struct iovec iov[MP_DIO_BATCH];
+	mp_buf_priv_t buf = *head, next;
+	size_t total = 0, batch = 0;
+	int n = 0, more;
+
+	if (off & (MP_DIO_ALIGN - 1)) {
+		fprintf(stderr, "offset %jd is not aligned on %d\n",
+			(intmax_t)off, MP_DIO_ALIGN);
+		return -1;
+	}
+
+	do {
+		uint32_t len = buf.buf->len;
+
+		more = mp_buf_next(mp_priv, &buf, &next) == 0;
+		if (more && (len & (MP_DIO_ALIGN - 1))) {
+			fprintf(stderr, "buffer length %u is not aligned on "
+				"%d\n", len, MP_DIO_ALIGN);
+			return -1;
+		}
+
+		iov[n].iov_base = buf.data;
+		iov[n].iov_len = MP_DIO_ROUND(len);
+		memset(buf.data + len, 0, iov[n].iov_len - len);
+		total += len;
+		batch += iov[n].iov_len;
+		n++;
+
+		if (n == MP_DIO_BATCH || !more) {
+			if (mp_dio_writev(fd, iov, n, off) < 0)
+				return -1;
+			off += batch;
+			batch = 0;
+			n = 0;
+		}
+		if (more)
+			buf = next;
+	} while (more);
+
+	return total;
+}
@@ -0,0 +1,22 @@
+#ifndef _MP_DIO_H_
+#define _MP_DIO_H_
+#include <sys/types.h>
+#include "mempool.h"
+
+/*
+ * Direct I/O between files and pool buffers. Payloads are page aligned
+ * and MEM_POOL_BUF_SIZE is a multiple of the page size, so they can be
+ * handed to the kernel as is with O_DIRECT. File offsets must be aligned
+ * on MP_DIO_ALIGN, which covers 512 and 4096 bytes logical blocks.
+ */
+
+#define MP_DIO_ALIGN 4096
+#define MP_DIO_BATCH 64		/* buffers per preadv()/pwritev() */
+
+int mp_dio_open(const char *path, int flags, mode_t mode);
+ssize_t mp_dio_read(mempool_priv_t *mp_priv, int fd, off_t off, size_t len,
+		    mp_buf_priv_t *head);
+ssize_t mp_dio_write(mempool_priv_t *mp_priv, int fd, off_t off,
+		     mp_buf_priv_t *head);
+
+#endif /* _MP_DIO_H_ */
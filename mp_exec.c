@@ -0,0 +1,218 @@
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include "mempool.h"
+#include "mp_exec.h"
+
+static inline uint64_t mp_exec_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+int mp_exec_init(mp_exec_t *exec, mempool_priv_t *mp_priv, int mc)
+{
+	memset(exec, 0, sizeof(mp_exec_t));
+	exec->mp_priv = mp_priv;
+	exec->mc = mc;
+
+	exec->epfd = epoll_create1(0);
+	if (exec->epfd < 0) {
+		perror("epoll_create1");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Parked tasks are left alone, they are owned by the caller.
+ */
+void mp_exec_destroy(mp_exec_t *exec)
+{
+	if (exec->epfd >= 0)
+		close(exec->epfd);
+	exec->epfd = -1;
+	memset(exec->slot, 0, sizeof(exec->slot));
+	exec->count = 0;
+	exec->notifs = 0;
+	exec->parked = 0;
+}
+
+/*
+ * Let tasks wait on a bucket. Bucket 0 must be added for mp_exec_alloc().
+ * notif is the index of the eventfd written when the bucket gets buffers
+ * (or room for a full bucket), mp_exec_run() sleeps on it when idle.
+ */
+int mp_exec_add(mp_exec_t *exec, int bucket, int notif)
+{
+	struct mp_exec_bucket *b;
+
+	if (exec->count >= MP_EXEC_MAX_BUCKETS) {
+		fprintf(stderr, "number of executor buckets cannot exceed %d\n",
+			MP_EXEC_MAX_BUCKETS);
+		return -1;
+	}
+
+	if (bucket < 0 || bucket >= MEM_POOL_MAX_BUCKETS ||
+	    exec->mp_priv->bucket[bucket] == NULL || exec->slot[bucket]) {
+		fprintf(stderr, "invalid bucket %d\n", bucket);
+		return -1;
+	}
+
+	if (notif >= 0) {
+		struct epoll_event ev = {
+			.events = EPOLLIN,
+		};
+		int fd;
+
+		if (notif >= MEM_POOL_MAX_FDS ||
+		    (fd = exec->mp_priv->fds[notif]) < 0) {
+			fprintf(stderr, "invalid notification %d\n", notif);
+			return -1;
+		}
+		ev.data.fd = fd;
+
+		/* several buckets may share the same notification */
+		if (epoll_ctl(exec->epfd, EPOLL_CTL_ADD, fd, &ev) < 0 &&
+		    errno != EEXIST) {
+			perror("epoll_ctl");
+			return -1;
+		}
+		exec->notifs++;
+	}
+
+	b = &exec->bkt[exec->count++];
+	b->bucket = bucket;
+	b->notif = notif;
+	b->get.head = NULL;
+	b->get.tail = &b->get.head;
+	b->put.head = NULL;
+	b->put.tail = &b->put.head;
+	exec->slot[bucket] = b;
+
+	return 0;
+}
+
+/* the callbacks may park the waiter again, it must be unlinked first */
+static inline void mp_exec_wake(mp_exec_t *exec, struct mp_wait_queue *q)
+{
+	mp_wait_t *w = mp_wait_queue_pop(q);
+
+	exec->parked--;
+	w->cb(w->ctx, &w->buf);
+}
+
+/*
+ * Complete up to MP_EXEC_BURST parked puts then gets per bucket, puts
+ * first as they may make room or buffers for the gets. Returns the number
+ * of operations completed.
+ */
+int mp_exec_poll(mp_exec_t *exec)
+{
+	int i, done = 0;
+
+	for (i = 0; i < exec->count; i++) {
+		struct mp_exec_bucket *b = &exec->bkt[i];
+		int n;
+
+		for (n = 0; n < MP_EXEC_BURST && b->put.head; n++) {
+			if (mp_put(exec->mp_priv, b->bucket,
+				   &b->put.head->buf) < 0)
+				break;
+			mp_exec_wake(exec, &b->put);
+		}
+		done += n;
+
+		for (n = 0; n < MP_EXEC_BURST && b->get.head; n++) {
+			if (__mp_exec_dequeue(exec, b->bucket,
+					      &b->get.head->buf) < 0)
+				break;
+			mp_exec_wake(exec, &b->get);
+		}
+		done += n;
+	}
+
+	return done;
+}
+
+static int mp_exec_wait(mp_exec_t *exec, int timeout)
+{
+	struct epoll_event ev[MP_EXEC_MAX_BUCKETS];
+	int i, nfds;
+
+	nfds = epoll_wait(exec->epfd, ev, MP_EXEC_MAX_BUCKETS, timeout);
+	if (nfds < 0) {
+		if (errno == EINTR)
+			return 0;
+		perror("epoll_wait");
+		return -1;
+	}
+
+	for (i = 0; i < nfds; i++) {
+		uint64_t value;
+
+		if (read(ev[i].data.fd, &value, sizeof(value)) < 0)
+			perror("notification read");
+	}
+
+	return nfds;
+}
+
+/*
+ * Run the parked tasks until none is left. When a round completes nothing
+ * the executor sleeps on the notifications of its buckets, or yields the
+ * cpu if there are none. timeout is in milliseconds, -1 waits forever.
+ * Returns 0 once no task is parked, -1 if nothing happened within timeout.
+ */
+int mp_exec_run(mp_exec_t *exec, int timeout)
+{
+	uint64_t deadline = 0;
+	int idle = 0;
+
+	while (exec->parked) {
+		int ret;
+
+		if (mp_exec_poll(exec)) {
+			idle = 0;
+			deadline = 0;
+			continue;
+		}
+
+		/* spin a bit, a sleep costs a notification to the producer */
+		if (++idle < MP_EXEC_BURST) {
+			cpu_spinwait();
+			continue;
+		}
+		idle = 0;
+
+		/* nothing to sleep on, the timeout runs from the last progress */
+		if (exec->notifs == 0) {
+			if (timeout >= 0) {
+				uint64_t now = mp_exec_now_ms();
+
+				if (deadline == 0)
+					deadline = now + timeout;
+				else if (now >= deadline)
+					return -1;
+			}
+			sched_yield();
+			continue;
+		}
+
+		ret = mp_exec_wait(exec, timeout);
+		if (ret < 0)
+			return -1;
+		if (ret == 0 && timeout >= 0 && mp_exec_poll(exec) == 0)
+			return -1;
+	}
+
+	return 0;
+}
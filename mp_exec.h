@@ -0,0 +1,150 @@
+#ifndef _MP_EXEC_H_
+#define _MP_EXEC_H_
+#include "mempool.h"
+
+/*
+ * Single threaded executor multiplexing many tasks over buckets. A task
+ * waits for a bucket operation with an mp_wait_t it embeds: the operation
+ * completes immediately when it can, otherwise the waiter is parked on the
+ * bucket and its callback runs from mp_exec_poll() once the operation went
+ * through. Parked operations of a bucket complete in FIFO order.
+ */
+
+#define MP_EXEC_MAX_BUCKETS 16
+#define MP_EXEC_BURST 32
+
+typedef struct mp_wait mp_wait_t;
+
+/* buf is the buffer got from the bucket, the one put for a put */
+typedef void (*mp_exec_cb)(void *ctx, mp_buf_priv_t *buf);
+
+struct mp_wait {
+	mp_wait_t     *next;
+	mp_exec_cb     cb;
+	void          *ctx;
+	mp_buf_priv_t  buf;
+};
+
+struct mp_wait_queue {
+	mp_wait_t  *head;
+	mp_wait_t **tail;
+};
+
+struct mp_exec_bucket {
+	int                  bucket;
+	int                  notif;	/* index in mp_priv->fds, -1 if none */
+	struct mp_wait_queue get;
+	struct mp_wait_queue put;
+};
+
+typedef struct mp_exec {
+	mempool_priv_t        *mp_priv;
+	int                    mc;	/* multi consumer dequeue */
+	int                    count;
+	int                    epfd;	/* combined readiness */
+	int                    notifs;
+	unsigned int           parked;
+	struct mp_exec_bucket *slot[MEM_POOL_MAX_BUCKETS];
+	struct mp_exec_bucket  bkt[MP_EXEC_MAX_BUCKETS];
+} mp_exec_t;
+
+int mp_exec_init(mp_exec_t *exec, mempool_priv_t *mp_priv, int mc);
+int mp_exec_add(mp_exec_t *exec, int bucket, int notif);
+int mp_exec_poll(mp_exec_t *exec);
+int mp_exec_run(mp_exec_t *exec, int timeout);
+void mp_exec_destroy(mp_exec_t *exec);
+
+static inline void
+mp_wait_queue_push(struct mp_wait_queue *q, mp_wait_t *w)
+{
+	w->next = NULL;
+	*q->tail = w;
+	q->tail = &w->next;
+}
+
+static inline mp_wait_t *mp_wait_queue_pop(struct mp_wait_queue *q)
+{
+	mp_wait_t *w = q->head;
+
+	q->head = w->next;
+	if (q->head == NULL)
+		q->tail = &q->head;
+
+	return w;
+}
+
+static inline int
+__mp_exec_dequeue(mp_exec_t *exec, int bucket, mp_buf_priv_t *buf)
+{
+	/* free buffers are charged to the quota of the process */
+	if (bucket == 0)
+		return mp_alloc(exec->mp_priv, buf);
+	if (exec->mc)
+		return mp_get(exec->mp_priv, bucket, buf);
+	return mp_get_sc(exec->mp_priv, bucket, buf);
+}
+
+/*
+ * Get a buffer from bucket into w->buf. Returns 0 if it completed
+ * immediately, 1 if the waiter got parked and cb will be called with the
+ * buffer later, -1 if the bucket wasn't added to the executor.
+ */
+static inline int mp_exec_get(mp_exec_t *exec, mp_wait_t *w, int bucket,
+			      mp_exec_cb cb, void *ctx)
+{
+	struct mp_exec_bucket *b = exec->slot[bucket];
+
+	if (unlikely(b == NULL))
+		return -1;
+
+	/* don't overtake the tasks already waiting */
+	if (b->get.head == NULL &&
+	    __mp_exec_dequeue(exec, bucket, &w->buf) == 0)
+		return 0;
+
+	w->cb = cb;
+	w->ctx = ctx;
+	mp_wait_queue_push(&b->get, w);
+	exec->parked++;
+
+	return 1;
+}
+
+/* get a free buffer, see mp_exec_get() */
+static inline int mp_exec_alloc(mp_exec_t *exec, mp_wait_t *w,
+				mp_exec_cb cb, void *ctx)
+{
+	return mp_exec_get(exec, w, 0, cb, ctx);
+}
+
+/*
+ * Put buf into bucket. Returns 0 if it completed immediately, 1 if the
+ * bucket is full and cb will be called once the buffer got in, -1 if the
+ * bucket wasn't added to the executor.
+ */
+static inline int mp_exec_put(mp_exec_t *exec, mp_wait_t *w, int bucket,
+			      mp_buf_priv_t *buf, mp_exec_cb cb, void *ctx)
+{
+	struct mp_exec_bucket *b = exec->slot[bucket];
+
+	if (unlikely(b == NULL))
+		return -1;
+
+	if (b->put.head == NULL && mp_put(exec->mp_priv, bucket, buf) == 0)
+		return 0;
+
+	w->buf = *buf;
+	w->cb = cb;
+	w->ctx = ctx;
+	mp_wait_queue_push(&b->put, w);
+	exec->parked++;
+
+	return 1;
+}
+
+static inline int mp_exec_fd(mp_exec_t *exec)
+{
+	return exec->epfd;
+}
+
+#endif /* _MP_EXEC_H_ */
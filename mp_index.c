@@ -0,0 +1,282 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "mempool.h"
+#include "mp_index.h"
+
+static void mp_index_shm_name(mempool_priv_t *mp_priv, mp_index_t *idx,
+			      const char *name)
+{
+	snprintf(idx->shm_name, MP_INDEX_MAX_NAME, "%s.i.%s",
+		 mp_priv->mp->name, name);
+}
+
+static size_t mp_index_mem_size(unsigned int capacity)
+{
+	return MEM_POOL_PAGE_ALIGN(sizeof(struct mp_index_hdr) +
+				   sizeof(struct mp_index_slot) * capacity);
+}
+
+static int mp_index_mmap(mp_index_t *idx, int create)
+{
+	int fd;
+
+	if (create)
+		fd = shm_open(idx->shm_name, O_CREAT|O_RDWR|O_TRUNC,
+			      S_IRUSR|S_IWUSR);
+	else
+		fd = shm_open(idx->shm_name, O_RDWR, S_IRUSR|S_IWUSR);
+	if (fd < 0) {
+		fprintf(stderr, "can't open shared memory %s\n",
+			idx->shm_name);
+		return -1;
+	}
+
+	if (create && ftruncate(fd, idx->size) < 0) {
+		shm_unlink(idx->shm_name);
+		close(fd);
+		return -1;
+	}
+
+	idx->hdr = mmap(NULL, idx->size, PROT_WRITE | PROT_READ, MAP_SHARED,
+			fd, 0);
+	close(fd);
+	if ((long)idx->hdr == -1) {
+		if (create)
+			shm_unlink(idx->shm_name);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Create an index of capacity slots, a power of 2. Probes get long as the
+ * table fills up, capacity should be about twice the keys in flight.
+ */
+int mp_index_create(mempool_priv_t *mp_priv, mp_index_t *idx,
+		    const char *name, unsigned int capacity)
+{
+	if (!POWEROF2(capacity) || capacity < 2 || capacity > (1U << 30)) {
+		fprintf(stderr, "index capacity must be power of 2\n");
+		return -1;
+	}
+
+	mp_index_shm_name(mp_priv, idx, name);
+	idx->size = mp_index_mem_size(capacity);
+	if (mp_index_mmap(idx, 1) < 0)
+		return -1;
+
+	/* the slots are zeroed by ftruncate(): free, generation 0 */
+	idx->hdr->capacity = capacity;
+	idx->hdr->mask = capacity - 1;
+	idx->hdr->count = 0;
+
+	return 0;
+}
+
+int mp_index_open(mempool_priv_t *mp_priv, mp_index_t *idx, const char *name)
+{
+	struct stat st;
+	int fd;
+
+	mp_index_shm_name(mp_priv, idx, name);
+	fd = shm_open(idx->shm_name, O_RDWR, S_IRUSR|S_IWUSR);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "can't open shared memory %s\n",
+			idx->shm_name);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	close(fd);
+	idx->size = st.st_size;
+
+	return mp_index_mmap(idx, 0);
+}
+
+void mp_index_close(mp_index_t *idx)
+{
+	munmap(idx->hdr, idx->size);
+	idx->hdr = NULL;
+}
+
+/* the processes which have it open keep their mapping */
+void mp_index_destroy(mp_index_t *idx)
+{
+	mp_index_close(idx);
+	shm_unlink(idx->shm_name);
+}
+
+static inline uint64_t mp_index_val(uint64_t old, int state, uint32_t handle)
+{
+	uint64_t gen = (old >> MP_INDEX_GEN_SHIFT) + 1;
+
+	return gen << MP_INDEX_GEN_SHIFT | (uint64_t)state << 32 | handle;
+}
+
+/*
+ * Whether tombstone i is on the probe sequence of none of the keys up to
+ * the next free slot: the probe sequence of a key never goes over a free
+ * slot, so no key further can go over i.
+ */
+static int mp_index_unreached(struct mp_index_hdr *hdr, uint32_t i)
+{
+	uint32_t j = (i + 1) & hdr->mask, n;
+	uint64_t k, v;
+
+	for (n = 1; n < hdr->capacity; n++, j = (j + 1) & hdr->mask) {
+		mp_index_read(&hdr->slot[j], &k, &v);
+		if (MP_INDEX_STATE(v) == MP_INDEX_FREE)
+			return 1;
+		if (MP_INDEX_STATE(v) == MP_INDEX_LIVE &&
+		    ((j - mp_index_hash(k)) & hdr->mask) >=
+		    ((j - i) & hdr->mask))
+			return 0;
+	}
+
+	return 0;
+}
+
+/*
+ * Turn tombstone i, and the ones right before it, back into free slots
+ * when no key probes over them. The slots after are read after the
+ * tombstone: an insert going over it meanwhile bumps its generation, see
+ * mp_index_settle(), and the CAS fails.
+ */
+static void mp_index_reclaim(struct mp_index_hdr *hdr, uint32_t i)
+{
+	uint64_t k, v;
+	uint32_t n;
+
+	for (n = 0; n < hdr->capacity; n++, i = (i - 1) & hdr->mask) {
+		mp_index_read(&hdr->slot[i], &k, &v);
+		if (MP_INDEX_STATE(v) != MP_INDEX_DEAD ||
+		    !mp_index_unreached(hdr, i))
+			return;
+		if (!atomic_cmpset_128(&hdr->slot[i].key, k, v, 0,
+				       mp_index_val(v, MP_INDEX_FREE, 0)))
+			return;
+	}
+}
+
+/*
+ * A key was just stored in slot end: bump the generation of the
+ * tombstones of its probe sequence so they can't be reclaimed without
+ * seeing it. Returns -1 if one already was, the key is unreachable and
+ * has to be inserted again.
+ */
+static int mp_index_settle(struct mp_index_hdr *hdr, uint32_t i, uint32_t end)
+{
+	uint64_t k, v;
+
+	for (; i != end; i = (i + 1) & hdr->mask) {
+		struct mp_index_slot *s = &hdr->slot[i];
+
+		do {
+			mp_index_read(s, &k, &v);
+			if (MP_INDEX_STATE(v) == MP_INDEX_FREE)
+				return -1;
+			if (MP_INDEX_STATE(v) == MP_INDEX_LIVE)
+				break;
+		} while (!atomic_cmpset_128(&s->key, k, v, k,
+					    mp_index_val(v, MP_INDEX_DEAD, 0)));
+	}
+
+	return 0;
+}
+
+/*
+ * Index a buffer under key, in the first tombstone or free slot of its
+ * probe sequence. Returns -1 if key is already indexed or the table is
+ * full.
+ */
+int mp_index_insert(mp_index_t *idx, uint64_t key, uintptr_t handle)
+{
+	struct mp_index_hdr *hdr = idx->hdr;
+	struct mp_index_slot *s, *dead;
+	uint64_t k, v, dead_k = 0, dead_v = 0, val;
+	uint32_t home, i, n;
+
+ again:
+	dead = NULL;
+	s = NULL;
+	home = i = mp_index_hash(key) & hdr->mask;
+	for (n = 0; n < hdr->capacity; n++, i = (i + 1) & hdr->mask) {
+		mp_index_read(&hdr->slot[i], &k, &v);
+		if (MP_INDEX_STATE(v) == MP_INDEX_FREE) {
+			s = &hdr->slot[i];
+			break;
+		}
+		if (MP_INDEX_STATE(v) == MP_INDEX_LIVE) {
+			if (k == key)
+				return -1;
+		} else if (dead == NULL) {
+			dead = &hdr->slot[i];
+			dead_k = k;
+			dead_v = v;
+		}
+	}
+	/* the key is not further than the first free slot */
+	if (dead) {
+		s = dead;
+		k = dead_k;
+		v = dead_v;
+	}
+	if (s == NULL)
+		return -1;
+
+	val = mp_index_val(v, MP_INDEX_LIVE, handle);
+	if (!atomic_cmpset_128(&s->key, k, v, key, val))
+		goto again;
+	__sync_fetch_and_add(&hdr->count, 1);
+
+	/* a tombstone before the slot was reclaimed meanwhile */
+	i = s - hdr->slot;
+	if (mp_index_settle(hdr, home, i) < 0) {
+		if (atomic_cmpset_128(&s->key, key, val, key,
+				      mp_index_val(val, MP_INDEX_DEAD, 0))) {
+			__sync_fetch_and_sub(&hdr->count, 1);
+			mp_index_reclaim(hdr, i);
+		}
+		goto again;
+	}
+
+	return 0;
+}
+
+/* unindex key, its buffer handle is stored in handle if not NULL */
+int mp_index_remove(mp_index_t *idx, uint64_t key, uintptr_t *handle)
+{
+	struct mp_index_hdr *hdr = idx->hdr;
+	uint64_t k, v;
+	uint32_t i, n;
+
+ again:
+	i = mp_index_hash(key) & hdr->mask;
+	for (n = 0; n < hdr->capacity; n++, i = (i + 1) & hdr->mask) {
+		struct mp_index_slot *s = &hdr->slot[i];
+
+		mp_index_read(s, &k, &v);
+		if (MP_INDEX_STATE(v) == MP_INDEX_FREE)
+			return -1;
+		if (MP_INDEX_STATE(v) != MP_INDEX_LIVE || k != key)
+			continue;
+
+		if (!atomic_cmpset_128(&s->key, k, v, k,
+				       mp_index_val(v, MP_INDEX_DEAD, 0)))
+			goto again;
+		__sync_fetch_and_sub(&hdr->count, 1);
+		if (handle)
+			*handle = MP_INDEX_HANDLE(v);
+		mp_index_reclaim(hdr, i);
+		return 0;
+	}
+
+	return -1;
+}
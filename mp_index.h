@@ -0,0 +1,133 @@
+#ifndef _MP_INDEX_H_
+#define _MP_INDEX_H_
+#include <sys/types.h>
+#include <stdint.h>
+#include "mempool.h"
+
+/*
+ * Shared index of in-flight buffers by key (order id, session id...): a
+ * fixed capacity open addressing table with linear probing, kept in its
+ * own shared memory object <pool name>.i.<index name> which any process
+ * of the pool opens with mp_index_open().
+ *
+ * A slot holds a key and a state word: a generation, the slot state and
+ * a buffer handle. Writers replace both with one 16 byte compare and
+ * swap bumping the generation, so readers never write: they read the
+ * state word, the key and the state word again, and read the slot again
+ * if it changed. A removed key leaves a tombstone, reused by the next
+ * insert probing over it, and freed again once no key probes over it so
+ * that keys coming and going don't leave the probes of misses running
+ * over the whole table. Lookups, inserts and removes run concurrently
+ * in any process, but a given key must be inserted by one of them at a
+ * time. The index doesn't own the buffers: a buffer is removed from it
+ * before being freed.
+ */
+
+#define MP_INDEX_FREE 0
+#define MP_INDEX_LIVE 1
+#define MP_INDEX_DEAD 2		/* tombstone */
+
+/* state word: generation (30 bits), state (2 bits), handle (32 bits) */
+#define MP_INDEX_GEN_SHIFT 34
+#define MP_INDEX_STATE(v)  (((v) >> 32) & 3)
+#define MP_INDEX_HANDLE(v) ((uint32_t)(v))
+
+#define MP_INDEX_MAX_NAME (MEM_POOL_MAX_NAME + MEM_POOL_MAX_BUCKET_NAME + 4)
+
+struct mp_index_slot {
+	volatile u_long key;
+	volatile u_long val;		/* state word */
+} __attribute__((aligned(16)));
+
+struct mp_index_hdr {
+	uint32_t          capacity;
+	uint32_t          mask;
+	volatile uint32_t count;	/* live keys */
+	struct mp_index_slot slot[] __cache_aligned;
+};
+
+typedef struct mp_index {
+	struct mp_index_hdr *hdr;
+	size_t               size;
+	char                 shm_name[MP_INDEX_MAX_NAME];
+} mp_index_t;
+
+int mp_index_create(mempool_priv_t *mp_priv, mp_index_t *idx,
+		    const char *name, unsigned int capacity);
+int mp_index_open(mempool_priv_t *mp_priv, mp_index_t *idx, const char *name);
+void mp_index_close(mp_index_t *idx);
+void mp_index_destroy(mp_index_t *idx);
+int mp_index_insert(mp_index_t *idx, uint64_t key, uintptr_t handle);
+int mp_index_remove(mp_index_t *idx, uint64_t key, uintptr_t *handle);
+
+static inline uint32_t mp_index_hash(uint64_t key)
+{
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	key *= 0xc4ceb9fe1a85ec53ULL;
+	key ^= key >> 33;
+
+	return key;
+}
+
+/* consistent key and state word of a slot */
+static inline void
+mp_index_read(struct mp_index_slot *s, uint64_t *key, uint64_t *val)
+{
+	uint64_t v;
+
+	do {
+		v = s->val;
+		*key = s->key;
+	} while (unlikely(v != s->val));
+	*val = v;
+}
+
+/* handle of the buffer indexed by key, -1 if there is none */
+static inline int
+mp_index_lookup(mp_index_t *idx, uint64_t key, uintptr_t *handle)
+{
+	struct mp_index_hdr *hdr = idx->hdr;
+	uint32_t i = mp_index_hash(key) & hdr->mask, n;
+
+	for (n = 0; n < hdr->capacity; n++, i = (i + 1) & hdr->mask) {
+		uint64_t k, v;
+
+		mp_index_read(&hdr->slot[i], &k, &v);
+		if (MP_INDEX_STATE(v) == MP_INDEX_FREE)
+			break;
+		if (MP_INDEX_STATE(v) == MP_INDEX_LIVE && k == key) {
+			*handle = MP_INDEX_HANDLE(v);
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/* the buffer indexed by key, its segment mapped if needed */
+static inline int
+mp_index_find(mempool_priv_t *mp_priv, mp_index_t *idx, uint64_t key,
+	      mp_buf_priv_t *buf)
+{
+	uintptr_t offset;
+
+	if (mp_index_lookup(idx, key, &offset) < 0)
+		return -1;
+
+	buf->offset = offset;
+	buf->buf = mp_buf_addr(mp_priv, offset);
+	if (unlikely(buf->buf == NULL))
+		return -1;
+	buf->data = mp_buf_data(mp_priv, offset);
+
+	return 0;
+}
+
+static inline unsigned int mp_index_count(mp_index_t *idx)
+{
+	return idx->hdr->count;
+}
+
+#endif /* _MP_INDEX_H_ */
@@ -0,0 +1,163 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "mempool.h"
+#include "mp_mmsg.h"
+
+/*
+ * sock is the socket to receive from or to send to, bucket the bucket the
+ * ingest stage puts the datagrams into or the one the egress stage takes
+ * them from.
+ */
+int mp_mmsg_init(mp_mmsg_t *st, mempool_priv_t *mp_priv, int sock,
+		 int bucket, unsigned int burst)
+{
+	if (burst == 0 || burst > MP_MMSG_MAX_BURST) {
+		fprintf(stderr, "burst must be between 1 and %d\n",
+			MP_MMSG_MAX_BURST);
+		return -1;
+	}
+
+	if (bucket < 0 || bucket >= MEM_POOL_MAX_BUCKETS ||
+	    mp_priv->bucket[bucket] == NULL) {
+		fprintf(stderr, "invalid bucket %d\n", bucket);
+		return -1;
+	}
+
+	memset(st, 0, sizeof(mp_mmsg_t));
+	st->mp_priv = mp_priv;
+	st->sock = sock;
+	st->bucket = bucket;
+	st->burst = burst;
+
+	return 0;
+}
+
+/* destination of the egress stage when the socket is not connected */
+void mp_mmsg_set_dest(mp_mmsg_t *st, const struct sockaddr *addr,
+		      socklen_t len)
+{
+	if (len > sizeof(st->dst))
+		len = sizeof(st->dst);
+	memcpy(&st->dst, addr, len);
+	st->dst_len = len;
+}
+
+/* the buffers held by the stage are freed */
+void mp_mmsg_destroy(mp_mmsg_t *st)
+{
+	unsigned int i;
+
+	for (i = 0; i < st->count; i++)
+		mp_free(st->mp_priv, &st->bufs[i]);
+	st->count = 0;
+}
+
+/* move the buffers from first on to the front */
+static void mp_mmsg_shift(mp_mmsg_t *st, unsigned int first, unsigned int k)
+{
+	unsigned int i;
+
+	for (i = first; i < st->count; i++)
+		st->bufs[k++] = st->bufs[i];
+	st->count = k;
+}
+
+/*
+ * Receive a burst of datagrams with recvmmsg() and put them into the
+ * bucket. flags are given to recvmmsg(), MSG_DONTWAIT on a blocking
+ * socket. Returns the number of datagrams received, 0 if none is ready or
+ * bucket 0 is empty, -1 on error.
+ */
+int mp_mmsg_ingest(mp_mmsg_t *st, int flags)
+{
+	mempool_priv_t *mp_priv = st->mp_priv;
+	unsigned int i, k = 0;
+	int n;
+
+	while (st->count < st->burst &&
+	       mp_alloc(mp_priv, &st->bufs[st->count]) == 0)
+		st->count++;
+	if (st->count == 0)
+		return 0;
+
+	for (i = 0; i < st->count; i++) {
+		st->iov[i].iov_base = st->bufs[i].data;
+		st->iov[i].iov_len = MEM_POOL_BUF_SIZE;
+		memset(&st->msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+		st->msgs[i].msg_hdr.msg_iov = &st->iov[i];
+		st->msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	n = recvmmsg(st->sock, st->msgs, st->count, flags, NULL);
+	if (n < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return 0;
+		perror("recvmmsg");
+		return -1;
+	}
+
+	/* the buffers which couldn't be handed over are kept */
+	for (i = 0; i < (unsigned int)n; i++) {
+		mp_buf_priv_t *buf = &st->bufs[i];
+
+		buf->buf->len = st->msgs[i].msg_len;
+		if ((st->msgs[i].msg_hdr.msg_flags & MSG_TRUNC) ||
+		    mp_put(mp_priv, st->bucket, buf) < 0) {
+			st->drops++;
+			st->bufs[k++] = *buf;
+		}
+	}
+	mp_mmsg_shift(st, n, k);
+	st->packets += n;
+
+	return n;
+}
+
+/*
+ * Send the buffers of the bucket by bursts with sendmmsg() and free them.
+ * Datagrams not sent are kept, in order, for the next call. Returns the
+ * number of datagrams sent, 0 if there is nothing to send or the socket
+ * buffer is full, -1 on error.
+ */
+int mp_mmsg_egress(mp_mmsg_t *st, int flags)
+{
+	mempool_priv_t *mp_priv = st->mp_priv;
+	unsigned int i;
+	int n;
+
+	while (st->count < st->burst &&
+	       mp_get(mp_priv, st->bucket, &st->bufs[st->count]) == 0)
+		st->count++;
+	if (st->count == 0)
+		return 0;
+
+	for (i = 0; i < st->count; i++) {
+		st->iov[i].iov_base = st->bufs[i].data;
+		st->iov[i].iov_len = st->bufs[i].buf->len;
+		memset(&st->msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+		st->msgs[i].msg_hdr.msg_iov = &st->iov[i];
+		st->msgs[i].msg_hdr.msg_iovlen = 1;
+		if (st->dst_len) {
+			st->msgs[i].msg_hdr.msg_name = &st->dst;
+			st->msgs[i].msg_hdr.msg_namelen = st->dst_len;
+		}
+	}
+
+	n = sendmmsg(st->sock, st->msgs, st->count, flags);
+	if (n < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return 0;
+		perror("sendmmsg");
+		return -1;
+	}
+
+	for (i = 0; i < (unsigned int)n; i++)
+		mp_free(mp_priv, &st->bufs[i]);
+	mp_mmsg_shift(st, n, 0);
+	st->packets += n;
+
+	return n;
+}
@@ -0,0 +1,41 @@
+#ifndef _MP_MMSG_H_
+#define _MP_MMSG_H_
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "mempool.h"
+
+/*
+ * Datagram stages moving bursts of pool buffers with one syscall. The
+ * ingest stage receives a burst with recvmmsg() straight into buffers and
+ * puts them into its bucket, the egress stage sends the buffers of its
+ * bucket with sendmmsg() and frees them. Buffers not used by a call are
+ * kept by the stage for the next one.
+ */
+
+#define MP_MMSG_MAX_BURST 64
+
+typedef struct mp_mmsg {
+	mempool_priv_t   *mp_priv;
+	int               sock;
+	int               bucket;
+	unsigned int      burst;
+	unsigned int      count;	/* buffers held by the stage */
+	struct sockaddr_storage dst;	/* egress to an unconnected socket */
+	socklen_t         dst_len;
+	mp_buf_priv_t     bufs[MP_MMSG_MAX_BURST];
+	struct iovec      iov[MP_MMSG_MAX_BURST];
+	struct mmsghdr    msgs[MP_MMSG_MAX_BURST];
+	/* statistics */
+	uint64_t          packets;
+	uint64_t          drops;	/* bucket full or truncated datagram */
+} mp_mmsg_t;
+
+int mp_mmsg_init(mp_mmsg_t *st, mempool_priv_t *mp_priv, int sock,
+		 int bucket, unsigned int burst);
+void mp_mmsg_set_dest(mp_mmsg_t *st, const struct sockaddr *addr,
+		      socklen_t len);
+int mp_mmsg_ingest(mp_mmsg_t *st, int flags);
+int mp_mmsg_egress(mp_mmsg_t *st, int flags);
+void mp_mmsg_destroy(mp_mmsg_t *st);
+
+#endif /* _MP_MMSG_H_ */
@@ -0,0 +1,160 @@
+#ifndef _MP_PACK_H_
+#define _MP_PACK_H_
+#include <time.h>
+#include "mempool.h"
+
+/*
+ * Packing of small messages into pool buffers. The writer appends length
+ * prefixed records to the current buffer (mp_buf::len is the used size)
+ * and puts it into the bucket when the next record doesn't fit, on
+ * mp_pack_flush() or when mp_pack_poll() finds the oldest record waited
+ * longer than max_delay. The reader walks the records of a buffer.
+ */
+
+struct mp_pack_rec {
+	uint32_t len;
+	char     data[];
+};
+
+#define MP_PACK_ALIGN(len) (((len) + 3) & ~3U)
+#define MP_PACK_REC_SIZE(len) \
+	MP_PACK_ALIGN(sizeof(struct mp_pack_rec) + (len))
+#define MP_PACK_MAX_MSG (MEM_POOL_BUF_SIZE - sizeof(struct mp_pack_rec))
+
+typedef struct mp_pack_writer {
+	mempool_priv_t *mp_priv;
+	int             bucket;
+	int             mp;		/* multi producer put */
+	int             has_buf;
+	mp_buf_priv_t   buf;
+	uint64_t        max_delay;	/* ns, 0 for no time limit */
+	uint64_t        first;		/* time of the 1st record of buf */
+} mp_pack_writer_t;
+
+typedef struct mp_pack_reader {
+	mp_buf_priv_t *buf;
+	uint32_t       off;
+} mp_pack_reader_t;
+
+static inline uint64_t mp_pack_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void
+mp_pack_writer_init(mp_pack_writer_t *w, mempool_priv_t *mp_priv, int bucket,
+		    int mp, uint64_t max_delay)
+{
+	w->mp_priv = mp_priv;
+	w->bucket = bucket;
+	w->mp = mp;
+	w->has_buf = 0;
+	w->max_delay = max_delay;
+}
+
+/* put the current buffer into the bucket, keep it if the bucket is full */
+static inline int mp_pack_flush(mp_pack_writer_t *w)
+{
+	int ret;
+
+	if (!w->has_buf)
+		return 0;
+
+	if (w->mp)
+		ret = mp_put(w->mp_priv, w->bucket, &w->buf);
+	else
+		ret = mp_put_sp(w->mp_priv, w->bucket, &w->buf);
+	if (ret < 0)
+		return -1;
+
+	w->has_buf = 0;
+
+	return 0;
+}
+
+/* flush if the oldest record waited longer than max_delay */
+static inline int mp_pack_poll(mp_pack_writer_t *w)
+{
+	if (w->has_buf && w->max_delay &&
+	    mp_pack_now() - w->first >= w->max_delay)
+		return mp_pack_flush(w);
+
+	return 0;
+}
+
+/*
+ * Reserve room for a message of len bytes and return where to write it,
+ * NULL if the previous buffer can't be put or no buffer is available.
+ */
+static inline void *mp_pack_reserve(mp_pack_writer_t *w, uint32_t len)
+{
+	struct mp_pack_rec *rec;
+	uint32_t size = MP_PACK_REC_SIZE(len);
+
+	if (unlikely(len > MP_PACK_MAX_MSG))
+		return NULL;
+
+	if (w->has_buf && w->buf.buf->len + size > MEM_POOL_BUF_SIZE &&
+	    mp_pack_flush(w) < 0)
+		return NULL;
+
+	if (!w->has_buf) {
+		if (mp_alloc(w->mp_priv, &w->buf) < 0)
+			return NULL;
+		w->buf.buf->len = 0;
+		w->has_buf = 1;
+		if (w->max_delay)
+			w->first = mp_pack_now();
+	}
+
+	rec = (struct mp_pack_rec *)(w->buf.data + w->buf.buf->len);
+	rec->len = len;
+	w->buf.buf->len += size;
+
+	return rec->data;
+}
+
+static inline int
+mp_pack_write(mp_pack_writer_t *w, const void *data, uint32_t len)
+{
+	void *ptr = mp_pack_reserve(w, len);
+
+	if (ptr == NULL)
+		return -1;
+	memcpy(ptr, data, len);
+
+	return 0;
+}
+
+static inline void
+mp_pack_reader_init(mp_pack_reader_t *r, mp_buf_priv_t *buf)
+{
+	r->buf = buf;
+	r->off = 0;
+}
+
+/*
+ * next message of the buffer, NULL when all of them have been read or the
+ * next record runs past the end of the buffer
+ */
+static inline void *mp_pack_next(mp_pack_reader_t *r, uint32_t *len)
+{
+	struct mp_pack_rec *rec;
+
+	if (r->off + sizeof(struct mp_pack_rec) > r->buf->buf->len)
+		return NULL;
+
+	rec = (struct mp_pack_rec *)(r->buf->data + r->off);
+	if (unlikely(rec->len > MP_PACK_MAX_MSG ||
+		     r->off + MP_PACK_REC_SIZE(rec->len) > r->buf->buf->len))
+		return NULL;
+	r->off += MP_PACK_REC_SIZE(rec->len);
+	*len = rec->len;
+
+	return rec->data;
+}
+
+#endif /* _MP_PACK_H_ */
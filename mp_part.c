@@ -0,0 +1,329 @@
+#include <sys/types.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include "mempool.h"
+#include "mp_part.h"
+
+/* points of each member on the hash ring */
+#define MP_PART_VNODES 128
+
+struct mp_part_point {
+	uint32_t pos;
+	uint32_t bucket;
+};
+
+static inline uint32_t mp_part_point_pos(uint32_t bucket, uint32_t vnode)
+{
+	return mp_part_hash((uint64_t)bucket << 32 | vnode);
+}
+
+static int mp_part_point_cmp(const void *a, const void *b)
+{
+	const struct mp_part_point *x = a, *y = b;
+
+	if (x->pos != y->pos)
+		return x->pos < y->pos ? -1 : 1;
+	return x->bucket < y->bucket ? -1 : x->bucket > y->bucket;
+}
+
+/*
+ * Give each slot of the hash space to the member owning the first point at
+ * or after the slot start, wrapping around.
+ */
+static void mp_part_build(struct mp_part *part, uint8_t *table)
+{
+	/* serialized by the part lock */
+	static struct mp_part_point points[MP_PART_MAX_MEMBERS *
+					   MP_PART_VNODES];
+	unsigned int i, v, n = 0, p = 0;
+
+	for (i = 0; i < MP_PART_MAX_MEMBERS; i++) {
+		struct mp_part_member *m = &part->member[i];
+
+		if (m->state != MP_PART_JOINED)
+			continue;
+		for (v = 0; v < MP_PART_VNODES; v++) {
+			points[n].pos = mp_part_point_pos(m->bucket, v);
+			points[n].bucket = m->bucket;
+			n++;
+		}
+	}
+
+	if (n == 0) {
+		memset(table, 0, MP_PART_SLOTS);
+		return;
+	}
+	qsort(points, n, sizeof(*points), mp_part_point_cmp);
+
+	for (i = 0; i < MP_PART_SLOTS; i++) {
+		uint32_t start = i << (32 - MP_PART_BITS);
+
+		while (p < n && points[p].pos < start)
+			p++;
+		table[i] = points[p < n ? p : 0].bucket;
+	}
+}
+
+static int mp_part_member_of(struct mp_part *part, unsigned int bucket)
+{
+	int i;
+
+	for (i = 0; i < MP_PART_MAX_MEMBERS; i++) {
+		struct mp_part_member *m = &part->member[i];
+
+		if (m->state != MP_PART_FREE && m->bucket == bucket)
+			return i;
+	}
+
+	return -1;
+}
+
+/*
+ * Rebuild the table from the joined members. The members getting slots
+ * are fenced until the previous owners have processed the buffers they
+ * hold: those taken so far plus those in their bucket, once the puts of
+ * producers which may have read the former table are in. The fences are
+ * set before the new table is seen, they hold until the backlogs are
+ * sampled. The part lock must be held.
+ */
+static void mp_part_rebalance(mempool_priv_t *mp_priv, struct mp_part *part)
+{
+	static uint8_t table[MP_PART_SLOTS];
+	uint8_t moved[MP_PART_MAX_MEMBERS][MP_PART_MAX_MEMBERS];
+	uint32_t epoch = part->epoch;
+	unsigned int k, n;
+	int i, j;
+
+	mp_part_build(part, table);
+
+	memset(moved, 0, sizeof(moved));
+	for (i = 0; i < MP_PART_SLOTS; i++) {
+		int from, to;
+
+		if (table[i] == part->table[i] || part->table[i] == 0)
+			continue;
+		from = mp_part_member_of(part, part->table[i]);
+		to = mp_part_member_of(part, table[i]);
+		if (from >= 0 && to >= 0)
+			moved[to][from] = 1;
+	}
+
+	part->sampling = 1;
+	wmb();
+	for (i = 0; i < MP_PART_MAX_MEMBERS; i++) {
+		struct mp_part_member *m = &part->member[i];
+
+		for (j = 0, n = 0; j < MP_PART_MAX_MEMBERS; j++) {
+			if (moved[i][j])
+				m->fence[n++].member = j;
+		}
+		if (n) {
+			wmb();
+			m->nfences = n;
+		}
+	}
+
+	/*
+	 * A producer counted in the new epoch reads the new table. One still
+	 * counted in the former epoch may have read the former table: its
+	 * buffer must be in the bucket of the former owner when sampled.
+	 */
+	wmb();
+	memcpy(part->table, table, MP_PART_SLOTS);
+	wmb();
+	part->epoch = epoch + 1;
+	mb();
+	while (part->puts[epoch & 1])
+		sched_yield();
+
+	for (i = 0; i < MP_PART_MAX_MEMBERS; i++) {
+		struct mp_part_member *m = &part->member[i];
+
+		for (k = 0, n = 0; k < m->nfences; k++) {
+			struct mp_part_member *old;
+			uint32_t taken, count;
+
+			old = &part->member[m->fence[k].member];
+			/* a consistent sample, not racing with a get */
+			do {
+				while (old->taking)
+					sched_yield();
+				taken = old->taken;
+				count = mp_count(mp_priv, old->bucket);
+			} while (old->taking || taken != old->taken);
+			/* nothing in flight, typically an idle member */
+			if (count == 0 && old->done == taken)
+				continue;
+			m->fence[n].member = m->fence[k].member;
+			m->fence[n].taken = taken + count;
+			n++;
+		}
+		m->nfences = n;
+	}
+	wmb();
+	part->sampling = 0;
+	part->rebalances++;
+}
+
+/* a rebalance can't start while members wait on the previous one */
+static int mp_part_settled(struct mp_part *part)
+{
+	int i;
+
+	for (i = 0; i < MP_PART_MAX_MEMBERS; i++) {
+		if (part->member[i].state != MP_PART_FREE &&
+		    part->member[i].nfences)
+			return 0;
+	}
+
+	return 1;
+}
+
+/* map the buckets of the members, their backlog is sampled on rebalance */
+static int mp_part_map(mempool_priv_t *mp_priv, struct mp_part *part)
+{
+	int i;
+
+	for (i = 0; i < MP_PART_MAX_MEMBERS; i++) {
+		struct mp_part_member *m = &part->member[i];
+
+		if (m->state == MP_PART_FREE ||
+		    mp_priv->bucket[m->bucket] != NULL)
+			continue;
+		if (mp_bucket_map(mp_priv, m->bucket) < 0) {
+			fprintf(stderr, "can't map bucket %u\n", m->bucket);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Add a consumer with its empty bucket to the dispatch. Returns its member
+ * number or -1. If members are still waiting on a previous rebalance,
+ * errno is set to EAGAIN and the caller should try again later.
+ */
+int mp_part_join(mempool_priv_t *mp_priv, int bucket)
+{
+	struct mp_part *part = &mp_priv->mp->part;
+	struct mp_part_member *m;
+	int i, ret = -1;
+
+	if (bucket <= 0 || bucket >= MEM_POOL_MAX_BUCKETS ||
+	    mp_priv->bucket[bucket] == NULL) {
+		fprintf(stderr, "invalid bucket %d\n", bucket);
+		return -1;
+	}
+	if (mp_count(mp_priv, bucket)) {
+		fprintf(stderr, "bucket %d is not empty\n", bucket);
+		return -1;
+	}
+
+	spin_lock(&part->lock);
+
+	if (!mp_part_settled(part)) {
+		errno = EAGAIN;
+		goto end;
+	}
+	if (mp_part_member_of(part, bucket) >= 0) {
+		fprintf(stderr, "bucket %d is already a member\n", bucket);
+		goto end;
+	}
+	for (i = 0; i < MP_PART_MAX_MEMBERS; i++) {
+		if (part->member[i].state == MP_PART_FREE)
+			break;
+	}
+	if (i == MP_PART_MAX_MEMBERS) {
+		fprintf(stderr, "no member slot left\n");
+		goto end;
+	}
+	if (mp_part_map(mp_priv, part) < 0)
+		goto end;
+
+	m = &part->member[i];
+	m->bucket = bucket;
+	m->taken = 0;
+	m->done = 0;
+	m->taking = 0;
+	m->nfences = 0;
+	m->held = MEM_POOL_BUF_NONE;
+	m->state = MP_PART_JOINED;
+	part->members++;
+	mp_part_rebalance(mp_priv, part);
+	ret = i;
+
+ end:
+	spin_unlock(&part->lock);
+
+	return ret;
+}
+
+/*
+ * Remove a member from the dispatch. Its keys go to the others and it
+ * keeps getting its remaining buffers with mp_part_get() until its bucket
+ * is empty. EAGAIN as for mp_part_join().
+ */
+int mp_part_leave(mempool_priv_t *mp_priv, int member)
+{
+	struct mp_part *part = &mp_priv->mp->part;
+	int ret = -1;
+
+	if (member < 0 || member >= MP_PART_MAX_MEMBERS ||
+	    part->member[member].state != MP_PART_JOINED) {
+		fprintf(stderr, "invalid member %d\n", member);
+		return -1;
+	}
+
+	spin_lock(&part->lock);
+
+	if (!mp_part_settled(part)) {
+		errno = EAGAIN;
+		goto end;
+	}
+	if (mp_part_map(mp_priv, part) < 0)
+		goto end;
+
+	part->member[member].state = MP_PART_LEAVING;
+	part->members--;
+	mp_part_rebalance(mp_priv, part);
+	ret = 0;
+
+ end:
+	spin_unlock(&part->lock);
+
+	return ret;
+}
+
+/*
+ * Drop the fences whose previous owner has caught up, returns non zero if
+ * the member still has to wait. Only called by the member itself.
+ */
+int mp_part_fenced(mempool_priv_t *mp_priv, struct mp_part_member *m)
+{
+	struct mp_part *part = &mp_priv->mp->part;
+	unsigned int i, n = 0;
+
+	/* the backlogs of the former owners are being sampled */
+	if (part->sampling)
+		return 1;
+	rmb();
+
+	for (i = 0; i < m->nfences; i++) {
+		struct mp_part_fence *f = &m->fence[i];
+		struct mp_part_member *old = &part->member[f->member];
+
+		/* a member leaving has processed its whole bucket when free */
+		if (old->state == MP_PART_FREE ||
+		    (int32_t)(old->done - f->taken) >= 0)
+			continue;
+		m->fence[n++] = *f;
+	}
+	m->nfences = n;
+
+	return n != 0;
+}
@@ -0,0 +1,125 @@
+#ifndef _MP_PART_H_
+#define _MP_PART_H_
+#include <sys/types.h>
+#include <stdint.h>
+#include "mempool.h"
+
+/*
+ * Key partitioned dispatch. Each consumer joins with its own bucket and
+ * producers put buffers with the hash of their key: all the buffers of a
+ * key go to the same member, in order, while different keys are processed
+ * in parallel. The hash space is spread over the members by consistent
+ * hashing so a join or a leave only moves the keys of one member's share.
+ *
+ * A member taking over keys doesn't consume until their previous owner
+ * has processed the buffers it had been given, which keeps the order of
+ * the keys across rebalancing. A rebalance waits for the producers which
+ * may have looked the former table up to complete their put before
+ * counting these buffers, and a buffer a member takes while getting
+ * fenced is kept until the fences are dropped. A member must fetch its
+ * buffers with mp_part_get() only, the previous buffer counts as processed
+ * on the next call.
+ */
+
+int mp_part_join(mempool_priv_t *mp_priv, int bucket);
+int mp_part_leave(mempool_priv_t *mp_priv, int member);
+int mp_part_fenced(mempool_priv_t *mp_priv, struct mp_part_member *m);
+
+/* hash a 64 bit key (instrument id, flow id...) into a dispatch hash */
+static inline uint32_t mp_part_hash(uint64_t key)
+{
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	key *= 0xc4ceb9fe1a85ec53ULL;
+	key ^= key >> 33;
+
+	return key;
+}
+
+/* the bucket a hash is dispatched to, 0 if there is no member */
+static inline int mp_part_bucket(mempool_priv_t *mp_priv, uint32_t hash)
+{
+	return mp_priv->mp->part.table[hash >> (32 - MP_PART_BITS)];
+}
+
+/* put buf into the bucket of the member owning hash - multi producer safe */
+static inline int
+mp_part_put(mempool_priv_t *mp_priv, uint32_t hash, mp_buf_priv_t *buf)
+{
+	struct mp_part *part = &mp_priv->mp->part;
+	uint32_t epoch;
+	int bucket, ret = -1;
+
+	/* a rebalance waits for the puts of its epoch, see mp_part.c */
+	for (;;) {
+		epoch = part->epoch;
+		__sync_fetch_and_add(&part->puts[epoch & 1], 1);
+		if (likely(part->epoch == epoch))
+			break;
+		__sync_fetch_and_sub(&part->puts[epoch & 1], 1);
+	}
+
+	bucket = mp_part_bucket(mp_priv, hash);
+	if (likely(bucket) && (likely(mp_priv->bucket[bucket] != NULL) ||
+			       mp_bucket_map(mp_priv, bucket) == 0))
+		ret = mp_put(mp_priv, bucket, buf);
+
+	__sync_fetch_and_sub(&part->puts[epoch & 1], 1);
+
+	return ret;
+}
+
+/*
+ * Get the next buffer of a member, -1 if there is none or the member waits
+ * for others to process the keys it took over. A leaving member is gone
+ * once its bucket is empty.
+ */
+static inline int
+mp_part_get(mempool_priv_t *mp_priv, int member, mp_buf_priv_t *buf)
+{
+	struct mp_part_member *m = &mp_priv->mp->part.member[member];
+	int held = m->held != MEM_POOL_BUF_NONE;
+
+	/* the buffers returned before have been processed */
+	m->done = m->taken - held;
+
+	if (unlikely(m->nfences) && mp_part_fenced(mp_priv, m))
+		return -1;
+
+	if (unlikely(held)) {
+		buf->offset = m->held;
+		buf->buf = mp_buf_addr(mp_priv, m->held);
+		buf->data = mp_buf_data(mp_priv, m->held);
+		m->held = MEM_POOL_BUF_NONE;
+		return 0;
+	}
+
+	m->taking = 1;
+	if (mp_get_sc(mp_priv, m->bucket, buf) < 0) {
+		m->taking = 0;
+		if (unlikely(m->state == MP_PART_LEAVING))
+			m->state = MP_PART_FREE;
+		return -1;
+	}
+	m->taken++;
+	m->taking = 0;
+
+	/*
+	 * A rebalance fenced the member meanwhile, the buffer may be of a key
+	 * it took over. It is kept until the fences are dropped.
+	 */
+	if (unlikely(m->nfences)) {
+		m->held = buf->offset;
+		return -1;
+	}
+
+	return 0;
+}
+
+static inline int mp_part_is_member(mempool_priv_t *mp_priv, int member)
+{
+	return mp_priv->mp->part.member[member].state != MP_PART_FREE;
+}
+
+#endif /* _MP_PART_H_ */
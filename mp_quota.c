@@ -0,0 +1,248 @@
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include "mempool.h"
+#include "mp_quota.h"
+
+/* reserved buffers the client hasn't allocated */
+static inline uint32_t mp_quota_unused(struct mp_client *cl)
+{
+	uint32_t outstanding = cl->outstanding;
+
+	return cl->reserved > outstanding ? cl->reserved - outstanding : 0;
+}
+
+/* mp->lock must be held */
+static int mp_quota_check(mempool_t *mp, struct mp_client *cl,
+			  unsigned int reserved, unsigned int max)
+{
+	if (max == 0 || reserved > max) {
+		fprintf(stderr, "quota maximum must be non zero and not lower "
+			"than the reservation\n");
+		return -1;
+	}
+
+	if (mp->reserved_total - (cl ? cl->reserved : 0) + reserved >
+	    mp->entries) {
+		fprintf(stderr, "not enough buffers left to reserve %u\n",
+			reserved);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Release the reservation of a client, mp->lock must be held. Buffers
+ * still charged to it are credited back to the slot when they are freed.
+ */
+static void mp_quota_release(mempool_t *mp, struct mp_client *cl)
+{
+	__sync_sub_and_fetch(&mp->reserve_unused, mp_quota_unused(cl));
+	mp->reserved_total -= cl->reserved;
+	cl->reserved = 0;
+	cl->pid = 0;
+}
+
+/* take a client slot with the default quota */
+int mp_quota_join(mempool_priv_t *mp_priv)
+{
+	mempool_t *mp = mp_priv->mp;
+	struct mp_client *cl;
+	int i, ret = -1;
+
+	spin_lock(&mp->lock);
+
+	/* a process which died without leaving keeps nothing reserved */
+	for (i = 0; i < MEM_POOL_MAX_CLIENTS; i++) {
+		cl = &mp->clients[i];
+		if (cl->pid && kill(cl->pid, 0) < 0 && errno == ESRCH)
+			mp_quota_release(mp, cl);
+	}
+
+	if (mp_quota_check(mp, NULL, mp->quota_reserved, mp->quota_max) < 0)
+		goto end;
+
+	/* the buffers of a client which left may still be charged to it */
+	for (i = 0; i < MEM_POOL_MAX_CLIENTS; i++) {
+		cl = &mp->clients[i];
+		if (cl->pid == 0 && cl->outstanding == 0)
+			break;
+	}
+	if (i == MEM_POOL_MAX_CLIENTS) {
+		fprintf(stderr, "no quota slot left\n");
+		goto end;
+	}
+
+	cl->reserved = mp->quota_reserved;
+	cl->max = mp->quota_max;
+	cl->failures = 0;
+	cl->pid = getpid();
+	mp->reserved_total += cl->reserved;
+	__sync_add_and_fetch(&mp->reserve_unused, cl->reserved);
+	mp_priv->client = i;
+	ret = 0;
+
+ end:
+	spin_unlock(&mp->lock);
+
+	return ret;
+}
+
+/* give the slot back, the unused part of the reservation is released */
+void mp_quota_leave(mempool_priv_t *mp_priv)
+{
+	mempool_t *mp = mp_priv->mp;
+	struct mp_client *cl;
+
+	if (mp_priv->client < 0)
+		return;
+	cl = &mp->clients[mp_priv->client];
+
+	spin_lock(&mp->lock);
+	mp_quota_release(mp, cl);
+	spin_unlock(&mp->lock);
+
+	mp_priv->client = -1;
+}
+
+/*
+ * Set the default quota of the clients and turn quotas on. The calling
+ * process becomes a client. Calling it again changes the quota given to
+ * the processes registering from then on.
+ */
+int mp_quota_enable(mempool_priv_t *mp_priv, unsigned int reserved,
+		    unsigned int max)
+{
+	mempool_t *mp = mp_priv->mp;
+
+	spin_lock(&mp->lock);
+	if (mp_quota_check(mp, NULL, reserved, max) < 0) {
+		spin_unlock(&mp->lock);
+		return -1;
+	}
+	mp->quota_reserved = reserved;
+	mp->quota_max = max;
+	__sync_fetch_and_or(&mp->bucket_desc[0].flags, MP_BUCKET_F_QUOTA);
+	spin_unlock(&mp->lock);
+
+	if (mp_priv->client >= 0)
+		return 0;
+
+	return mp_quota_join(mp_priv);
+}
+
+/*
+ * Change the quota of a client. It is approximate if the client allocates
+ * meanwhile.
+ */
+int mp_quota_set(mempool_priv_t *mp_priv, int client, unsigned int reserved,
+		 unsigned int max)
+{
+	mempool_t *mp = mp_priv->mp;
+	struct mp_client *cl;
+	int32_t unused;
+
+	if (client < 0 || client >= MEM_POOL_MAX_CLIENTS ||
+	    mp->clients[client].pid == 0) {
+		fprintf(stderr, "invalid client %d\n", client);
+		return -1;
+	}
+	cl = &mp->clients[client];
+
+	spin_lock(&mp->lock);
+	if (mp_quota_check(mp, cl, reserved, max) < 0) {
+		spin_unlock(&mp->lock);
+		return -1;
+	}
+	unused = mp_quota_unused(cl);
+	mp->reserved_total += reserved - cl->reserved;
+	cl->reserved = reserved;
+	cl->max = max;
+	__sync_add_and_fetch(&mp->reserve_unused,
+			     (int32_t)mp_quota_unused(cl) - unused);
+	spin_unlock(&mp->lock);
+
+	return 0;
+}
+
+/*
+ * mp_alloc() with quotas. A process without a slot can only take buffers
+ * not reserved by the clients.
+ */
+int mp_quota_alloc(mempool_priv_t *mp_priv, mp_buf_priv_t *buf)
+{
+	mempool_t *mp = mp_priv->mp;
+	struct mp_client *cl = NULL;
+	int reserved = 0;
+
+	if (mp_priv->client >= 0) {
+		uint32_t outstanding;
+
+		cl = &mp->clients[mp_priv->client];
+		outstanding = __sync_add_and_fetch(&cl->outstanding, 1);
+		if (outstanding > cl->max)
+			goto refused;
+		reserved = outstanding <= cl->reserved;
+	}
+
+	if (reserved)
+		__sync_sub_and_fetch(&mp->reserve_unused, 1);
+	else if ((int32_t)(mp_count(mp_priv, 0) + mp->trim.count) <=
+		 mp->reserve_unused)
+		goto refused;
+
+	if (mp_get(mp_priv, 0, buf) < 0) {
+		/* the pool is empty, not the client's fault */
+		if (reserved)
+			__sync_add_and_fetch(&mp->reserve_unused, 1);
+		if (cl)
+			__sync_sub_and_fetch(&cl->outstanding, 1);
+		return -1;
+	}
+	buf->buf->client = mp_priv->client + 1;
+
+	return 0;
+
+ refused:
+	if (cl) {
+		__sync_sub_and_fetch(&cl->outstanding, 1);
+		__sync_add_and_fetch(&cl->failures, 1);
+	}
+	return -1;
+}
+
+/* credit a buffer being freed back to the client it is charged to */
+void mp_quota_uncharge(mempool_priv_t *mp_priv, mp_buf_priv_t *buf)
+{
+	mempool_t *mp = mp_priv->mp;
+	uint32_t client = buf->buf->client - 1;
+	struct mp_client *cl;
+
+	buf->buf->client = 0;
+	if (client >= MEM_POOL_MAX_CLIENTS)
+		return;
+	cl = &mp->clients[client];
+
+	if (__sync_fetch_and_sub(&cl->outstanding, 1) <= cl->reserved)
+		__sync_add_and_fetch(&mp->reserve_unused, 1);
+}
+
+/* charge a buffer whose put failed back to client, see __mp_put() */
+void mp_quota_recharge(mempool_priv_t *mp_priv, mp_buf_priv_t *buf,
+		       uint32_t client)
+{
+	mempool_t *mp = mp_priv->mp;
+	struct mp_client *cl;
+
+	buf->buf->client = client;
+	if (client - 1 >= MEM_POOL_MAX_CLIENTS)
+		return;
+	cl = &mp->clients[client - 1];
+
+	if (__sync_add_and_fetch(&cl->outstanding, 1) <= cl->reserved)
+		__sync_sub_and_fetch(&mp->reserve_unused, 1);
+}
@@ -0,0 +1,32 @@
+#ifndef _MP_QUOTA_H_
+#define _MP_QUOTA_H_
+#include <sys/types.h>
+#include "mempool.h"
+
+/*
+ * Per process quotas on bucket 0. Once enabled, every process registering
+ * to the pool gets a client slot with a reservation, buffers which only
+ * this process can allocate, and a maximum of outstanding buffers. Beyond
+ * its reservation, a client allocates from the buffers not reserved by
+ * others. A refused allocation is counted in the failures of the client
+ * which hit its limit.
+ *
+ * A buffer is charged to the client which allocated it and credited back
+ * when it is freed, whichever process frees it. The reservation of a
+ * process which died without unregistering is released when the next one
+ * registers. Quotas are meant to be enabled by the creator before other
+ * processes register and can't be turned off.
+ */
+
+int mp_quota_enable(mempool_priv_t *mp_priv, unsigned int reserved,
+		    unsigned int max);
+int mp_quota_set(mempool_priv_t *mp_priv, int client, unsigned int reserved,
+		 unsigned int max);
+
+static inline struct mp_client *
+mp_quota_client(mempool_priv_t *mp_priv, int client)
+{
+	return &mp_priv->mp->clients[client];
+}
+
+#endif /* _MP_QUOTA_H_ */
@@ -0,0 +1,52 @@
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "mempool.h"
+#include "mp_reorder.h"
+
+/*
+ * Turn section into the entry of an ordered section and create its reorder
+ * bucket, named name with room for window buffers (a power of 2). The
+ * section bucket must be empty. Returns the reorder bucket or -1.
+ */
+int mp_reorder_create(mempool_priv_t *mp_priv, int section, const char *name,
+		      unsigned int window)
+{
+	struct mp_bucket_desc *desc;
+	int bucket;
+
+	if (section <= 0 || section >= MEM_POOL_MAX_BUCKETS ||
+	    mp_priv->bucket[section] == NULL) {
+		fprintf(stderr, "invalid bucket %d\n", section);
+		return -1;
+	}
+	desc = &mp_priv->mp->bucket_desc[section];
+
+	/* a buffer shed or dropped on get would leave a hole in the sequence */
+	if (desc->flags & (MP_BUCKET_F_SEQ | MP_BUCKET_F_SPILL |
+			   MP_BUCKET_F_DEADLINE | MP_BUCKET_F_CSUM_GET) ||
+	    desc->type == MP_RING_REORDER) {
+		fprintf(stderr, "bucket %d can't be a section\n", section);
+		return -1;
+	}
+	if (window <= desc->entries * desc->shards) {
+		fprintf(stderr, "reorder window must be larger than the section "
+			"bucket\n");
+		return -1;
+	}
+	if (mp_count(mp_priv, section)) {
+		fprintf(stderr, "bucket %d is not empty\n", section);
+		return -1;
+	}
+
+	if ((bucket = mp_bucket_create_reorder(mp_priv, name, window)) < 0)
+		return -1;
+
+	/* both start at 0 */
+	spin_lock(&desc->seq_lock);
+	desc->seq = 0;
+	__sync_fetch_and_or(&desc->flags, MP_BUCKET_F_SEQ);
+	spin_unlock(&desc->seq_lock);
+
+	return bucket;
+}
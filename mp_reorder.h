@@ -0,0 +1,24 @@
+#ifndef _MP_REORDER_H_
+#define _MP_REORDER_H_
+#include <sys/types.h>
+#include "mempool.h"
+
+/*
+ * Ordered parallel sections. Buffers put into a section bucket are
+ * numbered in the order they enter its ring and can be processed by any
+ * number of workers. The workers put them into the reorder bucket of the
+ * section which hands them out strictly in that order, whatever order
+ * they come in. A worker must pass every buffer of the section on,
+ * dropping one would stall the reorder bucket behind it.
+ *
+ * The reorder bucket only holds the buffers within a window of its size
+ * from the next one to release. A put beyond it fails like a put into a
+ * full bucket, the worker retries once the late buffers have come in. The
+ * window should be larger than the section bucket plus the buffers the
+ * workers hold, so a worker never waits on a buffer it holds itself.
+ */
+
+int mp_reorder_create(mempool_priv_t *mp_priv, int section, const char *name,
+		      unsigned int window);
+
+#endif /* _MP_REORDER_H_ */
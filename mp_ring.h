@@ -1,34 +1,63 @@
 #ifndef _MP_RING_H_
 #define _MP_RING_H_
 #include <assert.h>
+#include <sched.h>
 #include "sys.h"
 #include "atomic.h"
 
+/*
+ * The indexes run free and are masked on access: a consumer whose cons_head
+ * went stale can't succeed its compare and set after the ring wrapped
+ * around, as it could with masked indexes. A consumer reads its slot before
+ * claiming it, so a slot is free as soon as cons_head is past it and the
+ * consumers never wait on each other.
+ */
 typedef struct mp_ring {
 	volatile uint32_t   prod_head;
 	volatile uint32_t   prod_tail;
 	int                 mask;
 	volatile uint32_t   cons_head __cache_aligned;
-	volatile uint32_t   cons_tail;
 	void               *data[] __cache_aligned;
 } mp_ring_t;
 
+/* pauses before giving up the cpu, see mp_ring_wait() */
+#define MP_RING_SPINS 64
+
+/*
+ * Wait for the producers which started before us to publish. The one we
+ * wait on may have been preempted, spinning a whole time slice on a busy
+ * cpu would only delay it further.
+ */
+static inline void mp_ring_wait(volatile uint32_t *tail, uint32_t pos)
+{
+	unsigned int spins = 0;
+
+	while (*tail != pos) {
+		if (++spins % MP_RING_SPINS == 0)
+			sched_yield();
+		else
+			cpu_spinwait();
+	}
+}
+
 /* ring get - multi consumer safe */
 static inline int mp_ring_get(mp_ring_t *ring, void **ptr)
 {
-	uint32_t cons_head, cons_next;
+	uint32_t cons_head;
+	void *data;
 
 	do {
 		cons_head = ring->cons_head;
-		cons_next = (cons_head + 1) & ring->mask;
 
 		if (cons_head == ring->prod_tail)
 			return -1;
 
-	} while (!atomic_cmpset_int(&ring->cons_head, cons_head, cons_next));
-	atomic_store(&ring->cons_tail, cons_next);
-
-	*ptr = ring->data[cons_head];
+		/* stale if another consumer took the slot, the cas fails */
+		data = ring->data[cons_head & ring->mask];
+		barrier();
+	} while (!atomic_cmpset_int(&ring->cons_head, cons_head,
+				    cons_head + 1));
+	*ptr = data;
 
 	return 0;
 }
@@ -36,21 +65,20 @@ static inline int mp_ring_get(mp_ring_t *ring, void **ptr)
 /* ring put - multi producer safe */
 static inline int mp_ring_put(mp_ring_t *ring, void *ptr)
 {
-	uint32_t prod_head, prod_next, cons_tail;
+	uint32_t prod_head, prod_next, cons_head;
 
 	do {
 		prod_head = ring->prod_head;
-		prod_next = (prod_head + 1) & ring->mask;
-		cons_tail = ring->cons_tail;
+		prod_next = prod_head + 1;
+		cons_head = ring->cons_head;
 
-		if ((ring->mask + cons_tail - prod_head) == 0) {
+		if (prod_head - cons_head >= (uint32_t)ring->mask)
 			return -1;
-		}
 	} while (!atomic_cmpset_int(&ring->prod_head, prod_head, prod_next));
-	ring->data[prod_head] = ptr;
+	ring->data[prod_head & ring->mask] = ptr;
+	barrier();
 
-	while (ring->prod_tail != prod_head)
-		cpu_spinwait();
+	mp_ring_wait(&ring->prod_tail, prod_head);
 	atomic_store(&ring->prod_tail, prod_next);
 
 	return 0;
@@ -59,18 +87,17 @@ static inline int mp_ring_put(mp_ring_t *ring, void *ptr)
 /* ring get - single consumer safe */
 static inline int mp_ring_get_sc(mp_ring_t *ring, void **ptr)
 {
-	uint32_t cons_head, cons_next;
+	uint32_t cons_head;
 
 	cons_head = ring->cons_head;
-	cons_next = (cons_head + 1) & ring->mask;
 
 	if (cons_head == ring->prod_tail)
 		return -1;
 
-	ring->cons_head = cons_next;
-	ring->cons_tail = cons_next;
+	*ptr = ring->data[cons_head & ring->mask];
+	barrier();
 
-	*ptr =  ring->data[cons_head];
+	ring->cons_head = cons_head + 1;
 
 	return 0;
 }
@@ -78,17 +105,18 @@ static inline int mp_ring_get_sc(mp_ring_t *ring, void **ptr)
 /* ring put - single producer safe */
 static inline int mp_ring_put_sp(mp_ring_t *ring, void *ptr)
 {
-	uint32_t prod_head, prod_next, cons_tail;
+	uint32_t prod_head, prod_next, cons_head;
 
 	prod_head = ring->prod_head;
-	prod_next = (prod_head + 1) & ring->mask;
-	cons_tail = ring->cons_tail;
+	prod_next = prod_head + 1;
+	cons_head = ring->cons_head;
 
-	if ((ring->mask + cons_tail - prod_head) == 0)
+	if (prod_head - cons_head >= (uint32_t)ring->mask)
 		return -1;
 
 	ring->prod_head = prod_next;
-	ring->data[prod_head] = ptr;
+	ring->data[prod_head & ring->mask] = ptr;
+	barrier();
 
 	ring->prod_tail = prod_next;
 
@@ -97,9 +125,7 @@ static inline int mp_ring_put_sp(mp_ring_t *ring, void *ptr)
 
 static inline int mp_ring_is_full(mp_ring_t *ring)
 {
-	uint32_t prod_tail_next = (ring->prod_tail + 1) & ring->mask;
-
-	return !!(prod_tail_next == ring->cons_tail);
+	return ring->prod_tail - ring->cons_head >= (uint32_t)ring->mask;
 }
 
 static inline int mp_ring_size(mp_ring_t *ring)
@@ -107,4 +133,15 @@ static inline int mp_ring_size(mp_ring_t *ring)
 	return ring->mask;
 }
 
+/* number of entries in the ring, a hint if the ring is used concurrently */
+static inline unsigned int mp_ring_count(mp_ring_t *ring)
+{
+	return (ring->prod_tail - ring->cons_head) & ring->mask;
+}
+
+static inline unsigned int mp_ring_free_count(mp_ring_t *ring)
+{
+	return ring->mask - mp_ring_count(ring);
+}
+
 #endif
@@ -0,0 +1,127 @@
+#ifndef _MP_RING_FAA_H_
+#define _MP_RING_FAA_H_
+#include "sys.h"
+#include "atomic.h"
+
+/*
+ * Bounded MPMC ring reserving slots with fetch-and-add instead of CAS
+ * retry loops. Each slot carries a sequence number (as in Vyukov's bounded
+ * queue): slot i is free for the put at position p when seq == p and
+ * holds data for the get at position p when seq == p + 1.
+ *
+ * The items/space counters are reserved with fetch-and-add before taking
+ * a position so a get never waits for a put that has not started (and the
+ * other way round). Once a position is taken, the operation may only wait
+ * for a concurrent one already past its reservation to finish its slot.
+ */
+
+struct mp_faa_slot {
+	volatile uint32_t seq;
+	void *volatile    ptr;
+};
+
+typedef struct mp_ring_faa {
+	volatile uint32_t  prod_pos;
+	int                mask;
+	volatile uint32_t  cons_pos __cache_aligned;
+	volatile int32_t   items __cache_aligned;
+	volatile int32_t   space __cache_aligned;
+	struct mp_faa_slot slot[] __cache_aligned;
+} mp_ring_faa_t;
+
+static inline size_t mp_ring_faa_mem_size(unsigned int entries)
+{
+	return sizeof(mp_ring_faa_t) + sizeof(struct mp_faa_slot) * entries;
+}
+
+static inline void mp_ring_faa_init(mp_ring_faa_t *ring, unsigned int entries)
+{
+	unsigned int i;
+
+	ring->mask = entries - 1;
+	ring->prod_pos = 0;
+	ring->cons_pos = 0;
+	ring->items = 0;
+	ring->space = entries;
+	for (i = 0; i < entries; i++)
+		ring->slot[i].seq = i;
+}
+
+/* ring get - multi consumer safe */
+static inline int mp_ring_faa_get(mp_ring_faa_t *ring, void **ptr)
+{
+	struct mp_faa_slot *slot;
+	uint32_t pos;
+
+	/* polling an empty ring must not write the shared line */
+	if (ring->items <= 0)
+		return -1;
+	if (__sync_fetch_and_sub(&ring->items, 1) <= 0) {
+		__sync_fetch_and_add(&ring->items, 1);
+		return -1;
+	}
+
+	pos = __sync_fetch_and_add(&ring->cons_pos, 1);
+	slot = &ring->slot[pos & ring->mask];
+
+	while (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1)
+		cpu_spinwait();
+	*ptr = slot->ptr;
+	__atomic_store_n(&slot->seq, pos + ring->mask + 1, __ATOMIC_RELEASE);
+
+	__sync_fetch_and_add(&ring->space, 1);
+
+	return 0;
+}
+
+/* ring put - multi producer safe */
+static inline int mp_ring_faa_put(mp_ring_faa_t *ring, void *ptr)
+{
+	struct mp_faa_slot *slot;
+	uint32_t pos;
+
+	if (ring->space <= 0)
+		return -1;
+	if (__sync_fetch_and_sub(&ring->space, 1) <= 0) {
+		__sync_fetch_and_add(&ring->space, 1);
+		return -1;
+	}
+
+	pos = __sync_fetch_and_add(&ring->prod_pos, 1);
+	slot = &ring->slot[pos & ring->mask];
+
+	while (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos)
+		cpu_spinwait();
+	slot->ptr = ptr;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	__sync_fetch_and_add(&ring->items, 1);
+
+	return 0;
+}
+
+static inline int mp_ring_faa_is_full(mp_ring_faa_t *ring)
+{
+	return ring->space <= 0;
+}
+
+static inline unsigned int mp_ring_faa_count(mp_ring_faa_t *ring)
+{
+	int32_t items = ring->items;
+
+	return items < 0 ? 0 : items;
+}
+
+static inline unsigned int mp_ring_faa_free_count(mp_ring_faa_t *ring)
+{
+	int32_t space = ring->space;
+
+	return space < 0 ? 0 : space;
+}
+
+static inline int mp_ring_faa_is_empty(mp_ring_faa_t *ring)
+{
+	return ring->prod_pos == ring->cons_pos;
+}
+
+#endif /* _MP_RING_FAA_H_ */
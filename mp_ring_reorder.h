@@ -0,0 +1,109 @@
+#ifndef _MP_RING_REORDER_H_
+#define _MP_RING_REORDER_H_
+#include "sys.h"
+#include "atomic.h"
+
+/*
+ * Reorder window: items come in with a sequence number, in any order, and
+ * go out strictly by sequence. The item with sequence s sits in slot
+ * s & mask. As in the fetch-and-add ring, a slot is free for sequence s
+ * when its seq is s and holds the item of sequence s when it is s + 1.
+ * A put more than a window ahead of the next sequence to release fails,
+ * the window is full for it.
+ */
+
+struct mp_reorder_slot {
+	volatile uint32_t seq;
+	void *volatile    ptr;
+};
+
+typedef struct mp_ring_reorder {
+	volatile uint32_t  next;	/* sequence released next */
+	int                mask;
+	volatile int32_t   items __cache_aligned;
+	struct mp_reorder_slot slot[] __cache_aligned;
+} mp_ring_reorder_t;
+
+static inline size_t mp_ring_reorder_mem_size(unsigned int entries)
+{
+	return sizeof(mp_ring_reorder_t) +
+		sizeof(struct mp_reorder_slot) * entries;
+}
+
+static inline void
+mp_ring_reorder_init(mp_ring_reorder_t *ring, unsigned int entries)
+{
+	unsigned int i;
+
+	ring->mask = entries - 1;
+	ring->next = 0;
+	ring->items = 0;
+	for (i = 0; i < entries; i++)
+		ring->slot[i].seq = i;
+}
+
+/* ring get - returns the item of the next sequence once it is in */
+static inline int mp_ring_reorder_get(mp_ring_reorder_t *ring, void **ptr)
+{
+	struct mp_reorder_slot *slot;
+	uint32_t next;
+
+	do {
+		next = ring->next;
+		slot = &ring->slot[next & ring->mask];
+
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != next + 1)
+			return -1;
+	} while (!atomic_cmpset_int(&ring->next, next, next + 1));
+
+	*ptr = slot->ptr;
+	__atomic_store_n(&slot->seq, next + ring->mask + 1, __ATOMIC_RELEASE);
+	__sync_fetch_and_sub(&ring->items, 1);
+
+	return 0;
+}
+
+/* ring put - multi producer safe, each sequence being put once */
+static inline int
+mp_ring_reorder_put(mp_ring_reorder_t *ring, uint32_t seq, void *ptr)
+{
+	struct mp_reorder_slot *slot = &ring->slot[seq & ring->mask];
+
+	if (seq - ring->next > (uint32_t)ring->mask)
+		return -1;
+
+	/* the consumer may still be reading the previous lap */
+	while (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq)
+		cpu_spinwait();
+	slot->ptr = ptr;
+	__atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELEASE);
+	__sync_fetch_and_add(&ring->items, 1);
+
+	return 0;
+}
+
+static inline unsigned int mp_ring_reorder_count(mp_ring_reorder_t *ring)
+{
+	int32_t items = ring->items;
+
+	return items < 0 ? 0 : items;
+}
+
+static inline unsigned int
+mp_ring_reorder_free_count(mp_ring_reorder_t *ring)
+{
+	return ring->mask + 1 - mp_ring_reorder_count(ring);
+}
+
+/* every slot of the window holds an item */
+static inline int mp_ring_reorder_is_full(mp_ring_reorder_t *ring)
+{
+	return mp_ring_reorder_count(ring) > (uint32_t)ring->mask;
+}
+
+static inline int mp_ring_reorder_is_empty(mp_ring_reorder_t *ring)
+{
+	return ring->items == 0;
+}
+
+#endif /* _MP_RING_REORDER_H_ */
@@ -0,0 +1,213 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include "mempool.h"
+#include "mp_rpc.h"
+
+static inline uint64_t mp_rpc_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int mp_rpc_server_init(mp_rpc_server_t *srv, mempool_priv_t *mp_priv,
+		       const char *name, unsigned int entries)
+{
+	srv->mp_priv = mp_priv;
+	srv->bucket = mp_bucket_create_faa(mp_priv, name, entries);
+
+	return srv->bucket < 0 ? -1 : 0;
+}
+
+void mp_rpc_server_destroy(mp_rpc_server_t *srv)
+{
+	mp_buf_priv_t req;
+
+	/* nobody will answer the requests left */
+	while (mp_rpc_recv(srv, &req) == 0)
+		mp_free(srv->mp_priv, &req);
+	mp_bucket_destroy(srv->mp_priv, srv->bucket);
+}
+
+/* the reply bucket may have been created after the server attached */
+static int mp_rpc_reply_map(mp_rpc_server_t *srv, struct mp_rpc_hdr *hdr)
+{
+	mempool_priv_t *mp_priv = srv->mp_priv;
+
+	if (hdr->reply < 0 || hdr->reply >= MEM_POOL_MAX_BUCKETS)
+		return -1;
+	if (likely(mp_priv->bucket[hdr->reply] &&
+		   mp_priv->bucket_gen[hdr->reply] == hdr->reply_gen))
+		return 0;
+	if (mp_bucket_map(mp_priv, hdr->reply) < 0)
+		return -1;
+
+	/* the client is gone and its slot was reused by another bucket */
+	return mp_priv->bucket_gen[hdr->reply] == hdr->reply_gen ? 0 : -1;
+}
+
+/*
+ * Answer a request with len bytes of payload. rep is the reply buffer, or
+ * NULL to answer with the request buffer itself. A reply that can't be
+ * delivered is freed.
+ */
+int mp_rpc_reply(mp_rpc_server_t *srv, mp_buf_priv_t *req, mp_buf_priv_t *rep,
+		 uint32_t len, int status)
+{
+	struct mp_rpc_hdr *hdr;
+
+	if (rep == NULL) {
+		rep = req;
+	} else {
+		*mp_rpc_hdr(rep) = *mp_rpc_hdr(req);
+		mp_free(srv->mp_priv, req);
+	}
+
+	hdr = mp_rpc_hdr(rep);
+	hdr->status = status;
+	rep->buf->len = sizeof(struct mp_rpc_hdr) + len;
+
+	if (len > MP_RPC_MAX_DATA || mp_rpc_reply_map(srv, hdr) < 0 ||
+	    mp_put(srv->mp_priv, hdr->reply, rep) < 0) {
+		mp_free(srv->mp_priv, rep);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Connect to the server bucket and create the reply bucket of the client.
+ * Calls not answered within timeout ns complete with a NULL reply.
+ */
+int mp_rpc_client_init(mp_rpc_client_t *cli, mempool_priv_t *mp_priv,
+		       const char *server, unsigned int entries,
+		       uint64_t timeout)
+{
+	static unsigned int clients;
+	char name[MEM_POOL_MAX_BUCKET_NAME];
+
+	memset(cli, 0, sizeof(mp_rpc_client_t));
+	cli->mp_priv = mp_priv;
+	cli->timeout = timeout;
+	cli->next_id = cli->oldest = 1;
+
+	cli->server = mp_bucket_lookup(mp_priv, server);
+	if (cli->server < 0) {
+		fprintf(stderr, "rpc server %s not found\n", server);
+		return -1;
+	}
+
+	snprintf(name, sizeof(name), "rpc.%d.%u", getpid(),
+		 __sync_fetch_and_add(&clients, 1));
+	cli->reply = mp_bucket_create(mp_priv, name, entries);
+
+	return cli->reply < 0 ? -1 : 0;
+}
+
+void mp_rpc_client_destroy(mp_rpc_client_t *cli)
+{
+	mp_buf_priv_t rep;
+
+	while (mp_get_sc(cli->mp_priv, cli->reply, &rep) == 0)
+		mp_free(cli->mp_priv, &rep);
+	mp_bucket_destroy(cli->mp_priv, cli->reply);
+}
+
+/*
+ * Send a request with len bytes of payload (see mp_rpc_data()). cb is
+ * called from mp_rpc_poll() with the reply, which it must free. Returns
+ * the correlation id of the call, 0 if it can't be sent.
+ */
+uint64_t mp_rpc_call(mp_rpc_client_t *cli, mp_buf_priv_t *req, uint32_t len,
+		     mp_rpc_cb cb, void *ctx)
+{
+	uint64_t id = cli->next_id;
+	struct mp_rpc_call *call = &cli->call[id & (MP_RPC_MAX_PENDING - 1)];
+	struct mp_rpc_hdr *hdr = mp_rpc_hdr(req);
+
+	if (len > MP_RPC_MAX_DATA || call->id)
+		return 0;
+
+	hdr->id = id;
+	hdr->reply = cli->reply;
+	hdr->reply_gen = cli->mp_priv->bucket_gen[cli->reply];
+	hdr->status = 0;
+	req->buf->len = sizeof(struct mp_rpc_hdr) + len;
+
+	if (mp_put(cli->mp_priv, cli->server, req) < 0)
+		return 0;
+
+	call->id = id;
+	call->cb = cb;
+	call->ctx = ctx;
+	if (cli->timeout)
+		call->deadline = mp_rpc_now() + cli->timeout;
+	cli->next_id++;
+	cli->pending++;
+
+	return id;
+}
+
+static void mp_rpc_expire(mp_rpc_client_t *cli)
+{
+	uint64_t now = 0;
+
+	/* calls are sent in id order with the same timeout */
+	for (; cli->oldest < cli->next_id; cli->oldest++) {
+		struct mp_rpc_call *call =
+			&cli->call[cli->oldest & (MP_RPC_MAX_PENDING - 1)];
+
+		if (call->id != cli->oldest)
+			continue;
+		if (cli->timeout == 0)
+			break;
+		if (now == 0)
+			now = mp_rpc_now();
+		if (call->deadline > now)
+			break;
+
+		call->id = 0;
+		cli->pending--;
+		call->cb(call->ctx, cli->oldest, NULL);
+	}
+}
+
+/*
+ * Complete up to max calls which got their reply, and the calls which
+ * timed out. Returns the number of replies processed.
+ */
+int mp_rpc_poll(mp_rpc_client_t *cli, int max)
+{
+	mp_buf_priv_t rep;
+	int count = 0;
+
+	while (count < max &&
+	       mp_get_sc(cli->mp_priv, cli->reply, &rep) == 0) {
+		uint64_t id = mp_rpc_hdr(&rep)->id;
+		struct mp_rpc_call *call =
+			&cli->call[id & (MP_RPC_MAX_PENDING - 1)];
+
+		count++;
+
+		/* late reply of an expired call */
+		if (call->id != id) {
+			mp_free(cli->mp_priv, &rep);
+			continue;
+		}
+		call->id = 0;
+		cli->pending--;
+		call->cb(call->ctx, id, &rep);
+	}
+
+	if (cli->pending)
+		mp_rpc_expire(cli);
+	else
+		cli->oldest = cli->next_id;
+
+	return count;
+}
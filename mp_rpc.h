@@ -0,0 +1,85 @@
+#ifndef _MP_RPC_H_
+#define _MP_RPC_H_
+#include "mempool.h"
+
+/*
+ * Request/response calls over buckets. A server owns a named bucket, each
+ * client owns a reply bucket. Requests and replies travel in pool buffers
+ * starting with a struct mp_rpc_hdr, the server may answer with the
+ * request buffer itself so a call doesn't copy anything.
+ */
+
+#define MP_RPC_MAX_PENDING 1024	/* outstanding calls per client */
+
+struct mp_rpc_hdr {
+	uint64_t id;		/* correlation id */
+	int32_t  reply;		/* reply bucket of the client */
+	uint32_t reply_gen;	/* generation of the reply bucket */
+	int32_t  status;
+};
+
+#define MP_RPC_MAX_DATA (MEM_POOL_BUF_SIZE - sizeof(struct mp_rpc_hdr))
+
+/* completion callback, rep is NULL if the call timed out */
+typedef void (*mp_rpc_cb)(void *ctx, uint64_t id, mp_buf_priv_t *rep);
+
+struct mp_rpc_call {
+	uint64_t  id;		/* 0 if the slot is free */
+	uint64_t  deadline;
+	mp_rpc_cb cb;
+	void     *ctx;
+};
+
+typedef struct mp_rpc_client {
+	mempool_priv_t    *mp_priv;
+	int                server;
+	int                reply;
+	uint64_t           next_id;
+	uint64_t           oldest;	/* oldest call that may be pending */
+	uint64_t           timeout;	/* ns, 0 for none */
+	unsigned int       pending;
+	struct mp_rpc_call call[MP_RPC_MAX_PENDING];
+} mp_rpc_client_t;
+
+typedef struct mp_rpc_server {
+	mempool_priv_t *mp_priv;
+	int             bucket;
+} mp_rpc_server_t;
+
+int mp_rpc_server_init(mp_rpc_server_t *srv, mempool_priv_t *mp_priv,
+		       const char *name, unsigned int entries);
+void mp_rpc_server_destroy(mp_rpc_server_t *srv);
+int mp_rpc_reply(mp_rpc_server_t *srv, mp_buf_priv_t *req, mp_buf_priv_t *rep,
+		 uint32_t len, int status);
+
+int mp_rpc_client_init(mp_rpc_client_t *cli, mempool_priv_t *mp_priv,
+		       const char *server, unsigned int entries,
+		       uint64_t timeout);
+void mp_rpc_client_destroy(mp_rpc_client_t *cli);
+uint64_t mp_rpc_call(mp_rpc_client_t *cli, mp_buf_priv_t *req, uint32_t len,
+		     mp_rpc_cb cb, void *ctx);
+int mp_rpc_poll(mp_rpc_client_t *cli, int max);
+
+static inline struct mp_rpc_hdr *mp_rpc_hdr(mp_buf_priv_t *buf)
+{
+	return (struct mp_rpc_hdr *)buf->data;
+}
+
+/* payload of a request or a reply */
+static inline void *mp_rpc_data(mp_buf_priv_t *buf)
+{
+	return buf->data + sizeof(struct mp_rpc_hdr);
+}
+
+static inline uint32_t mp_rpc_len(mp_buf_priv_t *buf)
+{
+	return buf->buf->len - sizeof(struct mp_rpc_hdr);
+}
+
+/* get the next request, multi consumer safe */
+static inline int mp_rpc_recv(mp_rpc_server_t *srv, mp_buf_priv_t *req)
+{
+	return mp_get(srv->mp_priv, srv->bucket, req);
+}
+
+#endif /* _MP_RPC_H_ */
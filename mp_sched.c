@@ -0,0 +1,191 @@
+#include <sys/epoll.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "mempool.h"
+#include "mp_sched.h"
+
+int mp_sched_init(mp_sched_t *sched, mempool_priv_t *mp_priv,
+		  mp_sched_policy policy, int mc)
+{
+	memset(sched, 0, sizeof(mp_sched_t));
+	sched->mp_priv = mp_priv;
+	sched->policy = policy;
+	sched->mc = mc;
+
+	sched->epfd = epoll_create1(0);
+	if (sched->epfd < 0) {
+		perror("epoll_create1");
+		return -1;
+	}
+
+	return 0;
+}
+
+void mp_sched_destroy(mp_sched_t *sched)
+{
+	if (sched->epfd >= 0)
+		close(sched->epfd);
+	sched->epfd = -1;
+	sched->count = 0;
+}
+
+/*
+ * Add a bucket to the scheduler. With MP_SCHED_PRIO the buckets are served
+ * in the order they are added, with MP_SCHED_WRR a bucket gets weight
+ * buffers per round. notif is the index of the eventfd producers of the
+ * bucket write to, it is added to the combined readiness descriptor.
+ */
+int mp_sched_add(mp_sched_t *sched, int bucket, int weight, int notif)
+{
+	struct mp_sched_bucket *b;
+
+	if (sched->count >= MP_SCHED_MAX_BUCKETS) {
+		fprintf(stderr, "number of scheduled buckets cannot exceed %d\n",
+			MP_SCHED_MAX_BUCKETS);
+		return -1;
+	}
+
+	if (bucket < 0 || bucket >= MEM_POOL_MAX_BUCKETS ||
+	    sched->mp_priv->bucket[bucket] == NULL || weight < 1) {
+		fprintf(stderr, "invalid bucket %d\n", bucket);
+		return -1;
+	}
+
+	if (notif >= 0) {
+		struct epoll_event ev = {
+			.events = EPOLLIN,
+		};
+		int fd;
+
+		if (notif >= MEM_POOL_MAX_FDS ||
+		    (fd = sched->mp_priv->fds[notif]) < 0) {
+			fprintf(stderr, "invalid notification %d\n", notif);
+			return -1;
+		}
+		ev.data.fd = fd;
+
+		/* several buckets may share the same notification */
+		if (epoll_ctl(sched->epfd, EPOLL_CTL_ADD, fd, &ev) < 0 &&
+		    errno != EEXIST) {
+			perror("epoll_ctl");
+			return -1;
+		}
+	}
+
+	b = &sched->bkt[sched->count++];
+	b->bucket = bucket;
+	b->weight = weight;
+	b->credit = weight;
+	b->notif = notif;
+
+	return 0;
+}
+
+static inline int
+__sched_dequeue(mp_sched_t *sched, struct mp_sched_bucket *b,
+		mp_buf_priv_t *bufs, int *buckets, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		int ret;
+
+		if (sched->mc)
+			ret = mp_get(sched->mp_priv, b->bucket, &bufs[i]);
+		else
+			ret = mp_get_sc(sched->mp_priv, b->bucket, &bufs[i]);
+		if (ret < 0)
+			break;
+		if (buckets)
+			buckets[i] = b->bucket;
+	}
+
+	return i;
+}
+
+static int
+sched_get_prio(mp_sched_t *sched, mp_buf_priv_t *bufs, int *buckets, int n)
+{
+	int i, count = 0;
+
+	/* every burst starts again from the highest priority */
+	for (i = 0; i < sched->count && count < n; i++) {
+		count += __sched_dequeue(sched, &sched->bkt[i], bufs + count,
+					 buckets ? buckets + count : NULL,
+					 n - count);
+	}
+
+	return count;
+}
+
+static int
+sched_get_wrr(mp_sched_t *sched, mp_buf_priv_t *bufs, int *buckets, int n)
+{
+	int count = 0, idle = 0;
+
+	/* stop after a whole round without getting anything */
+	while (count < n && idle < sched->count) {
+		struct mp_sched_bucket *b = &sched->bkt[sched->cur];
+		int want = b->credit < n - count ? b->credit : n - count;
+		int got;
+
+		got = __sched_dequeue(sched, b, bufs + count,
+				      buckets ? buckets + count : NULL, want);
+		count += got;
+		b->credit -= got;
+		idle = got ? 0 : idle + 1;
+
+		/* empty buckets forfeit the rest of their turn */
+		if (b->credit == 0 || got < want) {
+			b->credit = b->weight;
+			if (++sched->cur == sched->count)
+				sched->cur = 0;
+		}
+	}
+
+	return count;
+}
+
+/*
+ * Dequeue up to n buffers from the scheduled buckets according to the
+ * policy. The bucket each buffer comes from is stored in buckets if not
+ * NULL. Returns the number of buffers dequeued.
+ */
+int mp_sched_get_burst(mp_sched_t *sched, mp_buf_priv_t *bufs, int *buckets,
+		       int n)
+{
+	if (sched->policy == MP_SCHED_PRIO)
+		return sched_get_prio(sched, bufs, buckets, n);
+
+	return sched_get_wrr(sched, bufs, buckets, n);
+}
+
+/*
+ * Wait until one of the notifications of the scheduled buckets fires and
+ * reset it. timeout is in milliseconds, -1 waits forever. Returns the
+ * number of notifications that fired.
+ */
+int mp_sched_wait(mp_sched_t *sched, int timeout)
+{
+	struct epoll_event ev[MP_SCHED_MAX_BUCKETS];
+	int i, nfds;
+
+	nfds = epoll_wait(sched->epfd, ev, MP_SCHED_MAX_BUCKETS, timeout);
+	if (nfds < 0) {
+		if (errno == EINTR)
+			return 0;
+		perror("epoll_wait");
+		return -1;
+	}
+
+	for (i = 0; i < nfds; i++) {
+		uint64_t value;
+
+		if (read(ev[i].data.fd, &value, sizeof(value)) < 0)
+			perror("notification read");
+	}
+
+	return nfds;
+}
@@ -0,0 +1,48 @@
+#ifndef _MP_SCHED_H_
+#define _MP_SCHED_H_
+#include "mempool.h"
+
+#define MP_SCHED_MAX_BUCKETS 16
+
+typedef enum mp_sched_policy {
+	MP_SCHED_PRIO,	/* strict priority, in the order of mp_sched_add() */
+	MP_SCHED_WRR,	/* weighted round robin */
+} mp_sched_policy;
+
+struct mp_sched_bucket {
+	int bucket;
+	int weight;
+	int credit;
+	int notif;	/* index in mp_priv->fds, -1 if none */
+};
+
+typedef struct mp_sched {
+	mempool_priv_t        *mp_priv;
+	mp_sched_policy        policy;
+	int                    mc;	/* multi consumer dequeue */
+	int                    count;
+	int                    cur;	/* wrr position */
+	int                    epfd;	/* combined readiness */
+	struct mp_sched_bucket bkt[MP_SCHED_MAX_BUCKETS];
+} mp_sched_t;
+
+int mp_sched_init(mp_sched_t *sched, mempool_priv_t *mp_priv,
+		  mp_sched_policy policy, int mc);
+int mp_sched_add(mp_sched_t *sched, int bucket, int weight, int notif);
+int mp_sched_get_burst(mp_sched_t *sched, mp_buf_priv_t *bufs, int *buckets,
+		       int n);
+int mp_sched_wait(mp_sched_t *sched, int timeout);
+void mp_sched_destroy(mp_sched_t *sched);
+
+static inline int mp_sched_fd(mp_sched_t *sched)
+{
+	return sched->epfd;
+}
+
+static inline int
+mp_sched_get(mp_sched_t *sched, mp_buf_priv_t *buf, int *bucket)
+{
+	return mp_sched_get_burst(sched, buf, bucket, 1) == 1 ? 0 : -1;
+}
+
+#endif /* _MP_SCHED_H_ */
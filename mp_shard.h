@@ -0,0 +1,73 @@
+#ifndef _MP_SHARD_H_
+#define _MP_SHARD_H_
+#include "mp_ring.h"
+
+/*
+ * Sharded ring: shards rings of the same size laid out back to back. Each
+ * producer sticks to one shard so producers don't share any cache line as
+ * long as there are not more producers than shards. Consumers drain the
+ * shards round robin.
+ */
+
+static inline mp_ring_t *mp_shard_ring(mp_ring_t *ring, unsigned int shard)
+{
+	size_t stride = sizeof(mp_ring_t) + sizeof(void *) * (ring->mask + 1);
+
+	return (mp_ring_t *)((char *)ring + stride * shard);
+}
+
+/* shard put - multi producer safe, uncontended if the shard is not shared */
+static inline int mp_shard_put(mp_ring_t *ring, unsigned int shard, void *ptr)
+{
+	return mp_ring_put(mp_shard_ring(ring, shard), ptr);
+}
+
+/* shard get - multi consumer safe if mc is set */
+static inline int mp_shard_get(mp_ring_t *ring, unsigned int shards,
+			       uint32_t *cursor, void **ptr, int mc)
+{
+	unsigned int i, shard = *cursor;
+
+	/* the cursor may come from a former bucket with more shards */
+	if (unlikely(shard >= shards))
+		shard = 0;
+	for (i = 0; i < shards; i++) {
+		mp_ring_t *r = mp_shard_ring(ring, shard);
+		int ret = mc ? mp_ring_get(r, ptr) : mp_ring_get_sc(r, ptr);
+
+		if (++shard == shards)
+			shard = 0;
+		if (ret == 0) {
+			*cursor = shard;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+static inline int mp_shard_is_empty(mp_ring_t *ring, unsigned int shards)
+{
+	unsigned int i;
+
+	for (i = 0; i < shards; i++) {
+		mp_ring_t *r = mp_shard_ring(ring, i);
+
+		if (r->cons_head != r->prod_tail)
+			return 0;
+	}
+
+	return 1;
+}
+
+static inline unsigned int mp_shard_count(mp_ring_t *ring, unsigned int shards)
+{
+	unsigned int i, count = 0;
+
+	for (i = 0; i < shards; i++)
+		count += mp_ring_count(mp_shard_ring(ring, i));
+
+	return count;
+}
+
+#endif /* _MP_SHARD_H_ */
@@ -0,0 +1,458 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include "mempool.h"
+
+#define MP_SPILL_SEG_SIZE (64 << 20)
+#define MP_SPILL_END      UINT32_MAX	/* no more records in the segment */
+#define MP_SPILL_BURST    32
+
+struct mp_spill_rec {
+	uint32_t len;
+	uint32_t csum;		/* checksum of the buffer, if any */
+	uint32_t deadline;	/* of the buffer, if any */
+	uint32_t pad;		/* keeps data 8 byte aligned */
+	char     data[];
+};
+
+#define MP_SPILL_REC_SIZE(len) \
+	((sizeof(struct mp_spill_rec) + (len) + 7) & ~7UL)
+
+/*
+ * Segment mapped by this process. The threads of the process share it, it
+ * is only switched to another segment with the spill lock held.
+ */
+struct mp_spill_view {
+	uint32_t gen;
+	uint32_t seg;
+	size_t   size;
+	char    *addr;
+};
+
+struct mp_spill_map {
+	struct mp_spill_view w;
+	struct mp_spill_view r;
+};
+
+static void mp_spill_path(char *path, mempool_priv_t *mp_priv, int bucket,
+			  uint32_t gen, uint32_t seg)
+{
+	struct mp_spill *spill = &mp_priv->mp->bucket_desc[bucket].spill;
+
+	snprintf(path, PATH_MAX, "%s/%s.%d.%u.%u", spill->dir,
+		 mp_priv->mp->name, bucket, gen, seg);
+}
+
+/*
+ * Map segment seg of the queue enabled for the gen-th time, creating it if
+ * asked to. Never called with the spill lock held: the other processes
+ * would spin on it for the duration of the file work.
+ */
+static char *mp_spill_seg(mempool_priv_t *mp_priv, int bucket, uint32_t gen,
+			  uint32_t seg, int create)
+{
+	struct mp_spill *spill = &mp_priv->mp->bucket_desc[bucket].spill;
+	char path[PATH_MAX];
+	char *addr;
+	int fd;
+
+	mp_spill_path(path, mp_priv, bucket, gen, seg);
+	if (create)
+		fd = open(path, O_CREAT|O_TRUNC|O_RDWR, S_IRUSR|S_IWUSR);
+	else
+		fd = open(path, O_RDWR);
+	if (fd < 0) {
+		fprintf(stderr, "can't open spill segment %s\n", path);
+		return NULL;
+	}
+
+	if (create && ftruncate(fd, spill->seg_size) < 0) {
+		close(fd);
+		unlink(path);
+		return NULL;
+	}
+
+	addr = mmap(NULL, spill->seg_size, PROT_WRITE | PROT_READ, MAP_SHARED,
+		    fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		if (create)
+			unlink(path);
+		return NULL;
+	}
+
+	return addr;
+}
+
+static int mp_spill_mapped(struct mp_spill_view *v, uint32_t gen,
+			   uint32_t seg)
+{
+	return v->addr && v->gen == gen && v->seg == seg;
+}
+
+/*
+ * Make v point to addr, called with the spill lock held. The previous
+ * mapping is moved to old, to be unmapped once the lock is released.
+ */
+static void mp_spill_switch(mempool_priv_t *mp_priv, int bucket,
+			    struct mp_spill_view *v, struct mp_spill_view *old,
+			    uint32_t gen, uint32_t seg, char *addr)
+{
+	*old = *v;
+	v->gen = gen;
+	v->seg = seg;
+	v->size = mp_priv->mp->bucket_desc[bucket].spill.seg_size;
+	v->addr = addr;
+}
+
+static void mp_spill_unmap(struct mp_spill_view *v)
+{
+	if (v->addr)
+		munmap(v->addr, v->size);
+	v->addr = NULL;
+}
+
+static void mp_spill_unlink(mempool_priv_t *mp_priv, int bucket, uint32_t gen,
+			    uint32_t seg, uint32_t n)
+{
+	char path[PATH_MAX];
+
+	for (; n; n--, seg++) {
+		mp_spill_path(path, mp_priv, bucket, gen, seg);
+		unlink(path);
+	}
+}
+
+static struct mp_spill_map *mp_spill_get_map(mempool_priv_t *mp_priv,
+					     int bucket)
+{
+	if (mp_priv->spill_map[bucket] == NULL)
+		mp_priv->spill_map[bucket] = calloc(1,
+						    sizeof(struct mp_spill_map));
+
+	return mp_priv->spill_map[bucket];
+}
+
+/*
+ * Let puts overflow to a file queue in dir when the bucket is full instead
+ * of failing. Spilled buffers are copied to segment files of seg_size bytes
+ * (0 for the default size) and returned to bucket 0. They are brought back
+ * in order by mp_get() as soon as the ring has room.
+ */
+int mp_spill_enable(mempool_priv_t *mp_priv, int bucket, const char *dir,
+		    unsigned int seg_size)
+{
+	struct mp_bucket_desc *desc;
+	struct mp_spill *spill;
+	struct mp_spill_map *map;
+	struct mp_spill_view old = { 0 };
+	uint32_t gen;
+	char *data;
+
+	if (bucket <= 0 || bucket >= MEM_POOL_MAX_BUCKETS ||
+	    mp_priv->bucket[bucket] == NULL) {
+		fprintf(stderr, "invalid bucket %d\n", bucket);
+		return -1;
+	}
+	desc = &mp_priv->mp->bucket_desc[bucket];
+	spill = &desc->spill;
+
+	/* spilled buffers would take the numbers of a section out of order */
+	if ((desc->flags & MP_BUCKET_F_SEQ) ||
+	    desc->type == MP_RING_REORDER) {
+		fprintf(stderr, "bucket %d is part of a section\n", bucket);
+		return -1;
+	}
+
+	if (seg_size == 0)
+		seg_size = MP_SPILL_SEG_SIZE;
+	if (seg_size < 2 * MP_SPILL_REC_SIZE(MEM_POOL_BUF_SIZE)) {
+		fprintf(stderr, "spill segment size must be at least %lu\n",
+			2 * MP_SPILL_REC_SIZE(MEM_POOL_BUF_SIZE));
+		return -1;
+	}
+
+	if (strlen(dir) >= MEM_POOL_MAX_NAME) {
+		fprintf(stderr, "spill directory name too long\n");
+		return -1;
+	}
+
+	if ((map = mp_spill_get_map(mp_priv, bucket)) == NULL)
+		return -1;
+
+	spin_lock(&spill->lock);
+
+	if ((desc->flags & MP_BUCKET_F_SPILL) || spill->growing) {
+		spin_unlock(&spill->lock);
+		fprintf(stderr, "bucket %d already spills\n", bucket);
+		return -1;
+	}
+
+	/* the segments mapped before by any process are stale from now on */
+	gen = ++spill->gen;
+	strcpy(spill->dir, dir);
+	spill->seg_size = seg_size;
+	spill->count = 0;
+	spill->wseg = spill->rseg = 0;
+	spill->woff = spill->roff = 0;
+	spill->growing = 1;
+
+	spin_unlock(&spill->lock);
+	data = mp_spill_seg(mp_priv, bucket, gen, 0, 1);
+	spin_lock(&spill->lock);
+
+	spill->growing = 0;
+	if (data) {
+		mp_spill_switch(mp_priv, bucket, &map->w, &old, gen, 0, data);
+		__sync_fetch_and_or(&desc->flags, MP_BUCKET_F_SPILL);
+	}
+
+	spin_unlock(&spill->lock);
+	mp_spill_unmap(&old);
+
+	return data ? 0 : -1;
+}
+
+/* unmap the segments, the last user removes the files */
+void mp_spill_release(mempool_priv_t *mp_priv, int bucket, int last)
+{
+	struct mp_spill *spill = &mp_priv->mp->bucket_desc[bucket].spill;
+	struct mp_spill_map *map = mp_priv->spill_map[bucket];
+
+	if (map) {
+		mp_spill_unmap(&map->w);
+		mp_spill_unmap(&map->r);
+		free(map);
+		mp_priv->spill_map[bucket] = NULL;
+	}
+
+	if (!last)
+		return;
+
+	mp_spill_unlink(mp_priv, bucket, spill->gen, spill->rseg,
+			spill->wseg - spill->rseg + 1);
+}
+
+int mp_spill_disable(mempool_priv_t *mp_priv, int bucket)
+{
+	struct mp_bucket_desc *desc = &mp_priv->mp->bucket_desc[bucket];
+	struct mp_spill *spill = &desc->spill;
+
+	spin_lock(&spill->lock);
+
+	if (spill->count || spill->growing) {
+		spin_unlock(&spill->lock);
+		fprintf(stderr, "spill queue of bucket %d is not empty\n",
+			bucket);
+		return -1;
+	}
+	__sync_fetch_and_and(&desc->flags, ~MP_BUCKET_F_SPILL);
+
+	spin_unlock(&spill->lock);
+
+	/* the positions stay until the next mp_spill_enable() */
+	mp_spill_release(mp_priv, bucket, 1);
+
+	return 0;
+}
+
+/* append the buffer to the spill queue and give it back to bucket 0 */
+int mp_spill_put(mempool_priv_t *mp_priv, int bucket, mp_buf_priv_t *buf)
+{
+	struct mp_bucket_desc *desc = &mp_priv->mp->bucket_desc[bucket];
+	struct mp_spill *spill = &desc->spill;
+	struct mp_spill_map *map = mp_spill_get_map(mp_priv, bucket);
+	struct mp_spill_view old = { 0 };
+	struct mp_spill_rec *rec;
+	uint32_t len = buf->buf->len, gen, seg;
+	size_t size = MP_SPILL_REC_SIZE(len);
+	char *data;
+
+	if (map == NULL || len > MEM_POOL_BUF_SIZE)
+		return -1;
+
+	spin_lock(&spill->lock);
+
+	while (1) {
+		/* disabled since the caller checked the flag */
+		if (!(desc->flags & MP_BUCKET_F_SPILL))
+			goto error;
+
+		/* another process creates the next segment */
+		if (spill->growing) {
+			spin_unlock(&spill->lock);
+			sched_yield();
+			spin_lock(&spill->lock);
+			continue;
+		}
+
+		gen = spill->gen;
+		seg = spill->wseg;
+		if (!mp_spill_mapped(&map->w, gen, seg)) {
+			spin_unlock(&spill->lock);
+			mp_spill_unmap(&old);
+			data = mp_spill_seg(mp_priv, bucket, gen, seg, 0);
+			spin_lock(&spill->lock);
+
+			if (data == NULL) {
+				if (spill->gen == gen && spill->wseg == seg)
+					goto error;
+				continue;
+			}
+			mp_spill_switch(mp_priv, bucket, &map->w, &old, gen,
+					seg, data);
+			continue;
+		}
+
+		if (spill->woff + size <= spill->seg_size)
+			break;
+
+		/* rotate to a new segment, the readers stop at the marker */
+		if (spill->seg_size - spill->woff >= sizeof(*rec)) {
+			rec = (struct mp_spill_rec *)(map->w.addr + spill->woff);
+			rec->len = MP_SPILL_END;
+		}
+		spill->growing = 1;
+		spin_unlock(&spill->lock);
+		mp_spill_unmap(&old);
+		data = mp_spill_seg(mp_priv, bucket, gen, seg + 1, 1);
+		spin_lock(&spill->lock);
+
+		spill->growing = 0;
+		if (data == NULL)
+			goto error;
+		spill->wseg++;
+		spill->woff = 0;
+		mp_spill_switch(mp_priv, bucket, &map->w, &old, gen, seg + 1,
+				data);
+	}
+
+	rec = (struct mp_spill_rec *)(map->w.addr + spill->woff);
+	rec->len = len;
+	rec->csum = buf->buf->csum;
+	rec->deadline = buf->buf->deadline;
+	memcpy(rec->data, buf->data, len);
+	spill->woff += size;
+	spill->count++;
+
+	spin_unlock(&spill->lock);
+	mp_spill_unmap(&old);
+
+	return mp_free(mp_priv, buf);
+
+ error:
+	spin_unlock(&spill->lock);
+	mp_spill_unmap(&old);
+
+	return -1;
+}
+
+/*
+ * Move spilled buffers back into the ring while it has room and bucket 0
+ * has free buffers. Called from mp_get(), a concurrent drain is skipped.
+ * The buffers are allocated before taking the lock, an allocation may map
+ * segments, and the unused ones freed, like consumed segment files are
+ * removed, once it is released.
+ */
+int mp_spill_drain(mempool_priv_t *mp_priv, int bucket)
+{
+	struct mp_bucket_desc *desc = &mp_priv->mp->bucket_desc[bucket];
+	struct mp_spill *spill = &desc->spill;
+	struct mp_spill_map *map = mp_spill_get_map(mp_priv, bucket);
+	struct mp_spill_view old = { 0 };
+	uint32_t gen, seg, done_gen = 0, done_seg = 0, done = 0;
+	mp_buf_priv_t bufs[MP_SPILL_BURST];
+	int moved = 0, n = 0;
+	char *data;
+
+	if (map == NULL || spill->count == 0)
+		return 0;
+
+	while (n < MP_SPILL_BURST && (uint32_t)n < spill->count &&
+	       (uint32_t)n < mp_free_count(mp_priv, bucket) &&
+	       mp_alloc(mp_priv, &bufs[n]) == 0)
+		n++;
+	if (n == 0 || !spin_trylock(&spill->lock))
+		goto end;
+
+	while (spill->count && moved < n && mp_free_count(mp_priv, bucket)) {
+		mp_buf_priv_t *buf = &bufs[moved];
+		struct mp_spill_rec *rec;
+
+		gen = spill->gen;
+		seg = spill->rseg;
+		if (!mp_spill_mapped(&map->r, gen, seg)) {
+			spin_unlock(&spill->lock);
+			mp_spill_unmap(&old);
+			mp_spill_unlink(mp_priv, bucket, done_gen, done_seg,
+					done);
+			done = 0;
+			data = mp_spill_seg(mp_priv, bucket, gen, seg, 0);
+			if (!spin_trylock(&spill->lock)) {
+				if (data)
+					munmap(data, spill->seg_size);
+				goto end;
+			}
+
+			if (data == NULL) {
+				if (spill->gen == gen && spill->rseg == seg)
+					break;
+				continue;
+			}
+			mp_spill_switch(mp_priv, bucket, &map->r, &old, gen,
+					seg, data);
+			continue;
+		}
+
+		rec = (struct mp_spill_rec *)(map->r.addr + spill->roff);
+		if (seg != spill->wseg &&
+		    (spill->seg_size - spill->roff < sizeof(*rec) ||
+		     rec->len == MP_SPILL_END)) {
+			/* segment consumed */
+			if (done == 0) {
+				done_gen = gen;
+				done_seg = seg;
+			}
+			done++;
+			spill->rseg++;
+			spill->roff = 0;
+			continue;
+		}
+
+		memcpy(buf->data, rec->data, rec->len);
+		buf->buf->len = rec->len;
+		buf->buf->csum = rec->csum;
+		buf->buf->deadline = rec->deadline;
+#ifndef NDEBUG
+		buf->buf->owner = bucket;
+#endif
+		if (__mp_ring_put(mp_priv, bucket, (void *)buf->offset, 1) < 0) {
+#ifndef NDEBUG
+			buf->buf->owner = -1;
+#endif
+			break;
+		}
+		spill->roff += MP_SPILL_REC_SIZE(rec->len);
+		spill->count--;
+		moved++;
+	}
+
+	spin_unlock(&spill->lock);
+	mp_spill_unlink(mp_priv, bucket, done_gen, done_seg, done);
+
+ end:
+	mp_spill_unmap(&old);
+	while (n > moved)
+		mp_free(mp_priv, &bufs[--n]);
+	if (moved && (desc->flags & MP_BUCKET_F_WM))
+		mp_wm_update(mp_priv, bucket);
+
+	return moved;
+}
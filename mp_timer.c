@@ -0,0 +1,289 @@
+#include <sys/types.h>
+#include <sys/timerfd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include "mempool.h"
+#include "mp_timer.h"
+
+/* longest delay, in ticks, for the expiries to compare across wraparound */
+#define MP_TIMER_MAX_TICKS ((1U << 31) - 1)
+
+static inline uint64_t mp_timer_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint32_t mp_timer_now(struct mp_timer *timer)
+{
+	return (mp_timer_clock() - timer->start_ns) / timer->tick_ns;
+}
+
+static void
+mp_timer_append(mempool_priv_t *mp_priv, struct mp_timer_slot *list,
+		uint32_t head, uint32_t tail)
+{
+	if (list->head == MP_TIMER_NONE)
+		list->head = head;
+	else
+		mp_buf_addr(mp_priv, list->tail)->timer_next = head;
+	list->tail = tail;
+}
+
+/*
+ * File a buffer in the slot matching its expiry: level n if it expires
+ * within 256^(n+1) ticks. The timer lock must be held.
+ */
+static void mp_timer_insert(mempool_priv_t *mp_priv, struct mp_timer *timer,
+			    uint32_t handle, mp_buf_t *hdr)
+{
+	uint32_t expires = hdr->timer_expires;
+	uint32_t delta = expires - timer->next;
+	int level;
+
+	if (delta < 1U << 8)
+		level = 0;
+	else if (delta < 1U << 16)
+		level = 1;
+	else if (delta < 1U << 24)
+		level = 2;
+	else
+		level = 3;
+
+	hdr->timer_next = MP_TIMER_NONE;
+	mp_timer_append(mp_priv,
+			&timer->wheel[level][(expires >> (8 * level)) & 0xff],
+			handle, handle);
+}
+
+/* spread the buffers of a slot over the lower levels */
+static void mp_timer_cascade(mempool_priv_t *mp_priv, struct mp_timer *timer,
+			     struct mp_timer_slot *slot)
+{
+	uint32_t handle = slot->head;
+
+	slot->head = slot->tail = MP_TIMER_NONE;
+	while (handle != MP_TIMER_NONE) {
+		mp_buf_t *hdr = mp_buf_addr(mp_priv, handle);
+		uint32_t next = hdr->timer_next;
+
+		mp_timer_insert(mp_priv, timer, handle, hdr);
+		handle = next;
+	}
+}
+
+/*
+ * Move the buffers which are due into their buckets. The wheel is advanced
+ * under the lock, taken with the segments mapped, the buckets are filled
+ * after it is released. A buffer whose bucket is full is delivered on the
+ * next tick. Returns the number of buffers delivered, 0 if another process
+ * is running the wheel.
+ */
+int mp_timer_run(mempool_priv_t *mp_priv)
+{
+	struct mp_timer *timer = &mp_priv->mp->timer;
+	struct mp_timer_slot due = { MP_TIMER_NONE, MP_TIMER_NONE };
+	struct mp_timer_slot full = { MP_TIMER_NONE, MP_TIMER_NONE };
+	uint32_t now, handle, next;
+	int moved = 0, postponed = 0;
+
+	if (timer->tick_ns == 0)
+		return 0;
+
+	now = mp_timer_now(timer);
+	if ((int32_t)(now - timer->next) < 0 ||
+	    !mp_trylock_mapped(mp_priv, &timer->lock))
+		return 0;
+
+	/* an empty wheel doesn't need to walk the ticks */
+	if (timer->pending == 0)
+		timer->next = now + 1;
+
+	while ((int32_t)(now - timer->next) >= 0) {
+		uint32_t tick = timer->next;
+		struct mp_timer_slot *slot = &timer->wheel[0][tick & 0xff];
+		int level;
+
+		/* level 0 wrapped, bring the next slot of upper levels down */
+		for (level = 1; (tick & 0xff) == 0 && level < MP_TIMER_LEVELS;
+		     level++) {
+			uint32_t idx = (tick >> (8 * level)) & 0xff;
+
+			mp_timer_cascade(mp_priv, timer,
+					 &timer->wheel[level][idx]);
+			if (idx)
+				break;
+		}
+
+		if (slot->head != MP_TIMER_NONE) {
+			mp_timer_append(mp_priv, &due, slot->head, slot->tail);
+			slot->head = slot->tail = MP_TIMER_NONE;
+		}
+		timer->next = tick + 1;
+	}
+	spin_unlock(&timer->lock);
+
+	for (handle = due.head; handle != MP_TIMER_NONE; handle = next) {
+		mp_buf_priv_t buf = {
+			.offset = handle,
+			.buf = mp_buf_addr(mp_priv, handle),
+		};
+
+		next = buf.buf->timer_next;
+		buf.data = mp_buf_data(mp_priv, handle);
+		if (mp_put(mp_priv, buf.buf->timer_bucket, &buf) == 0) {
+			moved++;
+			continue;
+		}
+		buf.buf->timer_next = MP_TIMER_NONE;
+		mp_timer_append(mp_priv, &full, handle, handle);
+		postponed++;
+	}
+	if (moved)
+		__sync_sub_and_fetch(&timer->pending, moved);
+
+	if (postponed) {
+		mp_lock_mapped(mp_priv, &timer->lock);
+		for (handle = full.head; handle != MP_TIMER_NONE;
+		     handle = next) {
+			mp_buf_t *hdr = mp_buf_addr(mp_priv, handle);
+
+			next = hdr->timer_next;
+			hdr->timer_expires = timer->next;
+			mp_timer_insert(mp_priv, timer, handle, hdr);
+		}
+		timer->postponed += postponed;
+		spin_unlock(&timer->lock);
+	}
+
+	return moved;
+}
+
+/* put buf into bucket in delay_us microseconds */
+int mp_put_after(mempool_priv_t *mp_priv, int bucket, mp_buf_priv_t *buf,
+		 uint64_t delay_us)
+{
+	struct mp_timer *timer = &mp_priv->mp->timer;
+	struct mp_bucket_desc *desc;
+	uint64_t delay_ns;
+	uint32_t expires;
+
+	if (timer->tick_ns == 0) {
+		fprintf(stderr, "timer wheel not enabled\n");
+		return -1;
+	}
+
+	if (bucket <= 0 || bucket >= MEM_POOL_MAX_BUCKETS ||
+	    mp_priv->bucket[bucket] == NULL) {
+		fprintf(stderr, "invalid bucket %d\n", bucket);
+		return -1;
+	}
+	desc = &mp_priv->mp->bucket_desc[bucket];
+
+	/* its consumers run the wheel from now on */
+	if (unlikely(!(desc->flags & MP_BUCKET_F_TIMER)))
+		__sync_fetch_and_or(&desc->flags, MP_BUCKET_F_TIMER);
+
+	delay_ns = delay_us * 1000;
+	if (delay_us > UINT64_MAX / 1000 ||
+	    delay_ns / timer->tick_ns >= MP_TIMER_MAX_TICKS)
+		delay_ns = (uint64_t)(MP_TIMER_MAX_TICKS - 1) * timer->tick_ns;
+	/* rounded up, the buffer is never delivered early */
+	expires = (mp_timer_clock() - timer->start_ns + delay_ns +
+		   timer->tick_ns - 1) / timer->tick_ns;
+
+	mp_lock_mapped(mp_priv, &timer->lock);
+
+	/* the wheel is already past it */
+	if ((int32_t)(expires - timer->next) < 0) {
+		spin_unlock(&timer->lock);
+		return mp_put(mp_priv, bucket, buf);
+	}
+
+	buf->buf->timer_bucket = bucket;
+	buf->buf->timer_expires = expires;
+	mp_timer_insert(mp_priv, timer, buf->offset, buf->buf);
+	__sync_add_and_fetch(&timer->pending, 1);
+
+	spin_unlock(&timer->lock);
+
+	return 0;
+}
+
+/*
+ * tick_us is the resolution of the delays, MP_TIMER_TICK_US if 0. The
+ * wheel can't be enabled again while buffers are pending.
+ */
+int mp_timer_enable(mempool_priv_t *mp_priv, unsigned int tick_us)
+{
+	struct mp_timer *timer = &mp_priv->mp->timer;
+	int level, i;
+
+	if (tick_us == 0)
+		tick_us = MP_TIMER_TICK_US;
+	if (tick_us > 1000000) {
+		fprintf(stderr, "timer tick cannot exceed 1s\n");
+		return -1;
+	}
+
+	spin_lock(&timer->lock);
+
+	if (timer->pending) {
+		spin_unlock(&timer->lock);
+		fprintf(stderr, "timer wheel has pending buffers\n");
+		return -1;
+	}
+
+	for (level = 0; level < MP_TIMER_LEVELS; level++) {
+		for (i = 0; i < MP_TIMER_SLOTS; i++) {
+			timer->wheel[level][i].head = MP_TIMER_NONE;
+			timer->wheel[level][i].tail = MP_TIMER_NONE;
+		}
+	}
+	timer->start_ns = mp_timer_clock();
+	timer->next = 0;
+	timer->postponed = 0;
+	wmb();
+	timer->tick_ns = tick_us * 1000;
+
+	spin_unlock(&timer->lock);
+
+	return 0;
+}
+
+/*
+ * A timerfd expiring every tick, for a ticker process to call
+ * mp_timer_run() when it is readable.
+ */
+int mp_timer_fd(mempool_priv_t *mp_priv)
+{
+	struct mp_timer *timer = &mp_priv->mp->timer;
+	struct itimerspec its;
+	int fd;
+
+	if (timer->tick_ns == 0) {
+		fprintf(stderr, "timer wheel not enabled\n");
+		return -1;
+	}
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0) {
+		perror("timerfd_create");
+		return -1;
+	}
+
+	its.it_interval.tv_sec = timer->tick_ns / 1000000000;
+	its.it_interval.tv_nsec = timer->tick_ns % 1000000000;
+	its.it_value = its.it_interval;
+	if (timerfd_settime(fd, 0, &its, NULL) < 0) {
+		perror("timerfd_settime");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
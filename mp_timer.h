@@ -0,0 +1,27 @@
+#ifndef _MP_TIMER_H_
+#define _MP_TIMER_H_
+#include <sys/types.h>
+#include <stdint.h>
+#include "mempool.h"
+
+/*
+ * Delayed delivery. mp_put_after() files a buffer in the timer wheel of
+ * the pool, in constant time, and it is put into its bucket once the delay
+ * elapsed. Due buffers are moved by mp_timer_run(), called by a ticker
+ * (see mp_timer_fd()) and by mp_get() on the buckets with delayed buffers.
+ * The delay is rounded up to the tick given to mp_timer_enable().
+ */
+
+#define MP_TIMER_TICK_US 1000	/* default tick */
+
+int mp_timer_enable(mempool_priv_t *mp_priv, unsigned int tick_us);
+int mp_put_after(mempool_priv_t *mp_priv, int bucket, mp_buf_priv_t *buf,
+		 uint64_t delay_us);
+int mp_timer_fd(mempool_priv_t *mp_priv);
+
+static inline unsigned int mp_timer_pending(mempool_priv_t *mp_priv)
+{
+	return mp_priv->mp->timer.pending;
+}
+
+#endif /* _MP_TIMER_H_ */
@@ -0,0 +1,179 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "mempool.h"
+#include "mp_trim.h"
+
+/* give the pages of n contiguous payloads back to the kernel */
+static void mp_trim_release(char *data, unsigned int n)
+{
+	/*
+	 * The payloads are a shared tmpfs mapping: MADV_DONTNEED would only
+	 * unmap the pages, MADV_REMOVE punches a hole in the shm file.
+	 */
+	if (madvise(data, (size_t)n * MEM_POOL_BUF_SIZE, MADV_REMOVE) < 0)
+		perror("madvise");
+}
+
+/*
+ * Move up to n cold buffers (MP_TRIM_BATCH if 0) back to bucket 0, returns
+ * their number.
+ */
+int mp_trim_refill(mempool_priv_t *mp_priv, unsigned int n)
+{
+	struct mp_trim *trim = &mp_priv->mp->trim;
+	mp_buf_priv_t buf;
+	uintptr_t handle;
+	unsigned int i, k;
+
+	if (n == 0)
+		n = MP_TRIM_BATCH;
+
+	mp_lock_mapped(mp_priv, &trim->lock);
+	handle = trim->head;
+	for (i = 0; i < n && trim->head != MEM_POOL_BUF_NONE; i++)
+		trim->head = mp_buf_addr(mp_priv, trim->head)->next;
+	trim->count -= i;
+	trim->refilled += i;
+	spin_unlock(&trim->lock);
+
+	for (k = 0; k < i; k++) {
+		buf.offset = handle;
+		buf.buf = mp_buf_addr(mp_priv, handle);
+		buf.data = mp_buf_data(mp_priv, handle);
+		handle = buf.buf->next;
+		buf.buf->next = MEM_POOL_BUF_NONE;
+		mp_free(mp_priv, &buf);
+	}
+
+	return i;
+}
+
+/*
+ * Sample the free buffers, trim the surplus which lasted window runs or
+ * refill up to the reserve. Returns the number of buffers trimmed, 0 if
+ * another process is running it.
+ */
+int mp_trim_run(mempool_priv_t *mp_priv)
+{
+	mempool_t *mp = mp_priv->mp;
+	struct mp_trim *trim = &mp->trim;
+	uintptr_t head = MEM_POOL_BUF_NONE, tail = MEM_POOL_BUF_NONE;
+	unsigned int free, reserve, surplus, n, i, run = 0;
+	char *run_data = NULL;
+	mp_buf_priv_t buf;
+
+	if (!(mp->bucket_desc[0].flags & MP_BUCKET_F_TRIM) ||
+	    !spin_trylock(&trim->lock))
+		return 0;
+
+	/* the buffers reserved by quotas and not allocated stay warm */
+	reserve = trim->reserve;
+	if (mp->bucket_desc[0].flags & MP_BUCKET_F_QUOTA &&
+	    mp->reserve_unused > (int32_t)reserve)
+		reserve = mp->reserve_unused;
+
+	free = mp_count(mp_priv, 0);
+	if (free <= reserve) {
+		trim->runs = 0;
+		spin_unlock(&trim->lock);
+		if (free < reserve && trim->count)
+			mp_trim_refill(mp_priv, reserve - free);
+		return 0;
+	}
+
+	/* a buffer is only trimmed if it was not needed for the whole window */
+	surplus = free - reserve;
+	if (trim->runs == 0 || surplus < trim->surplus)
+		trim->surplus = surplus;
+	if (++trim->runs < trim->window) {
+		spin_unlock(&trim->lock);
+		return 0;
+	}
+	n = trim->surplus;
+	trim->runs = 0;
+	spin_unlock(&trim->lock);
+
+	for (i = 0; i < n; i++) {
+		if (mp_get(mp_priv, 0, &buf) < 0)
+			break;
+
+		/* buffers freed in a row are often adjacent */
+		if (run && buf.data == run_data + run * MEM_POOL_BUF_SIZE) {
+			run++;
+		} else {
+			if (run)
+				mp_trim_release(run_data, run);
+			run_data = buf.data;
+			run = 1;
+		}
+
+		buf.buf->next = head;
+		head = buf.offset;
+		if (tail == MEM_POOL_BUF_NONE)
+			tail = head;
+	}
+	if (run)
+		mp_trim_release(run_data, run);
+	if (i == 0)
+		return 0;
+
+	/* tail was taken out of bucket 0 by this process, it is mapped */
+	spin_lock(&trim->lock);
+	mp_buf_addr(mp_priv, tail)->next = trim->head;
+	trim->head = head;
+	trim->count += i;
+	trim->trimmed += i;
+	spin_unlock(&trim->lock);
+
+	return i;
+}
+
+/*
+ * Keep reserve free buffers warm, a surplus has to last window runs of
+ * mp_trim_run() before it is trimmed. Refused while payloads are
+ * registered with io_uring, the holes would be punched under the pages the
+ * kernel pinned.
+ */
+int mp_trim_enable(mempool_priv_t *mp_priv, unsigned int reserve,
+		   unsigned int window)
+{
+	struct mp_trim *trim = &mp_priv->mp->trim;
+
+	if (window == 0) {
+		fprintf(stderr, "trim window must be at least 1 run\n");
+		return -1;
+	}
+
+	spin_lock(&trim->lock);
+	if (trim->pinned) {
+		spin_unlock(&trim->lock);
+		fprintf(stderr, "pool payloads are registered with io_uring\n");
+		return -1;
+	}
+	if (trim->count == 0)
+		trim->head = MEM_POOL_BUF_NONE;
+	trim->reserve = reserve;
+	trim->window = window;
+	trim->runs = 0;
+	/* set under the lock, mp_uring_register() checks it there */
+	__sync_fetch_and_or(&mp_priv->mp->bucket_desc[0].flags,
+			    MP_BUCKET_F_TRIM);
+	spin_unlock(&trim->lock);
+
+	return 0;
+}
+
+/* bring all the cold buffers back, mp_trim_run() must not be running */
+int mp_trim_disable(mempool_priv_t *mp_priv)
+{
+	struct mp_trim *trim = &mp_priv->mp->trim;
+
+	__sync_fetch_and_and(&mp_priv->mp->bucket_desc[0].flags,
+			     ~MP_BUCKET_F_TRIM);
+	while (trim->count)
+		mp_trim_refill(mp_priv, trim->count);
+
+	return 0;
+}
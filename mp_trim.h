@@ -0,0 +1,33 @@
+#ifndef _MP_TRIM_H_
+#define _MP_TRIM_H_
+#include <sys/types.h>
+#include <stdint.h>
+#include "mempool.h"
+
+/*
+ * Idle memory return. A pool sized for its peak keeps all its pages even
+ * when most buffers sit in bucket 0. Called periodically, mp_trim_run()
+ * samples the free buffers and, once they exceeded the reserve for window
+ * runs in a row, takes the lowest surplus seen out of bucket 0 - the
+ * buffers free for the longest as bucket 0 is FIFO - and gives their
+ * payload pages back to the kernel. These cold buffers come back to
+ * bucket 0 when the free buffers fall under the reserve again or, in
+ * batches, when mp_get() finds it empty. Their payload is zero filled on
+ * first touch. With quotas, the reserve is at least the buffers reserved
+ * by the clients and not allocated.
+ */
+
+#define MP_TRIM_BATCH 64	/* cold buffers refilled by an empty mp_get() */
+
+int mp_trim_enable(mempool_priv_t *mp_priv, unsigned int reserve,
+		   unsigned int window);
+int mp_trim_disable(mempool_priv_t *mp_priv);
+int mp_trim_run(mempool_priv_t *mp_priv);
+
+/* free buffers without payload pages */
+static inline unsigned int mp_trim_cold(mempool_priv_t *mp_priv)
+{
+	return mp_priv->mp->trim.count;
+}
+
+#endif /* _MP_TRIM_H_ */
@@ -0,0 +1,557 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "mempool.h"
+#include "mp_uring.h"
+
+enum {
+	MP_URING_OP_IN,		/* the result is the length of the data */
+	MP_URING_OP_OUT,
+};
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit,
+			  unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned int opcode, void *arg,
+			     unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* free the buffers of the parked requests, -1 if one still can't be */
+static int mp_uring_unpark(mp_uring_t *ur)
+{
+	while (ur->nr_parked) {
+		unsigned int idx = ur->req_parked[ur->nr_parked - 1];
+		mp_buf_priv_t buf;
+
+		buf.offset = ur->reqs[idx].offset;
+		buf.buf = mp_buf_addr(ur->mp_priv, buf.offset);
+		if (buf.buf == NULL)
+			return -1;
+		buf.data = mp_buf_data(ur->mp_priv, buf.offset);
+		if (mp_free(ur->mp_priv, &buf) < 0)
+			return -1;
+		ur->nr_parked--;
+		ur->req_free[ur->nr_free++] = idx;
+	}
+
+	return 0;
+}
+
+/*
+ * Set up a ring of entries submissions and register the segments mapped
+ * so far as fixed buffers.
+ */
+int mp_uring_init(mp_uring_t *ur, mempool_priv_t *mp_priv,
+		  unsigned int entries, unsigned int flags)
+{
+	struct io_uring_params p;
+	unsigned int i;
+	char *sq, *cq;
+
+	memset(ur, 0, sizeof(mp_uring_t));
+	memset(&p, 0, sizeof(p));
+	ur->mp_priv = mp_priv;
+	ur->flags = flags;
+
+	if (flags & MP_URING_SQPOLL) {
+		p.flags |= IORING_SETUP_SQPOLL;
+		p.sq_thread_idle = 1000;
+	}
+
+	ur->fd = io_uring_setup(entries, &p);
+	if (ur->fd < 0) {
+		perror("io_uring_setup");
+		return -1;
+	}
+
+	ur->sq_ring_size = p.sq_off.array +
+		p.sq_entries * sizeof(unsigned int);
+	ur->cq_ring_size = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ur->cq_ring_size > ur->sq_ring_size)
+			ur->sq_ring_size = ur->cq_ring_size;
+		ur->cq_ring_size = ur->sq_ring_size;
+	}
+
+	ur->sq_ring = mmap(NULL, ur->sq_ring_size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, ur->fd,
+			   IORING_OFF_SQ_RING);
+	if (ur->sq_ring == MAP_FAILED)
+		goto error;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ur->cq_ring = ur->sq_ring;
+	} else {
+		ur->cq_ring = mmap(NULL, ur->cq_ring_size,
+				   PROT_READ | PROT_WRITE,
+				   MAP_SHARED | MAP_POPULATE, ur->fd,
+				   IORING_OFF_CQ_RING);
+		if (ur->cq_ring == MAP_FAILED) {
+			ur->cq_ring = NULL;
+			goto error;
+		}
+	}
+
+	ur->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ur->fd, IORING_OFF_SQES);
+	if (ur->sqes == MAP_FAILED) {
+		ur->sqes = NULL;
+		goto error;
+	}
+
+	sq = ur->sq_ring;
+	ur->sq_head = (unsigned int *)(sq + p.sq_off.head);
+	ur->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	ur->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+	ur->sq_flags = (unsigned int *)(sq + p.sq_off.flags);
+	ur->sq_array = (unsigned int *)(sq + p.sq_off.array);
+	ur->sq_entries = p.sq_entries;
+	ur->sq_local = ur->sq_submitted = *ur->sq_tail;
+
+	cq = ur->cq_ring;
+	ur->cq_head = (unsigned int *)(cq + p.cq_off.head);
+	ur->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	ur->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+	ur->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	ur->cq_entries = p.cq_entries;
+
+	/* no more requests than completion entries are in flight */
+	ur->reqs = calloc(ur->cq_entries, sizeof(struct mp_uring_req));
+	ur->req_free = calloc(ur->cq_entries, sizeof(unsigned int));
+	ur->req_parked = calloc(ur->cq_entries, sizeof(unsigned int));
+	if (ur->reqs == NULL || ur->req_free == NULL ||
+	    ur->req_parked == NULL) {
+		perror("calloc");
+		goto destroy;
+	}
+	for (i = 0; i < ur->cq_entries; i++)
+		ur->req_free[i] = ur->cq_entries - 1 - i;
+	ur->nr_free = ur->cq_entries;
+
+	if (mp_uring_register(ur) < 0)
+		goto destroy;
+
+	return 0;
+
+ error:
+	perror("io_uring mmap");
+ destroy:
+	mp_uring_destroy(ur);
+	return -1;
+}
+
+void mp_uring_destroy(mp_uring_t *ur)
+{
+	if (mp_uring_unpark(ur) < 0)
+		fprintf(stderr, "%u buffers can't be freed\n", ur->nr_parked);
+	if (ur->sqes)
+		munmap(ur->sqes, ur->sq_entries * sizeof(struct io_uring_sqe));
+	if (ur->cq_ring && ur->cq_ring != ur->sq_ring)
+		munmap(ur->cq_ring, ur->cq_ring_size);
+	if (ur->sq_ring && ur->sq_ring != MAP_FAILED)
+		munmap(ur->sq_ring, ur->sq_ring_size);
+	if (ur->fd >= 0)
+		close(ur->fd);
+	/* closing the ring unregistered the buffers */
+	if (ur->nr_fixed)
+		__sync_fetch_and_sub(&ur->mp_priv->mp->trim.pinned, 1);
+	ur->nr_fixed = 0;
+	free(ur->reqs);
+	free(ur->req_free);
+	free(ur->req_parked);
+	ur->reqs = NULL;
+	ur->req_free = NULL;
+	ur->req_parked = NULL;
+	ur->nr_parked = 0;
+	ur->sqes = NULL;
+	ur->sq_ring = ur->cq_ring = NULL;
+	ur->fd = -1;
+}
+
+/*
+ * Register the payload region of every segment as fixed buffers of up to
+ * MP_URING_FIXED_BUFS payloads each, the kernel refusing larger ones. To
+ * be called again after the pool grew, buffers of newer segments are
+ * transferred with plain requests until then. Nothing is registered once
+ * mp_trim_enable() was called: trimming punches holes in the payloads and
+ * the kernel would keep using the pages it pinned.
+ */
+int mp_uring_register(mp_uring_t *ur)
+{
+	mempool_priv_t *mp_priv = ur->mp_priv;
+	struct mp_trim *trim = &mp_priv->mp->trim;
+	unsigned int seg, segments = mp_priv->mp->segments, nr = 0;
+	struct iovec *iov = NULL;
+	int ret = -1;
+
+	/* the pin is dropped at the end if nothing is registered */
+	if (ur->nr_fixed == 0) {
+		spin_lock(&trim->lock);
+		if (mp_priv->mp->bucket_desc[0].flags & MP_BUCKET_F_TRIM) {
+			spin_unlock(&trim->lock);
+			return 0;
+		}
+		trim->pinned++;
+		spin_unlock(&trim->lock);
+	}
+
+	for (seg = 0; seg < segments; seg++)
+		nr += (mp_priv->mp->seg_entries[seg] + MP_URING_FIXED_BUFS - 1) /
+			MP_URING_FIXED_BUFS;
+	iov = malloc(nr * sizeof(struct iovec));
+	if (iov == NULL) {
+		perror("malloc");
+		goto end;
+	}
+
+	for (nr = 0, seg = 0; seg < segments; seg++) {
+		unsigned int entries = mp_priv->mp->seg_entries[seg], i;
+		char *payload;
+
+		if (mp_priv->seg[seg] == NULL &&
+		    mp_map_segment(mp_priv, seg) == NULL)
+			goto end;
+		payload = mp_seg_payload(mp_priv->seg[seg], entries);
+		ur->fixed_base[seg] = nr;
+		for (i = 0; i < entries; i += MP_URING_FIXED_BUFS, nr++) {
+			unsigned int n = entries - i;
+
+			if (n > MP_URING_FIXED_BUFS)
+				n = MP_URING_FIXED_BUFS;
+			iov[nr].iov_base = payload + (size_t)i * MEM_POOL_BUF_SIZE;
+			iov[nr].iov_len = (size_t)n * MEM_POOL_BUF_SIZE;
+		}
+	}
+
+	if (ur->nr_fixed && io_uring_register(ur->fd, IORING_UNREGISTER_BUFFERS,
+					      NULL, 0) < 0) {
+		perror("io_uring unregister buffers");
+		goto end;
+	}
+	ur->nr_fixed = 0;
+
+	if (io_uring_register(ur->fd, IORING_REGISTER_BUFFERS, iov, nr) < 0) {
+		perror("io_uring register buffers");
+		goto end;
+	}
+	ur->nr_fixed = segments;
+	ret = 0;
+
+ end:
+	if (ur->nr_fixed == 0)
+		__sync_fetch_and_sub(&trim->pinned, 1);
+	free(iov);
+	return ret;
+}
+
+static struct io_uring_sqe *mp_uring_sqe(mp_uring_t *ur)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int head = *(volatile unsigned int *)ur->sq_head;
+	unsigned int idx = ur->sq_local & *ur->sq_mask;
+
+	/* the completion ring must not overflow either */
+	if (ur->sq_local - head >= ur->sq_entries ||
+	    ur->inflight >= ur->cq_entries)
+		return NULL;
+
+	sqe = &ur->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	ur->sq_array[idx] = idx;
+	ur->sq_local++;
+	ur->inflight++;
+
+	return sqe;
+}
+
+/* fill an entry for what is left of request idx */
+static int mp_uring_prep(mp_uring_t *ur, unsigned int idx)
+{
+	struct mp_uring_req *req = &ur->reqs[idx];
+	unsigned int seg = req->offset >> MEM_POOL_SEG_SHIFT;
+	struct io_uring_sqe *sqe;
+
+	sqe = mp_uring_sqe(ur);
+	if (sqe == NULL)
+		return -1;
+
+	sqe->opcode = req->opcode;
+	sqe->fd = req->fd;
+	sqe->addr = (uintptr_t)mp_buf_data(ur->mp_priv, req->offset) +
+		req->done;
+	sqe->len = req->len - req->done;
+	switch (req->opcode) {
+	case IORING_OP_READ_FIXED:
+	case IORING_OP_WRITE_FIXED:
+		sqe->buf_index = ur->fixed_base[seg] +
+			(req->offset & MEM_POOL_SEG_MASK) / MP_URING_FIXED_BUFS;
+		/* fall through */
+	case IORING_OP_READ:
+	case IORING_OP_WRITE:
+		sqe->off = req->off == -1 ? -1 : req->off + req->done;
+		break;
+	default:
+		sqe->msg_flags = req->flags;
+	}
+	sqe->user_data = idx;
+
+	return 0;
+}
+
+static int mp_uring_submit_req(mp_uring_t *ur, struct mp_uring_req *tmpl)
+{
+	unsigned int idx;
+
+	if (ur->nr_free == 0)
+		return -1;
+	idx = ur->req_free[ur->nr_free - 1];
+	ur->reqs[idx] = *tmpl;
+	if (mp_uring_prep(ur, idx) < 0)
+		return -1;
+	ur->nr_free--;
+
+	return 0;
+}
+
+static int mp_uring_rw(mp_uring_t *ur, int op, int fd, off_t off,
+		       mp_buf_priv_t *buf, uint32_t len, int bucket)
+{
+	unsigned int seg = buf->offset >> MEM_POOL_SEG_SHIFT;
+	int fixed = seg < ur->nr_fixed;
+	struct mp_uring_req req = {
+		.offset = buf->offset,
+		.bucket = bucket,
+		.op = op,
+		.fd = fd,
+		.len = len,
+		.off = off,
+	};
+
+	if (len > MEM_POOL_BUF_SIZE || bucket < 0 ||
+	    bucket >= MEM_POOL_MAX_BUCKETS)
+		return -1;
+
+	if (op == MP_URING_OP_IN)
+		req.opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+	else
+		req.opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+
+	return mp_uring_submit_req(ur, &req);
+}
+
+/*
+ * Read up to len bytes at off into buf, off being -1 for pipes, sockets
+ * or the current file position. buf->buf->len is set to the number of
+ * bytes read on completion and buf is put into bucket, it is freed if
+ * nothing could be read. Returns -1 if the submission ring is full.
+ */
+int mp_uring_read(mp_uring_t *ur, int fd, off_t off, mp_buf_priv_t *buf,
+		  uint32_t len, int bucket)
+{
+	return mp_uring_rw(ur, MP_URING_OP_IN, fd, off, buf, len, bucket);
+}
+
+/* write buf at off and put it into bucket on completion */
+int mp_uring_write(mp_uring_t *ur, int fd, off_t off, mp_buf_priv_t *buf,
+		   int bucket)
+{
+	return mp_uring_rw(ur, MP_URING_OP_OUT, fd, off, buf, buf->buf->len,
+			   bucket);
+}
+
+static int mp_uring_sr(mp_uring_t *ur, int op, int sock, mp_buf_priv_t *buf,
+		       uint32_t len, int flags, int bucket)
+{
+	struct mp_uring_req req = {
+		.offset = buf->offset,
+		.bucket = bucket,
+		.opcode = op == MP_URING_OP_IN ? IORING_OP_RECV : IORING_OP_SEND,
+		.op = op,
+		.fd = sock,
+		.flags = flags,
+		.len = len,
+	};
+
+	if (bucket < 0 || bucket >= MEM_POOL_MAX_BUCKETS)
+		return -1;
+
+	return mp_uring_submit_req(ur, &req);
+}
+
+/* like mp_uring_read() with recv(2) flags, for a whole buffer */
+int mp_uring_recv(mp_uring_t *ur, int sock, mp_buf_priv_t *buf, int flags,
+		  int bucket)
+{
+	return mp_uring_sr(ur, MP_URING_OP_IN, sock, buf, MEM_POOL_BUF_SIZE,
+			   flags, bucket);
+}
+
+int mp_uring_send(mp_uring_t *ur, int sock, mp_buf_priv_t *buf, int flags,
+		  int bucket)
+{
+	return mp_uring_sr(ur, MP_URING_OP_OUT, sock, buf, buf->buf->len,
+			   flags, bucket);
+}
+
+/*
+ * Make the prepared requests visible to the kernel. With MP_URING_SQPOLL
+ * the poll thread is only woken up if it went to sleep. Returns the number
+ * of requests submitted, -1 on error.
+ */
+int mp_uring_submit(mp_uring_t *ur)
+{
+	unsigned int count = ur->sq_local - ur->sq_submitted;
+	int ret;
+
+	if (count == 0)
+		return 0;
+
+	/* the entries must be written before the tail */
+	wmb();
+	*(volatile unsigned int *)ur->sq_tail = ur->sq_local;
+	ur->sq_submitted = ur->sq_local;
+
+	if (ur->flags & MP_URING_SQPOLL) {
+		mb();
+		if (!(*(volatile unsigned int *)ur->sq_flags &
+		      IORING_SQ_NEED_WAKEUP))
+			return count;
+		ur->enters++;
+		ret = io_uring_enter(ur->fd, 0, 0, IORING_ENTER_SQ_WAKEUP);
+	} else {
+		ur->enters++;
+		ret = io_uring_enter(ur->fd, count, 0, 0);
+	}
+	if (ret < 0) {
+		perror("io_uring_enter");
+		return -1;
+	}
+
+	return count;
+}
+
+/*
+ * Reap up to max completions without any syscall and put their buffers
+ * into the buckets given at submission. A short write is resubmitted for
+ * the remainder with the next mp_uring_submit(), the buffer is freed if
+ * there is no room for it. A completion whose buffer segment can't be
+ * mapped is left in the ring, and a buffer bucket 0 refuses is kept, for
+ * the next call. Returns the number of completions.
+ */
+int mp_uring_complete(mp_uring_t *ur, int max)
+{
+	mempool_priv_t *mp_priv = ur->mp_priv;
+	unsigned int head = *ur->cq_head;
+	unsigned int tail = *(volatile unsigned int *)ur->cq_tail;
+	int count = 0;
+
+	mp_uring_unpark(ur);
+
+	/* read the entries after the tail */
+	rmb();
+
+	while (head != tail && count < max) {
+		struct io_uring_cqe *cqe = &ur->cqes[head & *ur->cq_mask];
+		unsigned int idx = cqe->user_data;
+		struct mp_uring_req *req = &ur->reqs[idx];
+		int res = cqe->res, bucket = req->bucket;
+		mp_buf_priv_t buf;
+
+		buf.offset = req->offset;
+		buf.buf = mp_buf_addr(mp_priv, buf.offset);
+		if (unlikely(buf.buf == NULL))
+			break;
+		buf.data = mp_buf_data(mp_priv, buf.offset);
+
+		head++;
+		count++;
+		/* the entry can be reused for a resubmission */
+		ur->inflight--;
+
+		if (req->op == MP_URING_OP_IN) {
+			if (res > 0) {
+				buf.buf->len = res;
+			} else {
+				/* there is nothing to hand over */
+				ur->errors++;
+				bucket = 0;
+			}
+		} else if (res < 0 || (res == 0 && req->done < req->len)) {
+			/* the buffer is not where the caller expects it */
+			ur->errors++;
+			bucket = 0;
+		} else if ((req->done += res) < req->len) {
+			ur->shorts++;
+			if (mp_uring_prep(ur, idx) == 0)
+				continue;
+			ur->errors++;
+			bucket = 0;
+		}
+		if (mp_put(mp_priv, bucket, &buf) < 0) {
+			ur->drops++;
+			if (bucket == 0 || mp_free(mp_priv, &buf) < 0) {
+				ur->req_parked[ur->nr_parked++] = idx;
+				continue;
+			}
+		}
+		ur->req_free[ur->nr_free++] = idx;
+	}
+
+	/* the entries must be consumed before they are given back */
+	wmb();
+	*(volatile unsigned int *)ur->cq_head = head;
+
+	return count;
+}
+
+/*
+ * Wait for at least min completions, submitting the prepared requests. No
+ * more than the requests in flight are waited for, a parked one doesn't
+ * complete.
+ */
+int mp_uring_wait(mp_uring_t *ur, unsigned int min)
+{
+	unsigned int count = ur->sq_local - ur->sq_submitted;
+	unsigned int flags = IORING_ENTER_GETEVENTS;
+
+	if (min > ur->inflight)
+		min = ur->inflight;
+
+	if (count) {
+		wmb();
+		*(volatile unsigned int *)ur->sq_tail = ur->sq_local;
+		ur->sq_submitted = ur->sq_local;
+		/* the poll thread submits, the kernel only has to be woken up */
+		if (ur->flags & MP_URING_SQPOLL) {
+			count = 0;
+			flags |= IORING_ENTER_SQ_WAKEUP;
+		}
+	}
+
+	ur->enters++;
+	if (io_uring_enter(ur->fd, count, min, flags) < 0 && errno != EINTR) {
+		perror("io_uring_enter");
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,105 @@
+#ifndef _MP_URING_H_
+#define _MP_URING_H_
+#include <sys/types.h>
+#include <linux/io_uring.h>
+#include "mempool.h"
+
+/*
+ * io_uring I/O on pool buffers. The payload region of every segment is
+ * registered as fixed buffers, so reads and writes of a buffer don't pin
+ * pages at each request, unless the pool trims its idle buffers. When a
+ * request completes its buffer is put into the bucket given at submission:
+ * received data goes straight to the consumers, written buffers usually
+ * back to bucket 0. With MP_URING_SQPOLL a kernel thread picks the
+ * submissions up and completions are reaped from the shared ring, so the
+ * steady state doesn't make any syscall.
+ *
+ * A short write or send is resubmitted for the remainder by
+ * mp_uring_complete(), the buffer is only handed over once all of it went
+ * out. A failed write or send frees the buffer, as a failed read does, and
+ * a buffer bucket 0 doesn't take back is kept with its request until a
+ * later mp_uring_complete() frees it.
+ */
+
+#define MP_URING_SQPOLL 0x1	/* kernel side submission polling */
+
+/* a fixed buffer can't exceed 1 GB, larger segments are registered in parts */
+#define MP_URING_FIXED_BUFS ((1U << 30) / MEM_POOL_BUF_SIZE)
+
+/* request in flight, the completion refers to it by index */
+struct mp_uring_req {
+	uint32_t offset;	/* buffer handle */
+	uint16_t bucket;	/* completion bucket */
+	uint8_t  opcode;
+	uint8_t  op;		/* in or out, see mp_uring.c */
+	int      fd;
+	int      flags;		/* send/recv flags */
+	uint32_t len;
+	uint32_t done;		/* bytes already written */
+	off_t    off;		/* -1 for the current position */
+};
+
+typedef struct mp_uring {
+	mempool_priv_t      *mp_priv;
+	int                  fd;
+	unsigned int         flags;
+	unsigned int         nr_fixed;	/* registered segments */
+	/* fixed buffer index of the first part of each segment */
+	unsigned int         fixed_base[MEM_POOL_MAX_SEGS];
+	struct mp_uring_req *reqs;	/* cq_entries requests */
+	unsigned int        *req_free;	/* stack of free request indexes */
+	unsigned int         nr_free;
+	/* completed requests whose buffer bucket 0 didn't take back */
+	unsigned int        *req_parked;
+	unsigned int         nr_parked;
+	/* submission ring */
+	unsigned int        *sq_head;
+	unsigned int        *sq_tail;
+	unsigned int        *sq_mask;
+	unsigned int        *sq_flags;
+	unsigned int        *sq_array;
+	unsigned int         sq_entries;
+	unsigned int         sq_local;	/* tail of the prepared entries */
+	unsigned int         sq_submitted;
+	unsigned int         inflight;	/* prepared and not completed */
+	struct io_uring_sqe *sqes;
+	/* completion ring */
+	unsigned int        *cq_head;
+	unsigned int        *cq_tail;
+	unsigned int        *cq_mask;
+	unsigned int         cq_entries;
+	struct io_uring_cqe *cqes;
+	void                *sq_ring;
+	void                *cq_ring;
+	size_t               sq_ring_size;
+	size_t               cq_ring_size;
+	/* statistics */
+	uint64_t             enters;	/* io_uring_enter() calls */
+	uint64_t             errors;	/* failed or empty requests */
+	uint64_t             shorts;	/* short writes resubmitted */
+	uint64_t             drops;	/* completion bucket full */
+} mp_uring_t;
+
+int mp_uring_init(mp_uring_t *ur, mempool_priv_t *mp_priv,
+		  unsigned int entries, unsigned int flags);
+int mp_uring_register(mp_uring_t *ur);
+void mp_uring_destroy(mp_uring_t *ur);
+int mp_uring_read(mp_uring_t *ur, int fd, off_t off, mp_buf_priv_t *buf,
+		  uint32_t len, int bucket);
+int mp_uring_write(mp_uring_t *ur, int fd, off_t off, mp_buf_priv_t *buf,
+		   int bucket);
+int mp_uring_recv(mp_uring_t *ur, int sock, mp_buf_priv_t *buf, int flags,
+		  int bucket);
+int mp_uring_send(mp_uring_t *ur, int sock, mp_buf_priv_t *buf, int flags,
+		  int bucket);
+int mp_uring_submit(mp_uring_t *ur);
+int mp_uring_complete(mp_uring_t *ur, int max);
+int mp_uring_wait(mp_uring_t *ur, unsigned int min);
+
+/* requests prepared, in flight or with a buffer left to free */
+static inline unsigned int mp_uring_pending(mp_uring_t *ur)
+{
+	return ur->inflight + ur->nr_parked;
+}
+
+#endif /* _MP_URING_H_ */
@@ -0,0 +1,274 @@
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "mempool.h"
+#include "mp_workers.h"
+
+static inline void mp_futex_wait(volatile uint32_t *addr, uint32_t val)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static inline void mp_futex_wake(volatile uint32_t *addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static inline uint64_t mp_workers_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/*
+ * Park the calling worker until the monitor needs it again, returns -1
+ * without parking if only min workers are active or the pool stops.
+ */
+static int mp_worker_park(mp_workers_t *pool, struct mp_worker *w)
+{
+	spin_lock(&pool->lock);
+	if (pool->active <= pool->min || pool->stop) {
+		spin_unlock(&pool->lock);
+		return -1;
+	}
+	pool->active--;
+	w->parked = 1;
+	spin_unlock(&pool->lock);
+
+	while (w->parked)
+		mp_futex_wait(&w->parked, 1);
+
+	return 0;
+}
+
+static void *mp_worker_run(void *arg)
+{
+	struct mp_worker *w = arg;
+	struct timespec nap = {
+		.tv_nsec = MP_WORKERS_NAP_US * 1000,
+	};
+	mp_workers_t *pool = w->pool;
+	mp_buf_priv_t buf;
+	unsigned int idle = 0;
+	uint64_t idle_since = 0;
+
+	while (!pool->stop) {
+		if (mp_get(pool->mp_priv, pool->bucket, &buf) == 0) {
+			pool->cb(pool->ctx, &buf);
+			w->done++;
+			idle = 0;
+			continue;
+		}
+		if (idle < MP_WORKERS_IDLE_SPINS) {
+			idle++;
+			cpu_spinwait();
+			continue;
+		}
+		if (idle == MP_WORKERS_IDLE_SPINS) {
+			idle_since = mp_workers_now_us();
+			idle++;
+		}
+		/* parking slower than waking, a short lull keeps the workers */
+		if (mp_workers_now_us() - idle_since >= MP_WORKERS_PARK_US &&
+		    mp_worker_park(pool, w) == 0) {
+			idle = 0;
+			continue;
+		}
+		nanosleep(&nap, NULL);
+	}
+
+	return NULL;
+}
+
+/*
+ * Wake a parked worker or start a new one. A slot is claimed under the
+ * pool lock, the thread is created once it is released.
+ */
+static int mp_workers_grow(mp_workers_t *pool)
+{
+	struct mp_worker *w = NULL;
+	unsigned int i;
+	int start = 0;
+
+	spin_lock(&pool->lock);
+	for (i = 0; i < pool->max; i++) {
+		w = &pool->worker[i];
+
+		if (w->started && w->parked) {
+			w->parked = 0;
+			mp_futex_wake(&w->parked);
+			break;
+		}
+		if (!w->started) {
+			w->started = 1;
+			start = 1;
+			break;
+		}
+	}
+	if (i == pool->max) {
+		spin_unlock(&pool->lock);
+		return -1;
+	}
+	pool->active++;
+	pool->wakeups++;
+	spin_unlock(&pool->lock);
+
+	if (!start)
+		return 0;
+
+	w->pool = pool;
+	if (pthread_create(&w->thread, NULL, mp_worker_run, w)) {
+		perror("pthread_create");
+		spin_lock(&pool->lock);
+		w->started = 0;
+		pool->active--;
+		pool->wakeups--;
+		spin_unlock(&pool->lock);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Every interval, compare the backlog of the bucket with what the active
+ * workers dequeued during the last one and add the workers missing to
+ * drain it within the next. Workers scale down by parking themselves.
+ */
+static void *mp_workers_monitor(void *arg)
+{
+	struct timespec interval = {
+		.tv_nsec = MP_WORKERS_INTERVAL_US * 1000,
+	};
+	mp_workers_t *pool = arg;
+	unsigned int last_backlog = 0;
+	uint64_t last = 0;
+
+	while (!pool->stop) {
+		unsigned int i, active, backlog, need;
+		uint64_t done = 0, rate;
+
+		nanosleep(&interval, NULL);
+
+		for (i = 0; i < pool->max; i++)
+			done += pool->worker[i].done;
+		rate = done - last;
+		last = done;
+
+		backlog = mp_count(pool->mp_priv, pool->bucket);
+		if (backlog == 0) {
+			last_backlog = 0;
+			continue;
+		}
+
+		/*
+		 * A backlog seen once is a jitter of the producers the active
+		 * workers absorb, it has to last two samples to add any.
+		 */
+		active = pool->active;
+		if (active == 0)
+			need = 1;
+		else if (last_backlog == 0)
+			need = active;
+		else if (rate == 0)
+			need = active + 1;
+		else
+			need = (backlog * active + rate - 1) / rate;
+		last_backlog = backlog;
+
+		if (need > pool->max)
+			need = pool->max;
+		while (pool->active < need && mp_workers_grow(pool) == 0)
+			;
+	}
+
+	return NULL;
+}
+
+/*
+ * Start a pool of min to max threads consuming bucket, each buffer being
+ * passed to cb. The bucket is dequeued with mp_get(), other consumers may
+ * share it.
+ */
+int mp_workers_start(mp_workers_t *pool, mempool_priv_t *mp_priv, int bucket,
+		     unsigned int min, unsigned int max, mp_workers_cb cb,
+		     void *ctx)
+{
+	unsigned int i;
+
+	if (bucket < 0 || bucket >= MEM_POOL_MAX_BUCKETS ||
+	    mp_priv->bucket[bucket] == NULL) {
+		fprintf(stderr, "invalid bucket %d\n", bucket);
+		return -1;
+	}
+	if (max == 0 || max > MP_WORKERS_MAX || min > max) {
+		fprintf(stderr, "number of workers must be within 1 and %d\n",
+			MP_WORKERS_MAX);
+		return -1;
+	}
+
+	memset(pool, 0, sizeof(mp_workers_t));
+	pool->mp_priv = mp_priv;
+	pool->bucket = bucket;
+	pool->min = min;
+	pool->max = max;
+	pool->cb = cb;
+	pool->ctx = ctx;
+
+	for (i = 0; i < min; i++) {
+		if (mp_workers_grow(pool) < 0)
+			goto error;
+	}
+	pool->wakeups = 0;
+
+	if (pthread_create(&pool->monitor, NULL, mp_workers_monitor, pool)) {
+		perror("pthread_create");
+		goto error;
+	}
+
+	return 0;
+
+ error:
+	pool->stop = 1;
+	for (i = 0; i < max; i++) {
+		if (pool->worker[i].started)
+			pthread_join(pool->worker[i].thread, NULL);
+	}
+
+	return -1;
+}
+
+/* stop the monitor and the workers, the bucket is left as is */
+void mp_workers_stop(mp_workers_t *pool)
+{
+	unsigned int i;
+
+	pool->stop = 1;
+	pthread_join(pool->monitor, NULL);
+
+	/* no worker parks once stop is seen under the lock */
+	spin_lock(&pool->lock);
+	for (i = 0; i < pool->max; i++) {
+		struct mp_worker *w = &pool->worker[i];
+
+		if (w->started && w->parked) {
+			w->parked = 0;
+			mp_futex_wake(&w->parked);
+		}
+	}
+	spin_unlock(&pool->lock);
+
+	for (i = 0; i < pool->max; i++) {
+		if (pool->worker[i].started)
+			pthread_join(pool->worker[i].thread, NULL);
+	}
+	pool->active = 0;
+}
@@ -0,0 +1,64 @@
+#ifndef _MP_WORKERS_H_
+#define _MP_WORKERS_H_
+#include <pthread.h>
+#include <stdint.h>
+#include "mempool.h"
+
+/*
+ * Pool of consumer threads scaled to the load of a bucket. Between min and
+ * max workers get buffers from the bucket and pass them to a callback. A
+ * worker finding the bucket empty spins a little, then naps between polls
+ * and parks, sleeping on a futex, once idle for a few sampling intervals
+ * as long as more than min workers are left. A monitor thread samples the
+ * backlog of the bucket and the rate the workers dequeue at, and wakes or
+ * starts as many workers as needed to drain the backlog within a sampling
+ * interval once it lasted two samples.
+ */
+
+#define MP_WORKERS_MAX 64
+/* empty polls before a worker naps */
+#define MP_WORKERS_IDLE_SPINS 256
+/* sleep of an idle worker between polls */
+#define MP_WORKERS_NAP_US 50
+/* monitor sampling interval */
+#define MP_WORKERS_INTERVAL_US 500
+/* idle time before a worker parks */
+#define MP_WORKERS_PARK_US (4 * MP_WORKERS_INTERVAL_US)
+
+/* the callback owns buf, it has to put or free it */
+typedef void (*mp_workers_cb)(void *ctx, mp_buf_priv_t *buf);
+
+struct mp_worker {
+	pthread_t         thread;
+	struct mp_workers *pool;
+	int               started;
+	volatile uint32_t parked;	/* futex word */
+	volatile uint64_t done;		/* buffers processed */
+} __cache_aligned;
+
+typedef struct mp_workers {
+	mempool_priv_t    *mp_priv;
+	int                bucket;
+	unsigned int       min;
+	unsigned int       max;
+	mp_workers_cb      cb;
+	void              *ctx;
+	spinlock_t         lock;	/* parking and waking */
+	volatile int       stop;
+	volatile uint32_t  active;	/* workers started and not parked */
+	uint32_t           wakeups;	/* workers woken or started */
+	pthread_t          monitor;
+	struct mp_worker   worker[MP_WORKERS_MAX];
+} mp_workers_t;
+
+int mp_workers_start(mp_workers_t *pool, mempool_priv_t *mp_priv, int bucket,
+		     unsigned int min, unsigned int max, mp_workers_cb cb,
+		     void *ctx);
+void mp_workers_stop(mp_workers_t *pool);
+
+static inline unsigned int mp_workers_active(mp_workers_t *pool)
+{
+	return pool->active;
+}
+
+#endif /* _MP_WORKERS_H_ */
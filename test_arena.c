@@ -0,0 +1,363 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "atomic.h"
+#include "mempool.h"
+#include "mp_arena.h"
+
+/*
+ * Building messages of n items, each with a name string, then reading and
+ * freeing them. With -m arena the message is built in pool buffers with
+ * relative pointers and handed over through a bucket as is, with -m malloc
+ * each object is a malloc() of its own and the message is read in place,
+ * with -m copy the malloc() built message is serialized into a buffer and
+ * parsed back, as handing it to another process requires. With -m scratch,
+ * messages are built in a single arena reset after each one. Invalid
+ * alignments are checked to be refused first.
+ */
+
+mempool_priv_t mp;
+
+typedef enum bucket {
+	BKT_MEMPOOL,
+	BKT_MSG,
+	BKT_COUNT,
+} bucket;
+
+#define MP_ENTRIES 1024
+#define MP_NAME "mp_arena_shm"
+
+enum mode {
+	MODE_ARENA,
+	MODE_MALLOC,
+	MODE_COPY,
+	MODE_SCRATCH,
+};
+
+static const char *mode_names[] = { "arena", "malloc", "copy", "scratch" };
+static int mode = MODE_ARENA;
+static int count = 200000;
+static int items = 64;
+
+/* in pool buffers */
+struct item {
+	uint64_t  id;
+	double    price;
+	mp_rptr_t name;
+};
+
+struct order {
+	uint32_t  n;
+	mp_rptr_t items;
+};
+
+/* on the heap */
+struct heap_item {
+	uint64_t id;
+	double   price;
+	char    *name;
+};
+
+struct heap_order {
+	uint32_t          n;
+	struct heap_item *items;
+};
+
+static char names[16][32];
+
+static void usage(char *name)
+{
+	fprintf(stderr, "Usage: %s [-m] [-n] [-i]\n"
+		"\n"
+		"m     - arena|malloc|copy|scratch (default arena)\n"
+		"n     - number of messages (default 200000)\n"
+		"i     - items per message (default 64, 128 at most "
+		"for copy)\n",
+		name);
+	exit(EXIT_FAILURE);
+}
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Alignments which are not a power of 2 up to a buffer are refused, a
+ * buffer aligned one starts the next buffer.
+ */
+static int check_align(void)
+{
+	struct mp_arena arena;
+	mp_rptr_t rptr;
+	int ret = -1;
+
+	if (mp_arena_init(&mp, &arena) < 0)
+		return -1;
+	if (mp_arena_alloc(&arena, 1, 1, NULL) == NULL ||
+	    mp_arena_alloc(&arena, 1, 0, NULL) ||
+	    mp_arena_alloc(&arena, 1, 3, NULL) ||
+	    mp_arena_alloc(&arena, 1, MEM_POOL_BUF_SIZE * 2, NULL)) {
+		fprintf(stderr, "invalid alignment accepted\n");
+		goto end;
+	}
+	if (mp_arena_alloc(&arena, 1, MEM_POOL_BUF_SIZE, &rptr) == NULL ||
+	    rptr != (mp_rptr_t)arena.cur.offset << MP_RPTR_SHIFT ||
+	    arena.head.buf->len != 1 || arena.cur.buf->len != 1) {
+		fprintf(stderr, "buffer aligned allocation misplaced\n");
+		goto end;
+	}
+	ret = 0;
+ end:
+	mp_free_chain(&mp, &arena.head);
+	return ret;
+}
+
+/* the root object is first, at the start of the head buffer */
+static int build_arena(struct mp_arena *arena, uint32_t seq)
+{
+	struct order *o;
+	struct item *it;
+	int i;
+
+	o = mp_arena_alloc(arena, sizeof(*o), 8, NULL);
+	o->n = items;
+	it = mp_arena_alloc(arena, items * sizeof(*it), 8, &o->items);
+	if (it == NULL)
+		return -1;
+	for (i = 0; i < items; i++) {
+		it[i].id = seq + i;
+		it[i].price = i * 0.5;
+		if (mp_arena_strdup(arena, names[(seq + i) & 15],
+				    &it[i].name) == NULL)
+			return -1;
+	}
+
+	return 0;
+}
+
+static uint64_t read_arena(mp_buf_priv_t *msg)
+{
+	struct order *o = (struct order *)msg->data;
+	struct item *it = mp_rptr_addr(&mp, o->items);
+	uint64_t sum = 0;
+	uint32_t i;
+
+	for (i = 0; i < o->n; i++) {
+		char *name = mp_rptr_addr(&mp, it[i].name);
+
+		sum += it[i].id + (uint64_t)it[i].price + name[0];
+	}
+
+	return sum;
+}
+
+static struct heap_order *build_heap(uint32_t seq)
+{
+	struct heap_order *o = malloc(sizeof(*o));
+	int i;
+
+	o->n = items;
+	o->items = malloc(items * sizeof(*o->items));
+	for (i = 0; i < items; i++) {
+		o->items[i].id = seq + i;
+		o->items[i].price = i * 0.5;
+		o->items[i].name = strdup(names[(seq + i) & 15]);
+	}
+
+	return o;
+}
+
+static uint64_t read_heap(struct heap_order *o)
+{
+	uint64_t sum = 0;
+	uint32_t i;
+
+	for (i = 0; i < o->n; i++)
+		sum += o->items[i].id + (uint64_t)o->items[i].price +
+			o->items[i].name[0];
+
+	return sum;
+}
+
+static void free_heap(struct heap_order *o)
+{
+	uint32_t i;
+
+	for (i = 0; i < o->n; i++)
+		free(o->items[i].name);
+	free(o->items);
+	free(o);
+}
+
+/* n, then id, price, name length and name of each item */
+static void serialize(struct heap_order *o, mp_buf_priv_t *msg)
+{
+	char *p = msg->data;
+	uint32_t i;
+
+	memcpy(p, &o->n, sizeof(o->n));
+	p += sizeof(o->n);
+	for (i = 0; i < o->n; i++) {
+		struct heap_item *it = &o->items[i];
+		uint16_t len = strlen(it->name);
+
+		memcpy(p, &it->id, sizeof(it->id));
+		p += sizeof(it->id);
+		memcpy(p, &it->price, sizeof(it->price));
+		p += sizeof(it->price);
+		memcpy(p, &len, sizeof(len));
+		p += sizeof(len);
+		memcpy(p, it->name, len);
+		p += len;
+	}
+	msg->buf->len = p - msg->data;
+}
+
+static struct heap_order *parse(mp_buf_priv_t *msg)
+{
+	struct heap_order *o = malloc(sizeof(*o));
+	char *p = msg->data;
+	uint32_t i;
+
+	memcpy(&o->n, p, sizeof(o->n));
+	p += sizeof(o->n);
+	o->items = malloc(o->n * sizeof(*o->items));
+	for (i = 0; i < o->n; i++) {
+		struct heap_item *it = &o->items[i];
+		uint16_t len;
+
+		memcpy(&it->id, p, sizeof(it->id));
+		p += sizeof(it->id);
+		memcpy(&it->price, p, sizeof(it->price));
+		p += sizeof(it->price);
+		memcpy(&len, p, sizeof(len));
+		p += sizeof(len);
+		it->name = malloc(len + 1);
+		memcpy(it->name, p, len);
+		it->name[len] = '\0';
+		p += len;
+	}
+
+	return o;
+}
+
+int main(int argc, char *argv[])
+{
+	uint64_t start, elapsed, sum = 0;
+	struct mp_arena arena;
+	mp_buf_priv_t msg;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "m:n:i:")) != -1) {
+		switch (opt) {
+		case 'm':
+			for (mode = 0; mode <= MODE_SCRATCH; mode++) {
+				if (strcmp(optarg, mode_names[mode]) == 0)
+					break;
+			}
+			if (mode > MODE_SCRATCH)
+				usage(argv[0]);
+			break;
+
+		case 'n':
+			count = atoi(optarg);
+			if (count <= 0)
+				usage(argv[0]);
+			break;
+
+		case 'i':
+			items = atoi(optarg);
+			if (items <= 0)
+				usage(argv[0]);
+			break;
+
+		default:
+			usage(argv[0]);
+		}
+	}
+	/* serialized, the items have to fit in a buffer */
+	if (mode == MODE_COPY && items > 128)
+		usage(argv[0]);
+
+	for (i = 0; i < 16; i++)
+		snprintf(names[i], sizeof(names[i]), "instrument-%0*d",
+			 i + 1, i);
+
+	if (mp_create(&mp, MP_NAME, MP_ENTRIES, BKT_COUNT) < 0) {
+		fprintf(stderr, "can't create shared memory\n");
+		return EXIT_FAILURE;
+	}
+	if (check_align() < 0 ||
+	    (mode == MODE_SCRATCH && mp_arena_init(&mp, &arena) < 0)) {
+		mp_unregister(&mp);
+		return EXIT_FAILURE;
+	}
+
+	start = now_ns();
+	for (i = 0; i < count; i++) {
+		struct heap_order *o;
+
+		switch (mode) {
+		case MODE_ARENA:
+			if (mp_arena_init(&mp, &arena) < 0 ||
+			    build_arena(&arena, i) < 0 ||
+			    mp_put(&mp, BKT_MSG, &arena.head) < 0 ||
+			    mp_get(&mp, BKT_MSG, &msg) < 0) {
+				fprintf(stderr, "out of buffers\n");
+				return EXIT_FAILURE;
+			}
+			sum += read_arena(&msg);
+			mp_free_chain(&mp, &msg);
+			break;
+
+		case MODE_SCRATCH:
+			if (build_arena(&arena, i) < 0) {
+				fprintf(stderr, "out of buffers\n");
+				return EXIT_FAILURE;
+			}
+			sum += read_arena(&arena.head);
+			mp_arena_reset(&arena);
+			break;
+
+		case MODE_MALLOC:
+			o = build_heap(i);
+			sum += read_heap(o);
+			free_heap(o);
+			break;
+
+		case MODE_COPY:
+			o = build_heap(i);
+			if (mp_alloc(&mp, &msg) < 0) {
+				fprintf(stderr, "out of buffers\n");
+				return EXIT_FAILURE;
+			}
+			serialize(o, &msg);
+			free_heap(o);
+			mp_put(&mp, BKT_MSG, &msg);
+			mp_get(&mp, BKT_MSG, &msg);
+			o = parse(&msg);
+			mp_free(&mp, &msg);
+			sum += read_heap(o);
+			free_heap(o);
+			break;
+		}
+	}
+	elapsed = now_ns() - start;
+
+	printf("%s: %d messages of %d items, %.0f ns/message, "
+	       "%.1f ns/object (%lu)\n", mode_names[mode], count, items,
+	       (double)elapsed / count,
+	       (double)elapsed / count / (items * 2 + 2), sum);
+	if (mode == MODE_SCRATCH)
+		mp_free_chain(&mp, &arena.head);
+	mp_unregister(&mp);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "atomic.h"
+#include "mempool.h"
+
+/*
+ * Dynamic buckets shared by two processes. Each round the main process
+ * creates a named bucket, alternating its size so the slot is reused with
+ * another ring, and fills it. A second process looks the bucket up by
+ * name, drains it, checking the buffers, and destroys it. The main process
+ * then checks the name is gone and every buffer is back in bucket 0.
+ */
+
+mempool_priv_t mp;
+
+typedef enum bucket {
+	BKT_MEMPOOL,
+	BKT_DATA,
+	BKT_COUNT,
+} bucket;
+
+#define MP_ENTRIES 1024
+#define MP_NAME "mp_bucket_shm"
+
+static int rounds = 1000;
+static int count = 32;
+
+static void usage(char *name)
+{
+	fprintf(stderr, "Usage: %s [-n] [-b]\n"
+		"\n"
+		"n     - number of rounds (default 1000)\n"
+		"b     - buffers per round, below 64 (default 32)\n",
+		name);
+	exit(EXIT_FAILURE);
+}
+
+static void bucket_name(char *name, uint32_t round)
+{
+	snprintf(name, MEM_POOL_MAX_BUCKET_NAME, "round.%u", round);
+}
+
+/* look the bucket of a round up, drain it and destroy it */
+static int drain(uint32_t round)
+{
+	char name[MEM_POOL_MAX_BUCKET_NAME];
+	mp_buf_priv_t buf;
+	int b, i;
+
+	bucket_name(name, round);
+	if ((b = mp_bucket_lookup(&mp, name)) < 0) {
+		fprintf(stderr, "bucket %s not found\n", name);
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		if (mp_get(&mp, b, &buf) < 0) {
+			fprintf(stderr, "bucket %s: %d buffers missing\n", name,
+				count - i);
+			return -1;
+		}
+		if (buf.buf->len != sizeof(uint64_t) ||
+		    *(uint64_t *)buf.data != ((uint64_t)round << 32 | i)) {
+			fprintf(stderr, "bucket %s: bad buffer %d\n", name, i);
+			return -1;
+		}
+		mp_free(&mp, &buf);
+	}
+	if (mp_get(&mp, b, &buf) == 0) {
+		fprintf(stderr, "bucket %s: extra buffer\n", name);
+		return -1;
+	}
+	if (mp_bucket_destroy(&mp, b) < 0) {
+		fprintf(stderr, "can't destroy bucket %s\n", name);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* second process: drain the bucket of each round read from in */
+static void peer(int in, int out)
+{
+	uint32_t round;
+
+	if (mp_register(&mp, MP_NAME) < 0)
+		exit(EXIT_FAILURE);
+
+	while (read(in, &round, sizeof(round)) == sizeof(round)) {
+		char ret = drain(round) < 0;
+
+		if (write(out, &ret, 1) != 1)
+			break;
+	}
+
+	mp_unregister(&mp);
+	exit(EXIT_SUCCESS);
+}
+
+int main(int argc, char *argv[])
+{
+	char name[MEM_POOL_MAX_BUCKET_NAME];
+	int to_peer[2], from_peer[2];
+	unsigned int free_bufs;
+	mp_buf_priv_t buf;
+	int opt, status, ret = EXIT_FAILURE;
+	uint32_t round;
+	pid_t pid;
+
+	while ((opt = getopt(argc, argv, "n:b:")) != -1) {
+		switch (opt) {
+		case 'n':
+			rounds = atoi(optarg);
+			if (rounds <= 0)
+				usage(argv[0]);
+			break;
+
+		case 'b':
+			count = atoi(optarg);
+			if (count <= 0 || count >= 64)
+				usage(argv[0]);
+			break;
+
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (mp_create(&mp, MP_NAME, MP_ENTRIES, BKT_COUNT) < 0) {
+		fprintf(stderr, "can't create shared memory\n");
+		return EXIT_FAILURE;
+	}
+	free_bufs = mp_count(&mp, BKT_MEMPOOL);
+
+	if (pipe(to_peer) < 0 || pipe(from_peer) < 0) {
+		perror("pipe");
+		goto end;
+	}
+	if ((pid = fork()) == 0) {
+		close(to_peer[1]);
+		close(from_peer[0]);
+		peer(to_peer[0], from_peer[1]);
+	}
+	close(to_peer[0]);
+	close(from_peer[1]);
+
+	for (round = 0; round < rounds; round++) {
+		/* the slot is reused by a ring of another size every round */
+		unsigned int entries = round & 1 ? 64 : 128;
+		char peer_ret;
+		int b, i;
+
+		bucket_name(name, round);
+		if ((b = mp_bucket_create(&mp, name, entries)) < 0)
+			break;
+		if (mp_bucket_lookup(&mp, name) != b) {
+			fprintf(stderr, "bucket %s: lookup mismatch\n", name);
+			break;
+		}
+		for (i = 0; i < count; i++) {
+			if (mp_alloc(&mp, &buf) < 0) {
+				fprintf(stderr, "out of buffers\n");
+				goto stop;
+			}
+			buf.buf->len = sizeof(uint64_t);
+			*(uint64_t *)buf.data = (uint64_t)round << 32 | i;
+			if (mp_put(&mp, b, &buf) < 0) {
+				fprintf(stderr, "bucket %s is full\n", name);
+				goto stop;
+			}
+		}
+
+		if (write(to_peer[1], &round, sizeof(round)) != sizeof(round) ||
+		    read(from_peer[0], &peer_ret, 1) != 1 || peer_ret)
+			break;
+
+		if (mp_bucket_lookup(&mp, name) >= 0) {
+			fprintf(stderr, "bucket %s still found\n", name);
+			break;
+		}
+		if (mp_count(&mp, BKT_MEMPOOL) != free_bufs) {
+			fprintf(stderr, "%u buffers leaked\n",
+				free_bufs - mp_count(&mp, BKT_MEMPOOL));
+			break;
+		}
+	}
+ stop:
+	close(to_peer[1]);
+	waitpid(pid, &status, 0);
+
+	printf("%u of %d rounds, %d buffers each\n", round, rounds, count);
+	if (round == rounds && WIFEXITED(status) && WEXITSTATUS(status) == 0)
+		ret = EXIT_SUCCESS;
+ end:
+	mp_unregister(&mp);
+
+	return ret;
+}
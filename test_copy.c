@@ -0,0 +1,283 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/perf_event.h>
+#include "mempool.h"
+#include "mp_copy.h"
+
+/*
+ * Copy from a staging area into buffers with regular or non-temporal
+ * stores. The producer phase copies a batch then walks the producer's own
+ * working set, the time the walk takes (and the cache misses if perf counters
+ * are available) shows how much of it the copies evicted. The end to end
+ * phase hands the buffers to a consumer process which reads them.
+ */
+
+mempool_priv_t mp;
+
+typedef enum bucket {
+	BKT_MEMPOOL,
+	BKT_DATA,
+	BKT_COUNT,
+} bucket;
+
+#define MP_ENTRIES 1024
+#define MP_NAME "mp_copy_shm"
+#define BATCH 32
+#define STAGING_SIZE (16 << 20)
+
+static int count = 100000;
+static int size = MEM_POOL_BUF_SIZE;
+static size_t ws_size = 1024 << 10;
+static char *staging;
+static size_t staging_off;
+static size_t *ws;
+static volatile size_t ws_end;
+
+static void usage(char *name)
+{
+	fprintf(stderr, "Usage: %s [-m nt|cached] [-i sse2|avx2|avx512] [-n] "
+		"[-s] [-w]\n"
+		"\n"
+		"m     - store mode (default nt)\n"
+		"i     - copy kernel (default: widest supported)\n"
+		"n     - number of buffers (default 100000)\n"
+		"s     - payload size (default %d)\n"
+		"w     - producer working set in KB (default 1024)\n",
+		name, MEM_POOL_BUF_SIZE);
+	exit(EXIT_FAILURE);
+}
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* -1 if the hardware counters can't be used, e.g. in a VM */
+static int cache_misses_open(void)
+{
+	struct perf_event_attr attr = {
+		.size = sizeof(attr),
+		.type = PERF_TYPE_HARDWARE,
+		.config = PERF_COUNT_HW_CACHE_MISSES,
+		.exclude_kernel = 1,
+		.disabled = 1,
+	};
+
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static const char *next_src(void)
+{
+	const char *src = staging + staging_off;
+
+	staging_off += size;
+	if (staging_off + size > STAGING_SIZE)
+		staging_off = 0;
+
+	return src;
+}
+
+static void produce(mp_buf_priv_t *buf)
+{
+	while (mp_alloc(&mp, buf) < 0)
+		sched_yield();
+	mp_buf_write(buf, 0, next_src(), size);
+}
+
+/*
+ * The working set is a cycle through its cache lines in random order, a
+ * walk is a chain of dependent loads, so the prefetcher can't hide misses.
+ */
+static void ws_init(void)
+{
+	size_t lines = ws_size / 64, stride = 64 / sizeof(size_t), i;
+	size_t *order = malloc(lines * sizeof(size_t));
+
+	for (i = 0; i < lines; i++)
+		order[i] = i;
+	for (i = lines - 1; i > 0; i--) {
+		size_t j = rand() % (i + 1), tmp = order[i];
+
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+	for (i = 0; i < lines; i++)
+		ws[order[i] * stride] = order[(i + 1) % lines] * stride;
+	free(order);
+}
+
+static void ws_walk(void)
+{
+	size_t i, pos = 0;
+
+	for (i = 0; i < ws_size / 64; i++)
+		pos = ws[pos];
+	ws_end = pos;
+}
+
+static void producer_phase(void)
+{
+	mp_buf_priv_t bufs[BATCH];
+	uint64_t copy_ns = 0, walk_ns = 0, t, misses = 0;
+	int i, j, fd = cache_misses_open();
+
+	ws_walk();
+	for (i = 0; i < count; i += BATCH) {
+		t = now_ns();
+		for (j = 0; j < BATCH; j++)
+			produce(&bufs[j]);
+		copy_ns += now_ns() - t;
+
+		if (fd >= 0)
+			ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+		t = now_ns();
+		ws_walk();
+		walk_ns += now_ns() - t;
+		if (fd >= 0)
+			ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+
+		for (j = 0; j < BATCH; j++)
+			mp_free(&mp, &bufs[j]);
+	}
+
+	printf("producer: %.0f MB/s, working set %.2f ns/line",
+	       (double)count * size / 1048576.0 * 1e9 / copy_ns,
+	       (double)walk_ns / (count / BATCH) / (ws_size / 64));
+	if (fd >= 0 && read(fd, &misses, sizeof(misses)) == sizeof(misses))
+		printf(", %.1f misses/walk\n", (double)misses / (count / BATCH));
+	else
+		printf(", cache misses n/a\n");
+	if (fd >= 0)
+		close(fd);
+}
+
+static void consumer(void)
+{
+	mp_buf_priv_t buf;
+	uint64_t sum = 0;
+	int n = 0;
+
+	while (n < count) {
+		unsigned int i;
+
+		if (mp_get_sc(&mp, BKT_DATA, &buf) < 0) {
+			sched_yield();
+			continue;
+		}
+		for (i = 0; i < buf.buf->len; i += sizeof(uint64_t))
+			sum += *(uint64_t *)(buf.data + i);
+		mp_free(&mp, &buf);
+		n++;
+	}
+	exit(sum == 0);
+}
+
+static void end_to_end_phase(void)
+{
+	mp_buf_priv_t buf;
+	uint64_t start, elapsed;
+	pid_t pid;
+	int i;
+
+	fflush(stdout);
+	if ((pid = fork()) == 0)
+		consumer();
+
+	start = now_ns();
+	for (i = 0; i < count; i++) {
+		produce(&buf);
+		while (mp_put(&mp, BKT_DATA, &buf) < 0)
+			sched_yield();
+	}
+	waitpid(pid, NULL, 0);
+	elapsed = now_ns() - start;
+
+	printf("end to end: %.0f MB/s %.0f buffers/s\n",
+	       (double)count * size / 1048576.0 * 1e9 / elapsed,
+	       count * 1e9 / elapsed);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, isa = MP_COPY_ISA_AUTO, nt = 1;
+
+	while ((opt = getopt(argc, argv, "m:i:n:s:w:")) != -1) {
+		switch (opt) {
+		case 'm':
+			if (strcmp(optarg, "nt") == 0)
+				nt = 1;
+			else if (strcmp(optarg, "cached") == 0)
+				nt = 0;
+			else
+				usage(argv[0]);
+			break;
+
+		case 'i':
+			if (strcmp(optarg, "sse2") == 0)
+				isa = MP_COPY_ISA_SSE2;
+			else if (strcmp(optarg, "avx2") == 0)
+				isa = MP_COPY_ISA_AVX2;
+			else if (strcmp(optarg, "avx512") == 0)
+				isa = MP_COPY_ISA_AVX512;
+			else
+				usage(argv[0]);
+			break;
+
+		case 'n':
+			count = atoi(optarg);
+			if (count <= 0)
+				usage(argv[0]);
+			break;
+
+		case 's':
+			size = atoi(optarg);
+			if (size <= 0 || size > MEM_POOL_BUF_SIZE)
+				usage(argv[0]);
+			break;
+
+		case 'w':
+			ws_size = (size_t)atoi(optarg) << 10;
+			if (ws_size == 0)
+				usage(argv[0]);
+			break;
+
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (mp_copy_set_isa(isa) < 0)
+		return EXIT_FAILURE;
+	mp_copy_set_threshold(nt ? MP_COPY_THRESHOLD : (size_t)-1);
+
+	staging = malloc(STAGING_SIZE);
+	ws = malloc(ws_size);
+	if (staging == NULL || ws == NULL)
+		return EXIT_FAILURE;
+	memset(staging, 'm', STAGING_SIZE);
+	ws_init();
+
+	if (mp_create(&mp, MP_NAME, MP_ENTRIES, BKT_COUNT) < 0) {
+		fprintf(stderr, "can't create shared memory\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("%s %s: size=%d working set=%zuKB\n", nt ? "nt" : "cached",
+	       mp_copy_isa_name(), size, ws_size >> 10);
+	producer_phase();
+	end_to_end_phase();
+
+	mp_unregister(&mp);
+
+	return 0;
+}
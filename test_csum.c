@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include "mempool.h"
+#include "mp_csum.h"
+
+/*
+ * Cost of the payload checksums: CRC32C throughput of each implementation
+ * the CPU supports, then the put/get round trip of a buffer without
+ * checksum, verified in mp_get() and verified by bursts.
+ */
+
+mempool_priv_t mp;
+
+typedef enum bucket {
+	BKT_MEMPOOL,
+	BKT_DATA,
+	BKT_COUNT,
+} bucket;
+
+#define MP_ENTRIES 1024
+#define MP_NAME "mp_csum_shm"
+#define BURST 32
+
+static int count = 200000;
+static int size = MEM_POOL_BUF_SIZE;
+
+static void usage(char *name)
+{
+	fprintf(stderr, "Usage: %s [-n] [-s]\n"
+		"\n"
+		"n     - number of buffers (default 200000)\n"
+		"s     - payload size (default %d)\n",
+		name, MEM_POOL_BUF_SIZE);
+	exit(EXIT_FAILURE);
+}
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bench_crc(void)
+{
+	mp_buf_priv_t buf;
+	uint64_t start, elapsed;
+	uint32_t crc = 0, ref = 0;
+	int isa, i;
+
+	if (mp_alloc(&mp, &buf) < 0)
+		return;
+	for (i = 0; i < size; i++)
+		buf.data[i] = rand();
+
+	for (isa = MP_CSUM_ISA_GENERIC; isa <= MP_CSUM_ISA_PCLMUL; isa++) {
+		if (mp_csum_set_isa(isa) < 0)
+			continue;
+		start = now_ns();
+		for (i = 0; i < count; i++)
+			crc = mp_crc32c(0, buf.data, size);
+		elapsed = now_ns() - start;
+
+		if (isa == MP_CSUM_ISA_GENERIC)
+			ref = crc;
+		printf("crc32c %-14s %8.1f ns/buffer %6.2f GB/s%s\n",
+		       mp_csum_isa_name(), (double)elapsed / count,
+		       (double)count * size / elapsed,
+		       crc == ref ? "" : " MISMATCH");
+	}
+	mp_free(&mp, &buf);
+	mp_csum_set_isa(MP_CSUM_ISA_AUTO);
+}
+
+/* mode: -1 no checksum, otherwise the flags given to mp_csum_enable() */
+static void bench_put_get(const char *name, int mode)
+{
+	mp_buf_priv_t bufs[BURST];
+	uint64_t start, elapsed;
+	int i, j, n;
+
+	if (mode >= 0 && mp_csum_enable(&mp, BKT_DATA, mode) < 0)
+		return;
+
+	start = now_ns();
+	for (i = 0; i < count; i += BURST) {
+		for (j = 0; j < BURST; j++) {
+			if (mp_alloc(&mp, &bufs[j]) < 0)
+				break;
+			bufs[j].buf->len = size;
+			mp_put(&mp, BKT_DATA, &bufs[j]);
+		}
+		for (n = 0; n < BURST; n++) {
+			if (mp_get(&mp, BKT_DATA, &bufs[n]) < 0)
+				break;
+		}
+		if (mode == 0)
+			n = mp_csum_verify_burst(&mp, BKT_DATA, bufs, n);
+		for (j = 0; j < n; j++)
+			mp_free(&mp, &bufs[j]);
+	}
+	elapsed = now_ns() - start;
+
+	printf("put/get %-12s %8.1f ns/buffer, %u errors\n", name,
+	       (double)elapsed / count, mp_csum_errors(&mp, BKT_DATA));
+	mp_csum_disable(&mp, BKT_DATA);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+		switch (opt) {
+		case 'n':
+			count = atoi(optarg);
+			if (count <= 0)
+				usage(argv[0]);
+			break;
+
+		case 's':
+			size = atoi(optarg);
+			if (size <= 0 || size > MEM_POOL_BUF_SIZE)
+				usage(argv[0]);
+			break;
+
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (mp_create(&mp, MP_NAME, MP_ENTRIES, BKT_COUNT) < 0) {
+		fprintf(stderr, "can't create shared memory\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("payload size %d\n", size);
+	bench_crc();
+	bench_put_get("off", -1);
+	bench_put_get("on get", MP_CSUM_VERIFY);
+	bench_put_get("by bursts", 0);
+
+	mp_unregister(&mp);
+
+	return 0;
+}
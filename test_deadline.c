@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "atomic.h"
+#include "mempool.h"
+#include "mp_deadline.h"
+
+/*
+ * Overload: a producer puts buffers faster than the consumer processes
+ * them, until it runs out of free buffers. With -m fifo, the consumer
+ * works through the whole backlog, with -m shed the bucket has a deadline
+ * and the stale buffers are shed on get. Reports how many buffers were
+ * processed, how many of them within the deadline, and their latency.
+ */
+
+mempool_priv_t mp;
+volatile int stop;
+
+typedef enum bucket {
+	BKT_MEMPOOL,
+	BKT_DATA,
+	BKT_COUNT,
+} bucket;
+
+#define MP_ENTRIES 4096
+#define MP_NAME "mp_deadline_shm"
+
+struct msg {
+	uint64_t sent;		/* ns */
+};
+
+static int shed = 1;
+static int rate = 200000;
+static int duration_ms = 2000;
+static int ttl_us = 5000;
+static int work = 2000;
+
+/* put to processing latency of each buffer processed, ns */
+static uint32_t *latency;
+static uint32_t processed;
+
+static void usage(char *name)
+{
+	fprintf(stderr, "Usage: %s [-m] [-r] [-t] [-d] [-u]\n"
+		"\n"
+		"m     - fifo|shed (default shed)\n"
+		"r     - offered rate, in buffers/s (default 200000)\n"
+		"t     - duration, in ms (default 2000)\n"
+		"d     - deadline, in us (default 5000)\n"
+		"u     - work per buffer, in loop iterations (default 2000)\n",
+		name);
+	exit(EXIT_FAILURE);
+}
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *consume(void *arg)
+{
+	uint32_t max = *(uint32_t *)arg;
+	mp_buf_priv_t buf;
+
+	while (!stop) {
+		volatile uint64_t sink = 0;
+		int i;
+
+		if (mp_get_sc(&mp, BKT_DATA, &buf) < 0) {
+			sched_yield();
+			continue;
+		}
+		for (i = 0; i < work; i++)
+			sink += i;
+		if (processed < max)
+			latency[processed++] =
+				now_ns() - ((struct msg *)buf.data)->sent;
+		mp_free(&mp, &buf);
+	}
+
+	return NULL;
+}
+
+/* offer count buffers at rate */
+static void produce(uint32_t count)
+{
+	uint64_t start = now_ns();
+	uint32_t i;
+	mp_buf_priv_t buf;
+
+	for (i = 0; i < count; i++) {
+		uint64_t due = start + (uint64_t)i * 1000000000 / rate;
+		uint64_t now = now_ns();
+
+		/* behind schedule, the buffers go out back to back */
+		if (due > now) {
+			struct timespec ts = {
+				.tv_sec = (due - now) / 1000000000,
+				.tv_nsec = (due - now) % 1000000000,
+			};
+
+			nanosleep(&ts, NULL);
+		}
+		while (mp_alloc(&mp, &buf) < 0)
+			sched_yield();
+		((struct msg *)buf.data)->sent = now_ns();
+		while (mp_put_sp(&mp, BKT_DATA, &buf) < 0)
+			sched_yield();
+	}
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[])
+{
+	uint32_t count, timely = 0, i;
+	mp_buf_priv_t buf;
+	pthread_t thread;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "m:r:t:d:u:")) != -1) {
+		switch (opt) {
+		case 'm':
+			if (strcmp(optarg, "fifo") == 0)
+				shed = 0;
+			else if (strcmp(optarg, "shed") != 0)
+				usage(argv[0]);
+			break;
+
+		case 'r':
+			rate = atoi(optarg);
+			if (rate <= 0)
+				usage(argv[0]);
+			break;
+
+		case 't':
+			duration_ms = atoi(optarg);
+			if (duration_ms <= 0)
+				usage(argv[0]);
+			break;
+
+		case 'd':
+			ttl_us = atoi(optarg);
+			if (ttl_us <= 0)
+				usage(argv[0]);
+			break;
+
+		case 'u':
+			work = atoi(optarg);
+			if (work < 0)
+				usage(argv[0]);
+			break;
+
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	count = (uint64_t)rate * duration_ms / 1000;
+	if (count == 0)
+		usage(argv[0]);
+	latency = calloc(count, sizeof(*latency));
+	if (latency == NULL) {
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+
+	if (mp_create(&mp, MP_NAME, MP_ENTRIES, BKT_COUNT) < 0) {
+		fprintf(stderr, "can't create shared memory\n");
+		return EXIT_FAILURE;
+	}
+	if (shed && mp_deadline_enable(&mp, BKT_DATA, ttl_us) < 0) {
+		mp_unregister(&mp);
+		return EXIT_FAILURE;
+	}
+	if (pthread_create(&thread, NULL, consume, &count)) {
+		perror("pthread_create");
+		return EXIT_FAILURE;
+	}
+
+	produce(count);
+	stop = 1;
+	pthread_join(thread, NULL);
+
+	for (i = 0; i < processed; i++) {
+		if (latency[i] <= ttl_us * 1000U)
+			timely++;
+	}
+	qsort(latency, processed, sizeof(*latency), cmp_u32);
+	printf("%s: %u offered, %u shed, %u processed, %u within %d us\n",
+	       shed ? "shed" : "fifo", count,
+	       mp_deadline_expired(&mp, BKT_DATA), processed, timely, ttl_us);
+	if (processed)
+		printf("latency (us) p50=%.1f p99=%.1f\n",
+		       latency[processed / 2] / 1e3,
+		       latency[processed * 99 / 100] / 1e3);
+
+	while (mp_get(&mp, BKT_DATA, &buf) == 0)
+		mp_free(&mp, &buf);
+	mp_unregister(&mp);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,282 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "mempool.h"
+#include "mp_dio.h"
+
+/*
+ * Write then read back a file through pool buffers, either with O_DIRECT
+ * straight from/to the payloads or with buffered pwrite()/pread() and a
+ * copy through an aligned staging buffer. Beforehand, buffers taken one
+ * by one, fresh or which were in a chain, must be freed alone by
+ * mp_free_chain().
+ */
+
+mempool_priv_t mp;
+
+typedef enum mode {
+	MODE_DIRECT,
+	MODE_BUFFERED,
+} mode;
+
+#define MP_ENTRIES 1024
+#define MP_NAME "mp_dio_shm"
+#define CHUNK (MP_DIO_BATCH * MEM_POOL_BUF_SIZE)
+
+static const char *path = "mp_dio.dat";
+static size_t file_size = 256UL << 20;
+static char *staging;
+
+static void usage(char *name)
+{
+	fprintf(stderr, "Usage: %s [-m direct|buffered] [-f] [-s]\n"
+		"\n"
+		"m     - I/O mode (default direct)\n"
+		"f     - file (default mp_dio.dat)\n"
+		"s     - file size in MB (default 256)\n",
+		name);
+	exit(EXIT_FAILURE);
+}
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* a chain of full buffers stamped with their index in the file */
+static int build_chain(mp_buf_priv_t *head, int n)
+{
+	mp_buf_priv_t buf;
+	mp_buf_t *prev = NULL;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (mp_alloc(&mp, &buf) < 0)
+			return -1;
+		memset(buf.data, 'a' + i % 26, MEM_POOL_BUF_SIZE);
+		buf.buf->len = MEM_POOL_BUF_SIZE;
+		buf.buf->next = MEM_POOL_BUF_NONE;
+		if (prev)
+			prev->next = buf.offset;
+		else
+			*head = buf;
+		prev = buf.buf;
+	}
+
+	return 0;
+}
+
+/* a buffer allocated alone is a chain of one buffer */
+static int check_free_chain(void)
+{
+	unsigned int free_bufs = mp_count(&mp, 0), i;
+	mp_buf_priv_t buf, chain;
+
+	for (i = 0; i < 2 * free_bufs; i++) {
+		/* the buffers come back after the ones in bucket 0 */
+		if (i == free_bufs / 2) {
+			if (build_chain(&chain, MP_DIO_BATCH) < 0)
+				return -1;
+			mp_free_chain(&mp, &chain);
+		}
+		if (mp_alloc(&mp, &buf) < 0)
+			return -1;
+		mp_free_chain(&mp, &buf);
+		if (mp_count(&mp, 0) != free_bufs) {
+			fprintf(stderr, "%u free buffers after freeing "
+				"buffer %u, %u expected\n",
+				mp_count(&mp, 0), i, free_bufs);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int write_direct(int fd, mp_buf_priv_t *chain)
+{
+	size_t off;
+
+	for (off = 0; off < file_size; off += CHUNK) {
+		if (mp_dio_write(&mp, fd, off, chain) != CHUNK)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int write_buffered(int fd, mp_buf_priv_t *chain)
+{
+	size_t off;
+
+	for (off = 0; off < file_size; off += CHUNK) {
+		mp_buf_priv_t buf = *chain, next;
+		char *p = staging;
+
+		for (;;) {
+			memcpy(p, buf.data, buf.buf->len);
+			p += buf.buf->len;
+			if (mp_buf_next(&mp, &buf, &next) < 0)
+				break;
+			buf = next;
+		}
+		if (pwrite(fd, staging, p - staging, off) != p - staging) {
+			perror("pwrite");
+			return -1;
+		}
+	}
+
+	return fsync(fd);
+}
+
+static int check(mp_buf_priv_t *buf, int i)
+{
+	return buf->buf->len == MEM_POOL_BUF_SIZE &&
+		buf->data[0] == 'a' + i % 26 &&
+		buf->data[MEM_POOL_BUF_SIZE - 1] == 'a' + i % 26 ? 0 : -1;
+}
+
+static int read_direct(int fd)
+{
+	size_t off;
+	int bad = 0;
+
+	for (off = 0; off < file_size; off += CHUNK) {
+		mp_buf_priv_t head, buf, next;
+		int i = 0;
+
+		if (mp_dio_read(&mp, fd, off, CHUNK, &head) != CHUNK)
+			return -1;
+		buf = head;
+		for (;;) {
+			bad |= check(&buf, i++);
+			if (mp_buf_next(&mp, &buf, &next) < 0)
+				break;
+			buf = next;
+		}
+		mp_free_chain(&mp, &head);
+	}
+
+	return bad;
+}
+
+static int read_buffered(int fd)
+{
+	size_t off;
+	int bad = 0;
+
+	for (off = 0; off < file_size; off += CHUNK) {
+		int i;
+
+		if (pread(fd, staging, CHUNK, off) != CHUNK) {
+			perror("pread");
+			return -1;
+		}
+		for (i = 0; i < MP_DIO_BATCH; i++) {
+			mp_buf_priv_t buf;
+
+			if (mp_alloc(&mp, &buf) < 0)
+				return -1;
+			memcpy(buf.data, staging + i * MEM_POOL_BUF_SIZE,
+			       MEM_POOL_BUF_SIZE);
+			buf.buf->len = MEM_POOL_BUF_SIZE;
+			bad |= check(&buf, i);
+			mp_free(&mp, &buf);
+		}
+	}
+
+	return bad;
+}
+
+int main(int argc, char *argv[])
+{
+	int fd, opt, ret = EXIT_FAILURE, mode = MODE_DIRECT;
+	mp_buf_priv_t chain;
+	uint64_t start, wr, rd;
+
+	while ((opt = getopt(argc, argv, "m:f:s:")) != -1) {
+		switch (opt) {
+		case 'm':
+			if (strcmp(optarg, "direct") == 0)
+				mode = MODE_DIRECT;
+			else if (strcmp(optarg, "buffered") == 0)
+				mode = MODE_BUFFERED;
+			else
+				usage(argv[0]);
+			break;
+
+		case 'f':
+			path = optarg;
+			break;
+
+		case 's':
+			file_size = strtoul(optarg, NULL, 10) << 20;
+			if (file_size == 0)
+				usage(argv[0]);
+			break;
+
+		default:
+			usage(argv[0]);
+		}
+	}
+	/* whole chunks only */
+	file_size = (file_size + CHUNK - 1) / CHUNK * CHUNK;
+
+	if (posix_memalign((void **)&staging, MP_DIO_ALIGN, CHUNK))
+		return EXIT_FAILURE;
+
+	if (mp_create(&mp, MP_NAME, MP_ENTRIES, 2) < 0) {
+		fprintf(stderr, "can't create shared memory\n");
+		return EXIT_FAILURE;
+	}
+
+	if (check_free_chain() < 0 || build_chain(&chain, MP_DIO_BATCH) < 0)
+		goto end;
+
+	if (mode == MODE_DIRECT)
+		fd = mp_dio_open(path, O_CREAT | O_TRUNC | O_RDWR, 0600);
+	else
+		fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0600);
+	if (fd < 0)
+		goto end;
+
+	start = now_ns();
+	if ((mode == MODE_DIRECT ? write_direct(fd, &chain) :
+	     write_buffered(fd, &chain)) < 0) {
+		fprintf(stderr, "write failed\n");
+		goto close;
+	}
+	wr = now_ns() - start;
+
+	/* read from the device, not from the page cache */
+	if (mode == MODE_BUFFERED)
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+	start = now_ns();
+	if ((mode == MODE_DIRECT ? read_direct(fd) : read_buffered(fd)) != 0) {
+		fprintf(stderr, "read failed\n");
+		goto close;
+	}
+	rd = now_ns() - start;
+
+	printf("%s: %zu MB write %.0f MB/s read %.0f MB/s\n",
+	       mode == MODE_DIRECT ? "direct" : "buffered", file_size >> 20,
+	       (file_size >> 20) * 1e9 / wr, (file_size >> 20) * 1e9 / rd);
+	ret = 0;
+
+ close:
+	close(fd);
+	unlink(path);
+ end:
+	mp_unregister(&mp);
+	free(staging);
+
+	return ret;
+}
@@ -0,0 +1,273 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+#include "atomic.h"
+#include "mempool.h"
+#include "mp_exec.h"
+
+/*
+ * Consumer throughput of many tasks multiplexed by the executor on one
+ * core compared to a plain mp_get_sc() loop. A producer process floods
+ * the data bucket and writes the consumer eventfd when it was empty.
+ */
+
+mempool_priv_t mp;
+mp_exec_t exec;
+int duration = 5;
+int nb_tasks = 1000;
+volatile int quit;
+
+typedef enum bucket {
+	BKT_MEMPOOL,
+	BKT_DATA,
+	BKT_COUNT,
+} bucket;
+
+typedef enum notifs {
+	NOTIF_CONSUMER,
+	NOTIF_COUNT,
+} notifs;
+
+typedef enum mode {
+	MODE_RAW,
+	MODE_EXEC,
+} mode;
+
+#define MP_ENTRIES 4096
+#define MP_NAME "mp_exec_shm"
+
+struct task {
+	mp_wait_t w;
+	uint64_t  count;
+	uint64_t  sum;
+};
+
+static uint64_t raw_count, raw_sum;
+
+static void usage(char *name)
+{
+	fprintf(stderr, "Usage: %s [-m raw|exec] [-n] [-t]\n"
+		"\n"
+		"m     - consumer mode (default exec)\n"
+		"n     - number of tasks (default 1000)\n"
+		"t     - duration (in seconds)\n",
+		name);
+	exit(EXIT_FAILURE);
+}
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void set_quit(int signo)
+{
+	quit = 1;
+}
+
+static void producer(void)
+{
+	mp_buf_priv_t buf;
+	uint64_t seq = 0;
+	uint64_t value = 1;
+
+	while (!quit) {
+		int empty;
+
+		if (mp_alloc(&mp, &buf) < 0) {
+			sched_yield();
+			continue;
+		}
+		memcpy(buf.data, &seq, sizeof(seq));
+		buf.buf->len = sizeof(seq);
+		seq++;
+
+		empty = mp_count(&mp, BKT_DATA) == 0;
+		while (mp_put(&mp, BKT_DATA, &buf) < 0 && !quit)
+			sched_yield();
+
+		/* only a consumer which found the bucket empty may sleep */
+		if (empty &&
+		    write(mp.fds[NOTIF_CONSUMER], &value, sizeof(value)) < 0)
+			perror("notify consumer");
+	}
+	exit(0);
+}
+
+static inline uint64_t process(mp_buf_priv_t *buf)
+{
+	uint64_t seq;
+
+	memcpy(&seq, buf->data, sizeof(seq));
+	return seq;
+}
+
+static void consume_raw(void)
+{
+	mp_buf_priv_t buf;
+	unsigned int idle = 0;
+
+	while (!quit) {
+		if (mp_get_sc(&mp, BKT_DATA, &buf) < 0) {
+			if (++idle == MP_EXEC_BURST) {
+				idle = 0;
+				sched_yield();
+			}
+			continue;
+		}
+		raw_sum += process(&buf);
+		raw_count++;
+		mp_free(&mp, &buf);
+	}
+}
+
+static void task_got(void *ctx, mp_buf_priv_t *buf);
+
+static void task_freed(void *ctx, mp_buf_priv_t *buf)
+{
+	struct task *t = ctx;
+
+	/* get, process and free the buffer as long as nothing blocks */
+	while (!quit) {
+		if (mp_exec_get(&exec, &t->w, BKT_DATA, task_got, t) != 0)
+			return;
+		t->sum += process(&t->w.buf);
+		t->count++;
+		if (mp_exec_put(&exec, &t->w, BKT_MEMPOOL, &t->w.buf,
+				task_freed, t) != 0)
+			return;
+	}
+}
+
+static void task_got(void *ctx, mp_buf_priv_t *buf)
+{
+	struct task *t = ctx;
+
+	t->sum += process(buf);
+	t->count++;
+	if (mp_exec_put(&exec, &t->w, BKT_MEMPOOL, buf, task_freed, t) == 0)
+		task_freed(t, NULL);
+}
+
+static void consume_exec(struct task *tasks)
+{
+	int i;
+
+	if (mp_exec_init(&exec, &mp, 0) < 0)
+		return;
+
+	if (mp_exec_add(&exec, BKT_MEMPOOL, -1) < 0 ||
+	    mp_exec_add(&exec, BKT_DATA, NOTIF_CONSUMER) < 0)
+		goto end;
+
+	for (i = 0; i < nb_tasks; i++)
+		task_freed(&tasks[i], NULL);
+
+	/* the tasks stop parking once quit is set */
+	while (mp_exec_run(&exec, 10) < 0 && !quit)
+		;
+
+ end:
+	mp_exec_destroy(&exec);
+}
+
+int main(int argc, char *argv[])
+{
+	int i, opt, mode = MODE_EXEC;
+	struct task *tasks;
+	uint64_t start, elapsed, count = 0;
+	pid_t pid;
+
+	while ((opt = getopt(argc, argv, "m:n:t:")) != -1) {
+		switch (opt) {
+		case 'm':
+			if (strcmp(optarg, "raw") == 0)
+				mode = MODE_RAW;
+			else if (strcmp(optarg, "exec") == 0)
+				mode = MODE_EXEC;
+			else
+				usage(argv[0]);
+			break;
+
+		case 'n':
+			nb_tasks = atoi(optarg);
+			if (nb_tasks <= 0)
+				usage(argv[0]);
+			break;
+
+		case 't':
+			duration = atoi(optarg);
+			if (duration <= 0 || duration > 3600) {
+				fprintf(stderr, "bad duration %d\n", duration);
+				usage(argv[0]);
+			}
+			break;
+
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	tasks = calloc(nb_tasks, sizeof(struct task));
+	if (tasks == NULL)
+		return EXIT_FAILURE;
+
+	if (mp_create(&mp, MP_NAME, MP_ENTRIES, BKT_COUNT) < 0) {
+		fprintf(stderr, "can't create shared memory\n");
+		return EXIT_FAILURE;
+	}
+
+	if (mp_create_notifs(&mp, NOTIF_COUNT) < 0) {
+		fprintf(stderr, "failed creating eventfd notifications\n");
+		mp_unregister(&mp);
+		return EXIT_FAILURE;
+	}
+
+	signal(SIGTERM, set_quit);
+
+	if ((pid = fork()) == 0)
+		producer();
+
+	signal(SIGALRM, set_quit);
+	alarm(duration);
+
+	start = now_ns();
+	if (mode == MODE_RAW)
+		consume_raw();
+	else
+		consume_exec(tasks);
+	elapsed = now_ns() - start;
+
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+
+	if (mode == MODE_RAW) {
+		count = raw_count;
+		printf("raw: %.0f buffers/s\n", count * 1e9 / elapsed);
+	} else {
+		uint64_t min = UINT64_MAX, max = 0;
+
+		for (i = 0; i < nb_tasks; i++) {
+			count += tasks[i].count;
+			if (tasks[i].count < min)
+				min = tasks[i].count;
+			if (tasks[i].count > max)
+				max = tasks[i].count;
+		}
+		printf("exec: %d tasks: %.0f buffers/s, per task min=%lu "
+		       "max=%lu\n", nb_tasks, count * 1e9 / elapsed, min, max);
+	}
+
+	free(tasks);
+	mp_unregister(&mp);
+
+	return 0;
+}
@@ -0,0 +1,332 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "atomic.h"
+#include "mempool.h"
+#include "mp_index.h"
+
+/*
+ * Lookups of in-flight buffers by key from several processes. The main
+ * process indexes n keys, each buffer holding its key, then forks readers
+ * looking random keys up and checking the buffer they find. With -c, a
+ * writer process removes and inserts the keys again meanwhile, a lookup
+ * in between misses. With -m, the main process then replaces every key by
+ * new ones many times over, as order ids come and go, and compares the
+ * cost of lookups missing before and after.
+ */
+
+mempool_priv_t mp;
+mp_index_t idx;
+
+typedef enum bucket {
+	BKT_MEMPOOL,
+	BKT_INFLIGHT,
+	BKT_COUNT,
+} bucket;
+
+#define MP_ENTRIES 16384
+#define MP_NAME "mp_index_shm"
+#define MAX_READERS 16
+#define CHURN_ROUNDS 64
+
+struct result {
+	uint64_t lookups;
+	uint64_t misses;
+	uint64_t errors;
+	uint64_t churns;
+} __cache_aligned;
+
+static int readers = 4;
+static int keys = 8192;
+static int load = 50;
+static int duration_ms = 1000;
+static int churn;
+static int misses_phase;
+
+/* shared with the children */
+static volatile int *stop;
+static struct result *results;
+
+static void usage(char *name)
+{
+	fprintf(stderr, "Usage: %s [-r] [-n] [-l] [-t] [-c] [-m]\n"
+		"\n"
+		"r     - number of reader processes (default 4)\n"
+		"n     - number of keys (default 8192)\n"
+		"l     - load factor of the index, in %% (default 50)\n"
+		"t     - duration, in ms (default 1000)\n"
+		"c     - a writer removes and inserts keys meanwhile\n"
+		"m     - time misses before and after replacing the keys\n",
+		name);
+	exit(EXIT_FAILURE);
+}
+
+/* keys spread over the 64 bit space, as order ids of several sources */
+static inline uint64_t key_of(uint32_t i)
+{
+	return (uint64_t)i * 0x9e3779b97f4a7c15ULL;
+}
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* average cost of a lookup of a key which is not indexed, in ns */
+static double miss_ns(void)
+{
+	uint64_t start = now_ns();
+	uintptr_t handle;
+	int i;
+
+	for (i = 0; i < keys; i++) {
+		if (mp_index_lookup(&idx, ~key_of(i), &handle) == 0) {
+			fprintf(stderr, "key %lx found\n", ~key_of(i));
+			return -1;
+		}
+	}
+
+	return (double)(now_ns() - start) / keys;
+}
+
+static unsigned int tombstones(void)
+{
+	unsigned int i, n = 0;
+
+	for (i = 0; i < idx.hdr->capacity; i++)
+		n += MP_INDEX_STATE(idx.hdr->slot[i].val) == MP_INDEX_DEAD;
+
+	return n;
+}
+
+/* replace the keys by new ones, round after round */
+static int replace_keys(void)
+{
+	uintptr_t handle;
+	uint32_t round, i;
+
+	for (round = 1; round <= CHURN_ROUNDS; round++) {
+		for (i = 0; i < keys; i++) {
+			uint64_t old = key_of((round - 1) * keys + i);
+
+			if (mp_index_remove(&idx, old, &handle) < 0 ||
+			    mp_index_insert(&idx, key_of(round * keys + i),
+					    handle) < 0) {
+				fprintf(stderr, "key %lx lost\n", old);
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static void reader(int id)
+{
+	struct result *r = &results[id];
+	uint64_t lookups = 0, misses = 0, errors = 0;
+	unsigned int seed = id + 1;
+	mp_buf_priv_t buf;
+
+	if (mp_register(&mp, MP_NAME) < 0 ||
+	    mp_index_open(&mp, &idx, "orders") < 0)
+		exit(EXIT_FAILURE);
+
+	while (!*stop) {
+		int i;
+
+		for (i = 0; i < 256; i++) {
+			uint64_t key = key_of(rand_r(&seed) % keys);
+
+			if (mp_index_find(&mp, &idx, key, &buf) < 0)
+				misses++;
+			else if (*(uint64_t *)buf.data != key)
+				errors++;
+		}
+		lookups += 256;
+	}
+	r->lookups = lookups;
+	r->misses = misses;
+	r->errors = errors;
+
+	mp_index_close(&idx);
+	mp_unregister(&mp);
+	exit(EXIT_SUCCESS);
+}
+
+static void writer(void)
+{
+	struct result *r = &results[MAX_READERS];
+	unsigned int seed = 0;
+	uintptr_t handle;
+	uint64_t churns = 0;
+
+	if (mp_register(&mp, MP_NAME) < 0 ||
+	    mp_index_open(&mp, &idx, "orders") < 0)
+		exit(EXIT_FAILURE);
+
+	while (!*stop) {
+		uint64_t key = key_of(rand_r(&seed) % keys);
+
+		if (mp_index_remove(&idx, key, &handle) < 0 ||
+		    mp_index_insert(&idx, key, handle) < 0) {
+			fprintf(stderr, "key %lx lost\n", key);
+			exit(EXIT_FAILURE);
+		}
+		churns++;
+	}
+	r->churns = churns;
+
+	mp_index_close(&idx);
+	mp_unregister(&mp);
+	exit(EXIT_SUCCESS);
+}
+
+int main(int argc, char *argv[])
+{
+	pid_t pids[MAX_READERS + 1];
+	struct timespec ts;
+	uint64_t lookups = 0, misses = 0, errors = 0;
+	unsigned int capacity = 2;
+	mp_buf_priv_t buf;
+	int opt, i, nprocs, ret = EXIT_SUCCESS;
+
+	while ((opt = getopt(argc, argv, "r:n:l:t:cm")) != -1) {
+		switch (opt) {
+		case 'r':
+			readers = atoi(optarg);
+			if (readers < 1 || readers > MAX_READERS)
+				usage(argv[0]);
+			break;
+
+		case 'n':
+			keys = atoi(optarg);
+			if (keys <= 0 || keys >= MP_ENTRIES)
+				usage(argv[0]);
+			break;
+
+		case 'l':
+			load = atoi(optarg);
+			if (load <= 0 || load > 100)
+				usage(argv[0]);
+			break;
+
+		case 't':
+			duration_ms = atoi(optarg);
+			if (duration_ms <= 0)
+				usage(argv[0]);
+			break;
+
+		case 'c':
+			churn = 1;
+			break;
+
+		case 'm':
+			misses_phase = 1;
+			break;
+
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	while (capacity * load / 100 < keys)
+		capacity <<= 1;
+
+	stop = mmap(NULL, sizeof(int), PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	results = mmap(NULL, sizeof(*results) * (MAX_READERS + 1),
+		       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+		       -1, 0);
+	if (stop == MAP_FAILED || results == MAP_FAILED) {
+		perror("mmap");
+		return EXIT_FAILURE;
+	}
+
+	if (mp_create(&mp, MP_NAME, MP_ENTRIES, BKT_COUNT) < 0) {
+		fprintf(stderr, "can't create shared memory\n");
+		return EXIT_FAILURE;
+	}
+	if (mp_index_create(&mp, &idx, "orders", capacity) < 0) {
+		mp_unregister(&mp);
+		return EXIT_FAILURE;
+	}
+
+	/* the buffers stay in flight, in a bucket, while they are indexed */
+	for (i = 0; i < keys; i++) {
+		if (mp_alloc(&mp, &buf) < 0) {
+			fprintf(stderr, "out of buffers\n");
+			return EXIT_FAILURE;
+		}
+		*(uint64_t *)buf.data = key_of(i);
+		if (mp_index_insert(&idx, key_of(i), buf.offset) < 0 ||
+		    mp_put(&mp, BKT_INFLIGHT, &buf) < 0) {
+			fprintf(stderr, "can't index key %d\n", i);
+			return EXIT_FAILURE;
+		}
+	}
+
+	for (i = 0; i < readers; i++) {
+		if ((pids[i] = fork()) == 0)
+			reader(i);
+	}
+	nprocs = readers;
+	if (churn && (pids[nprocs++] = fork()) == 0)
+		writer();
+
+	ts.tv_sec = duration_ms / 1000;
+	ts.tv_nsec = duration_ms % 1000 * 1000000L;
+	nanosleep(&ts, NULL);
+	*stop = 1;
+	for (i = 0; i < nprocs; i++) {
+		int status;
+
+		waitpid(pids[i], &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			ret = EXIT_FAILURE;
+	}
+
+	for (i = 0; i < readers; i++) {
+		lookups += results[i].lookups;
+		misses += results[i].misses;
+		errors += results[i].errors;
+	}
+	printf("%d readers, %d keys in %u slots%s: %.1f Mlookups/s, "
+	       "%lu misses, %lu errors", readers, keys, capacity,
+	       churn ? ", churn" : "", lookups * 1e-3 / duration_ms,
+	       misses, errors);
+	if (churn)
+		printf(", %.2f Mchurns/s",
+		       results[MAX_READERS].churns * 1e-3 / duration_ms);
+	printf("\n");
+	if (errors || mp_index_count(&idx) != keys)
+		ret = EXIT_FAILURE;
+
+	if (misses_phase && ret == EXIT_SUCCESS) {
+		double before = miss_ns(), after;
+
+		if (before < 0 || replace_keys() < 0 ||
+		    (after = miss_ns()) < 0 || mp_index_count(&idx) != keys) {
+			ret = EXIT_FAILURE;
+		} else {
+			printf("misses: %.0f ns before, %.0f ns after %d "
+			       "rounds of new keys, %u tombstones\n", before,
+			       after, CHURN_ROUNDS, tombstones());
+		}
+	}
+
+	mp_index_destroy(&idx);
+	while (mp_get(&mp, BKT_INFLIGHT, &buf) == 0)
+		mp_free(&mp, &buf);
+	mp_unregister(&mp);
+
+	return ret;
+}
@@ -0,0 +1,264 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "mempool.h"
+#include "mp_mmsg.h"
+
+/*
+ * UDP loopback packet rate of the recvmmsg()/sendmmsg() stages compared
+ * to one sendto() per datagram and one recvfrom() into a stack buffer plus
+ * a copy into a pool buffer. A window of datagrams is sent and then
+ * received, so the sending and receiving sides are timed separately and
+ * the figures don't depend on how the two sides get scheduled.
+ */
+
+mempool_priv_t mp;
+int duration = 3;
+int size = 64;
+int burst = 32;
+int window = 1024;
+volatile int quit;
+
+typedef enum bucket {
+	BKT_MEMPOOL,
+	BKT_IN,
+	BKT_OUT,
+	BKT_COUNT,
+} bucket;
+
+typedef enum mode {
+	MODE_SINGLE,
+	MODE_MMSG,
+} mode;
+
+#define MP_ENTRIES 4096
+#define MP_NAME "mp_mmsg_shm"
+
+static void usage(char *name)
+{
+	fprintf(stderr, "Usage: %s [-m single|mmsg] [-b] [-s] [-w] [-t]\n"
+		"\n"
+		"m     - I/O mode (default mmsg)\n"
+		"b     - burst size (default 32)\n"
+		"s     - datagram size (default 64)\n"
+		"w     - datagrams per window (default 1024)\n"
+		"t     - duration (in seconds)\n",
+		name);
+	exit(EXIT_FAILURE);
+}
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void set_quit(int signo)
+{
+	quit = 1;
+}
+
+static uint64_t send_single(int sock, struct sockaddr_in *dst)
+{
+	char msg[MEM_POOL_BUF_SIZE];
+	uint64_t sent = 0;
+	int i;
+
+	memset(msg, 'm', size);
+	for (i = 0; i < window; i++) {
+		if (sendto(sock, msg, size, 0, (struct sockaddr *)dst,
+			   sizeof(*dst)) == size)
+			sent++;
+	}
+
+	return sent;
+}
+
+static uint64_t send_mmsg(mp_mmsg_t *st)
+{
+	mp_buf_priv_t buf;
+	uint64_t sent = 0;
+	int queued = 0, n;
+
+	while (sent < (uint64_t)window) {
+		/* keep the egress bucket fed */
+		while (queued < window && mp_count(&mp, BKT_OUT) <
+		       (unsigned int)burst && mp_alloc(&mp, &buf) == 0) {
+			buf.buf->len = size;
+			if (mp_put(&mp, BKT_OUT, &buf) < 0) {
+				mp_free(&mp, &buf);
+				break;
+			}
+			queued++;
+		}
+		n = mp_mmsg_egress(st, 0);
+		if (n <= 0)
+			break;
+		sent += n;
+	}
+
+	return sent;
+}
+
+static uint64_t drain(void)
+{
+	mp_buf_priv_t buf;
+	uint64_t n = 0;
+
+	while (mp_get_sc(&mp, BKT_IN, &buf) == 0) {
+		n++;
+		mp_free(&mp, &buf);
+	}
+
+	return n;
+}
+
+static uint64_t recv_single(int sock)
+{
+	char msg[MEM_POOL_BUF_SIZE];
+	uint64_t received = 0;
+
+	for (;;) {
+		mp_buf_priv_t buf;
+		ssize_t len = recvfrom(sock, msg, sizeof(msg), MSG_DONTWAIT,
+				       NULL, NULL);
+
+		if (len < 0 || mp_alloc(&mp, &buf) < 0)
+			break;
+		memcpy(buf.data, msg, len);
+		buf.buf->len = len;
+		if (mp_put(&mp, BKT_IN, &buf) < 0)
+			mp_free(&mp, &buf);
+		received += drain();
+	}
+
+	return received;
+}
+
+static uint64_t recv_mmsg(mp_mmsg_t *st)
+{
+	uint64_t received = 0;
+
+	while (mp_mmsg_ingest(st, MSG_DONTWAIT) > 0)
+		received += drain();
+
+	return received;
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, mode = MODE_MMSG, rsock, ssock, rcvbuf = 4 << 20;
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	socklen_t len = sizeof(addr);
+	uint64_t t, send_ns = 0, recv_ns = 0, sent = 0, received = 0;
+	mp_mmsg_t in, out;
+
+	while ((opt = getopt(argc, argv, "m:b:s:w:t:")) != -1) {
+		switch (opt) {
+		case 'm':
+			if (strcmp(optarg, "single") == 0)
+				mode = MODE_SINGLE;
+			else if (strcmp(optarg, "mmsg") == 0)
+				mode = MODE_MMSG;
+			else
+				usage(argv[0]);
+			break;
+
+		case 'b':
+			burst = atoi(optarg);
+			if (burst <= 0 || burst > MP_MMSG_MAX_BURST)
+				usage(argv[0]);
+			break;
+
+		case 's':
+			size = atoi(optarg);
+			if (size <= 0 || size > 1472)
+				usage(argv[0]);
+			break;
+
+		case 'w':
+			window = atoi(optarg);
+			if (window <= 0 || window > MP_ENTRIES / 2)
+				usage(argv[0]);
+			break;
+
+		case 't':
+			duration = atoi(optarg);
+			if (duration <= 0 || duration > 3600) {
+				fprintf(stderr, "bad duration %d\n", duration);
+				usage(argv[0]);
+			}
+			break;
+
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	rsock = socket(AF_INET, SOCK_DGRAM, 0);
+	ssock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (rsock < 0 || ssock < 0 ||
+	    bind(rsock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    getsockname(rsock, (struct sockaddr *)&addr, &len) < 0) {
+		perror("socket");
+		return EXIT_FAILURE;
+	}
+	/* a window has to fit in the receive buffer */
+	setsockopt(rsock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	if (mp_create(&mp, MP_NAME, MP_ENTRIES, BKT_COUNT) < 0) {
+		fprintf(stderr, "can't create shared memory\n");
+		return EXIT_FAILURE;
+	}
+
+	if (mp_mmsg_init(&in, &mp, rsock, BKT_IN, burst) < 0 ||
+	    mp_mmsg_init(&out, &mp, ssock, BKT_OUT, burst) < 0) {
+		mp_unregister(&mp);
+		return EXIT_FAILURE;
+	}
+	mp_mmsg_set_dest(&out, (struct sockaddr *)&addr, sizeof(addr));
+
+	signal(SIGALRM, set_quit);
+	alarm(duration);
+
+	while (!quit) {
+		t = now_ns();
+		if (mode == MODE_SINGLE)
+			sent += send_single(ssock, &addr);
+		else
+			sent += send_mmsg(&out);
+		send_ns += now_ns() - t;
+
+		t = now_ns();
+		if (mode == MODE_SINGLE)
+			received += recv_single(rsock);
+		else
+			received += recv_mmsg(&in);
+		recv_ns += now_ns() - t;
+	}
+
+	printf("%s: size=%d burst=%d: send %.0f pkt/s receive %.0f pkt/s "
+	       "(%.1f%% lost)\n", mode == MODE_SINGLE ? "single" : "mmsg",
+	       size, mode == MODE_SINGLE ? 1 : burst, sent * 1e9 / send_ns,
+	       received * 1e9 / recv_ns,
+	       sent ? 100.0 * (sent - received) / sent : 0);
+
+	mp_mmsg_destroy(&in);
+	mp_mmsg_destroy(&out);
+	close(rsock);
+	close(ssock);
+	mp_unregister(&mp);
+
+	return 0;
+}
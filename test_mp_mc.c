@@ -12,6 +12,8 @@ mempool_priv_t mp;
 int debug;
 int duration;
 int is_consumer;
+int grow;
+int throttle;
 
 typedef enum bucket {
 	BKT_MEMPOOL,
@@ -25,16 +27,19 @@ struct timeval tv_end;
 int quit;
 
 #define MP_ENTRIES 4096
+#define MP_MAX_ENTRIES (MP_ENTRIES * 8)
 #define MP_NAME "mp_shm"
 
 static void usage(char *name)
 {
-	fprintf(stderr, "Usage: %s -m p|c [-d] [-t] [-r]\n"
+	fprintf(stderr, "Usage: %s -m p|c [-d] [-t] [-r] [-g] [-w]\n"
 		"\n"
 		"m p|c - producer/consumer\n"
 		"t     - duration (in seconds)\n"
 		"d     - debug mode\n"
-		"r     - register only (don't create the shared memory)\n",
+		"r     - register only (don't create the shared memory)\n"
+		"g     - grow the pool when it runs out of buffers\n"
+		"w     - throttle when the consumer bucket is congested\n",
 		name);
 	exit(EXIT_FAILURE);
 }
@@ -93,7 +98,9 @@ static void producer(int register_only)
 	mp_buf_priv_t buf;
 
 	if (register_only == 0) {
-		if (mp_create(&mp, MP_NAME, MP_ENTRIES, BKT_COUNT) < 0) {
+		if (mp_create_growable(&mp, MP_NAME, MP_ENTRIES,
+				       grow ? MP_MAX_ENTRIES : MP_ENTRIES,
+				       BKT_COUNT) < 0) {
 			fprintf(stderr, "can't create shared memory\n");
 			return;
 		}
@@ -107,6 +114,12 @@ static void producer(int register_only)
 	if (debug)
 		dump_infos(&mp);
 
+	if (throttle && mp_set_watermarks(&mp, BKT_CONSUMER, MP_ENTRIES / 4,
+					  MP_ENTRIES * 3 / 4, -1) < 0) {
+		mp_unregister(&mp);
+		return;
+	}
+
 	if (signal(SIGINT, set_quit) == SIG_ERR) {
 		fprintf(stderr, "\ncan't catch SIGINT\n");
 		mp_unregister(&mp);
@@ -117,13 +130,21 @@ static void producer(int register_only)
 		if (unlikely(quit))
 			cleanup();
 
+		/* stop pulling data until the consumer catches up */
+		if (throttle && mp_is_congested(&mp, BKT_CONSUMER)) {
+			cpu_spinwait();
+			continue;
+		}
+
 		if (unlikely(mp_get(&mp, BKT_MEMPOOL, &buf) < 0)) {
 			/* fprintf(stderr, "no more memory\n"); */
+			if (grow && mp_grow(&mp, MP_ENTRIES) < 0)
+				grow = 0;
 			continue;
 		}
 
 		if (debug) {
-			snprintf(buf.buf->data, MEM_POOL_BUF_SIZE,
+			snprintf(buf.data, MEM_POOL_BUF_SIZE,
 				 "counter:%ld\n", tosend++);
 		}
 
@@ -173,7 +194,7 @@ static void consumer()
 	while (1) {
 		while (likely(mp_get(&mp, BKT_CONSUMER, &buf) >= 0)) {
 			if (debug)
-			    printf("%s", buf.buf->data);
+			    printf("%s", buf.data);
 			stats += MEM_POOL_BUF_SIZE;
 
 			if (unlikely(mp_free(&mp, &buf) < 0)) {
@@ -193,7 +214,7 @@ int main(int argc, char *argv[])
 	int opt, mode = 0;
 	int register_only = 0;
 
-	while ((opt = getopt(argc, argv, "m:dt:r")) != -1) {
+	while ((opt = getopt(argc, argv, "m:dt:rgw")) != -1) {
 		switch (opt) {
 		case 'm':
 			mode = *optarg;
@@ -215,6 +236,14 @@ int main(int argc, char *argv[])
 			register_only = 1;
 			break;
 
+		case 'g':
+			grow = 1;
+			break;
+
+		case 'w':
+			throttle = 1;
+			break;
+
 		default:
 			usage(argv[0]);
 		}
@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "atomic.h"
+#include "mempool.h"
+#include "mp_pack.h"
+
+/*
+ * Messages of random sizes are packed into buffers of a bucket, then
+ * unpacked and checked against the sequence written. The first buffers are
+ * then read again cut at every offset, and with a corrupted record length:
+ * the reader must return the complete records only.
+ */
+
+mempool_priv_t mp;
+
+typedef enum bucket {
+	BKT_MEMPOOL,
+	BKT_PACKED,
+	BKT_COUNT,
+} bucket;
+
+#define MP_ENTRIES 4096
+#define MP_NAME "mp_pack_shm"
+
+static int count = 100000;
+static int min_size = 8;
+static int max_size = 300;
+
+static void usage(char *name)
+{
+	fprintf(stderr, "Usage: %s [-n] [-s] [-S]\n"
+		"\n"
+		"n     - number of messages (default 100000)\n"
+		"s     - minimum message size, at least 4 (default 8)\n"
+		"S     - maximum message size (default 300)\n",
+		name);
+	exit(EXIT_FAILURE);
+}
+
+/* message i: its number followed by bytes derived from it */
+static uint32_t msg_size(uint32_t i)
+{
+	return min_size + (i * 2654435761U >> 8) % (max_size - min_size + 1);
+}
+
+static void msg_fill(char *data, uint32_t i, uint32_t len)
+{
+	uint32_t k;
+
+	memcpy(data, &i, sizeof(i));
+	for (k = sizeof(i); k < len; k++)
+		data[k] = i + k;
+}
+
+static int msg_check(const char *data, uint32_t i, uint32_t len)
+{
+	uint32_t k;
+
+	if (len != msg_size(i) || memcmp(data, &i, sizeof(i)))
+		return -1;
+	for (k = sizeof(i); k < len; k++) {
+		if (data[k] != (char)(i + k))
+			return -1;
+	}
+
+	return 0;
+}
+
+/* read buf cut to len bytes, it must stop after the complete records */
+static int check_truncated(mp_buf_priv_t *buf, uint32_t len)
+{
+	uint32_t full = buf->buf->len, off = 0, expect = 0, n = 0, msg_len;
+	mp_pack_reader_t r;
+	int ret = 0;
+
+	/* complete records within len */
+	while (off + sizeof(struct mp_pack_rec) <= full) {
+		struct mp_pack_rec *rec;
+
+		rec = (struct mp_pack_rec *)(buf->data + off);
+		if (off + MP_PACK_REC_SIZE(rec->len) > len)
+			break;
+		off += MP_PACK_REC_SIZE(rec->len);
+		expect++;
+	}
+
+	buf->buf->len = len;
+	mp_pack_reader_init(&r, buf);
+	while (mp_pack_next(&r, &msg_len))
+		n++;
+	if (n != expect) {
+		fprintf(stderr, "buffer cut at %u: %u records read, %u "
+			"expected\n", len, n, expect);
+		ret = -1;
+	}
+	buf->buf->len = full;
+
+	return ret;
+}
+
+/* a record claiming more than the buffer holds ends the walk */
+static int check_corrupted(mp_buf_priv_t *buf)
+{
+	struct mp_pack_rec *rec = (struct mp_pack_rec *)buf->data;
+	uint32_t saved = rec->len, len;
+	mp_pack_reader_t r;
+	int ret = 0;
+
+	rec->len = UINT32_MAX - 1;
+	mp_pack_reader_init(&r, buf);
+	if (mp_pack_next(&r, &len)) {
+		fprintf(stderr, "record of %u bytes read\n", len);
+		ret = -1;
+	}
+	rec->len = saved;
+
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	mp_pack_writer_t w;
+	mp_pack_reader_t r;
+	mp_buf_priv_t buf;
+	uint32_t packed = 0, unpacked = 0, buffers = 0, len;
+	int opt, ret = EXIT_FAILURE;
+	char *data;
+
+	while ((opt = getopt(argc, argv, "n:s:S:")) != -1) {
+		switch (opt) {
+		case 'n':
+			count = atoi(optarg);
+			if (count <= 0)
+				usage(argv[0]);
+			break;
+
+		case 's':
+			min_size = atoi(optarg);
+			break;
+
+		case 'S':
+			max_size = atoi(optarg);
+			break;
+
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (min_size < sizeof(uint32_t) || max_size < min_size ||
+	    max_size > MP_PACK_MAX_MSG)
+		usage(argv[0]);
+
+	if (mp_create(&mp, MP_NAME, MP_ENTRIES, BKT_COUNT) < 0) {
+		fprintf(stderr, "can't create shared memory\n");
+		return EXIT_FAILURE;
+	}
+	mp_pack_writer_init(&w, &mp, BKT_PACKED, 0, 0);
+
+	while (unpacked < count) {
+		/* pack until the bucket or the pool is full */
+		while (packed < count) {
+			len = msg_size(packed);
+			if ((data = mp_pack_reserve(&w, len)) == NULL)
+				break;
+			msg_fill(data, packed++, len);
+		}
+		if (packed == count && mp_pack_flush(&w) < 0)
+			goto end;
+
+		while (mp_get_sc(&mp, BKT_PACKED, &buf) == 0) {
+			uint32_t first = unpacked, cut;
+
+			mp_pack_reader_init(&r, &buf);
+			while ((data = mp_pack_next(&r, &len))) {
+				if (msg_check(data, unpacked, len) < 0) {
+					fprintf(stderr, "message %u is "
+						"corrupted\n", unpacked);
+					goto end;
+				}
+				unpacked++;
+			}
+			if (r.off != buf.buf->len || unpacked == first) {
+				fprintf(stderr, "buffer %u not fully "
+					"unpacked\n", buffers);
+				goto end;
+			}
+
+			if (buffers < 16) {
+				for (cut = 0; cut < buf.buf->len; cut++) {
+					if (check_truncated(&buf, cut) < 0)
+						goto end;
+				}
+				if (check_corrupted(&buf) < 0)
+					goto end;
+			}
+			buffers++;
+			mp_free(&mp, &buf);
+		}
+	}
+	ret = EXIT_SUCCESS;
+	printf("%u messages of %d to %d bytes in %u buffers\n", unpacked,
+	       min_size, max_size, buffers);
+
+ end:
+	mp_unregister(&mp);
+
+	return ret;
+}
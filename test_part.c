@@ -0,0 +1,340 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "atomic.h"
+#include "mempool.h"
+#include "mp_part.h"
+
+/*
+ * Key partitioned dispatch: the cost of mp_part_put() against a plain
+ * mp_put(), then consumer processes checking the per key order of
+ * sequenced messages while one of them keeps leaving and joining again.
+ * The messages come from producer processes spread over the CPUs, each
+ * sending its own keys, so that puts race with the rebalances.
+ */
+
+mempool_priv_t mp;
+
+#define MP_ENTRIES 4096
+#define MP_NAME "mp_part_shm"
+#define MAX_CONSUMERS 8
+#define MAX_PRODUCERS 8
+#define BATCH 64
+
+static int consumers = 3;
+static int producers = 2;
+static int count = 2000000;
+static int keys = 1024;
+
+struct msg {
+	uint32_t key;
+	uint32_t seq;
+};
+
+/* shared with the consumers */
+struct state {
+	volatile int      stop;
+	volatile uint64_t received[MAX_CONSUMERS];
+	volatile uint64_t disorder[MAX_CONSUMERS];
+	volatile uint32_t last[];	/* last sequence seen per key */
+};
+static struct state *state;
+
+static void usage(char *name)
+{
+	fprintf(stderr, "Usage: %s [-c] [-p] [-n] [-k]\n"
+		"\n"
+		"c     - number of consumers, the last one keeps leaving "
+		"and joining (default 3)\n"
+		"p     - number of producers (default 2)\n"
+		"n     - number of messages (default 2000000)\n"
+		"k     - number of keys, at least one per producer "
+		"(default 1024)\n",
+		name);
+	exit(EXIT_FAILURE);
+}
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int join(int bucket)
+{
+	int member;
+
+	while ((member = mp_part_join(&mp, bucket)) < 0 && errno == EAGAIN)
+		sched_yield();
+
+	return member;
+}
+
+static void consume(int id, struct msg *m)
+{
+	if (m->seq != state->last[m->key] + 1)
+		state->disorder[id]++;
+	state->last[m->key] = m->seq;
+	state->received[id]++;
+}
+
+/* run on one CPU, spread by id */
+static void pin(int id)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	cpu_set_t set;
+
+	if (cpus <= 1)
+		return;
+	CPU_ZERO(&set);
+	CPU_SET(id % cpus, &set);
+	sched_setaffinity(0, sizeof(set), &set);
+}
+
+static void consumer(int id)
+{
+	int member, bucket = id + 1, churn = id == consumers - 1;
+	uint64_t leave_after = count / (consumers * 32), joined;
+	mp_buf_priv_t buf;
+
+	if (mp_register(&mp, MP_NAME) < 0) {
+		fprintf(stderr, "can't register shared memory\n");
+		exit(EXIT_FAILURE);
+	}
+	pin(producers + id);
+
+	/* joins under traffic */
+	if (churn)
+		usleep(50000);
+
+	/* the last consumer leaves and, once its bucket is empty, joins again */
+	do {
+		if ((member = join(bucket)) < 0)
+			exit(EXIT_FAILURE);
+		joined = state->received[id];
+
+		while (mp_part_is_member(&mp, member)) {
+			if (mp_part_get(&mp, member, &buf) < 0) {
+				if (state->stop &&
+				    !mp.mp->part.member[member].nfences &&
+				    mp_count(&mp, bucket) == 0)
+					break;
+				sched_yield();
+				continue;
+			}
+			consume(id, (struct msg *)buf.data);
+			mp_free(&mp, &buf);
+
+			if (!churn ||
+			    state->received[id] - joined != leave_after)
+				continue;
+			while (mp_part_leave(&mp, member) < 0) {
+				if (errno != EAGAIN)
+					exit(EXIT_FAILURE);
+				sched_yield();
+			}
+		}
+	} while (churn && !state->stop);
+
+	mp_unregister(&mp);
+	exit(EXIT_SUCCESS);
+}
+
+/* send the share of producer id, the keys equal to id modulo producers */
+static void produce(int id)
+{
+	uint32_t *seq = calloc(keys, sizeof(uint32_t));
+	int i, n = count / producers + (id < count % producers);
+	mp_buf_priv_t buf;
+
+	if (seq == NULL)
+		exit(EXIT_FAILURE);
+	pin(id);
+	srand(id + 1);
+
+	for (i = 0; i < n; i++) {
+		uint32_t key = rand() % (keys / producers) * producers + id;
+		struct msg *m;
+
+		while (mp_alloc(&mp, &buf) < 0)
+			sched_yield();
+		m = (struct msg *)buf.data;
+		m->key = key;
+		m->seq = ++seq[key];
+		while (mp_part_put(&mp, mp_part_hash(key), &buf) < 0)
+			sched_yield();
+	}
+	free(seq);
+}
+
+static void producer(int id)
+{
+	if (mp_register(&mp, MP_NAME) < 0) {
+		fprintf(stderr, "can't register shared memory\n");
+		exit(EXIT_FAILURE);
+	}
+	produce(id);
+	mp_unregister(&mp);
+	exit(EXIT_SUCCESS);
+}
+
+static void drain(int *members)
+{
+	mp_buf_priv_t buf;
+	int b;
+
+	for (b = 0; b < consumers; b++) {
+		while (mp_part_get(&mp, members[b], &buf) == 0)
+			mp_free(&mp, &buf);
+	}
+}
+
+/*
+ * Single process, the members being the consumer buckets: puts timed in
+ * batches, the buckets drained in between.
+ */
+static void put_cost(int *members, int part)
+{
+	uint32_t hash[BATCH];
+	int dst[BATCH];
+	mp_buf_priv_t bufs[BATCH];
+	uint64_t elapsed = 0, start;
+	int i, j;
+
+	for (i = 0; i < count; i += BATCH) {
+		for (j = 0; j < BATCH; j++) {
+			hash[j] = mp_part_hash((i + j) % keys);
+			dst[j] = 1 + (i + j) % consumers;
+			if (mp_alloc(&mp, &bufs[j]) < 0)
+				exit(EXIT_FAILURE);
+		}
+
+		start = now_ns();
+		if (part) {
+			for (j = 0; j < BATCH; j++)
+				mp_part_put(&mp, hash[j], &bufs[j]);
+		} else {
+			for (j = 0; j < BATCH; j++)
+				mp_put(&mp, dst[j], &bufs[j]);
+		}
+		elapsed += now_ns() - start;
+
+		drain(members);
+	}
+
+	printf("%-12s %6.1f ns/put\n", part ? "mp_part_put" : "mp_put",
+	       (double)elapsed / i);
+}
+
+int main(int argc, char *argv[])
+{
+	pid_t pids[MAX_CONSUMERS], prod_pids[MAX_PRODUCERS];
+	int members[MAX_CONSUMERS];
+	uint64_t received = 0, disorder = 0, start, elapsed;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "c:p:n:k:")) != -1) {
+		switch (opt) {
+		case 'c':
+			consumers = atoi(optarg);
+			if (consumers < 2 || consumers > MAX_CONSUMERS)
+				usage(argv[0]);
+			break;
+
+		case 'p':
+			producers = atoi(optarg);
+			if (producers < 1 || producers > MAX_PRODUCERS)
+				usage(argv[0]);
+			break;
+
+		case 'n':
+			count = atoi(optarg);
+			if (count <= 0)
+				usage(argv[0]);
+			break;
+
+		case 'k':
+			keys = atoi(optarg);
+			if (keys <= 0)
+				usage(argv[0]);
+			break;
+
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (keys < producers)
+		usage(argv[0]);
+
+	state = mmap(NULL, sizeof(*state) + sizeof(uint32_t) * keys,
+		     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (state == MAP_FAILED) {
+		perror("mmap");
+		return EXIT_FAILURE;
+	}
+
+	if (mp_create(&mp, MP_NAME, MP_ENTRIES, consumers + 1) < 0) {
+		fprintf(stderr, "can't create shared memory\n");
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < consumers; i++)
+		members[i] = join(i + 1);
+	put_cost(members, 0);
+	put_cost(members, 1);
+	fflush(stdout);
+
+	/* leaving waits for the members fenced by the previous leave */
+	for (i = 0; i < consumers; i++) {
+		while (mp_part_leave(&mp, members[i]) < 0) {
+			if (errno != EAGAIN)
+				return EXIT_FAILURE;
+			drain(members);
+		}
+	}
+	while (mp.mp->part.member[members[consumers - 1]].state)
+		drain(members);
+
+	for (i = 0; i < consumers; i++) {
+		if ((pids[i] = fork()) == 0)
+			consumer(i);
+	}
+	/* the first members are in before the traffic starts */
+	while (mp.mp->part.members < consumers - 1)
+		sched_yield();
+
+	start = now_ns();
+	for (i = 1; i < producers; i++) {
+		if ((prod_pids[i] = fork()) == 0)
+			producer(i);
+	}
+	produce(0);
+	for (i = 1; i < producers; i++)
+		waitpid(prod_pids[i], NULL, 0);
+	state->stop = 1;
+
+	for (i = 0; i < consumers; i++)
+		waitpid(pids[i], NULL, 0);
+	elapsed = now_ns() - start;
+
+	for (i = 0; i < consumers; i++) {
+		printf("consumer %d: %lu messages\n", i, state->received[i]);
+		received += state->received[i];
+		disorder += state->disorder[i];
+	}
+	printf("%lu/%d messages in %.0f ms, %lu out of order, "
+	       "%u rebalances\n", received, count, elapsed / 1e6, disorder,
+	       mp.mp->part.rebalances);
+
+	mp_unregister(&mp);
+
+	return received == count && disorder == 0 ? 0 : EXIT_FAILURE;
+}
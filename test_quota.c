@@ -0,0 +1,254 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "atomic.h"
+#include "mempool.h"
+#include "mp_quota.h"
+#include "mp_trim.h"
+
+/*
+ * Quotas on bucket 0 shared by several processes. The main process
+ * allocates up to its limit, then, with the limit lifted, drains the pool
+ * but the reservation of a second process, which still gets all its
+ * reserved buffers. Each refused allocation must be counted in the
+ * failures of the process which made it. A third process dies without
+ * unregistering: its reservation must be released when the next one
+ * registers. Trimming bucket 0 must leave the reserved buffers alone.
+ */
+
+mempool_priv_t mp;
+
+typedef enum bucket {
+	BKT_MEMPOOL,
+	BKT_DATA,
+	BKT_COUNT,
+} bucket;
+
+#define MP_ENTRIES 1024
+#define MP_NAME "mp_quota_shm"
+
+static unsigned int reserved = 32;
+static unsigned int max = 64;
+static mp_buf_priv_t bufs[MP_ENTRIES];
+
+static void usage(char *name)
+{
+	fprintf(stderr, "Usage: %s [-r] [-m]\n"
+		"\n"
+		"r     - buffers reserved by each process (default 32)\n"
+		"m     - outstanding buffers allowed (default 64)\n",
+		name);
+	exit(EXIT_FAILURE);
+}
+
+/* allocate until refused, returns the number of buffers allocated */
+static unsigned int alloc_all(void)
+{
+	unsigned int n = 0;
+
+	while (n < MP_ENTRIES && mp_alloc(&mp, &bufs[n]) == 0)
+		n++;
+
+	return n;
+}
+
+static void free_all(unsigned int n)
+{
+	while (n)
+		mp_free(&mp, &bufs[--n]);
+}
+
+static unsigned int failures(int client)
+{
+	return mp_quota_client(&mp, client)->failures;
+}
+
+/*
+ * Second process: registers, sends its client slot and then, for each
+ * command read, allocates as much as it can ('a') or frees it all ('f')
+ * and sends back the number of buffers it holds.
+ */
+static void peer(int in, int out)
+{
+	unsigned int n = 0;
+	char cmd;
+
+	if (mp_register(&mp, MP_NAME) < 0)
+		exit(EXIT_FAILURE);
+	if (write(out, &mp.client, sizeof(mp.client)) != sizeof(mp.client))
+		exit(EXIT_FAILURE);
+
+	while (read(in, &cmd, 1) == 1) {
+		if (cmd == 'a') {
+			n = alloc_all();
+		} else {
+			free_all(n);
+			n = 0;
+		}
+		if (write(out, &n, sizeof(n)) != sizeof(n))
+			break;
+	}
+
+	mp_unregister(&mp);
+	exit(EXIT_SUCCESS);
+}
+
+static unsigned int peer_cmd(int to_peer, int from_peer, char cmd)
+{
+	unsigned int n = -1;
+
+	if (write(to_peer, &cmd, 1) != 1 ||
+	    read(from_peer, &n, sizeof(n)) != sizeof(n))
+		return -1;
+
+	return n;
+}
+
+/* a process registering and exiting, unregistering or not */
+static int register_exit(int unregister)
+{
+	int status;
+	pid_t pid;
+
+	if ((pid = fork()) == 0) {
+		if (mp_register(&mp, MP_NAME) < 0)
+			_exit(EXIT_FAILURE);
+		if (unregister)
+			mp_unregister(&mp);
+		_exit(EXIT_SUCCESS);
+	}
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status)) {
+		fprintf(stderr, "process %d failed to register\n", pid);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* the reservations of the live clients, unallocated */
+static int check_reserved(unsigned int clients)
+{
+	mempool_t *pool = mp.mp;
+
+	if (pool->reserved_total != clients * reserved ||
+	    pool->reserve_unused != clients * reserved) {
+		fprintf(stderr, "%u buffers reserved, %d unused, %u "
+			"expected\n", pool->reserved_total,
+			pool->reserve_unused, clients * reserved);
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int to_peer[2], from_peer[2];
+	int opt, status, peer_client, ret = EXIT_FAILURE;
+	unsigned int free_bufs, n;
+	pid_t pid = -1;
+
+	while ((opt = getopt(argc, argv, "r:m:")) != -1) {
+		switch (opt) {
+		case 'r':
+			reserved = atoi(optarg);
+			break;
+
+		case 'm':
+			max = atoi(optarg);
+			break;
+
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (max == 0 || reserved > max || reserved * 4 > MP_ENTRIES)
+		usage(argv[0]);
+
+	if (mp_create(&mp, MP_NAME, MP_ENTRIES, BKT_COUNT) < 0) {
+		fprintf(stderr, "can't create shared memory\n");
+		return EXIT_FAILURE;
+	}
+	free_bufs = mp_count(&mp, BKT_MEMPOOL);
+	if (mp_quota_enable(&mp, reserved, max) < 0)
+		goto end;
+
+	/* the limit */
+	if ((n = alloc_all()) != max || failures(mp.client) != 1) {
+		fprintf(stderr, "%u buffers allocated, %u failures, limit "
+			"%u\n", n, failures(mp.client), max);
+		goto end;
+	}
+	free_all(n);
+
+	if (pipe(to_peer) < 0 || pipe(from_peer) < 0) {
+		perror("pipe");
+		goto end;
+	}
+	if ((pid = fork()) == 0) {
+		close(to_peer[1]);
+		close(from_peer[0]);
+		peer(to_peer[0], from_peer[1]);
+	}
+	close(to_peer[0]);
+	close(from_peer[1]);
+	if (read(from_peer[0], &peer_client, sizeof(peer_client)) !=
+	    sizeof(peer_client))
+		goto stop;
+
+	/* the reservation of the peer is kept away from the main process */
+	if (mp_quota_set(&mp, mp.client, reserved, MP_ENTRIES) < 0)
+		goto stop;
+	if ((n = alloc_all()) != free_bufs - reserved ||
+	    failures(mp.client) != 2) {
+		fprintf(stderr, "%u buffers allocated with %u reserved by "
+			"the peer, %u failures\n", n, reserved,
+			failures(mp.client));
+		goto stop;
+	}
+	if (peer_cmd(to_peer[1], from_peer[0], 'a') != reserved ||
+	    failures(peer_client) != 1 || failures(mp.client) != 2) {
+		fprintf(stderr, "peer: %u failures, main: %u failures\n",
+			failures(peer_client), failures(mp.client));
+		goto stop;
+	}
+	free_all(n);
+	if (peer_cmd(to_peer[1], from_peer[0], 'f') != 0 ||
+	    mp_count(&mp, BKT_MEMPOOL) != free_bufs ||
+	    check_reserved(2) < 0)
+		goto stop;
+
+	/* a dead process gives its reservation back at the next register */
+	if (register_exit(0) < 0 || check_reserved(3) < 0 ||
+	    register_exit(1) < 0 || check_reserved(2) < 0)
+		goto stop;
+
+	/* the reserved buffers stay warm */
+	if (mp_trim_enable(&mp, 0, 1) < 0)
+		goto stop;
+	mp_trim_run(&mp);
+	n = mp_count(&mp, BKT_MEMPOOL);
+	mp_trim_disable(&mp);
+	if (n != 2 * reserved) {
+		fprintf(stderr, "%u buffers left after trimming, %u "
+			"reserved\n", n, 2 * reserved);
+		goto stop;
+	}
+
+	ret = EXIT_SUCCESS;
+	printf("%u buffers, %u reserved and %u allowed per process\n",
+	       free_bufs, reserved, max);
+ stop:
+	close(to_peer[1]);
+	waitpid(pid, &status, 0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+		ret = EXIT_FAILURE;
+ end:
+	mp_unregister(&mp);
+
+	return ret;
+}
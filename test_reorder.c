@@ -0,0 +1,215 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "atomic.h"
+#include "mempool.h"
+#include "mp_reorder.h"
+
+/*
+ * Ordered parallel section: the main process numbers buffers into the
+ * section, worker processes spend a random amount of work on each and the
+ * main process gets them back from the reorder bucket, checking they come
+ * out in order. With -m unordered, the workers put into a plain bucket
+ * instead, for the cost of the reordering.
+ */
+
+mempool_priv_t mp;
+
+typedef enum bucket {
+	BKT_MEMPOOL,
+	BKT_SECTION,
+	BKT_COUNT,
+} bucket;
+
+#define MP_ENTRIES 4096
+#define MP_NAME "mp_reorder_shm"
+#define MAX_WORKERS 16
+
+static int workers = 4;
+static int count = 1000000;
+static int work = 500;
+static unsigned int window = MP_ENTRIES * 2;
+static int ordered = 1;
+static int reorder;
+
+/* shared with the workers */
+static volatile int *stop;
+
+static void usage(char *name)
+{
+	fprintf(stderr, "Usage: %s [-m] [-w] [-n] [-u] [-s]\n"
+		"\n"
+		"m     - ordered|unordered (default ordered)\n"
+		"w     - number of workers (default 4)\n"
+		"n     - number of buffers (default 1000000)\n"
+		"u     - mean work per buffer, in loop iterations "
+		"(default 500)\n"
+		"s     - reorder window (default %d)\n",
+		name, MP_ENTRIES * 2);
+	exit(EXIT_FAILURE);
+}
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void worker(int id)
+{
+	mp_buf_priv_t buf;
+	unsigned int seed = id;
+
+	if (mp_register(&mp, MP_NAME) < 0 || mp_bucket_map(&mp, reorder) < 0)
+		exit(EXIT_FAILURE);
+
+	while (1) {
+		volatile uint64_t sink = 0;
+		int i, n;
+
+		if (mp_get(&mp, BKT_SECTION, &buf) < 0) {
+			if (*stop)
+				break;
+			sched_yield();
+			continue;
+		}
+
+		/* uneven work shuffles the buffers */
+		n = rand_r(&seed) % (work * 2 + 1);
+		for (i = 0; i < n; i++)
+			sink += i;
+		*(uint64_t *)(buf.data + sizeof(uint64_t)) = sink;
+
+		while (mp_put(&mp, reorder, &buf) < 0)
+			sched_yield();
+	}
+
+	mp_unregister(&mp);
+	exit(EXIT_SUCCESS);
+}
+
+/* take back what is in order, returns -1 on a buffer out of order */
+static int drain(uint64_t *expected)
+{
+	mp_buf_priv_t buf;
+
+	while (mp_get_sc(&mp, reorder, &buf) == 0) {
+		if (*(uint64_t *)buf.data != (*expected)++ && ordered)
+			return -1;
+		mp_free(&mp, &buf);
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	pid_t pids[MAX_WORKERS];
+	uint64_t sent = 0, expected = 0, start, elapsed;
+	mp_buf_priv_t buf;
+	int opt, i, ret = EXIT_SUCCESS;
+
+	while ((opt = getopt(argc, argv, "m:w:n:u:s:")) != -1) {
+		switch (opt) {
+		case 'm':
+			if (strcmp(optarg, "unordered") == 0)
+				ordered = 0;
+			else if (strcmp(optarg, "ordered") != 0)
+				usage(argv[0]);
+			break;
+
+		case 'w':
+			workers = atoi(optarg);
+			if (workers < 1 || workers > MAX_WORKERS)
+				usage(argv[0]);
+			break;
+
+		case 'n':
+			count = atoi(optarg);
+			if (count <= 0)
+				usage(argv[0]);
+			break;
+
+		case 'u':
+			work = atoi(optarg);
+			if (work < 0)
+				usage(argv[0]);
+			break;
+
+		case 's':
+			window = atoi(optarg);
+			break;
+
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	stop = mmap(NULL, sizeof(int), PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (stop == MAP_FAILED) {
+		perror("mmap");
+		return EXIT_FAILURE;
+	}
+
+	if (mp_create(&mp, MP_NAME, MP_ENTRIES, BKT_COUNT) < 0) {
+		fprintf(stderr, "can't create shared memory\n");
+		return EXIT_FAILURE;
+	}
+	if ((reorder = ordered ?
+	     mp_reorder_create(&mp, BKT_SECTION, "reorder", window) :
+	     mp_bucket_create(&mp, "gather", window)) < 0) {
+		mp_unregister(&mp);
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < workers; i++) {
+		if ((pids[i] = fork()) == 0)
+			worker(i);
+	}
+
+	start = now_ns();
+	while (expected < count) {
+		if (sent < count && mp_alloc(&mp, &buf) == 0) {
+			*(uint64_t *)buf.data = sent;
+			if (mp_put(&mp, BKT_SECTION, &buf) == 0)
+				sent++;
+			else
+				mp_free(&mp, &buf);
+			continue;
+		}
+		if (drain(&expected) < 0) {
+			fprintf(stderr, "buffer %lu out of order\n",
+				expected - 1);
+			ret = EXIT_FAILURE;
+			break;
+		}
+		sched_yield();
+	}
+	elapsed = now_ns() - start;
+
+	*stop = 1;
+	for (i = 0; i < workers; i++)
+		waitpid(pids[i], NULL, 0);
+
+	printf("%s, %d workers: %lu buffers in %.0f ms, %.2f Mbufs/s\n",
+	       ordered ? "ordered" : "unordered", workers, expected,
+	       elapsed / 1e6, expected * 1e3 / elapsed);
+
+	while (mp_get(&mp, BKT_SECTION, &buf) == 0)
+		mp_free(&mp, &buf);
+	while (mp_get(&mp, reorder, &buf) == 0)
+		mp_free(&mp, &buf);
+	mp_bucket_destroy(&mp, reorder);
+	mp_unregister(&mp);
+
+	return ret;
+}
@@ -0,0 +1,193 @@
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/time.h>
+#include "atomic.h"
+#include "mp_ring.h"
+
+/*
+ * Multi producer multi consumer stress of the classic ring. Producers put
+ * unique tokens into a small ring so it wraps around all the time,
+ * consumers get them and count each token. A token seen twice or never
+ * means a slot was overwritten before it was read or read twice.
+ *
+ * The windows are a few instructions wide and a thread rarely loses the
+ * cpu inside one, so an interval timer makes the running thread yield at
+ * random points. It reproduces the races on a single cpu too.
+ */
+
+#define MAX_THREADS 16
+
+static mp_ring_t *ring;
+static int producers = 2;
+static int consumers = 2;
+static int entries = 8;
+static uint32_t count = 1000000;	/* tokens per producer */
+static volatile uint8_t *seen;
+static volatile int producing;
+static int preempt_us = 20;
+
+static void usage(char *name)
+{
+	fprintf(stderr, "Usage: %s [-p] [-c] [-s] [-n] [-y]\n"
+		"\n"
+		"p     - number of producer threads (default 2)\n"
+		"c     - number of consumer threads (default 2)\n"
+		"s     - ring size, a power of 2 (default 8)\n"
+		"n     - tokens per producer (default 1000000)\n"
+		"y     - force a yield every y us, 0 to disable (default 20)\n",
+		name);
+	exit(EXIT_FAILURE);
+}
+
+static void preempt(int sig)
+{
+	(void)sig;
+	sched_yield();
+}
+
+static void *produce(void *arg)
+{
+	uintptr_t first = (uintptr_t)arg * count, i;
+
+	for (i = first; i < first + count; i++) {
+		/* 0 is not a token, a slot never written reads as 0 */
+		while (mp_ring_put(ring, (void *)(i + 1)) < 0)
+			sched_yield();
+	}
+	__sync_fetch_and_sub(&producing, 1);
+
+	return NULL;
+}
+
+static void *consume(void *arg)
+{
+	uint32_t total = producers * count;
+	void *ptr;
+
+	for (;;) {
+		uintptr_t token;
+
+		if (mp_ring_get(ring, &ptr) < 0) {
+			/* all the puts are done, nothing more to come */
+			if (producing == 0)
+				break;
+			sched_yield();
+			continue;
+		}
+		token = (uintptr_t)ptr;
+		if (token == 0 || token > total) {
+			fprintf(stderr, "bogus token %lu\n", token);
+			exit(EXIT_FAILURE);
+		}
+		/* a slot read twice, no point in going on */
+		if (__sync_fetch_and_add(&seen[token - 1], 1)) {
+			fprintf(stderr, "token %lu seen twice\n", token);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t threads[MAX_THREADS * 2];
+	uint32_t i, lost = 0;
+	int opt, n = 0;
+
+	while ((opt = getopt(argc, argv, "p:c:s:n:y:")) != -1) {
+		switch (opt) {
+		case 'p':
+			producers = atoi(optarg);
+			if (producers < 1 || producers > MAX_THREADS)
+				usage(argv[0]);
+			break;
+
+		case 'c':
+			consumers = atoi(optarg);
+			if (consumers < 1 || consumers > MAX_THREADS)
+				usage(argv[0]);
+			break;
+
+		case 's':
+			entries = atoi(optarg);
+			if (entries < 2 || !POWEROF2(entries))
+				usage(argv[0]);
+			break;
+
+		case 'n':
+			count = atoi(optarg);
+			if (count == 0)
+				usage(argv[0]);
+			break;
+
+		case 'y':
+			preempt_us = atoi(optarg);
+			if (preempt_us < 0)
+				usage(argv[0]);
+			break;
+
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (posix_memalign((void **)&ring, __cache_line_size,
+			   sizeof(mp_ring_t) + entries * sizeof(void *))) {
+		perror("posix_memalign");
+		return EXIT_FAILURE;
+	}
+	memset(ring, 0, sizeof(mp_ring_t) + entries * sizeof(void *));
+	ring->mask = entries - 1;
+	seen = calloc((size_t)producers * count, 1);
+	if (seen == NULL) {
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+
+	if (preempt_us) {
+		struct itimerval it = {
+			.it_interval = { .tv_usec = preempt_us },
+			.it_value = { .tv_usec = preempt_us },
+		};
+
+		signal(SIGALRM, preempt);
+		if (setitimer(ITIMER_REAL, &it, NULL) < 0) {
+			perror("setitimer");
+			return EXIT_FAILURE;
+		}
+	}
+
+	producing = producers;
+	for (i = 0; i < consumers; i++) {
+		if (pthread_create(&threads[n++], NULL, consume, NULL))
+			goto error;
+	}
+	for (i = 0; i < producers; i++) {
+		if (pthread_create(&threads[n++], NULL, produce,
+				   (void *)(uintptr_t)i))
+			goto error;
+	}
+	while (n)
+		pthread_join(threads[--n], NULL);
+
+	for (i = 0; i < producers * count; i++) {
+		if (seen[i] == 0)
+			lost++;
+	}
+	printf("%d producers, %d consumers, ring of %d: %u tokens, "
+	       "%u lost\n", producers, consumers, entries, producers * count, lost);
+
+	return lost ? EXIT_FAILURE : EXIT_SUCCESS;
+
+ error:
+	perror("pthread_create");
+	return EXIT_FAILURE;
+}
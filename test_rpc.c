@@ -0,0 +1,286 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "atomic.h"
+#include "mempool.h"
+#include "mp_rpc.h"
+
+mempool_priv_t mp;
+volatile int quit;
+int calls = 200000;
+int batch = 1;
+int size = 64;
+
+#define MP_ENTRIES 4096
+#define MP_NAME "mp_rpc_shm"
+#define RPC_SERVER "rpc_server"
+#define MAX_SIZE 4096
+#define IDLE_SPINS 1000
+
+typedef enum mode {
+	MODE_SHM,
+	MODE_UNIX,
+} mode;
+
+static uint64_t *samples;
+static int nb_samples;
+
+static void usage(char *name)
+{
+	fprintf(stderr, "Usage: %s [-m shm|unix] [-n] [-b] [-s]\n"
+		"\n"
+		"m     - transport (default shm)\n"
+		"n     - number of calls\n"
+		"b     - number of outstanding calls\n"
+		"s     - payload size\n",
+		name);
+	exit(EXIT_FAILURE);
+}
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void set_quit(int signo)
+{
+	quit = 1;
+}
+
+/* spin for a while then let the peer run, useful with few cores */
+static inline void idle(unsigned int *spins)
+{
+	if (++*spins < IDLE_SPINS) {
+		cpu_spinwait();
+		return;
+	}
+	*spins = 0;
+	sched_yield();
+}
+
+static void shm_server(mp_rpc_server_t *srv)
+{
+	mp_buf_priv_t req;
+	unsigned int spins = 0;
+
+	while (!quit) {
+		if (mp_rpc_recv(srv, &req) < 0) {
+			idle(&spins);
+			continue;
+		}
+		/* answer in place with the request payload */
+		mp_rpc_reply(srv, &req, NULL, mp_rpc_len(&req), 0);
+	}
+	exit(0);
+}
+
+static void shm_done(void *ctx, uint64_t id, mp_buf_priv_t *rep)
+{
+	uint64_t ts;
+
+	if (rep == NULL) {
+		fprintf(stderr, "call %lu timed out\n", id);
+		return;
+	}
+	memcpy(&ts, mp_rpc_data(rep), sizeof(ts));
+	samples[nb_samples++] = now_ns() - ts;
+	mp_free(&mp, rep);
+}
+
+static int shm_client(void)
+{
+	mp_rpc_client_t *cli = malloc(sizeof(mp_rpc_client_t));
+	int sent = 0;
+	unsigned int spins = 0;
+
+	if (cli == NULL ||
+	    mp_rpc_client_init(cli, &mp, RPC_SERVER, MP_RPC_MAX_PENDING,
+			       1000000000ULL) < 0)
+		return -1;
+
+	while (nb_samples < calls) {
+		mp_buf_priv_t req;
+
+		while (sent < calls && cli->pending < batch &&
+		       mp_alloc(&mp, &req) == 0) {
+			uint64_t ts = now_ns();
+
+			memcpy(mp_rpc_data(&req), &ts, sizeof(ts));
+			if (mp_rpc_call(cli, &req, size, shm_done, NULL) == 0) {
+				mp_free(&mp, &req);
+				break;
+			}
+			sent++;
+		}
+		if (mp_rpc_poll(cli, batch) == 0)
+			idle(&spins);
+	}
+
+	mp_rpc_client_destroy(cli);
+	free(cli);
+
+	return 0;
+}
+
+static void unix_server(int sock)
+{
+	char msg[MAX_SIZE];
+
+	while (!quit) {
+		if (recv(sock, msg, size, MSG_WAITALL) != size)
+			break;
+		if (send(sock, msg, size, 0) != size)
+			break;
+	}
+	exit(0);
+}
+
+static int unix_client(int sock)
+{
+	char msg[MAX_SIZE];
+	int sent = 0;
+
+	memset(msg, 0, sizeof(msg));
+	while (nb_samples < calls) {
+		uint64_t ts;
+
+		while (sent < calls && sent - nb_samples < batch) {
+			ts = now_ns();
+			memcpy(msg, &ts, sizeof(ts));
+			if (send(sock, msg, size, 0) != size)
+				return -1;
+			sent++;
+		}
+		if (recv(sock, msg, size, MSG_WAITALL) != size)
+			return -1;
+		memcpy(&ts, msg, sizeof(ts));
+		samples[nb_samples++] = now_ns() - ts;
+	}
+
+	return 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void report(const char *name, uint64_t elapsed)
+{
+	uint64_t sum = 0;
+	int i;
+
+	qsort(samples, nb_samples, sizeof(uint64_t), cmp_u64);
+	for (i = 0; i < nb_samples; i++)
+		sum += samples[i];
+
+	printf("%s: %d calls batch=%d size=%d: %.0f calls/s rtt (us): "
+	       "avg=%.2f p50=%.2f p99=%.2f\n", name, nb_samples, batch, size,
+	       nb_samples * 1e9 / elapsed, sum / (double)nb_samples / 1000.0,
+	       samples[nb_samples / 2] / 1000.0,
+	       samples[(uint64_t)nb_samples * 99 / 100] / 1000.0);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, ret, mode = MODE_SHM;
+	uint64_t start;
+	pid_t pid;
+
+	while ((opt = getopt(argc, argv, "m:n:b:s:")) != -1) {
+		switch (opt) {
+		case 'm':
+			if (strcmp(optarg, "shm") == 0)
+				mode = MODE_SHM;
+			else if (strcmp(optarg, "unix") == 0)
+				mode = MODE_UNIX;
+			else
+				usage(argv[0]);
+			break;
+
+		case 'n':
+			calls = atoi(optarg);
+			if (calls <= 0)
+				usage(argv[0]);
+			break;
+
+		case 'b':
+			batch = atoi(optarg);
+			if (batch <= 0 || batch > MP_RPC_MAX_PENDING)
+				usage(argv[0]);
+			break;
+
+		case 's':
+			size = atoi(optarg);
+			if (size < (int)sizeof(uint64_t) || size > MAX_SIZE)
+				usage(argv[0]);
+			break;
+
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	samples = malloc(sizeof(uint64_t) * calls);
+	if (samples == NULL)
+		return EXIT_FAILURE;
+
+	signal(SIGTERM, set_quit);
+
+	if (mode == MODE_SHM) {
+		mp_rpc_server_t srv;
+
+		if (mp_create(&mp, MP_NAME, MP_ENTRIES, 2) < 0) {
+			fprintf(stderr, "can't create shared memory\n");
+			return EXIT_FAILURE;
+		}
+		if (mp_rpc_server_init(&srv, &mp, RPC_SERVER, MP_ENTRIES) < 0) {
+			mp_unregister(&mp);
+			return EXIT_FAILURE;
+		}
+		if ((pid = fork()) == 0)
+			shm_server(&srv);
+
+		start = now_ns();
+		ret = shm_client();
+		report("shm", now_ns() - start);
+
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+		mp_rpc_server_destroy(&srv);
+		mp_unregister(&mp);
+	} else {
+		int sv[2];
+
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+			perror("socketpair");
+			return EXIT_FAILURE;
+		}
+		if ((pid = fork()) == 0) {
+			close(sv[0]);
+			unix_server(sv[1]);
+		}
+		close(sv[1]);
+
+		start = now_ns();
+		ret = unix_client(sv[0]);
+		report("unix", now_ns() - start);
+
+		close(sv[0]);
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+	}
+
+	return ret < 0 ? EXIT_FAILURE : 0;
+}
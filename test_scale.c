@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "atomic.h"
+#include "mempool.h"
+
+/*
+ * Throughput of a bucket fed by a growing number of producer processes,
+ * drained by one consumer or by as many consumers as producers (-c). Each
+ * producer owns a stash of buffers returned by the consumers through a
+ * private sharded bucket so the only contended ring is the measured one.
+ */
+
+mempool_priv_t mp;
+int duration = 2;
+int max_producers = 8;
+int mpmc;
+volatile int quit;
+
+#define MP_ENTRIES 16384
+#define MP_NAME "mp_scale_shm"
+#define STASH 128
+#define TARGET_ENTRIES 4096
+#define MAX_PRODUCERS 64
+
+typedef enum bucket_type {
+	TYPE_CLASSIC,
+	TYPE_SHARDED,
+	TYPE_FAA,
+	TYPE_COUNT,
+} bucket_type;
+
+static const char *type_names[TYPE_COUNT] = {
+	[TYPE_CLASSIC] = "classic",
+	[TYPE_SHARDED] = "sharded",
+	[TYPE_FAA]     = "faa",
+};
+
+/* consumers counters, shared with the parent */
+static uint64_t *counts;
+
+static void usage(char *name)
+{
+	fprintf(stderr, "Usage: %s [-n] [-t] [-c]\n"
+		"\n"
+		"n     - max number of producers (default 8)\n"
+		"t     - duration of each run (in seconds)\n"
+		"c     - as many consumers as producers\n",
+		name);
+	exit(EXIT_FAILURE);
+}
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void set_quit(int signo)
+{
+	quit = 1;
+}
+
+static void producer(int id, int target, int ret)
+{
+	mp_buf_priv_t buf;
+
+	while (!quit) {
+		if (mp_get_sc(&mp, ret, &buf) < 0)
+			continue;
+		buf.buf->len = id;
+		while (mp_put(&mp, target, &buf) < 0 && !quit)
+			cpu_spinwait();
+	}
+	exit(0);
+}
+
+static void consumer(int id, int target, int *ret)
+{
+	mp_buf_priv_t buf;
+	uint64_t count = 0;
+
+	while (!quit) {
+		if (mp_get(&mp, target, &buf) < 0)
+			continue;
+		mp_put(&mp, ret[buf.buf->len], &buf);
+		count++;
+	}
+	counts[id] = count;
+	exit(0);
+}
+
+static int create_target(bucket_type type, int producers)
+{
+	int entries = TARGET_ENTRIES / producers;
+
+	switch (type) {
+	case TYPE_SHARDED:
+		return mp_bucket_create_sharded(&mp, "target",
+						entries < STASH * 2 ?
+						STASH * 2 : entries,
+						producers);
+	case TYPE_FAA:
+		return mp_bucket_create_faa(&mp, "target", TARGET_ENTRIES);
+	default:
+		return mp_bucket_create(&mp, "target", TARGET_ENTRIES);
+	}
+}
+
+static int run(bucket_type type, int producers)
+{
+	int ret[MAX_PRODUCERS];
+	pid_t pids[MAX_PRODUCERS * 2];
+	mp_buf_priv_t buf;
+	uint64_t count = 0, start, end;
+	int i, j, target, consumers = mpmc ? producers : 1;
+
+	if (mp_create(&mp, MP_NAME, MP_ENTRIES, 2) < 0) {
+		fprintf(stderr, "can't create shared memory\n");
+		return -1;
+	}
+
+	if ((target = create_target(type, producers)) < 0)
+		goto error;
+
+	for (i = 0; i < producers; i++) {
+		char name[MEM_POOL_MAX_BUCKET_NAME];
+
+		/* one shard per consumer, returning buffers never contends */
+		snprintf(name, sizeof(name), "ret%d", i);
+		ret[i] = mp_bucket_create_sharded(&mp, name, STASH * 2,
+						  consumers);
+		if (ret[i] < 0)
+			goto error;
+
+		for (j = 0; j < STASH; j++) {
+			if (mp_alloc(&mp, &buf) < 0 ||
+			    mp_put(&mp, ret[i], &buf) < 0)
+				goto error;
+		}
+	}
+
+	quit = 0;
+	memset(counts, 0, sizeof(uint64_t) * MAX_PRODUCERS);
+	for (i = 0; i < producers; i++) {
+		if ((pids[i] = fork()) == 0)
+			producer(i, target, ret[i]);
+	}
+	for (i = 0; i < consumers; i++) {
+		if ((pids[producers + i] = fork()) == 0)
+			consumer(i, target, ret);
+	}
+
+	start = now_ns();
+	sleep(duration);
+
+	/* stop the consumers 1st so the counters are not too optimistic */
+	for (i = producers + consumers - 1; i >= 0; i--)
+		kill(pids[i], SIGTERM);
+	end = now_ns();
+	for (i = 0; i < producers + consumers; i++)
+		waitpid(pids[i], NULL, 0);
+
+	for (i = 0; i < consumers; i++)
+		count += counts[i];
+
+	printf("%-8s producers=%-3d consumers=%-3d %8.2f Mops/s\n",
+	       type_names[type], producers, consumers,
+	       count * 1000.0 / (end - start));
+	fflush(stdout);
+
+	mp_unregister(&mp);
+
+	return 0;
+
+ error:
+	mp_unregister(&mp);
+
+	return -1;
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, type, producers;
+
+	while ((opt = getopt(argc, argv, "n:t:c")) != -1) {
+		switch (opt) {
+		case 'n':
+			max_producers = atoi(optarg);
+			if (max_producers < 1 || max_producers > MAX_PRODUCERS) {
+				fprintf(stderr, "bad number of producers %d\n",
+					max_producers);
+				usage(argv[0]);
+			}
+			break;
+
+		case 't':
+			duration = atoi(optarg);
+			if (duration <= 0 || duration > 3600) {
+				fprintf(stderr, "bad duration %d\n", duration);
+				usage(argv[0]);
+			}
+			break;
+
+		case 'c':
+			mpmc = 1;
+			break;
+
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	counts = mmap(NULL, sizeof(uint64_t) * MAX_PRODUCERS,
+		      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (counts == MAP_FAILED) {
+		perror("mmap");
+		return EXIT_FAILURE;
+	}
+
+	signal(SIGTERM, set_quit);
+
+	for (type = 0; type < TYPE_COUNT; type++) {
+		for (producers = 1; producers <= max_producers;
+		     producers *= 2) {
+			if (run(type, producers) < 0)
+				return EXIT_FAILURE;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,274 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+#include "atomic.h"
+#include "mempool.h"
+#include "mp_sched.h"
+
+mempool_priv_t mp;
+int duration = 5;
+volatile int quit;
+
+typedef enum bucket {
+	BKT_MEMPOOL,
+	BKT_HIGH,
+	BKT_LOW,
+	BKT_COUNT,
+} bucket;
+
+typedef enum notifs {
+	NOTIF_CONSUMER,
+	NOTIF_COUNT,
+} notifs;
+
+typedef enum mode {
+	MODE_PRIO,
+	MODE_WRR,
+	MODE_DRAIN,	/* hand written loop draining each bucket in turn */
+} mode;
+
+#define MP_ENTRIES 4096
+#define MP_NAME "mp_sched_shm"
+#define HIGH_PERIOD_NS 100000
+#define WORK_NS 200
+#define BURST 32
+#define MAX_SAMPLES (1 << 20)
+
+static uint64_t samples[MAX_SAMPLES];
+static unsigned int nb_samples;
+
+static void usage(char *name)
+{
+	fprintf(stderr, "Usage: %s [-p prio|wrr|drain] [-t]\n"
+		"\n"
+		"p     - consumer policy (default prio)\n"
+		"t     - duration (in seconds)\n",
+		name);
+	exit(EXIT_FAILURE);
+}
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void set_quit(int signo)
+{
+	quit = 1;
+}
+
+static void notify(void)
+{
+	uint64_t value = 1;
+
+	if (write(mp.fds[NOTIF_CONSUMER], &value, sizeof(value)) < 0)
+		perror("notify consumer");
+}
+
+/* flood the low priority bucket as fast as possible */
+static void low_producer(void)
+{
+	mp_buf_priv_t buf;
+	unsigned int sent = 0;
+
+	while (!quit) {
+		if (mp_alloc(&mp, &buf) < 0)
+			continue;
+		buf.buf->len = 0;
+		while (mp_put(&mp, BKT_LOW, &buf) < 0 && !quit)
+			cpu_spinwait();
+		if (unlikely((sent++ & (2048 - 1)) == 0))
+			notify();
+	}
+	exit(0);
+}
+
+/* send a timestamped buffer every HIGH_PERIOD_NS */
+static void high_producer(void)
+{
+	mp_buf_priv_t buf;
+	uint64_t next = now_ns();
+
+	while (!quit) {
+		uint64_t ts;
+
+		if (mp_alloc(&mp, &buf) < 0)
+			continue;
+
+		while ((ts = now_ns()) < next)
+			cpu_spinwait();
+		next = ts + HIGH_PERIOD_NS;
+
+		memcpy(buf.data, &ts, sizeof(ts));
+		buf.buf->len = sizeof(ts);
+		while (mp_put(&mp, BKT_HIGH, &buf) < 0 && !quit)
+			cpu_spinwait();
+		notify();
+	}
+	exit(0);
+}
+
+static inline void process(mp_buf_priv_t *buf, int bucket)
+{
+	uint64_t start = now_ns();
+
+	if (bucket == BKT_HIGH && nb_samples < MAX_SAMPLES) {
+		uint64_t ts;
+
+		memcpy(&ts, buf->data, sizeof(ts));
+		samples[nb_samples++] = start - ts;
+	}
+
+	/* simulate some work */
+	while (now_ns() - start < WORK_NS)
+		cpu_spinwait();
+
+	mp_free(&mp, buf);
+}
+
+static void consume_sched(mp_sched_policy policy)
+{
+	mp_sched_t sched;
+	mp_buf_priv_t bufs[BURST];
+	int buckets[BURST];
+
+	if (mp_sched_init(&sched, &mp, policy, 0) < 0)
+		return;
+
+	/* high priority bucket first, weights only matter for wrr */
+	if (mp_sched_add(&sched, BKT_HIGH, 4, NOTIF_CONSUMER) < 0 ||
+	    mp_sched_add(&sched, BKT_LOW, 1, NOTIF_CONSUMER) < 0)
+		goto end;
+
+	while (!quit) {
+		int i, n = mp_sched_get_burst(&sched, bufs, buckets, BURST);
+
+		if (n == 0) {
+			mp_sched_wait(&sched, 10);
+			continue;
+		}
+		for (i = 0; i < n; i++)
+			process(&bufs[i], buckets[i]);
+	}
+
+ end:
+	mp_sched_destroy(&sched);
+}
+
+static void consume_drain(void)
+{
+	mp_buf_priv_t buf;
+
+	while (!quit) {
+		while (mp_get_sc(&mp, BKT_HIGH, &buf) >= 0)
+			process(&buf, BKT_HIGH);
+		while (!quit && mp_get_sc(&mp, BKT_LOW, &buf) >= 0)
+			process(&buf, BKT_LOW);
+	}
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void report(const char *policy)
+{
+	uint64_t sum = 0;
+	unsigned int i;
+
+	if (nb_samples == 0) {
+		printf("%s: no high priority buffer received\n", policy);
+		return;
+	}
+	qsort(samples, nb_samples, sizeof(uint64_t), cmp_u64);
+	for (i = 0; i < nb_samples; i++)
+		sum += samples[i];
+
+	printf("%s: high priority latency over %u buffers (us): "
+	       "avg=%.2f p50=%.2f p99=%.2f max=%.2f\n", policy, nb_samples,
+	       sum / (double)nb_samples / 1000.0,
+	       samples[nb_samples / 2] / 1000.0,
+	       samples[(uint64_t)nb_samples * 99 / 100] / 1000.0,
+	       samples[nb_samples - 1] / 1000.0);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, mode = MODE_PRIO;
+	const char *policy = "prio";
+	pid_t low, high;
+
+	while ((opt = getopt(argc, argv, "p:t:")) != -1) {
+		switch (opt) {
+		case 'p':
+			policy = optarg;
+			if (strcmp(optarg, "prio") == 0)
+				mode = MODE_PRIO;
+			else if (strcmp(optarg, "wrr") == 0)
+				mode = MODE_WRR;
+			else if (strcmp(optarg, "drain") == 0)
+				mode = MODE_DRAIN;
+			else
+				usage(argv[0]);
+			break;
+
+		case 't':
+			duration = atoi(optarg);
+			if (duration <= 0 || duration > 3600) {
+				fprintf(stderr, "bad duration %d\n", duration);
+				usage(argv[0]);
+			}
+			break;
+
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (mp_create(&mp, MP_NAME, MP_ENTRIES, BKT_COUNT) < 0) {
+		fprintf(stderr, "can't create shared memory\n");
+		return EXIT_FAILURE;
+	}
+
+	if (mp_create_notifs(&mp, NOTIF_COUNT) < 0) {
+		fprintf(stderr, "failed creating eventfd notifications\n");
+		mp_unregister(&mp);
+		return EXIT_FAILURE;
+	}
+
+	signal(SIGTERM, set_quit);
+
+	/* children share the mapping and the eventfds */
+	if ((low = fork()) == 0)
+		low_producer();
+	if ((high = fork()) == 0)
+		high_producer();
+
+	signal(SIGALRM, set_quit);
+	alarm(duration);
+
+	if (mode == MODE_DRAIN)
+		consume_drain();
+	else
+		consume_sched(mode == MODE_PRIO ? MP_SCHED_PRIO : MP_SCHED_WRR);
+
+	kill(low, SIGTERM);
+	kill(high, SIGTERM);
+	waitpid(low, NULL, 0);
+	waitpid(high, NULL, 0);
+
+	report(policy);
+	mp_unregister(&mp);
+
+	return 0;
+}
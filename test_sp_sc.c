@@ -136,7 +136,7 @@ static void producer(void)
 
 		(void)tosend;
 		if (debug) {
-			snprintf(buf.buf->data, MEM_POOL_BUF_SIZE,
+			snprintf(buf.data, MEM_POOL_BUF_SIZE,
 				 "counter:%ld\n", tosend++);
 		}
 
@@ -202,7 +202,7 @@ static void consumer(void)
 	       >= 0) {
 		while (likely(mp_get_sp(&mp, BKT_CONSUMER, &buf) >= 0)) {
 			if (debug)
-			    printf("%s", buf.buf->data);
+			    printf("%s", buf.data);
 			stats += MEM_POOL_BUF_SIZE;
 
 			if (unlikely(mp_free(&mp, &buf) < 0))
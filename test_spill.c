@@ -0,0 +1,238 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <glob.h>
+#include <sys/wait.h>
+#include "atomic.h"
+#include "mempool.h"
+
+/*
+ * Spill queue shared by two processes and enabled again every round. The
+ * main process enables spilling on a small dynamic bucket, puts more
+ * buffers than its ring holds, so they go through segment files, and hands
+ * over to a second process which gets them all back, checking their order
+ * and content. The main process then disables spilling and checks no
+ * segment file is left behind. Every other round only spills a few buffers
+ * so the next one starts on the segment both processes have just used.
+ */
+
+mempool_priv_t mp;
+
+typedef enum bucket {
+	BKT_MEMPOOL,
+	BKT_DATA,
+	BKT_COUNT,
+} bucket;
+
+#define MP_ENTRIES 1024
+#define MP_NAME "mp_spill_shm"
+#define BKT_SPILL_NAME "spill"
+#define BKT_SPILL_ENTRIES 64
+
+static int rounds = 100;
+static int count = 1000;
+static unsigned int seg_size = 64 << 10;
+static char *dir = "/tmp";
+static int spill_bkt;
+
+static void usage(char *name)
+{
+	fprintf(stderr, "Usage: %s [-n] [-b] [-s] [-d]\n"
+		"\n"
+		"n     - number of rounds (default 100)\n"
+		"b     - buffers per long round (default 1000)\n"
+		"s     - spill segment size (default 65536)\n"
+		"d     - spill directory (default /tmp)\n",
+		name);
+	exit(EXIT_FAILURE);
+}
+
+static int round_count(uint32_t round)
+{
+	return round & 1 ? count : BKT_SPILL_ENTRIES + 8;
+}
+
+/* buffer i of a round: its number followed by bytes derived from it */
+static uint32_t buf_len(uint32_t i)
+{
+	return sizeof(uint64_t) + i * 7 % 1000;
+}
+
+static int buf_check(mp_buf_priv_t *buf, uint32_t round, uint32_t i)
+{
+	uint32_t len = buf_len(i);
+
+	return buf->buf->len == len &&
+		*(uint64_t *)buf->data == ((uint64_t)round << 32 | i) &&
+		buf->data[len - 1] == (char)i ? 0 : -1;
+}
+
+/* get the buffers of a round back, in order */
+static int drain(uint32_t round)
+{
+	int i, n = round_count(round);
+	mp_buf_priv_t buf;
+
+	for (i = 0; i < n; i++) {
+		if (mp_get(&mp, spill_bkt, &buf) < 0) {
+			fprintf(stderr, "round %u: %d buffers missing\n", round,
+				n - i);
+			return -1;
+		}
+		if (buf_check(&buf, round, i) < 0) {
+			fprintf(stderr, "round %u: bad buffer %d\n", round, i);
+			return -1;
+		}
+		mp_free(&mp, &buf);
+	}
+	if (mp_get(&mp, spill_bkt, &buf) == 0) {
+		fprintf(stderr, "round %u: extra buffer\n", round);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* second process: drain the round read from in */
+static void peer(int in, int out)
+{
+	uint32_t round;
+
+	if (mp_register(&mp, MP_NAME) < 0 ||
+	    (spill_bkt = mp_bucket_lookup(&mp, BKT_SPILL_NAME)) < 0)
+		exit(EXIT_FAILURE);
+
+	while (read(in, &round, sizeof(round)) == sizeof(round)) {
+		char ret = drain(round) < 0;
+
+		if (write(out, &ret, 1) != 1)
+			break;
+	}
+
+	mp_unregister(&mp);
+	exit(EXIT_SUCCESS);
+}
+
+/* segment files of the bucket left in dir */
+static size_t spill_files(void)
+{
+	char pattern[MEM_POOL_MAX_NAME * 2 + 16];
+	glob_t g;
+	size_t n;
+
+	snprintf(pattern, sizeof(pattern), "%s/%s.%d.*", dir, MP_NAME,
+		 spill_bkt);
+	if (glob(pattern, 0, NULL, &g) != 0)
+		return 0;
+	n = g.gl_pathc;
+	globfree(&g);
+
+	return n;
+}
+
+int main(int argc, char *argv[])
+{
+	int to_peer[2], from_peer[2];
+	int opt, status, ret = EXIT_FAILURE;
+	mp_buf_priv_t buf;
+	uint32_t round;
+	pid_t pid;
+
+	while ((opt = getopt(argc, argv, "n:b:s:d:")) != -1) {
+		switch (opt) {
+		case 'n':
+			rounds = atoi(optarg);
+			if (rounds <= 0)
+				usage(argv[0]);
+			break;
+
+		case 'b':
+			count = atoi(optarg);
+			if (count <= 0)
+				usage(argv[0]);
+			break;
+
+		case 's':
+			seg_size = atoi(optarg);
+			break;
+
+		case 'd':
+			dir = optarg;
+			break;
+
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (mp_create(&mp, MP_NAME, MP_ENTRIES, BKT_COUNT) < 0) {
+		fprintf(stderr, "can't create shared memory\n");
+		return EXIT_FAILURE;
+	}
+	spill_bkt = mp_bucket_create(&mp, BKT_SPILL_NAME, BKT_SPILL_ENTRIES);
+	if (spill_bkt < 0)
+		goto end;
+
+	if (pipe(to_peer) < 0 || pipe(from_peer) < 0) {
+		perror("pipe");
+		goto end;
+	}
+	if ((pid = fork()) == 0) {
+		close(to_peer[1]);
+		close(from_peer[0]);
+		peer(to_peer[0], from_peer[1]);
+	}
+	close(to_peer[0]);
+	close(from_peer[1]);
+
+	for (round = 0; round < rounds; round++) {
+		int i, n = round_count(round);
+		char peer_ret;
+
+		if (mp_spill_enable(&mp, spill_bkt, dir, seg_size) < 0)
+			break;
+
+		for (i = 0; i < n; i++) {
+			uint32_t len = buf_len(i);
+
+			if (mp_alloc(&mp, &buf) < 0) {
+				fprintf(stderr, "out of buffers\n");
+				goto stop;
+			}
+			buf.buf->len = len;
+			memset(buf.data, i, len);
+			*(uint64_t *)buf.data = (uint64_t)round << 32 | i;
+			if (mp_put(&mp, spill_bkt, &buf) < 0) {
+				fprintf(stderr, "round %u: put %d failed\n",
+					round, i);
+				goto stop;
+			}
+		}
+
+		if (write(to_peer[1], &round, sizeof(round)) != sizeof(round) ||
+		    read(from_peer[0], &peer_ret, 1) != 1 || peer_ret)
+			break;
+
+		if (mp_spill_disable(&mp, spill_bkt) < 0)
+			break;
+		if (spill_files()) {
+			fprintf(stderr, "round %u: %zu spill files left\n",
+				round, spill_files());
+			break;
+		}
+	}
+ stop:
+	close(to_peer[1]);
+	waitpid(pid, &status, 0);
+
+	printf("%u of %d rounds, up to %d buffers each\n", round, rounds,
+	       count);
+	if (round == rounds && WIFEXITED(status) && WEXITSTATUS(status) == 0)
+		ret = EXIT_SUCCESS;
+ end:
+	mp_unregister(&mp);
+
+	return ret;
+}
@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include "mempool.h"
+#include "mp_timer.h"
+
+/*
+ * Delayed delivery of many buffers: the cost of mp_put_after() with all of
+ * them pending, then how late they come out of mp_get() with the consumer
+ * sleeping on the ticker between bursts.
+ */
+
+mempool_priv_t mp;
+
+typedef enum bucket {
+	BKT_MEMPOOL,
+	BKT_DELAYED,
+	BKT_COUNT,
+} bucket;
+
+#define MP_NAME "mp_timer_shm"
+
+static int count = 200000;
+static int max_delay = 2000;
+static int tick = MP_TIMER_TICK_US;
+
+static void usage(char *name)
+{
+	fprintf(stderr, "Usage: %s [-n] [-d] [-t]\n"
+		"\n"
+		"n     - number of delayed buffers (default 200000)\n"
+		"d     - longest delay in ms, uniformly spread (default 2000)\n"
+		"t     - tick in us (default %d)\n",
+		name, MP_TIMER_TICK_US);
+	exit(EXIT_FAILURE);
+}
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, fd, i, received = 0, early = 0, measured = 0;
+	unsigned int entries = 2;
+	uint64_t *due, *late, start, elapsed, t;
+	struct pollfd pfd;
+	mp_buf_priv_t buf;
+
+	while ((opt = getopt(argc, argv, "n:d:t:")) != -1) {
+		switch (opt) {
+		case 'n':
+			count = atoi(optarg);
+			if (count <= 0 || count >= MEM_POOL_MAX_SEG_ENTRIES / 2)
+				usage(argv[0]);
+			break;
+
+		case 'd':
+			max_delay = atoi(optarg);
+			if (max_delay <= 0)
+				usage(argv[0]);
+			break;
+
+		case 't':
+			tick = atoi(optarg);
+			if (tick <= 0)
+				usage(argv[0]);
+			break;
+
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	/*
+	 * The payloads are never touched, only the headers get mapped in. The
+	 * pool holds just enough buffers to stay under 2GB.
+	 */
+	while (entries <= (unsigned int)count)
+		entries <<= 1;
+	if (mp_create_growable(&mp, MP_NAME, count + 1, entries,
+			       BKT_COUNT) < 0) {
+		fprintf(stderr, "can't create shared memory\n");
+		return EXIT_FAILURE;
+	}
+	if (mp_timer_enable(&mp, tick) < 0 || (fd = mp_timer_fd(&mp)) < 0) {
+		mp_unregister(&mp);
+		return EXIT_FAILURE;
+	}
+
+	due = malloc(sizeof(uint64_t) * entries);
+	late = malloc(sizeof(uint64_t) * count);
+	if (due == NULL || late == NULL)
+		return EXIT_FAILURE;
+
+	elapsed = 0;
+	for (i = 0; i < count; i++) {
+		uint64_t delay = (uint64_t)rand() % (max_delay * 1000ULL);
+
+		if (mp_alloc(&mp, &buf) < 0)
+			break;
+		start = now_ns();
+		due[buf.offset] = start + delay * 1000;
+		if (mp_put_after(&mp, BKT_DELAYED, &buf, delay) < 0)
+			break;
+		elapsed += now_ns() - start;
+	}
+	printf("%d buffers delayed by up to %d ms: %.1f ns/insert, "
+	       "%u pending\n", i, max_delay, (double)elapsed / i,
+	       mp_timer_pending(&mp));
+	count = i;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	start = now_ns();
+	while (received < count) {
+		uint64_t expirations;
+
+		/* mp_get() runs the wheel */
+		while (mp_get_sc(&mp, BKT_DELAYED, &buf) == 0) {
+			t = now_ns();
+			if (t < due[buf.offset])
+				early++;
+			/* the wheel didn't run while the buffers were put */
+			else if (due[buf.offset] >= start)
+				late[measured++] = t - due[buf.offset];
+			received++;
+			mp_free(&mp, &buf);
+		}
+		if (poll(&pfd, 1, max_delay) <= 0)
+			break;
+		if (read(fd, &expirations, sizeof(expirations)) < 0)
+			break;
+	}
+	elapsed = now_ns() - start;
+
+	printf("%d delivered in %.0f ms, %d early, %u postponed\n", received,
+	       elapsed / 1e6, early, mp.mp->timer.postponed);
+	if (measured) {
+		qsort(late, measured, sizeof(uint64_t), cmp_u64);
+		printf("late (us) of the %d due after the inserts: p50=%.0f "
+		       "p99=%.0f max=%.0f\n", measured, late[measured / 2] / 1e3,
+		       late[(uint64_t)measured * 99 / 100] / 1e3,
+		       late[measured - 1] / 1e3);
+	}
+
+	close(fd);
+	mp_unregister(&mp);
+
+	return received == count && early == 0 ? 0 : EXIT_FAILURE;
+}
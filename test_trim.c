@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include "atomic.h"
+#include "mempool.h"
+#include "mp_trim.h"
+
+/*
+ * Diurnal load on a pool sized for the peak: each tick, the buffers in
+ * flight are freed and as many as the load of the hour allocated and
+ * written, from 10% of the pool at night up to 90% at noon. With -m trim,
+ * mp_trim_run() is called on each tick. Prints the resident memory of the
+ * process every hour and the allocation cost, which includes refaulting
+ * trimmed payloads.
+ */
+
+mempool_priv_t mp;
+
+typedef enum bucket {
+	BKT_MEMPOOL,
+	BKT_DATA,
+	BKT_COUNT,
+} bucket;
+
+#define MP_NAME "mp_trim_shm"
+
+static int trim = 1;
+static int entries = 16384;
+static int days = 2;
+static int ticks = 20;
+static int tick_ms = 5;
+static int reserve = 256;
+static int window = 20;
+
+static void usage(char *name)
+{
+	fprintf(stderr, "Usage: %s [-m] [-n] [-d] [-T] [-t] [-r] [-w]\n"
+		"\n"
+		"m     - keep|trim (default trim)\n"
+		"n     - number of buffers of the pool (default 16384)\n"
+		"d     - number of days (default 2)\n"
+		"T     - ticks per hour (default 20)\n"
+		"t     - tick duration, in ms (default 5)\n"
+		"r     - free buffers kept warm (default 256)\n"
+		"w     - ticks a surplus lasts before it is trimmed "
+		"(default 20)\n",
+		name);
+	exit(EXIT_FAILURE);
+}
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* resident memory of the process, shared pages included */
+static double rss_mb(void)
+{
+	unsigned long size, resident;
+	FILE *f = fopen("/proc/self/statm", "r");
+
+	if (f == NULL)
+		return 0;
+	if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+		resident = 0;
+	fclose(f);
+
+	return resident * (double)sysconf(_SC_PAGESIZE) / (1 << 20);
+}
+
+int main(int argc, char *argv[])
+{
+	mp_buf_priv_t *held;
+	uint64_t alloc_ns = 0, allocs = 0;
+	unsigned int count = 0;
+	double peak_rss = 0;
+	int opt, hour, tick;
+
+	while ((opt = getopt(argc, argv, "m:n:d:T:t:r:w:")) != -1) {
+		switch (opt) {
+		case 'm':
+			if (strcmp(optarg, "keep") == 0)
+				trim = 0;
+			else if (strcmp(optarg, "trim") != 0)
+				usage(argv[0]);
+			break;
+
+		case 'n':
+			entries = atoi(optarg);
+			if (entries <= 0)
+				usage(argv[0]);
+			break;
+
+		case 'd':
+			days = atoi(optarg);
+			if (days <= 0)
+				usage(argv[0]);
+			break;
+
+		case 'T':
+			ticks = atoi(optarg);
+			if (ticks <= 0)
+				usage(argv[0]);
+			break;
+
+		case 't':
+			tick_ms = atoi(optarg);
+			if (tick_ms < 0)
+				usage(argv[0]);
+			break;
+
+		case 'r':
+			reserve = atoi(optarg);
+			if (reserve < 0)
+				usage(argv[0]);
+			break;
+
+		case 'w':
+			window = atoi(optarg);
+			if (window <= 0)
+				usage(argv[0]);
+			break;
+
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	held = calloc(entries, sizeof(*held));
+	if (held == NULL) {
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+
+	if (mp_create(&mp, MP_NAME, entries, BKT_COUNT) < 0) {
+		fprintf(stderr, "can't create shared memory\n");
+		return EXIT_FAILURE;
+	}
+	if (trim && mp_trim_enable(&mp, reserve, window) < 0) {
+		mp_unregister(&mp);
+		return EXIT_FAILURE;
+	}
+
+	printf("%s, %d buffers of %d KB\n", trim ? "trim" : "keep", entries,
+	       MEM_POOL_BUF_SIZE >> 10);
+	printf("hour  load  rss (MB)  cold  alloc (ns/buf)\n");
+	for (hour = 0; hour < days * 24; hour++) {
+		double load = 0.1 + 0.8 * (1 - cos(2 * M_PI * hour / 24)) / 2;
+		unsigned int want = entries * load;
+
+		alloc_ns = allocs = 0;
+		for (tick = 0; tick < ticks; tick++) {
+			struct timespec ts = {
+				.tv_nsec = tick_ms * 1000000L,
+			};
+			uint64_t start;
+			char *p;
+
+			while (count)
+				mp_free(&mp, &held[--count]);
+
+			start = now_ns();
+			while (count < want &&
+			       mp_alloc(&mp, &held[count]) == 0) {
+				/* fault the whole payload in */
+				for (p = held[count].data;
+				     p < held[count].data + MEM_POOL_BUF_SIZE;
+				     p += MEM_POOL_PAGE_SIZE)
+					*p = count;
+				count++;
+			}
+			alloc_ns += now_ns() - start;
+			allocs += count;
+
+			if (trim)
+				mp_trim_run(&mp);
+			nanosleep(&ts, NULL);
+		}
+
+		if (rss_mb() > peak_rss)
+			peak_rss = rss_mb();
+		printf("%4d  %3.0f%%  %8.1f  %5u  %14.0f\n", hour % 24,
+		       load * 100, rss_mb(), mp_trim_cold(&mp),
+		       allocs ? (double)alloc_ns / allocs : 0);
+	}
+	printf("peak rss %.1f MB, %u buffers trimmed, %u refilled\n", peak_rss,
+	       mp.mp->trim.trimmed, mp.mp->trim.refilled);
+
+	while (count)
+		mp_free(&mp, &held[--count]);
+	if (trim)
+		mp_trim_disable(&mp);
+	mp_unregister(&mp);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,311 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "mempool.h"
+#include "mp_uring.h"
+
+/*
+ * Ingest from a file, a pipe or a local socket into a bucket, either with
+ * io_uring requests completing straight into the bucket or with one
+ * read() per buffer. Reports the throughput and the syscalls per buffer.
+ */
+
+mempool_priv_t mp;
+
+typedef enum bucket {
+	BKT_MEMPOOL,
+	BKT_DATA,
+	BKT_COUNT,
+} bucket;
+
+typedef enum source {
+	SRC_FILE,
+	SRC_PIPE,
+	SRC_SOCK,
+} source;
+
+#define MP_ENTRIES 1024
+#define MP_NAME "mp_uring_shm"
+#define QUEUE_DEPTH 64
+
+static int src = SRC_FILE;
+static int use_uring = 1;
+static int sqpoll;
+static int count = 100000;
+static int size = 4096;
+static const char *path = "mp_uring.dat";
+
+static void usage(char *name)
+{
+	fprintf(stderr, "Usage: %s [-m uring|sync] [-k file|pipe|sock] [-p] "
+		"[-n] [-s]\n"
+		"\n"
+		"m     - I/O mode (default uring)\n"
+		"k     - source (default file)\n"
+		"p     - kernel side submission polling\n"
+		"n     - number of messages (default 100000)\n"
+		"s     - message size (default 4096)\n",
+		name);
+	exit(EXIT_FAILURE);
+}
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void writer(int fd)
+{
+	char *msg = malloc(size);
+	int i;
+
+	memset(msg, 'm', size);
+	for (i = 0; i < count; i++) {
+		if (write(fd, msg, size) != size) {
+			perror("write");
+			break;
+		}
+	}
+	close(fd);
+	exit(0);
+}
+
+static int open_source(pid_t *pid)
+{
+	int fds[2], i, fd;
+	char *msg;
+
+	*pid = 0;
+	if (src == SRC_FILE) {
+		fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0600);
+		if (fd < 0)
+			return -1;
+		msg = malloc(size);
+		memset(msg, 'm', size);
+		for (i = 0; i < count; i++) {
+			if (write(fd, msg, size) != size)
+				return -1;
+		}
+		free(msg);
+		return fd;
+	}
+
+	if (src == SRC_PIPE ? pipe(fds) :
+	    socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds)) {
+		perror("pipe");
+		return -1;
+	}
+	if ((*pid = fork()) == 0) {
+		close(fds[0]);
+		writer(fds[1]);
+	}
+	close(fds[1]);
+
+	return fds[0];
+}
+
+/* consume what reached the bucket, returns the number of bytes */
+static uint64_t drain(uint64_t *bufs)
+{
+	mp_buf_priv_t buf;
+	uint64_t bytes = 0;
+
+	while (mp_get_sc(&mp, BKT_DATA, &buf) == 0) {
+		bytes += buf.buf->len;
+		(*bufs)++;
+		mp_free(&mp, &buf);
+	}
+
+	return bytes;
+}
+
+static int ingest_uring(int fd, uint64_t total, uint64_t *bufs,
+			uint64_t *syscalls)
+{
+	mp_uring_t ur;
+	uint64_t bytes = 0, off = 0;
+	int eof = 0, idle = 0;
+
+	if (mp_uring_init(&ur, &mp, QUEUE_DEPTH * 2,
+			  sqpoll ? MP_URING_SQPOLL : 0) < 0)
+		return -1;
+
+	while (bytes < total) {
+		mp_buf_priv_t buf;
+
+		/* keep the queue full */
+		while (!eof && mp_uring_pending(&ur) < QUEUE_DEPTH &&
+		       (src != SRC_FILE || off < total) &&
+		       mp_alloc(&mp, &buf) == 0) {
+			int ret;
+
+			if (src == SRC_SOCK)
+				ret = mp_uring_recv(&ur, fd, &buf, 0, BKT_DATA);
+			else
+				ret = mp_uring_read(&ur, fd, src == SRC_FILE ?
+						    (off_t)off : -1, &buf,
+						    size, BKT_DATA);
+			if (ret < 0) {
+				mp_free(&mp, &buf);
+				break;
+			}
+			off += size;
+		}
+		if (mp_uring_submit(&ur) < 0)
+			break;
+
+		if (mp_uring_complete(&ur, QUEUE_DEPTH) == 0) {
+			/* the poll thread may need the cpu */
+			if (sqpoll && ++idle < 1000) {
+				cpu_spinwait();
+				continue;
+			}
+			idle = 0;
+			if (mp_uring_wait(&ur, 1) < 0)
+				break;
+			continue;
+		}
+		bytes += drain(bufs);
+		/* empty reads: the writer is gone */
+		eof = ur.errors != 0;
+		if (eof && mp_uring_pending(&ur) == 0)
+			break;
+	}
+
+	/* pending reads complete with EOF once the writer is gone */
+	while (mp_uring_pending(&ur)) {
+		if (mp_uring_complete(&ur, QUEUE_DEPTH) == 0 &&
+		    mp_uring_wait(&ur, 1) < 0)
+			break;
+	}
+	drain(bufs);
+
+	*syscalls = ur.enters;
+	mp_uring_destroy(&ur);
+
+	return bytes == total ? 0 : -1;
+}
+
+static int ingest_sync(int fd, uint64_t total, uint64_t *bufs,
+		       uint64_t *syscalls)
+{
+	uint64_t bytes = 0;
+
+	while (bytes < total) {
+		mp_buf_priv_t buf;
+		ssize_t ret;
+
+		if (mp_alloc(&mp, &buf) < 0)
+			return -1;
+		if (src == SRC_FILE)
+			ret = pread(fd, buf.data, size, bytes);
+		else
+			ret = read(fd, buf.data, size);
+		(*syscalls)++;
+		if (ret <= 0) {
+			mp_free(&mp, &buf);
+			break;
+		}
+		buf.buf->len = ret;
+		if (mp_put(&mp, BKT_DATA, &buf) < 0)
+			mp_free(&mp, &buf);
+		bytes += drain(bufs);
+	}
+
+	return bytes == total ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
+{
+	int fd, opt, ret;
+	uint64_t start, elapsed, bufs = 0, syscalls = 0;
+	uint64_t total;
+	pid_t pid;
+
+	while ((opt = getopt(argc, argv, "m:k:pn:s:")) != -1) {
+		switch (opt) {
+		case 'm':
+			if (strcmp(optarg, "uring") == 0)
+				use_uring = 1;
+			else if (strcmp(optarg, "sync") == 0)
+				use_uring = 0;
+			else
+				usage(argv[0]);
+			break;
+
+		case 'k':
+			if (strcmp(optarg, "file") == 0)
+				src = SRC_FILE;
+			else if (strcmp(optarg, "pipe") == 0)
+				src = SRC_PIPE;
+			else if (strcmp(optarg, "sock") == 0)
+				src = SRC_SOCK;
+			else
+				usage(argv[0]);
+			break;
+
+		case 'p':
+			sqpoll = 1;
+			break;
+
+		case 'n':
+			count = atoi(optarg);
+			if (count <= 0)
+				usage(argv[0]);
+			break;
+
+		case 's':
+			size = atoi(optarg);
+			if (size <= 0 || size > MEM_POOL_BUF_SIZE)
+				usage(argv[0]);
+			break;
+
+		default:
+			usage(argv[0]);
+		}
+	}
+	total = (uint64_t)count * size;
+
+	if (mp_create(&mp, MP_NAME, MP_ENTRIES, BKT_COUNT) < 0) {
+		fprintf(stderr, "can't create shared memory\n");
+		return EXIT_FAILURE;
+	}
+
+	fd = open_source(&pid);
+	if (fd < 0) {
+		mp_unregister(&mp);
+		return EXIT_FAILURE;
+	}
+
+	start = now_ns();
+	if (use_uring)
+		ret = ingest_uring(fd, total, &bufs, &syscalls);
+	else
+		ret = ingest_sync(fd, total, &bufs, &syscalls);
+	elapsed = now_ns() - start;
+
+	if (ret < 0)
+		fprintf(stderr, "short ingest\n");
+	printf("%s%s: %lu buffers %.0f MB/s %.0f buffers/s "
+	       "%.3f syscalls/buffer\n", use_uring ? "uring" : "sync",
+	       sqpoll ? "+sqpoll" : "", bufs, total / 1048576.0 * 1e9 / elapsed,
+	       bufs * 1e9 / elapsed, bufs ? (double)syscalls / bufs : 0);
+
+	close(fd);
+	if (pid)
+		waitpid(pid, NULL, 0);
+	if (src == SRC_FILE)
+		unlink(path);
+	mp_unregister(&mp);
+
+	return ret < 0 ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,282 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "atomic.h"
+#include "mempool.h"
+#include "mp_workers.h"
+
+/*
+ * Worker pool driven by the bucket load: a producer sends at a low rate,
+ * then a burst at a high rate, then at the low rate again.
+ * With -m static, threads poll the bucket all along as consumers sized
+ * statically do, with -m auto a worker pool scales between 1 and the
+ * number of workers. Each phase reports the cpu time of the process and
+ * the latency from put to processing.
+ */
+
+mempool_priv_t mp;
+mp_workers_t pool;
+pthread_t threads[MP_WORKERS_MAX];
+volatile int stop;
+
+typedef enum bucket {
+	BKT_MEMPOOL,
+	BKT_DATA,
+	BKT_COUNT,
+} bucket;
+
+#define MP_ENTRIES 4096
+#define MP_NAME "mp_workers_shm"
+
+struct msg {
+	uint32_t seq;
+	uint64_t sent;		/* ns */
+};
+
+static int workers = 4;
+static int scale = 1;
+static int rate = 10000;
+static int low_ms = 1000;
+static int burst_rate = 200000;
+static int burst = 200000;
+static int work = 200;
+
+/* put to processing latency of each message, ns */
+static uint32_t *latency;
+/* most workers active during a phase */
+static unsigned int peak;
+
+static void usage(char *name)
+{
+	fprintf(stderr, "Usage: %s [-m] [-w] [-r] [-t] [-R] [-b] [-u]\n"
+		"\n"
+		"m     - static|auto (default auto)\n"
+		"w     - number of workers, max for auto (default 4)\n"
+		"r     - low load rate, in buffers/s (default 10000)\n"
+		"t     - low load phase duration, in ms (default 1000)\n"
+		"R     - burst rate, in buffers/s (default 200000)\n"
+		"b     - number of buffers of the burst (default 200000)\n"
+		"u     - work per buffer, in loop iterations (default 200)\n",
+		name);
+	exit(EXIT_FAILURE);
+}
+
+static inline uint64_t clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t now_ns(void)
+{
+	return clock_ns(CLOCK_MONOTONIC);
+}
+
+static void process(void *ctx, mp_buf_priv_t *buf)
+{
+	struct msg *m = (struct msg *)buf->data;
+	volatile uint64_t sink = 0;
+	int i;
+
+	latency[m->seq] = now_ns() - m->sent;
+	for (i = 0; i < work; i++)
+		sink += i;
+	mp_free(&mp, buf);
+}
+
+static void *poll_bucket(void *arg)
+{
+	mp_buf_priv_t buf;
+
+	while (!stop) {
+		if (mp_get(&mp, BKT_DATA, &buf) == 0)
+			process(NULL, &buf);
+		else
+			cpu_spinwait();
+	}
+
+	return NULL;
+}
+
+static void send_msg(uint32_t seq)
+{
+	mp_buf_priv_t buf;
+	struct msg *m;
+
+	while (mp_alloc(&mp, &buf) < 0)
+		sched_yield();
+	m = (struct msg *)buf.data;
+	m->seq = seq;
+	m->sent = now_ns();
+	while (mp_put(&mp, BKT_DATA, &buf) < 0)
+		sched_yield();
+}
+
+/* send count messages at rate per second */
+static void send_phase(uint32_t first, uint32_t count, int rate)
+{
+	uint64_t start = now_ns();
+	uint32_t i;
+
+	for (i = 0; i < count; i++) {
+		uint64_t due = start + (uint64_t)i * 1000000000 / rate;
+		uint64_t now = now_ns();
+
+		/* late messages go out back to back */
+		if (due > now) {
+			struct timespec ts = {
+				.tv_sec = (due - now) / 1000000000,
+				.tv_nsec = (due - now) % 1000000000,
+			};
+
+			nanosleep(&ts, NULL);
+		}
+		send_msg(first + i);
+		if (scale && mp_workers_active(&pool) > peak)
+			peak = mp_workers_active(&pool);
+	}
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void report(const char *name, uint32_t first, uint32_t count,
+		   uint64_t wall, uint64_t cpu)
+{
+	uint32_t *lat = latency + first;
+
+	qsort(lat, count, sizeof(*lat), cmp_u32);
+	printf("%-6s %7u bufs in %5.0f ms, cpu %4.0f%%, latency (us) "
+	       "p50=%.1f p99=%.1f, up to %u workers\n", name, count,
+	       wall / 1e6, cpu * 100.0 / wall, lat[count / 2] / 1e3,
+	       lat[count * 99 / 100] / 1e3, scale ? peak : workers);
+}
+
+static void phase(const char *name, uint32_t *seq, uint32_t count, int rate)
+{
+	uint64_t wall = now_ns(), cpu = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+
+	peak = 0;
+	send_phase(*seq, count, rate);
+	while (mp_count(&mp, BKT_DATA))
+		sched_yield();
+	/* the last ones are being processed */
+	usleep(1000);
+
+	wall = now_ns() - wall;
+	cpu = clock_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+	report(name, *seq, count, wall, cpu);
+	*seq += count;
+}
+
+int main(int argc, char *argv[])
+{
+	uint32_t seq = 0, low;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "m:w:r:t:R:b:u:")) != -1) {
+		switch (opt) {
+		case 'm':
+			if (strcmp(optarg, "static") == 0)
+				scale = 0;
+			else if (strcmp(optarg, "auto") != 0)
+				usage(argv[0]);
+			break;
+
+		case 'w':
+			workers = atoi(optarg);
+			if (workers < 1 || workers > MP_WORKERS_MAX)
+				usage(argv[0]);
+			break;
+
+		case 'r':
+			rate = atoi(optarg);
+			if (rate <= 0)
+				usage(argv[0]);
+			break;
+
+		case 't':
+			low_ms = atoi(optarg);
+			if (low_ms <= 0)
+				usage(argv[0]);
+			break;
+
+		case 'R':
+			burst_rate = atoi(optarg);
+			if (burst_rate <= 0)
+				usage(argv[0]);
+			break;
+
+		case 'b':
+			burst = atoi(optarg);
+			if (burst <= 0)
+				usage(argv[0]);
+			break;
+
+		case 'u':
+			work = atoi(optarg);
+			if (work < 0)
+				usage(argv[0]);
+			break;
+
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	low = (uint64_t)rate * low_ms / 1000;
+	if (low == 0)
+		usage(argv[0]);
+	latency = calloc(low * 2 + burst, sizeof(*latency));
+	if (latency == NULL) {
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+
+	if (mp_create(&mp, MP_NAME, MP_ENTRIES, BKT_COUNT) < 0) {
+		fprintf(stderr, "can't create shared memory\n");
+		return EXIT_FAILURE;
+	}
+	if (scale) {
+		if (mp_workers_start(&pool, &mp, BKT_DATA, 1, workers,
+				     process, NULL) < 0) {
+			mp_unregister(&mp);
+			return EXIT_FAILURE;
+		}
+	} else {
+		for (i = 0; i < workers; i++) {
+			if (pthread_create(&threads[i], NULL, poll_bucket,
+					   NULL)) {
+				perror("pthread_create");
+				return EXIT_FAILURE;
+			}
+		}
+	}
+
+	printf("%s, %d workers\n", scale ? "auto" : "static", workers);
+	phase("low", &seq, low, rate);
+	phase("burst", &seq, burst, burst_rate);
+	phase("low", &seq, low, rate);
+	if (scale) {
+		printf("%u workers woken\n", pool.wakeups);
+		mp_workers_stop(&pool);
+	} else {
+		stop = 1;
+		for (i = 0; i < workers; i++)
+			pthread_join(threads[i], NULL);
+	}
+	mp_unregister(&mp);
+
+	return EXIT_SUCCESS;
+}